@@ -1,6 +1,8 @@
 ﻿#include <gtest/gtest.h>
 #include <homie-cpp/client.h>
+#include <homie-cpp/schema.h>
 #include <map>
+#include <cstdio>
 
 using namespace homie;
 
@@ -359,6 +361,7 @@ TEST(ClientTest, InitWithNodeAndProperty) {
 		.add_message("homie/testdevice/testnode/intensity", "100")
 		.add_message("homie/testdevice/testnode/intensity/$name", "Intensity")
 		.add_message("homie/testdevice/testnode/intensity/$settable", "true")
+		.add_message("homie/testdevice/testnode/intensity/$retained", "false")
 		.add_message("homie/testdevice/testnode/intensity/$unit", "%")
 		.add_message("homie/testdevice/testnode/intensity/$datatype", "integer")
 		.add_message("homie/testdevice/testnode/intensity/$format", "0:100");
@@ -403,6 +406,7 @@ TEST(ClientTest, InitWithNodeArrayAndProperty) {
 		.add_message("homie/testdevice/testnode/$array", "1-3")
 		.add_message("homie/testdevice/testnode/intensity/$name", "Intensity")
 		.add_message("homie/testdevice/testnode/intensity/$settable", "true")
+		.add_message("homie/testdevice/testnode/intensity/$retained", "false")
 		.add_message("homie/testdevice/testnode/intensity/$unit", "%")
 		.add_message("homie/testdevice/testnode/intensity/$datatype", "integer")
 		.add_message("homie/testdevice/testnode/intensity/$format", "0:100")
@@ -450,6 +454,7 @@ TEST(ClientTest, ChangesGetPublished) {
 		.add_message("homie/testdevice/testnode/$array", "1-3")
 		.add_message("homie/testdevice/testnode/intensity/$name", "Intensity")
 		.add_message("homie/testdevice/testnode/intensity/$settable", "true")
+		.add_message("homie/testdevice/testnode/intensity/$retained", "false")
 		.add_message("homie/testdevice/testnode/intensity/$unit", "%")
 		.add_message("homie/testdevice/testnode/intensity/$datatype", "integer")
 		.add_message("homie/testdevice/testnode/intensity/$format", "0:100")
@@ -490,4 +495,922 @@ TEST(ClientTest, ChangesGetPublished) {
 	ASSERT_TRUE(test_client.steps.empty());
 	ASSERT_TRUE(test_client.expect_subscribe.empty());
 	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
-}
\ No newline at end of file
+}
+TEST(ClientTest, SetValidation) {
+
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/testdevice/+/+/set");
+	test_client.expect_unsubscribe.insert("homie/testdevice/+/+/set");
+	test_client.add_step().add_message("homie/testdevice/$state", "init");
+	test_client.add_step()
+		.add_message("homie/testdevice/$homie", "3.0.0")
+		.add_message("homie/testdevice/$name", "Testdevice")
+		.add_message("homie/testdevice/$localip", "10.0.0.1")
+		.add_message("homie/testdevice/$mac", "AA:BB:CC:DD:EE:FF")
+		.add_message("homie/testdevice/$fw/name", "Firmwarename")
+		.add_message("homie/testdevice/$fw/version", "0.0.1")
+		.add_message("homie/testdevice/$nodes", "testnode")
+		.add_message("homie/testdevice/$implementation", "homie-cpp")
+		.add_message("homie/testdevice/$stats", "uptime")
+		.add_message("homie/testdevice/$stats/interval", "60")
+		.add_message("homie/testdevice/$stats/uptime", "0")
+		.add_message("homie/testdevice/testnode/$name", "Testnode")
+		.add_message("homie/testdevice/testnode/$type", "light")
+		.add_message("homie/testdevice/testnode/$properties", "intensity")
+		.add_message("homie/testdevice/testnode/intensity", "100")
+		.add_message("homie/testdevice/testnode/intensity/$name", "Intensity")
+		.add_message("homie/testdevice/testnode/intensity/$settable", "true")
+		.add_message("homie/testdevice/testnode/intensity/$retained", "false")
+		.add_message("homie/testdevice/testnode/intensity/$unit", "%")
+		.add_message("homie/testdevice/testnode/intensity/$datatype", "integer")
+		.add_message("homie/testdevice/testnode/intensity/$format", "0:100");
+	test_client.add_step().add_message("homie/testdevice/$state", "ready");
+	test_client.add_step().add_message("homie/testdevice/$state", "disconnected");
+
+	{
+		auto dev = std::make_shared<test_device>();
+		auto node = std::make_shared<test_node>(dev);
+		auto prop = std::make_shared<test_property>(node);
+		dev->add_node(node);
+		node->add_property(prop);
+		homie::client client(test_client, dev);
+
+		test_client.handler->on_message("homie/testdevice/testnode/intensity/set", "50");
+		ASSERT_EQ(prop->value, "50");
+		test_client.handler->on_message("homie/testdevice/testnode/intensity/set", "101");
+		test_client.handler->on_message("homie/testdevice/testnode/intensity/set", "-1");
+		test_client.handler->on_message("homie/testdevice/testnode/intensity/set", "5x");
+		ASSERT_EQ(prop->value, "50");
+		ASSERT_EQ(client.get_rejected_sets(), 3);
+
+		// Cached validator is rebuilt after a structure change
+		prop->attributes["format"] = "0:200";
+		client.notify_structure_changed();
+		test_client.handler->on_message("homie/testdevice/testnode/intensity/set", "150");
+		ASSERT_EQ(prop->value, "150");
+
+		// A changed $format is picked up even without notify_structure_changed()
+		prop->attributes["format"] = "0:300";
+		test_client.handler->on_message("homie/testdevice/testnode/intensity/set", "250");
+		ASSERT_EQ(prop->value, "250");
+		ASSERT_EQ(client.get_rejected_sets(), 3);
+	}
+
+	ASSERT_TRUE(test_client.open_called);
+	ASSERT_TRUE(test_client.steps.empty());
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(ClientTest, PropertyFormat) {
+	typed_value v;
+	auto range = property_format::compile(datatype::number, "-1.5:2.5");
+	ASSERT_TRUE(range.validate("2.5", v));
+	ASSERT_DOUBLE_EQ(v.number, 2.5);
+	ASSERT_FALSE(range.validate("2.6"));
+	ASSERT_FALSE(range.validate(""));
+	// strtod leniency, nan would pass every range check
+	for (auto e : { "nan", "-inf", " 1", "1 ", "0x1", ".", "1e", "-" }) ASSERT_FALSE(range.validate(e)) << e;
+	ASSERT_TRUE(range.validate("-.5"));
+	ASSERT_TRUE(range.validate("+1e-1"));
+
+	auto open_range = property_format::compile(datatype::integer, ":10");
+	ASSERT_TRUE(open_range.validate("-1000"));
+	ASSERT_FALSE(open_range.validate("11"));
+
+	auto enumeration = property_format::compile(datatype::enumeration, "off,low,medium,high");
+	ASSERT_TRUE(enumeration.validate("medium", v));
+	ASSERT_EQ(v.enum_index, 2);
+	ASSERT_TRUE(enumeration.validate("off", v));
+	ASSERT_EQ(v.enum_index, 0);
+	ASSERT_FALSE(enumeration.validate("max"));
+	ASSERT_FALSE(enumeration.validate(""));
+
+	auto rgb = property_format::compile(datatype::color, "rgb");
+	ASSERT_TRUE(rgb.validate("255,0,10", v));
+	ASSERT_EQ(v.model, color_model::rgb);
+	ASSERT_EQ(v.color[2], 10);
+	ASSERT_FALSE(rgb.validate("256,0,10"));
+	ASSERT_FALSE(rgb.validate("1,2"));
+	ASSERT_FALSE(rgb.validate("1,2,3,4"));
+	auto hsv = property_format::compile(datatype::color, "hsv");
+	ASSERT_TRUE(hsv.validate("360,100,0"));
+	ASSERT_FALSE(hsv.validate("360,101,0"));
+
+	auto boolean = property_format::compile(datatype::boolean, "");
+	ASSERT_TRUE(boolean.validate("true", v));
+	ASSERT_TRUE(v.boolean);
+	ASSERT_FALSE(boolean.validate("1"));
+}
+
+namespace test_schema {
+	struct intensity : homie::schema::property_defaults {
+		static constexpr const char* id() { return "intensity"; }
+		static constexpr const char* name() { return "Intensity"; }
+		static constexpr homie::datatype type() { return homie::datatype::integer; }
+		static constexpr const char* unit() { return "%"; }
+		static constexpr const char* format() { return "0:100"; }
+		static constexpr bool settable() { return true; }
+	};
+	struct power : homie::schema::property_defaults {
+		static constexpr const char* id() { return "power"; }
+		static constexpr const char* name() { return "Power"; }
+		static constexpr homie::datatype type() { return homie::datatype::boolean; }
+	};
+	struct light : homie::schema::node_defaults {
+		static constexpr const char* id() { return "testnode"; }
+		static constexpr const char* name() { return "Testnode"; }
+		static constexpr const char* type() { return "light"; }
+		typedef homie::schema::list<intensity, power> properties;
+	};
+	struct lamp : homie::schema::device_defaults {
+		static constexpr const char* name() { return "Testdevice"; }
+		static constexpr const char* firmware_name() { return "Firmwarename"; }
+		static constexpr const char* firmware_version() { return "0.0.1"; }
+		typedef homie::schema::list<light> nodes;
+	};
+}
+
+TEST(ClientTest, StaticSchema) {
+	using namespace test_schema;
+
+	auto& table = homie::schema::static_device<lamp>::static_announcement();
+	std::map<std::string, std::string> announcement(table.begin(), table.end());
+	ASSERT_EQ(announcement.at("$nodes"), "testnode");
+	ASSERT_EQ(announcement.at("testnode/$properties"), "intensity,power");
+	ASSERT_EQ(announcement.at("testnode/intensity/$format"), "0:100");
+	ASSERT_EQ(announcement.at("testnode/power/$settable"), "false");
+	ASSERT_EQ(&table, &homie::schema::static_device<lamp>::static_announcement());
+
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/testdevice/+/+/set");
+	test_client.expect_unsubscribe.insert("homie/testdevice/+/+/set");
+	test_client.add_step().add_message("homie/testdevice/$state", "init");
+	test_client.add_step()
+		.add_message("homie/testdevice/$homie", "3.0.0")
+		.add_message("homie/testdevice/$name", "Testdevice")
+		.add_message("homie/testdevice/$localip", "10.0.0.1")
+		.add_message("homie/testdevice/$mac", "AA:BB:CC:DD:EE:FF")
+		.add_message("homie/testdevice/$fw/name", "Firmwarename")
+		.add_message("homie/testdevice/$fw/version", "0.0.1")
+		.add_message("homie/testdevice/$nodes", "testnode")
+		.add_message("homie/testdevice/$implementation", "homie-cpp")
+		.add_message("homie/testdevice/$stats", "uptime")
+		.add_message("homie/testdevice/$stats/interval", "60")
+		.add_message("homie/testdevice/$stats/uptime", "0")
+		.add_message("homie/testdevice/testnode/$name", "Testnode")
+		.add_message("homie/testdevice/testnode/$type", "light")
+		.add_message("homie/testdevice/testnode/$properties", "intensity,power")
+		.add_message("homie/testdevice/testnode/intensity", "100")
+		.add_message("homie/testdevice/testnode/intensity/$name", "Intensity")
+		.add_message("homie/testdevice/testnode/intensity/$settable", "true")
+		.add_message("homie/testdevice/testnode/intensity/$retained", "true")
+		.add_message("homie/testdevice/testnode/intensity/$unit", "%")
+		.add_message("homie/testdevice/testnode/intensity/$datatype", "integer")
+		.add_message("homie/testdevice/testnode/intensity/$format", "0:100")
+		.add_message("homie/testdevice/testnode/power/$name", "Power")
+		.add_message("homie/testdevice/testnode/power/$settable", "false")
+		.add_message("homie/testdevice/testnode/power/$retained", "true")
+		.add_message("homie/testdevice/testnode/power/$unit", "")
+		.add_message("homie/testdevice/testnode/power/$datatype", "boolean")
+		.add_message("homie/testdevice/testnode/power/$format", "");
+	test_client.add_step().add_message("homie/testdevice/$state", "ready");
+	test_client.add_step().add_message("homie/testdevice/testnode/intensity", "20");
+	test_client.add_step().add_message("homie/testdevice/$state", "disconnected");
+
+	{
+		auto dev = homie::schema::make_device<lamp>("testdevice");
+		dev->set_attribute("localip", "10.0.0.1");
+		dev->set_attribute("mac", "AA:BB:CC:DD:EE:FF");
+		dev->set_attribute("stats", "uptime");
+		dev->set_attribute("stats/uptime", "0");
+		// Attributes defined by the schema can not be overwritten
+		dev->set_attribute("name", "Other");
+		ASSERT_EQ(dev->get_name(), "Testdevice");
+
+		auto& prop = dev->get<light>().get<intensity>();
+		prop.value = "100";
+		int64_t last = -1;
+		prop.on_set = [&](homie::schema::static_property<intensity>&, const homie::typed_value& v, const std::string&) {
+			last = v.integer;
+		};
+		ASSERT_EQ(dev->get_node("testnode")->get_property("intensity").get(), &prop);
+		ASSERT_EQ(dev->get_node("missing"), nullptr);
+
+		// client announces the precomputed table
+		ASSERT_EQ(&dynamic_cast<const static_structure&>(*dev).get_static_announcement(), &table);
+		homie::client client(test_client, dev);
+
+		test_client.handler->on_message("homie/testdevice/testnode/intensity/set", "50");
+		ASSERT_EQ(prop.value, "50");
+		ASSERT_EQ(last, 50);
+		test_client.handler->on_message("homie/testdevice/testnode/intensity/set", "150");
+		ASSERT_EQ(prop.value, "50");
+
+		prop.value = "20";
+		client.notify_property_changed("testnode", "intensity");
+	}
+
+	ASSERT_TRUE(test_client.open_called);
+	ASSERT_TRUE(test_client.steps.empty());
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(ClientTest, ReannounceFromCache) {
+
+	test_mqtt_client test_client;
+	auto announce = [&](const std::string& name, const std::string& localip, const std::string& uptime) {
+		test_client.expect_subscribe.insert("homie/testdevice/+/+/set");
+		test_client.add_step().add_message("homie/testdevice/$state", "init");
+		test_client.add_step()
+			.add_message("homie/testdevice/$homie", "3.0.0")
+			.add_message("homie/testdevice/$name", name)
+			.add_message("homie/testdevice/$localip", localip)
+			.add_message("homie/testdevice/$mac", "AA:BB:CC:DD:EE:FF")
+			.add_message("homie/testdevice/$fw/name", "Firmwarename")
+			.add_message("homie/testdevice/$fw/version", "0.0.1")
+			.add_message("homie/testdevice/$nodes", "")
+			.add_message("homie/testdevice/$implementation", "homie-cpp")
+			.add_message("homie/testdevice/$stats", "uptime")
+			.add_message("homie/testdevice/$stats/interval", "60")
+			.add_message("homie/testdevice/$stats/uptime", uptime);
+		test_client.add_step().add_message("homie/testdevice/$state", "ready");
+	};
+	test_client.expect_unsubscribe.insert("homie/testdevice/+/+/set");
+	announce("Testdevice", "10.0.0.1", "0");
+
+	{
+		auto dev = std::make_shared<test_device>();
+		homie::client client(test_client, dev);
+		ASSERT_TRUE(test_client.steps.empty());
+
+		// Session still present, only the state is refreshed
+		test_client.expect_subscribe.insert("homie/testdevice/+/+/set");
+		test_client.add_step().add_message("homie/testdevice/$state", "ready");
+		test_client.handler->on_connect(true, true);
+		ASSERT_TRUE(test_client.steps.empty());
+
+		// Session lost, the cached announcement is replayed but runtime attributes and stats are read again
+		dev->attributes["name"] = "Renamed";
+		dev->attributes["localip"] = "10.0.0.2";
+		dev->attributes["stats/uptime"] = "10";
+		announce("Renamed", "10.0.0.2", "10");
+		test_client.handler->on_connect(false, true);
+		ASSERT_TRUE(test_client.steps.empty());
+
+		client.notify_structure_changed();
+		announce("Renamed", "10.0.0.2", "10");
+		test_client.handler->on_connect(false, true);
+		ASSERT_TRUE(test_client.steps.empty());
+		test_client.add_step().add_message("homie/testdevice/$state", "disconnected");
+	}
+
+	ASSERT_TRUE(test_client.steps.empty());
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+namespace {
+	struct recording_mqtt_client : public homie::mqtt_client {
+		homie::mqtt_event_handler* handler = nullptr;
+		bool fail = false;
+		std::vector<std::pair<std::string, std::string>> published;
+		std::function<void()> on_publish;
+
+		virtual void set_event_handler(homie::mqtt_event_handler* evt) override { handler = evt; }
+		virtual void open(const std::string&, const std::string&, int, bool) override {
+			if (handler) handler->on_connect(false, false);
+		}
+		virtual void open() override { FAIL(); }
+		virtual void publish(const std::string& topic, const std::string& payload, int, bool) override {
+			if (fail) throw std::runtime_error("Failed to publish");
+			published.push_back({ topic, payload });
+			if (on_publish) on_publish();
+		}
+		virtual void subscribe(const std::string&, int) override {}
+		virtual void unsubscribe(const std::string&) override {}
+		virtual bool is_connected() const override { return !fail; }
+	};
+}
+
+TEST(ClientTest, OfflineQueue) {
+	recording_mqtt_client mqtt;
+	auto dev = std::make_shared<test_device>();
+	auto node = std::make_shared<test_node>(dev);
+	auto prop = std::make_shared<test_property>(node);
+	prop->attributes["retained"] = "true";
+	dev->add_node(node);
+	node->add_property(prop);
+	homie::client client(mqtt, dev);
+	mqtt.published.clear();
+
+	// Retained updates are coalesced while offline
+	mqtt.handler->on_offline();
+	prop->value = "1";
+	client.notify_property_changed("testnode", "intensity");
+	prop->value = "2";
+	client.notify_property_changed("testnode", "intensity");
+	ASSERT_TRUE(mqtt.published.empty());
+	ASSERT_EQ(client.get_pending_updates(), 1);
+
+	mqtt.handler->on_connect(true, true);
+	ASSERT_EQ(mqtt.published.size(), 2);
+	ASSERT_EQ(mqtt.published[1], std::make_pair(std::string("homie/testdevice/testnode/intensity"), std::string("2")));
+	ASSERT_EQ(client.get_pending_updates(), 0);
+	mqtt.published.clear();
+
+	// A failing publish queues the update until the next connect
+	mqtt.fail = true;
+	prop->value = "3";
+	client.notify_property_changed("testnode", "intensity");
+	mqtt.fail = false;
+	ASSERT_EQ(client.drain(), 0);
+	ASSERT_EQ(client.get_pending_updates(), 1);
+	mqtt.handler->on_connect(true, true);
+	ASSERT_EQ(mqtt.published.back().second, "3");
+	ASSERT_EQ(client.get_dropped_updates(), 0);
+}
+
+TEST(ClientTest, OfflineQueueDrainsAfterReconnect) {
+	homie::outbox_options opts;
+	opts.drain_rate = 50;
+	opts.drain_burst = 1;
+
+	recording_mqtt_client mqtt;
+	auto dev = std::make_shared<test_device>();
+	auto node = std::make_shared<test_node>(dev);
+	auto prop = std::make_shared<test_property>(node);
+	prop->attributes["retained"] = "false";
+	dev->add_node(node);
+	node->add_property(prop);
+	homie::client client(mqtt, dev);
+	client.set_outbox_options(opts);
+
+	mqtt.handler->on_offline();
+	for (int i = 0; i < 3; i++) {
+		prop->value = std::to_string(i);
+		client.notify_property_changed("testnode", "intensity");
+	}
+	ASSERT_EQ(client.get_pending_updates(), 3);
+
+	// The drain rate holds back two updates, the client publishes them without further calls
+	mqtt.handler->on_connect(true, true);
+	for (int i = 0; i < 200 && client.get_pending_updates() != 0; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	ASSERT_EQ(client.get_pending_updates(), 0);
+	ASSERT_EQ(mqtt.published.back(), std::make_pair(std::string("homie/testdevice/testnode/intensity"), std::string("2")));
+}
+
+TEST(ClientTest, OfflineQueueSpill) {
+	const std::string path = "outbox_test.spill";
+	std::remove(path.c_str());
+	homie::outbox_options opts;
+	opts.max_entries = 1;
+	opts.drain_rate = 0;
+	opts.spill_path = path;
+
+	recording_mqtt_client mqtt;
+	auto dev = std::make_shared<test_device>();
+	auto node = std::make_shared<test_node_array>(dev);
+	auto prop = std::make_shared<test_property>(node);
+	dev->add_node(node);
+	node->add_property(prop);
+	{
+		homie::client client(mqtt, dev);
+		client.set_outbox_options(opts);
+		mqtt.handler->on_offline();
+		client.notify_property_changed("testnode", "intensity");
+		ASSERT_EQ(client.get_pending_updates(), 3);
+	}
+
+	// Spilled updates survive the client and are published by the next one
+	mqtt.published.clear();
+	{
+		homie::client client(mqtt, dev);
+		client.set_outbox_options(opts);
+		client.drain();
+		ASSERT_EQ(client.get_pending_updates(), 0);
+	}
+	size_t updates = 0;
+	for (auto& e : mqtt.published)
+		if (e.first == "homie/testdevice/testnode_1/intensity" || e.first == "homie/testdevice/testnode_2/intensity") updates++;
+	// Values are published once by the announcement and once from the spill file
+	ASSERT_EQ(updates, 4);
+
+	// A record whose length runs past the written part of the file drops the rest of the file
+	{
+		homie::client client(mqtt, dev);
+		client.set_outbox_options(opts);
+		mqtt.handler->on_offline();
+		client.notify_property_changed("testnode", "intensity");
+		ASSERT_EQ(client.get_pending_updates(), 3);
+	}
+	{
+		auto file = std::fopen(path.c_str(), "r+b");
+		ASSERT_NE(file, nullptr);
+		// First record behind the 24 byte header, starting with the topic length
+		uint32_t topic_len = 0x7fffffff;
+		std::fseek(file, 24, SEEK_SET);
+		std::fwrite(&topic_len, sizeof(topic_len), 1, file);
+		std::fclose(file);
+	}
+	mqtt.published.clear();
+	{
+		homie::client client(mqtt, dev);
+		client.set_outbox_options(opts);
+		mqtt.published.clear();
+		ASSERT_EQ(client.drain(), 0);
+		ASSERT_EQ(client.get_pending_updates(), 0);
+		ASSERT_TRUE(mqtt.published.empty());
+	}
+
+	// Replacing the spill file keeps the messages it holds
+	std::remove(path.c_str());
+	{
+		homie::outbound_queue queue(opts);
+		for (auto e : { "1", "2", "3" }) queue.push("t", e, 1, false);
+		homie::outbox_options memory;
+		memory.drain_rate = 0;
+		queue.reset(memory);
+		ASSERT_EQ(queue.size(), 3);
+		ASSERT_EQ(queue.get_dropped(), 0);
+		recording_mqtt_client out;
+		ASSERT_EQ(queue.drain(out), 3);
+		ASSERT_EQ(out.published, (std::vector<std::pair<std::string, std::string>>{ { "t", "1" }, { "t", "2" }, { "t", "3" } }));
+	}
+	std::remove(path.c_str());
+}
+
+TEST(ClientTest, StatCollectorsSampledByNotify) {
+	recording_mqtt_client mqtt;
+	auto dev = std::make_shared<test_device>();
+	auto node = std::make_shared<test_node>(dev);
+	auto prop = std::make_shared<test_property>(node);
+	dev->add_node(node);
+	node->add_property(prop);
+	homie::client client(mqtt, dev);
+	int calls = 0;
+	client.add_stat_collector("calls", [&calls]() { return std::to_string(++calls); });
+	client.notify_stats_changed();
+	ASSERT_EQ(calls, 1);
+
+	// Reannouncing publishes the last sample instead of starting a new measurement
+	mqtt.published.clear();
+	mqtt.handler->on_connect(false, true);
+	ASSERT_EQ(calls, 1);
+	auto it = std::find(mqtt.published.begin(), mqtt.published.end(), std::make_pair(std::string("homie/testdevice/$stats/calls"), std::string("1")));
+	ASSERT_NE(it, mqtt.published.end());
+	client.notify_stats_changed();
+	ASSERT_EQ(calls, 2);
+}
+
+TEST(ClientTest, OfflineQueuePublishUnlocked) {
+	homie::outbox_options opts;
+	opts.drain_rate = 0;
+	homie::outbound_queue queue(opts);
+	recording_mqtt_client mqtt;
+	queue.push("a", "1", 1, false);
+	// Queueing from within publish deadlocks if drain holds the queue lock
+	mqtt.on_publish = [&]() { if (mqtt.published.size() == 1) queue.push("b", "2", 1, false); };
+	ASSERT_EQ(queue.drain(mqtt), 2);
+
+	// A failed publish stays at the front
+	queue.push("c", "3", 1, false);
+	queue.push("d", "4", 1, false);
+	mqtt.fail = true;
+	ASSERT_THROW(queue.drain(mqtt), std::runtime_error);
+	mqtt.fail = false;
+	ASSERT_EQ(queue.size(), 2);
+	ASSERT_EQ(queue.drain(mqtt), 2);
+	ASSERT_EQ(mqtt.published, (std::vector<std::pair<std::string, std::string>>{ { "a", "1" }, { "b", "2" }, { "c", "3" }, { "d", "4" } }));
+}
+
+TEST(ClientTest, InitHomie4) {
+
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/testdevice/+/+/set");
+	test_client.expect_unsubscribe.insert("homie/testdevice/+/+/set");
+	test_client.add_step().add_message("homie/testdevice/$state", "init");
+	test_client.add_step()
+		.add_message("homie/testdevice/$homie", "4.0.0")
+		.add_message("homie/testdevice/$name", "Testdevice")
+		.add_message("homie/testdevice/$extensions", "")
+		.add_message("homie/testdevice/$nodes", "testnode")
+		.add_message("homie/testdevice/testnode/$name", "Testnode")
+		.add_message("homie/testdevice/testnode/$type", "light")
+		.add_message("homie/testdevice/testnode/$properties", "intensity")
+		.add_message("homie/testdevice/testnode/intensity", "100")
+		.add_message("homie/testdevice/testnode/intensity/$name", "Intensity")
+		.add_message("homie/testdevice/testnode/intensity/$settable", "true")
+		.add_message("homie/testdevice/testnode/intensity/$retained", "false")
+		.add_message("homie/testdevice/testnode/intensity/$unit", "%")
+		.add_message("homie/testdevice/testnode/intensity/$datatype", "integer")
+		.add_message("homie/testdevice/testnode/intensity/$format", "0:100");
+	test_client.add_step().add_message("homie/testdevice/$state", "ready");
+	test_client.add_step().add_message("homie/testdevice/$state", "disconnected");
+
+	{
+		auto dev = std::make_shared<test_device>();
+		auto node = std::make_shared<test_node>(dev);
+		auto prop = std::make_shared<test_property>(node);
+		dev->add_node(node);
+		node->add_property(prop);
+		homie::client client(test_client, dev, "homie/", homie::protocol_version::v4);
+		// Stats are not part of Homie 4
+		client.notify_stats_changed();
+	}
+
+	ASSERT_TRUE(test_client.open_called);
+	ASSERT_TRUE(test_client.steps.empty());
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(ClientTest, InitHomie5) {
+	recording_mqtt_client mqtt;
+	auto dev = std::make_shared<test_device>();
+	auto node = std::make_shared<test_node>(dev);
+	auto prop = std::make_shared<test_property>(node);
+	dev->add_node(node);
+	node->add_property(prop);
+	std::string description;
+	{
+		homie::client client(mqtt, dev, "homie/5/", homie::protocol_version::v5);
+		std::vector<std::pair<std::string, std::string>> expected = {
+			{ "homie/5/testdevice/$state", "init" },
+			{ "homie/5/testdevice/$description", "" },
+			{ "homie/5/testdevice/testnode/intensity", "100" },
+			{ "homie/5/testdevice/$state", "ready" }
+		};
+		ASSERT_EQ(mqtt.published.size(), expected.size());
+		for (size_t i = 0; i < expected.size(); i++) {
+			ASSERT_EQ(mqtt.published[i].first, expected[i].first);
+			if (i != 1) {
+				ASSERT_EQ(mqtt.published[i].second, expected[i].second);
+			}
+		}
+		description = mqtt.published[1].second;
+
+		// The name is part of the description, a rename shows on the next announcement
+		dev->attributes["name"] = "Renamed";
+		mqtt.published.clear();
+		mqtt.handler->on_connect(false, true);
+		ASSERT_EQ(mqtt.published.at(1).first, "homie/5/testdevice/$description");
+		ASSERT_NE(mqtt.published.at(1).second.find("\"name\":\"Renamed\""), std::string::npos);
+	}
+
+	// Read it back with the JSON reader used by the master
+	std::map<std::string, std::string> attributes;
+	homie::json::reader r(description);
+	std::function<bool(const std::string&, const std::string&)> member = [&](const std::string& path, const std::string& key) {
+		if (r.at_container()) return r.object([&](const std::string& k) { return member(path + key + "/", k); });
+		return r.scalar(attributes[path + key]);
+	};
+	ASSERT_TRUE(r.object([&](const std::string& k) { return member("", k); }));
+	ASSERT_TRUE(r.at_end());
+	ASSERT_EQ(attributes.at("homie"), "5.0");
+	ASSERT_EQ(attributes.at("name"), "Testdevice");
+	ASSERT_FALSE(attributes.at("version").empty());
+	ASSERT_EQ(attributes.at("nodes/testnode/type"), "light");
+	ASSERT_EQ(attributes.at("nodes/testnode/properties/intensity/datatype"), "integer");
+	ASSERT_EQ(attributes.at("nodes/testnode/properties/intensity/format"), "0:100");
+	ASSERT_EQ(attributes.at("nodes/testnode/properties/intensity/settable"), "true");
+	ASSERT_EQ(attributes.at("nodes/testnode/properties/intensity/retained"), "false");
+	ASSERT_EQ(attributes.at("nodes/testnode/properties/intensity/unit"), "%");
+}
+
+TEST(ClientTest, BroadcastRouting) {
+	recording_mqtt_client mqtt;
+	auto dev = std::make_shared<test_device>();
+	{
+		homie::client client(mqtt, dev);
+		std::vector<std::string> calls;
+		client.subscribe_broadcast("alert/#", [&](const std::string& level, const std::string& payload) { calls.push_back("alert:" + level); });
+		client.subscribe_broadcast("+/reboot", [&](const std::string& level, const std::string& payload) { calls.push_back("reboot:" + level); });
+		mqtt.handler->on_message("homie/$broadcast/alert/fire/kitchen", "1");
+		mqtt.handler->on_message("homie/$broadcast/system/reboot", "1");
+		mqtt.handler->on_message("homie/$broadcast/system/reboot/now", "1");
+		ASSERT_EQ(calls, (std::vector<std::string>{ "alert:alert/fire/kitchen", "reboot:system/reboot" }));
+	}
+}
+
+namespace {
+	// Setter blocks until the gate opens, like a property talking to slow hardware
+	struct blocking_property : public test_property {
+		std::string id;
+		std::mutex mtx;
+		std::condition_variable cv;
+		bool open = true;
+		std::vector<std::string> values;
+
+		blocking_property(std::weak_ptr<homie::node> ptr, const std::string& pid)
+			: test_property(ptr), id(pid)
+		{}
+
+		virtual std::string get_id() const override { return id; }
+		virtual void set_value(const std::string& v) override {
+			std::unique_lock<std::mutex> lck(mtx);
+			values.push_back(v);
+			cv.notify_all();
+			cv.wait(lck, [this]() { return open; });
+		}
+		virtual void set_value(int64_t idx, const std::string& v) override {
+			set_value(std::to_string(idx) + ":" + v);
+		}
+
+		void set_open(bool o) {
+			std::lock_guard<std::mutex> lck(mtx);
+			open = o;
+			cv.notify_all();
+		}
+		bool wait_for_values(size_t n) {
+			std::unique_lock<std::mutex> lck(mtx);
+			return cv.wait_for(lck, std::chrono::seconds(5), [&]() { return values.size() >= n; });
+		}
+	};
+}
+
+TEST(ClientTest, AsyncSets) {
+	recording_mqtt_client mqtt;
+	auto dev = std::make_shared<test_device>();
+	auto node = std::make_shared<test_node>(dev);
+	auto slow = std::make_shared<blocking_property>(node, "intensity");
+	auto fast = std::make_shared<blocking_property>(node, "color");
+	dev->add_node(node);
+	node->add_property(slow);
+	node->add_property(fast);
+	{
+		homie::client client(mqtt, dev);
+		client.enable_async_sets(2, true);
+		slow->set_open(false);
+		// Keeps the running executor
+		client.enable_async_sets(1, false);
+		// Returns although the setter blocks
+		mqtt.handler->on_message("homie/testdevice/testnode/intensity/set", "1");
+		ASSERT_TRUE(slow->wait_for_values(1));
+		// Other properties are not held up
+		mqtt.handler->on_message("homie/testdevice/testnode/color/set", "5");
+		ASSERT_TRUE(fast->wait_for_values(1));
+		// Sets waiting behind the blocked one are replaced by the latest
+		mqtt.handler->on_message("homie/testdevice/testnode/intensity/set", "2");
+		mqtt.handler->on_message("homie/testdevice/testnode/intensity/set", "3");
+		mqtt.handler->on_message("homie/testdevice/testnode/intensity/set", "4");
+		ASSERT_EQ(client.get_dropped_sets(), 2);
+		slow->set_open(true);
+		client.wait_for_sets();
+		ASSERT_EQ(slow->values, (std::vector<std::string>{ "1", "4" }));
+		ASSERT_EQ(fast->values, std::vector<std::string>{ "5" });
+	}
+
+	// leds_2 and leds_02 address the same index and share its queue
+	auto arr = std::make_shared<test_node_array>(dev);
+	auto leds = std::make_shared<blocking_property>(arr, "intensity");
+	dev->nodes.clear();
+	dev->add_node(arr);
+	arr->add_property(leds);
+	{
+		homie::client client(mqtt, dev);
+		client.enable_async_sets(2, true);
+		leds->set_open(false);
+		mqtt.handler->on_message("homie/testdevice/testnode_2/intensity/set", "1");
+		ASSERT_TRUE(leds->wait_for_values(1));
+		mqtt.handler->on_message("homie/testdevice/testnode_02/intensity/set", "2");
+		mqtt.handler->on_message("homie/testdevice/testnode_2/intensity/set", "3");
+		ASSERT_EQ(client.get_dropped_sets(), 1);
+		leds->set_open(true);
+		client.wait_for_sets();
+		ASSERT_EQ(leds->values, (std::vector<std::string>{ "2:1", "2:3" }));
+	}
+}
+
+namespace {
+	struct gated_mqtt_client : public recording_mqtt_client {
+		std::mutex mtx;
+		std::condition_variable cv;
+		bool open = true;
+		bool blocked = false;
+
+		virtual void publish(const std::string& topic, const std::string& payload, int qos, bool retain) override {
+			std::unique_lock<std::mutex> lck(mtx);
+			blocked = true;
+			cv.notify_all();
+			cv.wait(lck, [this]() { return open; });
+			blocked = false;
+			published.push_back({ topic, payload });
+		}
+		void set_open(bool o) {
+			std::lock_guard<std::mutex> lck(mtx);
+			open = o;
+			cv.notify_all();
+		}
+		void wait_blocked() {
+			std::unique_lock<std::mutex> lck(mtx);
+			cv.wait(lck, [this]() { return blocked; });
+		}
+	};
+}
+
+TEST(ClientTest, ConcurrentNotify) {
+	gated_mqtt_client mqtt;
+	auto dev = std::make_shared<test_device>();
+	auto node = std::make_shared<test_node>(dev);
+	auto prop = std::make_shared<test_property>(node);
+	dev->add_node(node);
+	node->add_property(prop);
+	{
+		homie::client client(mqtt, dev);
+		client.enable_concurrent_notify();
+		mqtt.published.clear();
+
+		// Many producers at once
+		std::vector<std::thread> producers;
+		for (int t = 0; t < 8; t++) {
+			producers.emplace_back([&]() {
+				for (int i = 0; i < 1000; i++) client.notify_property_changed("testnode", "intensity");
+			});
+		}
+		for (auto& t : producers) t.join();
+		client.flush_notifications();
+		ASSERT_FALSE(mqtt.published.empty());
+		ASSERT_LE(mqtt.published.size(), 8000);
+		for (auto& e : mqtt.published) ASSERT_EQ(e, (std::pair<std::string, std::string>{ "homie/testdevice/testnode/intensity", "100" }));
+
+		// Notifications queued while the publisher is busy collapse into one publish
+		mqtt.published.clear();
+		mqtt.set_open(false);
+		client.notify_property_changed("testnode", "intensity");
+		mqtt.wait_blocked();
+		for (int i = 0; i < 100; i++) {
+			client.notify_property_changed("testnode", "intensity");
+			client.notify_stats_changed();
+		}
+		mqtt.set_open(true);
+		client.flush_notifications();
+		size_t values = 0;
+		for (auto& e : mqtt.published) if (e.first == "homie/testdevice/testnode/intensity") values++;
+		ASSERT_EQ(values, 2);
+		// Plus one publish of the uptime stat
+		ASSERT_EQ(mqtt.published.size(), values + 1);
+	}
+}
+
+TEST(ClientTest, ConcurrentReannounce) {
+	gated_mqtt_client mqtt;
+	auto dev = std::make_shared<test_device>();
+	auto node = std::make_shared<test_node>(dev);
+	auto prop = std::make_shared<test_property>(node);
+	dev->add_node(node);
+	node->add_property(prop);
+	{
+		homie::client client(mqtt, dev);
+		client.enable_concurrent_notify();
+
+		// Reconnects on the transport thread, notifications and structure changes on others
+		std::atomic<bool> done(false);
+		std::thread transport([&]() {
+			while (!done) mqtt.handler->on_connect(false, true);
+		});
+		std::thread notifier([&]() {
+			while (!done) {
+				client.notify_property_changed("testnode", "intensity");
+				client.notify_stats_changed();
+			}
+		});
+		for (int i = 0; i < 50; i++) {
+			client.add_stat_collector("s" + std::to_string(i), [i]() { return std::to_string(i); });
+			client.notify_structure_changed();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		done = true;
+		transport.join();
+		notifier.join();
+		client.flush_notifications();
+
+		mqtt.handler->on_connect(false, true);
+		std::lock_guard<std::mutex> lck(mqtt.mtx);
+		auto it = std::find_if(mqtt.published.rbegin(), mqtt.published.rend(), [](const std::pair<std::string, std::string>& e) { return e.first == "homie/testdevice/$stats"; });
+		ASSERT_NE(it, mqtt.published.rend());
+		ASSERT_EQ(std::count(it->second.begin(), it->second.end(), ','), 50);
+	}
+}
+
+TEST(ClientTest, StatsScheduler) {
+	recording_mqtt_client mqtt;
+	auto dev = std::make_shared<test_device>();
+	homie::client client(mqtt, dev);
+	std::atomic<int> counter(1);
+	client.add_stat_collector("counter", [&]() { return std::to_string(counter.load()); });
+	client.add_builtin_stats();
+	client.notify_structure_changed();
+	mqtt.published.clear();
+
+	auto scheduled = homie::stats_scheduler::instance().size();
+	client.enable_stats_scheduler(std::chrono::milliseconds(10));
+	ASSERT_EQ(homie::stats_scheduler::instance().size(), scheduled + 1);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	client.disable_stats_scheduler();
+	ASSERT_EQ(homie::stats_scheduler::instance().size(), scheduled);
+	client.flush_notifications();
+
+	// Several ticks, but every stat is published once until it changes
+	std::map<std::string, std::vector<std::string>> stats;
+	for (auto& e : mqtt.published) stats[e.first].push_back(e.second);
+	ASSERT_EQ(stats["homie/testdevice/$stats/counter"], std::vector<std::string>{ "1" });
+	ASSERT_EQ(stats["homie/testdevice/$stats/uptime"], std::vector<std::string>{ "0" });
+	// Process stats change on their own
+	ASSERT_FALSE(stats["homie/testdevice/$stats/rss"].empty());
+	ASSERT_GT(std::stoll(stats["homie/testdevice/$stats/rss"][0]), 0);
+	ASSERT_FALSE(stats["homie/testdevice/$stats/cpuload"].empty());
+
+	mqtt.published.clear();
+	counter = 2;
+	client.enable_stats_scheduler(std::chrono::milliseconds(10));
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	client.disable_stats_scheduler();
+	client.flush_notifications();
+	size_t counters = 0;
+	for (auto& e : mqtt.published) {
+		if (e.first != "homie/testdevice/$stats/counter") continue;
+		ASSERT_EQ(e.second, "2");
+		counters++;
+	}
+	ASSERT_EQ(counters, 1);
+
+	// Collectors are announced with the device stats
+	mqtt.published.clear();
+	mqtt.handler->on_connect(false, false);
+	bool announced = false;
+	for (auto& e : mqtt.published) {
+		if (e.first == "homie/testdevice/$stats") {
+			ASSERT_EQ(e.second, "counter,cpuload,rss,uptime");
+			announced = true;
+		}
+	}
+	ASSERT_TRUE(announced);
+}
+
+namespace {
+	struct throwing_property : public test_property {
+		throwing_property(std::weak_ptr<homie::node> node) : test_property(node) {}
+		virtual void set_value(int64_t node_idx, const std::string& value) override { throw std::runtime_error("setter failed"); }
+	};
+}
+
+TEST(ClientTest, MalformedSets) {
+	recording_mqtt_client mqtt;
+	auto dev = std::make_shared<test_device>();
+	auto node = std::make_shared<test_node_array>(dev);
+	auto prop = std::make_shared<throwing_property>(node);
+	dev->add_node(node);
+	node->add_property(prop);
+	homie::client client(mqtt, dev);
+	client.enable_quarantine(2);
+
+	// None of these may throw into the mqtt library
+	mqtt.handler->on_message("homie/testdevice/testnode_x/intensity/set", "5");
+	mqtt.handler->on_message("homie/testdevice/testnode_99999999999999999999/intensity/set", "5");
+	mqtt.handler->on_message("homie/testdevice/testnode_4/intensity/set", "5");
+	mqtt.handler->on_message("homie/testdevice//intensity/set", "5");
+	mqtt.handler->on_message("homie/testdevice/testnode_1/intensity/set", "5");
+	ASSERT_EQ(client.get_malformed_messages(), 4);
+	auto q = client.get_quarantined();
+	ASSERT_EQ(q.size(), 2);
+	ASSERT_EQ(q[0].reason, "array index out of range");
+	ASSERT_EQ(q[1].reason, "empty topic level");
+	// The set was valid, the setter failed
+	ASSERT_EQ(client.get_handler_errors(), 1);
+
+	// Rejected by $format, not malformed
+	mqtt.handler->on_message("homie/testdevice/testnode_1/intensity/set", "abc");
+	ASSERT_EQ(client.get_malformed_messages(), 4);
+	ASSERT_EQ(client.get_rejected_sets(), 1);
+
+	// Setters run by the set executor are counted the same way
+	client.enable_async_sets(1, false);
+	mqtt.handler->on_message("homie/testdevice/testnode_1/intensity/set", "6");
+	client.wait_for_sets();
+	ASSERT_EQ(client.get_handler_errors(), 2);
+	ASSERT_EQ(client.get_malformed_messages(), 4);
+}
+
+TEST(ClientTest, LenientAttributes) {
+	auto dev = std::make_shared<test_device>();
+	auto node = std::make_shared<test_node_array>(dev);
+	dev->attributes["stats/interval"] = "soon";
+	ASSERT_EQ(dev->get_stats_interval().count(), 0);
+	node->attributes["array"] = "1-x";
+	ASSERT_EQ(node->array_range(), (std::pair<int64_t, int64_t>(0, -1)));
+	node->attributes["array"] = "-";
+	ASSERT_EQ(node->array_range(), (std::pair<int64_t, int64_t>(0, -1)));
+	node->attributes["array"] = "2-5";
+	ASSERT_EQ(node->array_range(), (std::pair<int64_t, int64_t>(2, 5)));
+
+	int64_t v = 0;
+	ASSERT_TRUE(homie::utils::parse_int64(std::string("-9223372036854775808"), v));
+	ASSERT_EQ(v, INT64_MIN);
+	ASSERT_TRUE(homie::utils::parse_int64(std::string("9223372036854775807"), v));
+	ASSERT_EQ(v, INT64_MAX);
+	for (auto bad : { "", "-", "+1", " 1", "1 ", "9223372036854775808", "1e3", "0x10" })
+		ASSERT_FALSE(homie::utils::parse_int64(std::string(bad), v)) << bad;
+}
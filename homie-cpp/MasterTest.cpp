@@ -1,5 +1,10 @@
 #include <gtest/gtest.h>
 #include <homie-cpp/master.h>
+#include <homie-cpp/exporter.h>
+#include <homie-cpp/supervisor.h>
+#include <homie-cpp/retained_gc.h>
+#include <sstream>
+#include <iostream>
 
 using namespace homie;
 
@@ -442,4 +447,1479 @@ TEST(MasterTest, EventHandler) {
 	ASSERT_TRUE(test_client.steps.empty());
 	ASSERT_TRUE(test_client.expect_subscribe.empty());
 	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
-}
\ No newline at end of file
+}
+TEST(MasterTest, EnumerateTree) {
+	test_mqtt_client test_client;
+	test_client.is_manager = true;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		test_client.handler->on_message("homie/testdevice/$state", "init");
+		test_client.handler->on_message("homie/testdevice/$name", "Testdevice");
+		test_client.handler->on_message("homie/testdevice/$nodes", "testnode,arraynode[]");
+		test_client.handler->on_message("homie/testdevice/testnode/$name", "Testnode");
+		test_client.handler->on_message("homie/testdevice/testnode/$properties", "intensity,color");
+		test_client.handler->on_message("homie/testdevice/testnode/intensity/$name", "Intensity");
+		test_client.handler->on_message("homie/testdevice/testnode/color/$name", "Color");
+		test_client.handler->on_message("homie/testdevice/arraynode/$array", "0-1");
+		test_client.handler->on_message("homie/testdevice/arraynode_0/$name", "First");
+		test_client.handler->on_message("homie/testdevice/arraynode_1/$name", "Second");
+		test_client.handler->on_message("homie/testdevice/$state", "ready");
+
+		std::vector<std::string> devices;
+		m.for_each_discovered_device([&](const std::string& id, device& dev) {
+			devices.push_back(id);
+			ASSERT_EQ(id, dev.get_id());
+		});
+		ASSERT_EQ(devices, std::vector<std::string>({ "testdevice" }));
+
+		auto dev = m.get_discovered_device("testdevice");
+		std::map<std::string, std::string> attributes;
+		dev->for_each_attribute([&](const std::string& id, const std::string& value) {
+			attributes[id] = value;
+		});
+		ASSERT_EQ(attributes.size(), dev->get_attributes().size());
+		ASSERT_EQ(attributes["name"], "Testdevice");
+
+		std::vector<std::string> nodes;
+		dev->for_each_node([&](const std::string& id, const node& n) {
+			nodes.push_back(id);
+			ASSERT_EQ(id, n.get_id());
+		});
+		ASSERT_EQ(nodes, std::vector<std::string>({ "arraynode", "testnode" }));
+
+		std::map<std::string, std::string> properties;
+		dev->get_node("testnode")->for_each_property([&](const std::string& id, property& p) {
+			properties[id] = p.get_name();
+		});
+		ASSERT_EQ(properties.size(), 2);
+		ASSERT_EQ(properties["intensity"], "Intensity");
+		ASSERT_EQ(properties["color"], "Color");
+
+		std::map<std::string, std::string> idx_attributes;
+		dev->get_node("arraynode")->for_each_attribute(1, [&](const std::string& id, const std::string& value) {
+			idx_attributes[id] = value;
+		});
+		ASSERT_EQ(idx_attributes.size(), 1);
+		ASSERT_EQ(idx_attributes["name"], "Second");
+	}
+	ASSERT_TRUE(test_client.open_called);
+	ASSERT_TRUE(test_client.steps.empty());
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+struct counting_handler : master_event_handler {
+	std::vector<std::string> events;
+
+	// Inherited by master_event_handler
+	virtual void on_broadcast(const std::string & level, const std::string & payload) override { events.push_back("broadcast:" + level); }
+	virtual void on_device_discovered(device_ptr dev) override { events.push_back("discovered:" + dev->get_id()); }
+	virtual void on_device_changed(device_ptr dev, const std::string & attribute) override { events.push_back("device:" + dev->get_id() + "/" + attribute); }
+	virtual void on_node_changed(node_ptr node, const std::string & attribute) override { events.push_back("node:" + node->get_id() + "/" + attribute); }
+	virtual void on_node_changed(node_ptr node, int64_t idx, const std::string & attribute) override { events.push_back("node:" + node->get_id() + "_" + std::to_string(idx) + "/" + attribute); }
+	virtual void on_property_changed(property_ptr prop, const std::string & attribute) override { events.push_back("property:" + prop->get_id() + "/" + attribute); }
+	virtual void on_property_changed(property_ptr prop, int64_t idx, const std::string & attribute) override { events.push_back("property:" + prop->get_id() + "/" + attribute); }
+	virtual void on_property_value_changed(property_ptr prop, const std::string & value) override { events.push_back("value:" + prop->get_id() + "=" + value); }
+	virtual void on_property_value_changed(property_ptr prop, int64_t idx, const std::string & value) override { events.push_back("value:" + prop->get_id() + "=" + value); }
+};
+
+TEST(MasterTest, Subscriptions) {
+	test_mqtt_client test_client;
+	test_client.is_manager = true;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		counting_handler all, kitchen, temps, floats;
+		master m(test_client);
+		auto all_id = m.subscribe(all);
+		m.subscribe(kitchen, event_filter().on_device("kitchen"));
+		m.subscribe(temps, event_filter().on_node("sensor").on_property("temperature").only(event_kind::value));
+		m.subscribe(floats, event_filter().only(event_kind::value).with_datatype(datatype::number));
+
+		for (auto dev : { "kitchen", "garage" }) {
+			std::string base = std::string("homie/") + dev;
+			test_client.handler->on_message(base + "/$state", "init");
+			test_client.handler->on_message(base + "/sensor/temperature/$datatype", "float");
+			test_client.handler->on_message(base + "/sensor/humidity/$datatype", "integer");
+			test_client.handler->on_message(base + "/$state", "ready");
+		}
+		ASSERT_EQ(all.events, std::vector<std::string>({ "discovered:kitchen", "discovered:garage" }));
+		ASSERT_EQ(kitchen.events, std::vector<std::string>({ "discovered:kitchen" }));
+		ASSERT_TRUE(temps.events.empty());
+		ASSERT_TRUE(floats.events.empty());
+
+		test_client.handler->on_message("homie/kitchen/sensor/temperature", "21.5");
+		test_client.handler->on_message("homie/garage/sensor/temperature", "10.5");
+		test_client.handler->on_message("homie/garage/sensor/humidity", "40");
+		test_client.handler->on_message("homie/garage/sensor/$name", "Sensor");
+		test_client.handler->on_message("homie/$broadcast/alert", "Alert");
+
+		ASSERT_EQ(all.events.size(), 7);
+		ASSERT_EQ(kitchen.events, std::vector<std::string>({ "discovered:kitchen", "value:temperature=21.5", "broadcast:alert" }));
+		ASSERT_EQ(temps.events, std::vector<std::string>({ "value:temperature=21.5", "value:temperature=10.5" }));
+		ASSERT_EQ(floats.events, std::vector<std::string>({ "value:temperature=21.5", "value:temperature=10.5" }));
+
+		m.unsubscribe(all_id);
+		test_client.handler->on_message("homie/garage/sensor/humidity", "41");
+		ASSERT_EQ(all.events.size(), 7);
+	}
+	ASSERT_TRUE(test_client.open_called);
+	ASSERT_TRUE(test_client.steps.empty());
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, SubscriptionOwnThread) {
+	test_mqtt_client test_client;
+	test_client.is_manager = true;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	counting_handler threaded;
+	{
+		master m(test_client);
+		m.subscribe(threaded, event_filter().only(event_kind::value), true);
+		test_client.handler->on_message("homie/testdevice/$state", "ready");
+		for (int i = 0; i < 100; i++)
+			test_client.handler->on_message("homie/testdevice/node/prop", std::to_string(i));
+	}
+	// Destroying the master drains the queue
+	ASSERT_EQ(threaded.events.size(), 100);
+	ASSERT_EQ(threaded.events.back(), "value:prop=99");
+}
+
+TEST(MasterTest, SubscriptionSelfRemoval) {
+	test_mqtt_client test_client;
+	test_client.is_manager = true;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	struct self_removing_handler : counting_handler {
+		master* m = nullptr;
+		subscription_registry::id_type id = 0;
+		std::mutex mtx;
+		std::condition_variable cv;
+
+		virtual void on_property_value_changed(property_ptr prop, const std::string & value) override {
+			std::lock_guard<std::mutex> lck(mtx);
+			counting_handler::on_property_value_changed(prop, value);
+			m->unsubscribe(id);
+			cv.notify_all();
+		}
+	};
+
+	self_removing_handler threaded;
+	{
+		master m(test_client);
+		threaded.m = &m;
+		{
+			std::lock_guard<std::mutex> lck(threaded.mtx);
+			threaded.id = m.subscribe(threaded, event_filter().only(event_kind::value), true);
+		}
+		test_client.handler->on_message("homie/testdevice/$state", "ready");
+		for (int i = 0; i < 100; i++)
+			test_client.handler->on_message("homie/testdevice/node/prop", std::to_string(i));
+		std::unique_lock<std::mutex> lck(threaded.mtx);
+		ASSERT_TRUE(threaded.cv.wait_for(lck, std::chrono::seconds(5), [&]() { return !threaded.events.empty(); }));
+	}
+	// Unsubscribing from the delivery thread stops delivery without joining itself
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	std::lock_guard<std::mutex> lck(threaded.mtx);
+	ASSERT_EQ(threaded.events, std::vector<std::string>({ "value:prop=0" }));
+}
+
+TEST(MasterTest, ValueHistory) {
+	test_mqtt_client test_client;
+	test_client.is_manager = true;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		// Enough memory for exactly one numeric buffer
+		m.enable_history(8, value_history::footprint(8, true));
+		test_client.handler->on_message("homie/testdevice/$state", "ready");
+		test_client.handler->on_message("homie/testdevice/testnode/temperature/$datatype", "float");
+		test_client.handler->on_message("homie/testdevice/testnode/name/$datatype", "string");
+		for (int i = 1; i <= 10; i++)
+			test_client.handler->on_message("homie/testdevice/testnode/temperature", std::to_string(i));
+		test_client.handler->on_message("homie/testdevice/testnode/temperature", "invalid");
+		test_client.handler->on_message("homie/testdevice/testnode/temperature", "nan");
+		test_client.handler->on_message("homie/testdevice/testnode/temperature", "-inf");
+		test_client.handler->on_message("homie/testdevice/testnode/name", "Test");
+
+		auto node = m.get_discovered_device("testdevice")->get_node("testnode");
+		auto hist = m.get_history(node->get_property("temperature"));
+		ASSERT_NE(hist, nullptr);
+		ASSERT_TRUE(hist->is_numeric());
+		ASSERT_EQ(hist->size(), 8);
+		auto from = value_history::clock::now() - std::chrono::hours(1);
+		auto to = value_history::clock::now() + std::chrono::hours(1);
+		auto agg = hist->aggregate(from, to);
+		ASSERT_EQ(agg.count, 8);
+		ASSERT_DOUBLE_EQ(agg.min, 3);
+		ASSERT_DOUBLE_EQ(agg.max, 10);
+		ASSERT_DOUBLE_EQ(agg.avg, 6.5);
+		std::vector<double> values;
+		hist->for_each_number(from, to, [&](value_history::clock::time_point, double v) {
+			values.push_back(v);
+		});
+		ASSERT_EQ(values, std::vector<double>({ 3, 4, 5, 6, 7, 8, 9, 10 }));
+
+		// Budget exhausted
+		ASSERT_EQ(m.get_history(node->get_property("name")), nullptr);
+		ASSERT_EQ(m.get_history_memory(), value_history::footprint(8, true));
+	}
+	ASSERT_TRUE(test_client.open_called);
+	ASSERT_TRUE(test_client.steps.empty());
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, ValueHistoryLifecycle) {
+	test_mqtt_client test_client;
+	test_client.is_manager = true;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		m.enable_history(8, value_history::footprint(8, false));
+		test_client.handler->on_message("homie/testdevice/$state", "ready");
+		// Retained values may arrive before $datatype
+		test_client.handler->on_message("homie/testdevice/testnode/temperature", "21.5");
+		ASSERT_EQ(m.get_history_memory(), value_history::footprint(8, false));
+		test_client.handler->on_message("homie/testdevice/testnode/temperature/$datatype", "float");
+		test_client.handler->on_message("homie/testdevice/testnode/temperature", "0.1");
+
+		auto prop = m.get_discovered_device("testdevice")->get_node("testnode")->get_property("temperature");
+		auto hist = m.get_history(prop);
+		ASSERT_NE(hist, nullptr);
+		ASSERT_TRUE(hist->is_numeric());
+		ASSERT_EQ(m.get_history_memory(), value_history::footprint(8, true));
+		std::vector<std::string> values;
+		hist->for_each_value(value_history::clock::now() - std::chrono::hours(1), value_history::clock::now() + std::chrono::hours(1),
+			[&](value_history::clock::time_point, const std::string& v) { values.push_back(v); });
+		ASSERT_EQ(values, std::vector<std::string>({ "21.5", "0.1" }));
+
+		// Forgetting the property returns its memory to the budget
+		test_client.handler->on_message("homie/testdevice/testnode/$properties", "humidity");
+		ASSERT_EQ(m.collect_stale_topics(std::chrono::seconds(0)).size(), 2);
+		ASSERT_EQ(m.get_history_memory(), 0);
+	}
+	ASSERT_TRUE(test_client.open_called);
+	ASSERT_TRUE(test_client.steps.empty());
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, BatchExporter) {
+	test_mqtt_client test_client;
+	test_client.is_manager = true;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	std::ostringstream csv;
+	std::ostringstream lp;
+	{
+		stream_sink csv_sink(csv, export_format::csv);
+		stream_sink lp_sink(lp, export_format::line_protocol);
+		batch_exporter csv_exporter(csv_sink, 2, std::chrono::hours(1));
+		batch_exporter lp_exporter(lp_sink, 100, std::chrono::hours(1));
+		master m(test_client);
+		m.subscribe(csv_exporter, event_filter().only(event_kind::value));
+		m.subscribe(lp_exporter, event_filter().only(event_kind::value));
+		test_client.handler->on_message("homie/testdevice/$state", "ready");
+		test_client.handler->on_message("homie/testdevice/testnode/temperature", "21.5");
+		ASSERT_TRUE(csv.str().empty());
+		test_client.handler->on_message("homie/testdevice/testnode/on", "true");
+		// Batch size reached
+		auto written = csv.str();
+		ASSERT_EQ(std::count(written.begin(), written.end(), '\n'), 2);
+		test_client.handler->on_message("homie/testdevice/arraynode_1/name", "say \"hi\"");
+		csv_exporter.flush();
+		lp_exporter.flush();
+
+		auto rows = utils::split<std::string>(csv.str(), "\n");
+		ASSERT_EQ(rows.size(), 4);
+		ASSERT_NE(rows[0].find(",testdevice/testnode/temperature,21.5"), std::string::npos);
+		ASSERT_NE(rows[1].find(",testdevice/testnode/on,true"), std::string::npos);
+		ASSERT_NE(rows[2].find(",testdevice/arraynode_1/name,\"say \"\"hi\"\"\""), std::string::npos);
+
+		rows = utils::split<std::string>(lp.str(), "\n");
+		ASSERT_EQ(rows.size(), 4);
+		ASSERT_EQ(rows[0].find("homie,device=testdevice,node=testnode,property=temperature value=21.5 "), 0);
+		ASSERT_EQ(rows[1].find("homie,device=testdevice,node=testnode,property=on value=t "), 0);
+		ASSERT_EQ(rows[2].find("homie,device=testdevice,node=arraynode_1,property=name value=\"say \\\"hi\\\"\" "), 0);
+
+		// Newlines are escaped, nan is not a number
+		test_client.handler->on_message("homie/testdevice/arraynode_1/name", "a\nb");
+		test_client.handler->on_message("homie/testdevice/testnode/temperature", "nan");
+		test_client.handler->on_message("homie/testdevice/testnode/temperature", "20");
+		lp_exporter.flush();
+		rows = utils::split<std::string>(lp.str(), "\n");
+		ASSERT_EQ(rows.size(), 7);
+		ASSERT_EQ(rows[3].find("homie,device=testdevice,node=arraynode_1,property=name value=\"a\\nb\" "), 0);
+		ASSERT_EQ(rows[4].find("homie,device=testdevice,node=testnode,property=temperature value=\"nan\" "), 0);
+		ASSERT_EQ(rows[5].find("homie,device=testdevice,node=testnode,property=temperature value=20 "), 0);
+	}
+	ASSERT_TRUE(test_client.open_called);
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+namespace {
+	struct flaky_mqtt_client : public homie::mqtt_client {
+		homie::mqtt_event_handler* handler = nullptr;
+		std::mutex mtx;
+		std::atomic<int> fail_opens{ 0 };
+		std::atomic<int> opens{ 0 };
+		bool session_present = false;
+		std::vector<std::string> subscribed;
+
+		virtual void set_event_handler(homie::mqtt_event_handler* evt) override { handler = evt; }
+		virtual void open(const std::string&, const std::string&, int, bool) override { open(); }
+		virtual void open() override {
+			opens++;
+			if (fail_opens > 0) {
+				fail_opens--;
+				throw std::runtime_error("Failed to connect");
+			}
+			if (handler) handler->on_connect(session_present, false);
+		}
+		virtual void publish(const std::string&, const std::string&, int, bool) override {}
+		virtual void subscribe(const std::string& topic, int) override {
+			std::lock_guard<std::mutex> lck(mtx);
+			subscribed.push_back(topic);
+		}
+		virtual void unsubscribe(const std::string&) override {}
+		virtual bool is_connected() const override { return true; }
+	};
+}
+
+TEST(MasterTest, BatchExporterConcurrentFlush) {
+	test_mqtt_client test_client;
+	test_client.is_manager = true;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	struct slow_sink : export_sink {
+		std::atomic<size_t> rows{ 0 };
+		std::atomic<bool> writing{ false };
+		virtual void write(const export_batch& b) override {
+			writing = true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			rows += b.size();
+		}
+		virtual void flush() override {}
+	};
+
+	slow_sink sink;
+	{
+		batch_exporter exporter(sink, 2, std::chrono::hours(1));
+		master m(test_client);
+		m.subscribe(exporter, event_filter().only(event_kind::value));
+		test_client.handler->on_message("homie/testdevice/$state", "ready");
+		test_client.handler->on_message("homie/testdevice/testnode/p0", "0");
+		std::thread flusher([&]() { exporter.flush(); });
+		while (!sink.writing) std::this_thread::yield();
+		// The batch filling up while the flusher still writes makes the producer flush as well
+		test_client.handler->on_message("homie/testdevice/testnode/p1", "1");
+		test_client.handler->on_message("homie/testdevice/testnode/p2", "2");
+		flusher.join();
+		ASSERT_EQ(sink.rows, 3);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, BatchExporterThroughput) {
+	test_mqtt_client test_client;
+	test_client.is_manager = true;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	// Discards the output and counts lines
+	struct counting_buf : std::streambuf {
+		size_t lines = 0;
+		virtual int overflow(int c) override {
+			if (c == '\n') lines++;
+			return c;
+		}
+		virtual std::streamsize xsputn(const char* s, std::streamsize n) override {
+			lines += std::count(s, s + n, '\n');
+			return n;
+		}
+	};
+
+	counting_buf buf;
+	std::ostream out(&buf);
+	stream_sink sink(out, export_format::line_protocol);
+	const size_t updates = 200000;
+	{
+		batch_exporter exporter(sink);
+		master m(test_client);
+		m.subscribe(exporter, event_filter().only(event_kind::value));
+		test_client.handler->on_message("homie/testdevice/$state", "ready");
+		std::vector<std::string> topics, payloads;
+		for (int i = 0; i < 100; i++) topics.push_back("homie/testdevice/testnode/p" + std::to_string(i));
+		for (int i = 0; i < 1000; i++) payloads.push_back(std::to_string(i * 0.25));
+
+		// Raw messages through master into line protocol
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < updates; i++)
+			test_client.handler->on_message(topics[i % topics.size()], payloads[i % payloads.size()]);
+		exporter.flush();
+		auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		auto rate = static_cast<int64_t>(updates / seconds);
+		RecordProperty("updates_per_second", std::to_string(rate));
+		std::cout << "[          ] " << rate << " updates/s" << std::endl;
+	}
+	ASSERT_EQ(buf.lines, updates);
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, ConnectionSupervisor) {
+	flaky_mqtt_client transport;
+	homie::backoff_policy backoff;
+	backoff.initial = std::chrono::milliseconds(1);
+	backoff.max = std::chrono::milliseconds(4);
+	homie::connection_supervisor supervisor(transport, backoff);
+	{
+		master m(supervisor);
+		supervisor.subscribe("other/topic", 1);
+		ASSERT_EQ(transport.subscribed.size(), 2);
+
+		transport.fail_opens = 2;
+		transport.handler->on_offline();
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (supervisor.get_reconnects() == 0 && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		ASSERT_EQ(supervisor.get_reconnects(), 1);
+		ASSERT_EQ(supervisor.get_reconnect_attempts(), 3);
+
+		// The master renews its own subscription, the supervisor restores the other one
+		std::lock_guard<std::mutex> lck(transport.mtx);
+		ASSERT_EQ(transport.subscribed.size(), 4);
+		ASSERT_EQ(std::count(transport.subscribed.begin(), transport.subscribed.end(), "homie/#"), 2);
+		ASSERT_EQ(std::count(transport.subscribed.begin(), transport.subscribed.end(), "other/topic"), 2);
+	}
+}
+
+TEST(MasterTest, ConnectionSupervisorTransportReconnect) {
+	flaky_mqtt_client transport;
+	homie::backoff_policy backoff;
+	backoff.initial = std::chrono::milliseconds(20);
+	homie::connection_supervisor supervisor(transport, backoff);
+	{
+		master m(supervisor);
+		auto opens = transport.opens.load();
+		// The transport reconnects before the backoff elapsed, the supervisor must not open it again
+		transport.handler->on_offline();
+		transport.handler->on_connect(false, true);
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+		ASSERT_EQ(transport.opens, opens);
+		ASSERT_EQ(supervisor.get_reconnect_attempts(), 0);
+		ASSERT_EQ(supervisor.get_reconnects(), 1);
+	}
+}
+
+TEST(MasterTest, RateLimiter) {
+	homie::rate_limiter limiter(10, 2);
+	ASSERT_TRUE(limiter.try_acquire());
+	ASSERT_TRUE(limiter.try_acquire());
+	ASSERT_FALSE(limiter.try_acquire());
+	std::this_thread::sleep_for(std::chrono::milliseconds(150));
+	ASSERT_TRUE(limiter.try_acquire());
+
+	homie::rate_limiter unlimited;
+	for (int i = 0; i < 1000; i++) ASSERT_TRUE(unlimited.try_acquire());
+}
+
+TEST(MasterTest, Homie4DevicePublished) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		for (auto& id : { "v3device", "v4device" }) {
+			std::string dev = std::string("homie/") + id;
+			test_client.handler->on_message(dev + "/$state", "init");
+			test_client.handler->on_message(dev + "/$homie", id[1] == '3' ? "3.0.1" : "4.0.0");
+			test_client.handler->on_message(dev + "/$name", "Testdevice");
+			test_client.handler->on_message(dev + "/$nodes", "node_1");
+			test_client.handler->on_message(dev + "/node_1/$name", "Node");
+			test_client.handler->on_message(dev + "/node_1/intensity/$datatype", "integer");
+			test_client.handler->on_message(dev + "/node_1/intensity", "5");
+			test_client.handler->on_message(dev + "/$state", "ready");
+		}
+
+		ASSERT_EQ(2, m.get_discovered_devices().size());
+		std::map<std::string, device_ptr> devs;
+		for (auto& e : m.get_discovered_devices()) devs[e->get_id()] = e;
+		// Homie 3 reads "node_1" as index 1 of the array node "node"
+		auto v3 = devs.at("v3device");
+		ASSERT_EQ(v3->get_nodes(), std::set<std::string>{ "node" });
+		ASSERT_EQ(v3->get_node("node")->get_property("intensity")->get_value(1), "5");
+		// Homie 4 has no arrays, the id is taken as is
+		auto v4 = devs.at("v4device");
+		ASSERT_EQ(v4->get_attribute("homie"), "4.0.0");
+		ASSERT_EQ(v4->get_nodes(), std::set<std::string>{ "node_1" });
+		ASSERT_EQ(v4->get_node("node_1")->get_name(), "Node");
+		ASSERT_EQ(v4->get_node("node_1")->get_property("intensity")->get_value(), "5");
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, Homie5Description) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/5/#");
+	test_client.expect_unsubscribe.insert("homie/5/#");
+
+	{
+		master m(test_client, "homie/5/");
+		test_client.handler->on_message("homie/5/dev/$state", "init");
+		test_client.handler->on_message("homie/5/dev/$description", R"({
+			"homie": "5.0", "version": 7, "name": "Lamp \"A\" \u00e4",
+			"extensions": ["x", {"y": [1, 2.5e3, null]}],
+			"nodes": {
+				"light": { "name": "Light", "type": "dimmer", "properties": {
+					"intensity": { "name": "Intensity", "datatype": "integer", "format": "0:100", "settable": true, "unit": "%" },
+					"power": { "datatype": "boolean", "retained": false }
+				}},
+				"old": { "properties": {} }
+			}
+		})");
+		test_client.handler->on_message("homie/5/dev/light_1/intensity", "5");
+		test_client.handler->on_message("homie/5/dev/$state", "ready");
+
+		ASSERT_EQ(1, m.get_discovered_devices().size());
+		auto dev = *m.get_discovered_devices().begin();
+		ASSERT_EQ(dev->get_name(), "Lamp \"A\" \xc3\xa4");
+		ASSERT_EQ(dev->get_attribute("homie"), "5.0");
+		ASSERT_EQ(dev->get_attribute("version"), "7");
+		ASSERT_EQ(dev->get_nodes(), (std::set<std::string>{ "light", "light_1", "old" }));
+		auto intensity = dev->get_node("light")->get_property("intensity");
+		ASSERT_EQ(intensity->get_datatype(), datatype::integer);
+		ASSERT_EQ(intensity->get_format(), "0:100");
+		ASSERT_TRUE(intensity->is_settable());
+		ASSERT_TRUE(intensity->is_retained());
+		ASSERT_EQ(intensity->get_unit(), "%");
+		auto power = dev->get_node("light")->get_property("power");
+		ASSERT_FALSE(power->is_settable());
+		ASSERT_FALSE(power->is_retained());
+
+		// Malformed documents leave the tree untouched
+		test_client.handler->on_message("homie/5/dev/$description", R"({"nodes": {"light": {)");
+		ASSERT_NE(dev->get_node("old"), nullptr);
+
+		// A new description replaces the structure and reports every attribute it changed
+		counting_handler events;
+		m.subscribe(events);
+		test_client.handler->on_message("homie/5/dev/$description", R"({"homie":"5.0","version":8,"nodes":{"light":{"properties":{"power":{"datatype":"boolean"}}}}})");
+		ASSERT_EQ(dev->get_nodes(), std::set<std::string>{ "light" });
+		ASSERT_EQ(dev->get_node("light")->get_properties(), std::set<std::string>{ "power" });
+		ASSERT_TRUE(dev->get_node("light")->get_property("power")->is_retained());
+		ASSERT_EQ(events.events, std::vector<std::string>({ "device:dev/description", "device:dev/version", "property:power/retained",
+			"node:light/name", "node:light/properties", "node:light/type", "device:dev/nodes" }));
+
+		// A property losing its $datatype is a string again
+		test_client.handler->on_message("homie/5/dev/$description", R"({"homie":"5.0","version":8,"nodes":{"light":{"properties":{"power":{}}}}})");
+		ASSERT_EQ(dev->get_node("light")->get_property("power")->get_datatype(), datatype::string);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+namespace {
+	struct purge_mqtt_client : public test_mqtt_client {
+		std::vector<std::pair<std::string, std::string>> published;
+		virtual void publish(const std::string& topic, const std::string& payload, int qos, bool retain) override {
+			published.push_back({ topic, payload });
+			if (handler) handler->on_message(topic, payload);
+		}
+	};
+}
+
+TEST(MasterTest, StaleRetainedTopics) {
+	purge_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		msg("dev/$state", "ready");
+		msg("dev/$nodes", "node,arr[]");
+		msg("dev/node/$properties", "prop");
+		msg("dev/node/prop", "1");
+		msg("dev/node/prop/$datatype", "integer");
+		msg("dev/node/removed", "2");
+		msg("dev/node/removed/$name", "Removed");
+		msg("dev/arr_1/prop", "3");
+		msg("dev/gone/$name", "Gone");
+		msg("dev/gone/prop", "4");
+		msg("old/$state", "lost");
+		msg("old/$name", "Old");
+		msg("old/node/prop", "5");
+
+		auto found = m.collect_stale_topics(std::chrono::hours(1), false);
+		std::set<std::string> topics(found.begin(), found.end());
+		ASSERT_EQ(topics, (std::set<std::string>{
+			"homie/dev/node/removed",
+			"homie/dev/node/removed/$name",
+			"homie/dev/gone/$name",
+			"homie/dev/gone/prop" }));
+
+		found = m.collect_stale_topics(std::chrono::seconds(0));
+		topics = std::set<std::string>(found.begin(), found.end());
+		ASSERT_EQ(topics.size(), 7);
+		ASSERT_EQ(topics.count("homie/old/$state"), 1);
+		ASSERT_EQ(topics.count("homie/old/node/prop"), 1);
+		ASSERT_EQ(m.get_discovered_device("old"), nullptr);
+		ASSERT_EQ(m.get_discovered_device("dev")->get_nodes(), (std::set<std::string>{ "arr", "node" }));
+
+		// Clearing the topics echoes empty retained messages back, they must not recreate anything
+		homie::retained_purger purger(test_client, 1000, 4);
+		ASSERT_EQ(purger.purge(found), found.size());
+		ASSERT_EQ(test_client.published.size(), found.size());
+		ASSERT_EQ(m.get_discovered_device("old"), nullptr);
+		ASSERT_EQ(m.get_discovered_device("dev")->get_nodes(), (std::set<std::string>{ "arr", "node" }));
+		ASSERT_EQ(m.get_discovered_device("dev")->get_node("node")->get_properties(), std::set<std::string>{ "prop" });
+		ASSERT_TRUE(m.collect_stale_topics(std::chrono::seconds(0)).empty());
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, Snapshot) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		ASSERT_EQ(m.snapshot().size(), 0);
+		msg("dev/$state", "ready");
+		msg("dev/$nodes", "node,arr[]");
+		msg("dev/node/prop", "1");
+		m.enable_snapshots();
+		msg("dev/node/prop/$datatype", "integer");
+		msg("dev/arr/$array", "0-1");
+		msg("dev/arr_1/$name", "One");
+		msg("dev/arr_1/prop", "3");
+		msg("other/$state", "ready");
+
+		auto first = m.snapshot();
+		ASSERT_EQ(first.size(), 2);
+		std::ostringstream json;
+		first.write_json(json);
+		auto expected = std::string(R"({"time":)") + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(first.get_time().time_since_epoch()).count())
+			+ R"(,"devices":{"dev":{"attributes":{"nodes":"node,arr[]","state":"ready"},"nodes":{)"
+			+ R"("arr":{"attributes":{"array":"0-1"},"array_attributes":{"1":{"name":"One"}},"properties":{"prop":{"value":"","values":{"1":"3"},"attributes":{}}}},)"
+			+ R"("node":{"attributes":{},"properties":{"prop":{"value":"1","attributes":{"datatype":"integer"}}}}}},)"
+			+ R"("other":{"attributes":{"state":"ready"},"nodes":{}}}})";
+		ASSERT_EQ(json.str(), expected);
+
+		// Later changes only show up in later snapshots, unchanged parts are shared
+		msg("dev/node/prop", "2");
+		msg("dev/$state", "lost");
+		auto second = m.snapshot();
+		ASSERT_EQ(first.get_device("dev")->nodes.at("node")->properties.at("prop")->value, "1");
+		ASSERT_EQ(first.get_device("dev")->attributes.at("state"), "ready");
+		ASSERT_EQ(second.get_device("dev")->nodes.at("node")->properties.at("prop")->value, "2");
+		ASSERT_EQ(second.get_device("dev")->attributes.at("state"), "lost");
+		ASSERT_EQ(first.get_device("dev")->nodes.at("arr"), second.get_device("dev")->nodes.at("arr"));
+		ASSERT_EQ(first.get_device("other"), second.get_device("other"));
+		// A new value keeps sharing the attributes of the property
+		ASSERT_EQ(first.get_device("dev")->nodes.at("node")->properties.at("prop")->attributes, second.get_device("dev")->nodes.at("node")->properties.at("prop")->attributes);
+
+		// The trie grows with the fleet, every device stays reachable and other snapshots keep their view
+		for (int i = 0; i < 1000; i++) msg("fleet" + std::to_string(i) + "/$state", "ready");
+		auto fleet = m.snapshot();
+		ASSERT_EQ(fleet.size(), 1002);
+		for (int i = 0; i < 1000; i++) ASSERT_NE(fleet.get_device("fleet" + std::to_string(i)), nullptr);
+		ASSERT_EQ(second.size(), 2);
+		ASSERT_EQ(second.get_device("fleet1"), nullptr);
+		size_t visited = 0;
+		std::string last;
+		fleet.for_each_device([&](const snapshot_device& d) {
+			ASSERT_LT(last, d.id);
+			last = d.id;
+			visited++;
+		});
+		ASSERT_EQ(visited, 1002);
+		msg("fleet7/$state", "lost");
+		ASSERT_EQ(m.snapshot().get_device("fleet7")->attributes.at("state"), "lost");
+		ASSERT_EQ(m.snapshot().get_device("fleet8"), fleet.get_device("fleet8"));
+
+		m.collect_stale_topics(std::chrono::seconds(0));
+		ASSERT_EQ(m.snapshot().get_device("dev"), nullptr);
+		ASSERT_EQ(m.snapshot().get_device("fleet7"), nullptr);
+		ASSERT_EQ(m.snapshot().size(), 1000);
+		ASSERT_NE(second.get_device("dev"), nullptr);
+
+		// Binary round trip
+		std::stringstream bin;
+		first.write_binary(bin);
+		auto restored = master_snapshot::read_binary(bin);
+		std::ostringstream json2;
+		restored.write_json(json2);
+		ASSERT_EQ(json2.str(), expected);
+		ASSERT_EQ(restored.get_time(), std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::milliseconds>(first.get_time().time_since_epoch())));
+
+		auto truncated = bin.str().substr(0, bin.str().size() - 3);
+		std::istringstream in(truncated);
+		ASSERT_THROW(master_snapshot::read_binary(in), std::runtime_error);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, SharedAttributeSets) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		for (int i = 0; i < 100; i++) {
+			auto dev = "dev" + std::to_string(i);
+			msg(dev + "/$state", "init");
+			msg(dev + "/$name", "Device " + std::to_string(i));
+			msg(dev + "/$nodes", "light");
+			msg(dev + "/light/$name", "Light");
+			msg(dev + "/light/$properties", "intensity");
+			msg(dev + "/light/intensity/$name", "Intensity");
+			msg(dev + "/light/intensity/$datatype", "integer");
+			msg(dev + "/light/intensity/$unit", "%");
+			msg(dev + "/light/intensity", std::to_string(i));
+			msg(dev + "/$state", "ready");
+		}
+		// One set for the node and one for the property, values stay per device
+		ASSERT_EQ(m.get_attribute_set_count(), 2);
+		auto a = m.get_discovered_device("dev1")->get_node("light")->get_property("intensity");
+		auto b = m.get_discovered_device("dev2")->get_node("light")->get_property("intensity");
+		ASSERT_EQ(a->get_value(), "1");
+		ASSERT_EQ(b->get_value(), "2");
+		ASSERT_EQ(b->get_datatype(), datatype::integer);
+
+		// Changing one device leaves the others untouched
+		msg("dev1/light/intensity/$unit", "lx");
+		ASSERT_EQ(a->get_unit(), "lx");
+		ASSERT_EQ(b->get_unit(), "%");
+		ASSERT_EQ(m.get_attribute_set_count(), 3);
+		msg("dev1/light/intensity/$unit", "%");
+		ASSERT_EQ(m.get_attribute_set_count(), 2);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, BroadcastRouting) {
+	purge_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		// Outlives the master, which publishes pending broadcasts when it is destroyed
+		std::vector<std::string> calls;
+		master m(test_client);
+		auto record = [&](const std::string& name) {
+			return [&calls, name](const std::string& level, const std::string& payload) { calls.push_back(name + ":" + level + "=" + payload); };
+		};
+		m.subscribe_broadcast("alert/#", record("alerts"));
+		auto reboot = m.subscribe_broadcast("system/+/reboot", record("reboot"));
+		m.subscribe_broadcast("#", record("all"));
+		m.subscribe_broadcast("alert", record("exact"));
+		ASSERT_THROW(m.subscribe_broadcast("alert/#/x", record("bad")), std::invalid_argument);
+		ASSERT_THROW(m.subscribe_broadcast("sys+/x", record("bad")), std::invalid_argument);
+
+		// Published broadcasts are echoed back by the test client
+		m.publish_broadcast("alert/fire", "1");
+		m.publish_broadcast("system/kitchen/reboot", "now");
+		m.publish_broadcast("alert", "2");
+		m.publish_broadcast("system/kitchen/shutdown", "now");
+		ASSERT_EQ(calls, (std::vector<std::string>{
+			"alerts:alert/fire=1", "all:alert/fire=1",
+			"reboot:system/kitchen/reboot=now", "all:system/kitchen/reboot=now",
+			"alerts:alert=2", "all:alert=2", "exact:alert=2",
+			"all:system/kitchen/shutdown=now" }));
+
+		calls.clear();
+		m.unsubscribe_broadcast(reboot);
+		m.publish_broadcast("system/kitchen/reboot", "now");
+		ASSERT_EQ(calls, std::vector<std::string>{ "all:system/kitchen/reboot=now" });
+
+		// Rate limited broadcasts wait in the queue
+		outbox_options opts;
+		opts.drain_rate = 0.001;
+		opts.drain_burst = 2;
+		m.set_broadcast_options(opts);
+		test_client.published.clear();
+		m.publish_broadcast("a", "1");
+		m.publish_broadcast("b", "2");
+		m.publish_broadcast("c", "3");
+		ASSERT_EQ(test_client.published.size(), 2);
+		ASSERT_EQ(m.get_pending_broadcasts(), 1);
+		ASSERT_EQ(m.flush_broadcasts(), 0);
+
+		// New options keep pending broadcasts, beyond max_entries the oldest is dropped
+		opts.max_entries = 1;
+		m.set_broadcast_options(opts);
+		ASSERT_EQ(m.get_pending_broadcasts(), 1);
+		m.publish_broadcast("d", "4");
+		ASSERT_EQ(m.get_pending_broadcasts(), 1);
+		ASSERT_EQ(m.get_dropped_broadcasts(), 1);
+		ASSERT_EQ(test_client.published.size(), 2);
+	}
+	// Destroying the master publishes what is still pending
+	ASSERT_EQ(test_client.published.back(), std::make_pair(std::string("homie/$broadcast/d"), std::string("4")));
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+namespace {
+	struct batch_mqtt_client : public test_mqtt_client {
+		std::vector<std::pair<std::string, std::string>> published;
+		std::vector<size_t> batches;
+		std::string failing_topic;
+		virtual void publish(const std::string& topic, const std::string& payload, int qos, bool retain) override {
+			if (topic == failing_topic) throw std::runtime_error("Failed to publish");
+			published.push_back({ topic, payload });
+		}
+		virtual void publish_batch(const std::vector<mqtt_message>& messages, std::vector<bool>& ok) override {
+			batches.push_back(messages.size());
+			mqtt_client::publish_batch(messages, ok);
+		}
+	};
+}
+
+TEST(MasterTest, BulkSet) {
+	batch_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		std::vector<set_request> requests;
+		for (int i = 0; i < 3; i++) {
+			auto dev = "light" + std::to_string(i);
+			msg(dev + "/$state", "ready");
+			msg(dev + "/switch/on", "true");
+			msg(dev + "/switch/on/$settable", "true");
+			requests.emplace_back(m.get_discovered_device(dev)->get_node("switch")->get_property("on"), "false");
+		}
+		msg("strip/$state", "ready");
+		msg("strip/leds_2/color", "red");
+		requests.emplace_back(m.get_discovered_device("strip")->get_node("leds")->get_property("color"), 2, "blue");
+
+		// Properties of another master are rejected
+		test_client.expect_subscribe.insert("homie/#");
+		test_client.expect_unsubscribe.insert("homie/#");
+		{
+			master other(test_client);
+			msg("foreign/$state", "ready");
+			msg("foreign/node/prop", "1");
+			requests.emplace_back(other.get_discovered_device("foreign")->get_node("node")->get_property("prop"), "2");
+		}
+		test_client.expect_unsubscribe.insert("homie/#");
+
+		test_client.failing_topic = "homie/light1/switch/on/set";
+		auto res = m.set_values(requests);
+		ASSERT_EQ(res, (std::vector<set_status>{ set_status::published, set_status::failed, set_status::published, set_status::published, set_status::unknown_property }));
+		ASSERT_EQ(test_client.batches, std::vector<size_t>{ 4 });
+		ASSERT_EQ(test_client.published, (std::vector<std::pair<std::string, std::string>>{
+			{ "homie/light0/switch/on/set", "false" },
+			{ "homie/light2/switch/on/set", "false" },
+			{ "homie/strip/leds_2/color/set", "blue" } }));
+
+		// Single sets use the same cached topics
+		test_client.published.clear();
+		m.get_discovered_device("light0")->get_node("switch")->get_property("on")->set_value("true");
+		m.get_discovered_device("strip")->get_node("leds")->get_property("color")->set_value(1, "green");
+		ASSERT_EQ(test_client.published, (std::vector<std::pair<std::string, std::string>>{
+			{ "homie/light0/switch/on/set", "true" },
+			{ "homie/strip/leds_1/color/set", "green" } }));
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, SetTracking) {
+	batch_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		msg("light/$state", "ready");
+		msg("light/switch/on", "true");
+		msg("strip/$state", "ready");
+		msg("strip/leds_1/on", "true");
+		auto on = m.get_discovered_device("light")->get_node("switch")->get_property("on");
+		auto led = m.get_discovered_device("strip")->get_node("leds")->get_property("on");
+		ASSERT_THROW(m.set_value_tracked(set_request(on, "false")), std::logic_error);
+
+		m.enable_set_tracking(std::chrono::milliseconds(100), std::chrono::milliseconds(10));
+		auto acked = m.set_value_tracked(set_request(on, "false"));
+		ASSERT_EQ(m.get_pending_sets(), 1);
+		// Other values do not complete the set
+		msg("light/switch/on", "true");
+		ASSERT_EQ(acked.wait_for(std::chrono::seconds(0)), std::future_status::timeout);
+		msg("light/switch/on", "false");
+		ASSERT_EQ(acked.wait_for(std::chrono::seconds(0)), std::future_status::ready);
+		ASSERT_EQ(acked.get().outcome, set_outcome::acknowledged);
+
+		auto superseded = m.set_value_tracked(set_request(on, "true"));
+		auto timed_out = m.set_value_tracked(set_request(on, "toggle"));
+		ASSERT_EQ(superseded.get().outcome, set_outcome::superseded);
+		ASSERT_EQ(timed_out.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+		auto res = timed_out.get();
+		ASSERT_EQ(res.outcome, set_outcome::timed_out);
+		ASSERT_GE(res.latency, std::chrono::milliseconds(100));
+
+		// Array nodes are tracked per index, plain set_value is tracked as well
+		std::vector<set_outcome> outcomes;
+		m.set_value_tracked(set_request(led, 1, "false"), [&](const set_result& r) { outcomes.push_back(r.outcome); });
+		led->set_value(2, "false");
+		msg("strip/leds_2/on", "false");
+		ASSERT_TRUE(outcomes.empty());
+		msg("strip/leds_1/on", "false");
+		ASSERT_EQ(outcomes, std::vector<set_outcome>{ set_outcome::acknowledged });
+
+		test_client.failing_topic = "homie/light/switch/on/set";
+		ASSERT_EQ(m.set_value_tracked(set_request(on, "false")).get().outcome, set_outcome::failed);
+		ASSERT_EQ(m.set_values({ set_request(on, "false") }), std::vector<set_status>{ set_status::failed });
+		ASSERT_EQ(m.get_pending_sets(), 0);
+
+		auto stats = m.get_set_statistics("light");
+		ASSERT_EQ(stats.acknowledged, 1);
+		ASSERT_EQ(stats.superseded, 1);
+		ASSERT_EQ(stats.timed_out, 1);
+		ASSERT_EQ(stats.failed, 2);
+		ASSERT_EQ(stats.latency.count(), 1);
+		ASSERT_LE(stats.latency.percentile(0.5), std::chrono::seconds(1));
+		ASSERT_EQ(m.get_set_statistics("strip").acknowledged, 2);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+namespace {
+	// Publishes arrive from the coalescing thread
+	struct locked_mqtt_client : public test_mqtt_client {
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::vector<std::pair<std::string, std::string>> published;
+		std::string failing_topic;
+		virtual void publish(const std::string& topic, const std::string& payload, int qos, bool retain) override {
+			std::lock_guard<std::mutex> lck(mtx);
+			if (topic == failing_topic) throw std::runtime_error("Failed to publish");
+			published.push_back({ topic, payload });
+			cv.notify_all();
+		}
+		void fail(const std::string& topic) {
+			std::lock_guard<std::mutex> lck(mtx);
+			failing_topic = topic;
+		}
+		std::vector<std::pair<std::string, std::string>> wait_for(size_t count) {
+			std::unique_lock<std::mutex> lck(mtx);
+			cv.wait_for(lck, std::chrono::seconds(5), [&]() { return published.size() >= count; });
+			return published;
+		}
+	};
+}
+
+TEST(MasterTest, SetCoalescing) {
+	locked_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		msg("light/$state", "ready");
+		msg("light/dimmer/level", "0");
+		msg("strip/$state", "ready");
+		msg("strip/leds_1/color", "red");
+		auto level = m.get_discovered_device("light")->get_node("dimmer")->get_property("level");
+		auto color = m.get_discovered_device("strip")->get_node("leds")->get_property("color");
+
+		m.enable_set_coalescing(std::chrono::hours(1));
+		// The first value goes out right away
+		level->set_value("1");
+		ASSERT_EQ(test_client.wait_for(1).size(), 1);
+		// Later ones wait for the next flush, only the latest survives
+		for (int i = 2; i <= 100; i++) level->set_value(std::to_string(i));
+		ASSERT_EQ(m.get_coalesced_sets(), 98);
+		ASSERT_EQ(m.flush_sets(), 1);
+		ASSERT_EQ(test_client.wait_for(2), (std::vector<std::pair<std::string, std::string>>{
+			{ "homie/light/dimmer/level/set", "1" },
+			{ "homie/light/dimmer/level/set", "100" } }));
+
+		// A failed set is retried with the next flush until a newer value replaces it
+		test_client.fail("homie/light/dimmer/level/set");
+		level->set_value("6");
+		ASSERT_EQ(m.flush_sets(), 1);
+		ASSERT_EQ(m.flush_sets(), 1);
+		level->set_value("7");
+		test_client.fail("");
+		ASSERT_EQ(m.flush_sets(), 1);
+		ASSERT_EQ(m.flush_sets(), 0);
+		ASSERT_EQ(test_client.wait_for(3).back(), (std::pair<std::string, std::string>{ "homie/light/dimmer/level/set", "7" }));
+
+		color->set_value(1, "green");
+		color->set_value(2, "blue");
+		color->set_value(1, "white");
+		// Disabling publishes what is pending
+		m.disable_set_coalescing();
+		ASSERT_EQ(test_client.wait_for(5), (std::vector<std::pair<std::string, std::string>>{
+			{ "homie/light/dimmer/level/set", "1" },
+			{ "homie/light/dimmer/level/set", "100" },
+			{ "homie/light/dimmer/level/set", "7" },
+			{ "homie/strip/leds_1/color/set", "white" },
+			{ "homie/strip/leds_2/color/set", "blue" } }));
+		level->set_value("5");
+		ASSERT_EQ(test_client.wait_for(6).back(), (std::pair<std::string, std::string>{ "homie/light/dimmer/level/set", "5" }));
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, Rules) {
+	batch_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		msg("room/$state", "ready");
+		msg("room/sensor/temperature", "18.5");
+		msg("room/window/open", "false");
+		msg("room/heater/power", "off");
+		msg("strip/$state", "ready");
+		msg("strip/leds_1/color", "red");
+
+		ASSERT_THROW(m.add_rule("{room/sensor/temperature} >", {}), std::invalid_argument);
+		ASSERT_THROW(m.add_rule("{room/sensor} > 1", {}), std::invalid_argument);
+		ASSERT_THROW(m.add_rule("true", { { "room/heater", "1" } }), std::invalid_argument);
+		ASSERT_EQ(m.get_rule_count(), 0);
+
+		auto heat = m.add_rule("{room/sensor/temperature} < 19 && !{room/window/open}", { { "room/heater/power", "\"on\"" } });
+		m.add_rule("{room/sensor/temperature} >= 21 || {room/window/open} == true", { { "{room/heater/power}", "\"off\"" } });
+		m.add_rule("{room/heater/power} == \"on\"", { { "strip/leds_1/color", "\"orange\"" }, { "room/sensor/offset", "{room/sensor/temperature} * 2 - 1" } });
+		ASSERT_EQ(m.get_rule_count(), 3);
+		// Already true when added, nothing fires until the condition turns true again
+		ASSERT_TRUE(test_client.published.empty());
+
+		msg("room/sensor/temperature", "21");
+		ASSERT_EQ(test_client.published, (std::vector<std::pair<std::string, std::string>>{ { "homie/room/heater/power/set", "off" } }));
+		// Unchanged values and other properties do not fire again
+		msg("room/sensor/temperature", "21");
+		msg("room/sensor/temperature", "22");
+		msg("room/heater/power", "off");
+		ASSERT_EQ(test_client.published.size(), 1);
+
+		test_client.published.clear();
+		msg("room/sensor/temperature", "18");
+		ASSERT_EQ(test_client.published, (std::vector<std::pair<std::string, std::string>>{ { "homie/room/heater/power/set", "on" } }));
+		// Chained through the echo, the offset property is unknown and reported as failed
+		msg("room/heater/power", "on");
+		ASSERT_EQ(test_client.published, (std::vector<std::pair<std::string, std::string>>{
+			{ "homie/room/heater/power/set", "on" },
+			{ "homie/strip/leds_1/color/set", "orange" } }));
+		ASSERT_EQ(m.get_failed_rule_actions(), 1);
+		ASSERT_EQ(m.get_fired_rules(), 3);
+
+		test_client.published.clear();
+		m.remove_rule(heat);
+		ASSERT_EQ(m.get_rule_count(), 2);
+		msg("room/window/open", "true");
+		msg("room/window/open", "false");
+		ASSERT_EQ(test_client.published, (std::vector<std::pair<std::string, std::string>>{ { "homie/room/heater/power/set", "off" } }));
+
+		// Text comparison and rules on not yet discovered properties
+		test_client.published.clear();
+		msg("strip/leds_1/color", "orange");
+		m.add_rule("{garage/door/state} == \"open\" && {strip/leds_1/color} != \"red\"", { { "strip/leds_1/color", "\"red\"" } });
+		msg("garage/$state", "ready");
+		msg("garage/door/state", "open");
+		ASSERT_EQ(test_client.published, (std::vector<std::pair<std::string, std::string>>{ { "homie/strip/leds_1/color/set", "red" } }));
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, RuleBeforeDiscovery) {
+	batch_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		msg("h/$state", "ready");
+		msg("h/room/heater", "off");
+		msg("h/room/fan", "on");
+		msg("h/room/light", "off");
+		m.add_rule("{s/room/temp} < 19", { { "h/room/heater", "\"on\"" } });
+		m.add_rule("!({s/room/temp} >= 19)", { { "h/room/fan", "\"off\"" } });
+		m.add_rule("{s/room/temp} + 1 > 0 || {s/room/label} < 5", { { "h/room/light", "\"on\"" } });
+		ASSERT_TRUE(test_client.published.empty());
+
+		// Text is not ordered against numbers
+		msg("s/$state", "ready");
+		msg("s/room/label", "cold");
+		ASSERT_TRUE(test_client.published.empty());
+
+		// The first reading fires every rule it makes true
+		msg("s/room/temp", "15");
+		ASSERT_EQ(test_client.published, (std::vector<std::pair<std::string, std::string>>{
+			{ "homie/h/room/heater/set", "on" },
+			{ "homie/h/room/fan/set", "off" },
+			{ "homie/h/room/light/set", "on" } }));
+		ASSERT_EQ(m.get_fired_rules(), 3);
+
+		// Cleared values are unknown again
+		test_client.published.clear();
+		msg("s/room/temp", "");
+		msg("s/room/temp", "16");
+		ASSERT_EQ(test_client.published.size(), 3);
+
+		// Values computed from unknown properties are not sent
+		test_client.published.clear();
+		m.add_rule("{s/room/temp} > 20", { { "h/room/heater", "{s/room/target} - 1" }, { "h/room/fan", "\"on\"" } });
+		msg("s/room/temp", "21");
+		ASSERT_EQ(test_client.published, (std::vector<std::pair<std::string, std::string>>{ { "homie/h/room/fan/set", "on" } }));
+		ASSERT_EQ(m.get_failed_rule_actions(), 1);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, RuleRemoval) {
+	rule_engine engine;
+	auto none = [](const property_ref&, std::string&) { return false; };
+	auto keep = engine.add("{a/b/c} > 1", {}, none);
+	// Removed rules release their properties and constants, ids are reused
+	for (int i = 0; i < 1000; i++) {
+		auto id = engine.add("{a/b/c} < {d/e/p" + std::to_string(i) + "} + 2", { { "a/b/c", "\"x\"" } }, none);
+		ASSERT_EQ(engine.get_slot_count(), 2);
+		engine.remove(id);
+		ASSERT_EQ(id, 1);
+	}
+	ASSERT_THROW(engine.add("{x/y/z} > ", {}, none), std::invalid_argument);
+	ASSERT_EQ(engine.get_slot_count(), 1);
+	ASSERT_EQ(engine.size(), 1);
+
+	std::vector<rule_engine::fired_action> fired;
+	engine.update("a/b/c", "5", fired);
+	ASSERT_EQ(engine.get_fired(), 1);
+	engine.remove(keep);
+	ASSERT_EQ(engine.get_slot_count(), 0);
+	ASSERT_FALSE(engine.update("a/b/c", "6", fired));
+}
+
+TEST(MasterTest, RuleScale) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		for (int i = 0; i < 10000; i++) {
+			auto prop = "{sensors/s" + std::to_string(i % 100) + "/value}";
+			m.add_rule(prop + " > " + std::to_string(i % 1000) + " && " + prop + " < 5000", {});
+		}
+		ASSERT_EQ(m.get_rule_count(), 10000);
+		// Each value only evaluates the 100 rules reading it
+		msg("sensors/$state", "ready");
+		for (int round = 0; round < 10; round++) {
+			for (int i = 0; i < 100; i++) msg("sensors/s" + std::to_string(i) + "/value", std::to_string(round * 100));
+		}
+		// Every rule with a threshold below 900 turned true once
+		ASSERT_EQ(m.get_fired_rules(), 9000);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, DerivedProperties) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		msg("kitchen/$state", "ready");
+		msg("kitchen/climate/$type", "sensor");
+		msg("kitchen/climate/temperature", "20");
+		msg("kitchen/oven/$type", "appliance");
+		msg("kitchen/oven/temperature", "180");
+
+		auto avg = m.add_derived_property("climate", "average", aggregate_spec::of(aggregate_function::avg, "temperature").of_type("sensor"));
+		auto max = m.add_derived_property("climate", "maximum", aggregate_spec::of(aggregate_function::max, "temperature"));
+		auto alerts = m.add_derived_property("devices", "alert", aggregate_spec::devices_in(device_state::alert));
+		auto open = m.add_derived_property("windows", "open", aggregate_spec::of(aggregate_function::count, "open").where_equals("true"));
+		ASSERT_THROW(m.add_derived_property("climate", "average", aggregate_spec()), std::invalid_argument);
+		// Existing values are included right away
+		ASSERT_EQ(avg->get_value(), "20");
+		ASSERT_EQ(max->get_value(), "180");
+		ASSERT_EQ(alerts->get_value(), "0");
+		ASSERT_EQ(avg->get_datatype(), datatype::number);
+		ASSERT_EQ(alerts->get_datatype(), datatype::integer);
+		ASSERT_THROW(avg->set_value("1"), std::logic_error);
+
+		std::vector<std::string> changes;
+		m.get_derived_device()->on_change([&](const std::string& node, const std::string& prop) { changes.push_back(node + "/" + prop); });
+
+		msg("bedroom/$state", "ready");
+		msg("bedroom/climate/$type", "sensor");
+		msg("bedroom/climate/temperature", "17");
+		ASSERT_EQ(avg->get_value(), "18.5");
+		ASSERT_EQ(changes, std::vector<std::string>{ "climate/average" });
+		msg("bedroom/climate/temperature", "abc");
+		ASSERT_EQ(avg->get_value(), "20");
+		msg("kitchen/oven/temperature", "200");
+		ASSERT_EQ(max->get_value(), "200");
+		msg("kitchen/oven/temperature", "");
+		ASSERT_EQ(max->get_value(), "20");
+
+		// Nodes join and leave type selected aggregates when their type changes
+		msg("kitchen/oven/temperature", "100");
+		msg("kitchen/oven/$type", "sensor");
+		ASSERT_EQ(avg->get_value(), "60");
+		msg("kitchen/oven/$type", "appliance");
+		ASSERT_EQ(avg->get_value(), "20");
+
+		msg("kitchen/$state", "alert");
+		msg("bedroom/$state", "alert");
+		ASSERT_EQ(alerts->get_value(), "2");
+		msg("kitchen/$state", "ready");
+		ASSERT_EQ(alerts->get_value(), "1");
+
+		msg("bedroom/window_1/open", "true");
+		msg("bedroom/window_2/open", "true");
+		msg("bedroom/window_2/open", "false");
+		ASSERT_EQ(open->get_value(), "1");
+
+		// Exposed like any other device
+		auto dev = m.get_derived_device();
+		ASSERT_EQ(dev->get_id(), "derived");
+		ASSERT_EQ(dev->get_nodes(), (std::set<std::string>{ "climate", "devices", "windows" }));
+		ASSERT_EQ(dev->get_node("climate")->get_properties(), (std::set<std::string>{ "average", "maximum" }));
+		ASSERT_EQ(dev->get_node("devices")->get_property("alert")->get_value(), "1");
+
+		ASSERT_TRUE(m.remove_derived_property("climate", "maximum"));
+		ASSERT_FALSE(m.remove_derived_property("climate", "maximum"));
+		changes.clear();
+		msg("kitchen/oven/temperature", "300");
+		ASSERT_TRUE(changes.empty());
+		ASSERT_EQ(dev->get_node("climate")->get_properties(), std::set<std::string>{ "average" });
+
+		// Members without updates drop out of windowed aggregates
+		auto recent = m.add_derived_property("climate", "recent", aggregate_spec::of(aggregate_function::sum, "temperature").on_node("climate").within(std::chrono::milliseconds(50)));
+		ASSERT_EQ(recent->get_value(), "20");
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+		msg("bedroom/climate/temperature", "18");
+		ASSERT_EQ(recent->get_value(), "18");
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+		ASSERT_EQ(recent->get_value(), "0");
+		// Expiry is reported once noticed
+		msg("bedroom/climate/temperature", "19");
+		changes.clear();
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+		m.expire_derived();
+		ASSERT_EQ(changes, std::vector<std::string>{ "climate/recent" });
+		ASSERT_TRUE(m.remove_derived_property("climate", "recent"));
+
+		// Forgotten devices and properties leave the aggregates
+		auto lost = m.add_derived_property("devices", "lost", aggregate_spec::devices_in(device_state::lost));
+		ASSERT_EQ(avg->get_value(), "19.5");
+		msg("bedroom/$state", "lost");
+		ASSERT_EQ(lost->get_value(), "1");
+		changes.clear();
+		m.collect_stale_topics(std::chrono::seconds(0));
+		ASSERT_EQ(avg->get_value(), "20");
+		ASSERT_EQ(lost->get_value(), "0");
+		ASSERT_EQ(open->get_value(), "0");
+		ASSERT_EQ(changes, (std::vector<std::string>{ "climate/average", "windows/open", "devices/lost" }));
+		msg("kitchen/climate/$properties", "humidity");
+		m.collect_stale_topics(std::chrono::seconds(0));
+		ASSERT_EQ(avg->get_value(), "");
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, TimingWheel) {
+	typedef timing_wheel<int>::clock clock;
+	auto start = clock::now();
+	timing_wheel<int> wheel(std::chrono::milliseconds(1), start);
+	std::vector<int> expired;
+	auto collect = [&](int k) { expired.push_back(k); };
+	// Spread over all levels
+	wheel.touch(1, std::chrono::milliseconds(10), start);
+	wheel.touch(2, std::chrono::milliseconds(1000), start);
+	wheel.touch(3, std::chrono::milliseconds(100000), start);
+	wheel.touch(4, std::chrono::milliseconds(20000000), start);
+	wheel.touch(5, std::chrono::milliseconds(10), start);
+	wheel.remove(5);
+	ASSERT_EQ(wheel.size(), 4);
+
+	wheel.advance(start + std::chrono::milliseconds(10), collect);
+	ASSERT_TRUE(expired.empty());
+	wheel.advance(start + std::chrono::milliseconds(11), collect);
+	ASSERT_EQ(expired, std::vector<int>{ 1 });
+	// Moving a deadline back and forth keeps a single expiry at the latest deadline
+	wheel.touch(2, std::chrono::milliseconds(2000), start);
+	wheel.touch(2, std::chrono::milliseconds(500), start);
+	wheel.touch(2, std::chrono::milliseconds(1500), start);
+	wheel.advance(start + std::chrono::milliseconds(1500), collect);
+	ASSERT_EQ(expired, std::vector<int>{ 1 });
+	wheel.advance(start + std::chrono::milliseconds(1501), collect);
+	ASSERT_EQ(expired, (std::vector<int>{ 1, 2 }));
+	wheel.advance(start + std::chrono::milliseconds(100000), collect);
+	ASSERT_EQ(expired.size(), 2);
+	wheel.advance(start + std::chrono::milliseconds(100001), collect);
+	ASSERT_EQ(expired, (std::vector<int>{ 1, 2, 3 }));
+	wheel.advance(start + std::chrono::milliseconds(20000001), collect);
+	ASSERT_EQ(expired, (std::vector<int>{ 1, 2, 3, 4 }));
+	ASSERT_EQ(wheel.size(), 0);
+}
+
+TEST(MasterTest, Liveness) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		counting_handler hdl;
+		m.set_event_handler(&hdl);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		msg("quiet/$state", "ready");
+		msg("slow/$state", "ready");
+		msg("slow/$stats/interval", "60");
+		msg("asleep/$state", "sleeping");
+		m.enable_liveness(2, std::chrono::milliseconds(20), std::chrono::milliseconds(5));
+		ASSERT_EQ(m.get_tracked_devices(), 2);
+
+		// Other devices talking do not keep a device alive
+		for (int i = 0; i < 5; i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			msg("slow/sensor/value", std::to_string(i));
+		}
+		m.check_liveness();
+		ASSERT_EQ(m.get_discovered_device("quiet")->get_state(), device_state::lost);
+		ASSERT_EQ(m.get_discovered_device("slow")->get_state(), device_state::ready);
+		ASSERT_EQ(m.get_discovered_device("asleep")->get_state(), device_state::sleeping);
+		ASSERT_EQ(std::count(hdl.events.begin(), hdl.events.end(), "device:quiet/state"), 1);
+		ASSERT_EQ(m.get_tracked_devices(), 1);
+
+		// Any message brings it back
+		hdl.events.clear();
+		msg("quiet/node/prop", "1");
+		ASSERT_EQ(m.get_discovered_device("quiet")->get_state(), device_state::ready);
+		ASSERT_EQ(std::count(hdl.events.begin(), hdl.events.end(), "device:quiet/state"), 1);
+		ASSERT_EQ(m.get_tracked_devices(), 2);
+
+		// Presumed lost devices are not garbage collected
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+		m.check_liveness();
+		ASSERT_EQ(m.get_discovered_device("quiet")->get_state(), device_state::lost);
+		ASSERT_TRUE(m.collect_stale_topics(std::chrono::seconds(0)).empty());
+
+		// Retained sets and clears are not sent by the device
+		hdl.events.clear();
+		msg("quiet/node/prop/set", "2");
+		msg("quiet/node/prop", "");
+		ASSERT_EQ(m.get_discovered_device("quiet")->get_state(), device_state::lost);
+		ASSERT_EQ(std::count(hdl.events.begin(), hdl.events.end(), "device:quiet/state"), 0);
+		ASSERT_EQ(m.get_tracked_devices(), 1);
+
+		// Devices going offline on purpose are no longer tracked, without passing through the presumed state
+		msg("quiet/$state", "disconnected");
+		ASSERT_EQ(m.get_discovered_device("quiet")->get_state(), device_state::disconnected);
+		ASSERT_EQ(std::count(hdl.events.begin(), hdl.events.end(), "device:quiet/state"), 1);
+		ASSERT_EQ(m.get_tracked_devices(), 1);
+		m.set_event_handler(nullptr);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+namespace {
+	struct throwing_handler : counting_handler {
+		virtual void on_property_value_changed(property_ptr prop, int64_t idx, const std::string & value) override { throw std::runtime_error("handler failed"); }
+	};
+}
+
+TEST(MasterTest, MalformedMessages) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+
+	{
+		master m(test_client);
+		auto msg = [&](const std::string& topic, const std::string& payload) { test_client.handler->on_message("homie/" + topic, payload); };
+		m.enable_quarantine(3, 4);
+		msg("dev/$state", "ready");
+		// None of these may throw into the mqtt library
+		msg("dev/node_x/prop", "1");
+		msg("dev/node_/prop", "1");
+		msg("dev/node_99999999999999999999/prop", "1");
+		msg("dev//prop", "1");
+		msg("dev", "1");
+		msg("other/$description", "{\"homie\":");
+		ASSERT_EQ(m.get_malformed_messages(), 6);
+		auto q = m.get_quarantined();
+		ASSERT_EQ(q.size(), 3);
+		ASSERT_EQ(q[0].topic, "homie/dev//prop");
+		ASSERT_EQ(q[0].reason, "empty topic level");
+		ASSERT_EQ(q[1].reason, "missing topic levels");
+		ASSERT_EQ(q[2].topic, "homie/other/$description");
+		ASSERT_EQ(q[2].payload, "{\"ho");
+		ASSERT_EQ(q[2].reason, "invalid $description");
+		// Rejected before creating the node
+		ASSERT_EQ(m.get_discovered_device("dev")->get_node("node"), nullptr);
+
+		// Valid messages are unaffected
+		msg("dev/node_2/prop", "1");
+		ASSERT_EQ(m.get_discovered_device("dev")->get_node("node")->get_property("prop")->get_value(2), "1");
+
+		// Exceptions from event handlers are contained as well, but counted apart as the message was fine
+		throwing_handler hdl;
+		counting_handler sub;
+		m.set_event_handler(&hdl);
+		auto id = m.subscribe(sub);
+		msg("dev/node_2/prop", "2");
+		auto bid = m.subscribe_broadcast("#", [](const std::string&, const std::string&) { throw std::runtime_error("callback failed"); });
+		msg("$broadcast/alert", "fire");
+		m.unsubscribe_broadcast(bid);
+		m.unsubscribe(id);
+		m.set_event_handler(nullptr);
+		ASSERT_EQ(m.get_malformed_messages(), 6);
+		ASSERT_EQ(m.get_quarantined().back().reason, "invalid $description");
+		ASSERT_EQ(m.get_handler_errors(), 2);
+		// Delivery to the other handlers goes on
+		ASSERT_EQ(sub.events, (std::vector<std::string>{ "value:prop=2", "broadcast:alert" }));
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
@@ -0,0 +1,386 @@
+#pragma once
+#include <string>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include "device.h"
+
+namespace homie {
+	enum class aggregate_function {
+		sum,
+		avg,
+		min,
+		max,
+		count
+	};
+
+	enum class aggregate_source {
+		// Values of the properties matching device, node and property
+		property_value,
+		// $state of the devices matching device
+		device_state
+	};
+
+	// Declares which values a derived property aggregates.
+	// Id patterns are either an exact id or "+" to match any id, like event_filter.
+	struct aggregate_spec {
+		aggregate_function function = aggregate_function::avg;
+		aggregate_source source = aggregate_source::property_value;
+		std::string device = "+";
+		std::string node = "+";
+		std::string property = "+";
+		// Only nodes announcing this $type, empty for any
+		std::string node_type;
+		// Only count members whose value equals this, empty counts every member
+		std::string equals;
+		// Members without a new value for this long drop out, zero keeps them until they are removed
+		std::chrono::milliseconds window = std::chrono::milliseconds(0);
+
+		static aggregate_spec of(aggregate_function fn, const std::string& property_id) {
+			aggregate_spec res;
+			res.function = fn;
+			res.property = property_id;
+			return res;
+		}
+
+		// Number of devices in the given state
+		static aggregate_spec devices_in(device_state state) {
+			aggregate_spec res;
+			res.function = aggregate_function::count;
+			res.source = aggregate_source::device_state;
+			res.equals = enum_to_string(state);
+			return res;
+		}
+
+		aggregate_spec& on_device(const std::string& id) { device = id; return *this; }
+		aggregate_spec& on_node(const std::string& id) { node = id; return *this; }
+		aggregate_spec& of_type(const std::string& type) { node_type = type; return *this; }
+		aggregate_spec& where_equals(const std::string& value) { equals = value; return *this; }
+		aggregate_spec& within(std::chrono::milliseconds w) { window = w; return *this; }
+
+		bool matches(const std::string& pattern, const std::string& id) const { return pattern == "+" || pattern == id; }
+	};
+
+	// Running aggregate over a set of members, each contributing its latest value.
+	// sum, avg and count update in O(1), min and max in O(log n).
+	class aggregator {
+		typedef std::chrono::steady_clock clock;
+
+		struct member {
+			double num;
+			bool counted;
+			clock::time_point updated;
+		};
+
+		aggregate_spec spec;
+		mutable std::mutex mtx;
+		// Mutable as reads expire members that fell out of the window
+		mutable std::unordered_map<std::string, member> members;
+		// Counted members ordered by value, only kept for min and max
+		mutable std::multiset<double> ordered;
+		// Updates in arrival order, stale entries are skipped when expiring
+		mutable std::deque<std::pair<clock::time_point, std::string>> timeline;
+		mutable double sum;
+		mutable size_t counted;
+
+		bool is_counted(const std::string& value, double& num) const {
+			if (spec.function == aggregate_function::count) {
+				num = 1;
+				return spec.equals.empty() ? !value.empty() : value == spec.equals;
+			}
+			if (!spec.equals.empty() && value != spec.equals) return false;
+			char* end = nullptr;
+			num = std::strtod(value.c_str(), &end);
+			return !value.empty() && *end == '\0' && std::isfinite(num);
+		}
+
+		bool keeps_order() const { return spec.function == aggregate_function::min || spec.function == aggregate_function::max; }
+
+		void drop(std::unordered_map<std::string, member>::iterator it) const {
+			if (it->second.counted) {
+				sum -= it->second.num;
+				counted--;
+				if (keeps_order()) ordered.erase(ordered.find(it->second.num));
+			}
+			members.erase(it);
+		}
+
+		// Caller holds mtx
+		void expire(clock::time_point now) const {
+			if (spec.window.count() == 0) return;
+			while (!timeline.empty() && now - timeline.front().first >= spec.window) {
+				auto it = members.find(timeline.front().second);
+				if (it != members.end() && it->second.updated == timeline.front().first) drop(it);
+				timeline.pop_front();
+			}
+			if (members.empty()) {
+				// Avoid drift from adding and subtracting
+				sum = 0;
+			}
+		}
+
+		// Caller holds mtx
+		std::string result() const {
+			double v;
+			switch (spec.function) {
+			case aggregate_function::count: return std::to_string(counted);
+			case aggregate_function::sum: v = sum; break;
+			case aggregate_function::avg:
+				if (counted == 0) return "";
+				v = sum / counted;
+				break;
+			case aggregate_function::min:
+				if (ordered.empty()) return "";
+				v = *ordered.begin();
+				break;
+			case aggregate_function::max:
+				if (ordered.empty()) return "";
+				v = *ordered.rbegin();
+				break;
+			default: return "";
+			}
+			char buf[32];
+			std::snprintf(buf, sizeof(buf), "%.10g", v);
+			return buf;
+		}
+	public:
+		explicit aggregator(const aggregate_spec& s)
+			: spec(s), sum(0), counted(0)
+		{}
+
+		const aggregate_spec& get_spec() const { return spec; }
+
+		// Returns true if the aggregated value changed
+		bool update(const std::string& key, const std::string& value) {
+			std::lock_guard<std::mutex> lck(mtx);
+			auto now = clock::now();
+			auto before = result();
+			expire(now);
+			double num = 0;
+			bool c = is_counted(value, num);
+			auto it = members.find(key);
+			if (it != members.end()) {
+				auto& m = it->second;
+				if (m.counted) {
+					sum -= m.num;
+					counted--;
+					if (keeps_order()) ordered.erase(ordered.find(m.num));
+				}
+				m.num = num;
+				m.counted = c;
+				m.updated = now;
+			}
+			else members.insert({ key, member{ num, c, now } });
+			if (c) {
+				sum += num;
+				counted++;
+				if (keeps_order()) ordered.insert(num);
+			}
+			if (spec.window.count() != 0) timeline.emplace_back(now, key);
+			return result() != before;
+		}
+
+		// Returns true if the aggregated value changed
+		bool remove(const std::string& key) {
+			std::lock_guard<std::mutex> lck(mtx);
+			auto it = members.find(key);
+			if (it == members.end()) return false;
+			auto before = result();
+			drop(it);
+			return result() != before;
+		}
+
+		// Drops members that fell out of the window, returns true if the aggregated value changed
+		bool expire() {
+			std::lock_guard<std::mutex> lck(mtx);
+			auto before = result();
+			expire(clock::now());
+			return result() != before;
+		}
+
+		// Formatted result, empty if there is nothing to aggregate (except for count and sum)
+		std::string get_value() const {
+			std::lock_guard<std::mutex> lck(mtx);
+			expire(clock::now());
+			return result();
+		}
+
+		size_t size() const {
+			std::lock_guard<std::mutex> lck(mtx);
+			return members.size();
+		}
+	};
+
+	// Read only property whose value is an aggregate over other properties, maintained by master
+	class derived_property : public basic_property {
+		std::weak_ptr<node> parent;
+		std::string id;
+		std::map<std::string, std::string> attributes;
+	public:
+		aggregator values;
+
+		derived_property(std::weak_ptr<node> n, const std::string& pid, const aggregate_spec& spec)
+			: parent(n), id(pid), values(spec)
+		{
+			attributes["name"] = pid;
+			bool integral = spec.function == aggregate_function::count;
+			attributes["datatype"] = integral ? "integer" : "float";
+			attributes["settable"] = "false";
+			attributes["retained"] = "true";
+		}
+
+		virtual node_ptr get_node() override { return parent.lock(); }
+		virtual const_node_ptr get_node() const override { return parent.lock(); }
+		virtual std::string get_id() const override { return id; }
+
+		virtual std::string get_value(int64_t node_idx) const override { return get_value(); }
+		virtual void set_value(int64_t node_idx, const std::string& value) override { set_value(value); }
+		virtual std::string get_value() const override { return values.get_value(); }
+		virtual void set_value(const std::string& value) override { throw std::logic_error("derived properties are read only"); }
+
+		virtual std::set<std::string> get_attributes() const override {
+			std::set<std::string> res;
+			for (auto& e : attributes) res.insert(e.first);
+			return res;
+		}
+		virtual std::string get_attribute(const std::string& aid) const override {
+			auto it = attributes.find(aid);
+			return it != attributes.end() ? it->second : "";
+		}
+		virtual void set_attribute(const std::string& aid, const std::string& value) override { attributes[aid] = value; }
+	};
+
+	class derived_node : public basic_node {
+		std::weak_ptr<device> parent;
+		std::string id;
+		std::map<std::string, std::string> attributes;
+	public:
+		std::map<std::string, std::shared_ptr<derived_property>> properties;
+
+		derived_node(std::weak_ptr<device> dev, const std::string& nid)
+			: parent(dev), id(nid)
+		{
+			attributes["name"] = nid;
+			attributes["type"] = "aggregate";
+		}
+
+		virtual device_ptr get_device() override { return parent.lock(); }
+		virtual const_device_ptr get_device() const override { return parent.lock(); }
+		virtual std::string get_id() const override { return id; }
+		virtual std::set<std::string> get_properties() const override {
+			std::set<std::string> res;
+			for (auto& e : properties) res.insert(e.first);
+			return res;
+		}
+		virtual const_property_ptr get_property(const std::string& pid) const override {
+			auto it = properties.find(pid);
+			return it != properties.end() ? it->second : nullptr;
+		}
+		virtual property_ptr get_property(const std::string& pid) override {
+			auto it = properties.find(pid);
+			return it != properties.end() ? it->second : nullptr;
+		}
+
+		virtual std::set<std::string> get_attributes() const override {
+			std::set<std::string> res;
+			for (auto& e : attributes) res.insert(e.first);
+			return res;
+		}
+		virtual std::set<std::string> get_attributes(int64_t idx) const override { return {}; }
+		virtual std::string get_attribute(const std::string& aid) const override {
+			auto it = attributes.find(aid);
+			return it != attributes.end() ? it->second : "";
+		}
+		virtual void set_attribute(const std::string& aid, const std::string& value) override { attributes[aid] = value; }
+		virtual std::string get_attribute(const std::string& aid, int64_t idx) const override { return ""; }
+		virtual void set_attribute(const std::string& aid, const std::string& value, int64_t idx) override {}
+	};
+
+	// Virtual device holding the derived properties of a master.
+	// Pass it to homie::client to republish the aggregates, and forward on_change to client::notify_property_changed.
+	class derived_device : public basic_device, public std::enable_shared_from_this<derived_device> {
+		std::string id;
+		std::map<std::string, std::string> attributes;
+		std::map<std::string, std::shared_ptr<derived_node>> nodes;
+		std::function<void(const std::string&, const std::string&)> change_handler;
+		mutable std::mutex handler_mtx;
+	public:
+		explicit derived_device(const std::string& did)
+			: id(did)
+		{
+			attributes["name"] = did;
+			attributes["state"] = "ready";
+			attributes["implementation"] = "homie-cpp";
+			attributes["stats"] = "";
+			attributes["stats/interval"] = "60";
+		}
+
+		virtual std::string get_id() const override { return id; }
+		virtual std::set<std::string> get_nodes() const override {
+			std::set<std::string> res;
+			for (auto& e : nodes) res.insert(e.first);
+			return res;
+		}
+		virtual node_ptr get_node(const std::string& nid) override {
+			auto it = nodes.find(nid);
+			return it != nodes.end() ? it->second : nullptr;
+		}
+		virtual const_node_ptr get_node(const std::string& nid) const override {
+			auto it = nodes.find(nid);
+			return it != nodes.end() ? it->second : nullptr;
+		}
+
+		virtual std::set<std::string> get_attributes() const override {
+			std::set<std::string> res;
+			for (auto& e : attributes) res.insert(e.first);
+			return res;
+		}
+		virtual std::string get_attribute(const std::string& aid) const override {
+			auto it = attributes.find(aid);
+			return it != attributes.end() ? it->second : "";
+		}
+		virtual void set_attribute(const std::string& aid, const std::string& value) override { attributes[aid] = value; }
+
+		// Throws std::invalid_argument if the property already exists
+		std::shared_ptr<derived_property> add_property(const std::string& node_id, const std::string& property_id, const aggregate_spec& spec) {
+			auto& n = nodes[node_id];
+			if (!n) n = std::make_shared<derived_node>(shared_from_this(), node_id);
+			auto& p = n->properties[property_id];
+			if (p) throw std::invalid_argument("derived property " + node_id + "/" + property_id + " already exists");
+			p = std::make_shared<derived_property>(n, property_id, spec);
+			return p;
+		}
+
+		// Returns false if there is no such property
+		bool remove_property(const std::string& node_id, const std::string& property_id) {
+			auto it = nodes.find(node_id);
+			if (it == nodes.end() || it->second->properties.erase(property_id) == 0) return false;
+			if (it->second->properties.empty()) nodes.erase(it);
+			return true;
+		}
+
+		// Called with node and property id whenever an aggregated value changed
+		void on_change(std::function<void(const std::string& node_id, const std::string& property_id)> fn) {
+			std::lock_guard<std::mutex> lck(handler_mtx);
+			change_handler = std::move(fn);
+		}
+
+		void notify_changed(const std::string& node_id, const std::string& property_id) const {
+			std::function<void(const std::string&, const std::string&)> fn;
+			{
+				std::lock_guard<std::mutex> lck(handler_mtx);
+				fn = change_handler;
+			}
+			if (fn) fn(node_id, property_id);
+		}
+	};
+}
@@ -0,0 +1,144 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include "utils.h"
+
+namespace homie {
+	// Routes broadcasts to callbacks registered on MQTT style level patterns, e.g. "alert/#" or "system/+/reboot".
+	// Patterns are kept in a trie, so matching a level costs time proportional to its number of parts
+	// and not to the number of registered callbacks.
+	class broadcast_router {
+	public:
+		typedef uint64_t id_type;
+		typedef std::function<void(const std::string& level, const std::string& payload)> callback;
+	private:
+		struct trie_node {
+			std::unordered_map<std::string, std::unique_ptr<trie_node>> children;
+			std::unique_ptr<trie_node> any;
+			// Patterns ending at this node
+			std::vector<id_type> exact;
+			// Patterns ending with '#' below this node
+			std::vector<id_type> rest;
+
+			bool empty() const { return children.empty() && !any && exact.empty() && rest.empty(); }
+		};
+		struct entry {
+			std::vector<std::string> levels;
+			std::shared_ptr<callback> fn;
+		};
+
+		mutable std::mutex mtx;
+		trie_node root;
+		std::unordered_map<id_type, entry> entries;
+		id_type next_id;
+		mutable std::atomic<uint64_t> errors;
+
+		static void collect(const trie_node& node, const std::vector<std::string>& parts, size_t pos, std::vector<id_type>& out) {
+			out.insert(out.end(), node.rest.begin(), node.rest.end());
+			if (pos == parts.size()) {
+				out.insert(out.end(), node.exact.begin(), node.exact.end());
+				return;
+			}
+			auto it = node.children.find(parts[pos]);
+			if (it != node.children.end()) collect(*it->second, parts, pos + 1, out);
+			if (node.any) collect(*node.any, parts, pos + 1, out);
+		}
+
+		// Returns true if node became empty and can be removed by the caller
+		static bool remove(trie_node& node, const std::vector<std::string>& levels, size_t pos, id_type id) {
+			if (pos == levels.size() || levels[pos] == "#") {
+				auto& list = pos == levels.size() ? node.exact : node.rest;
+				list.erase(std::remove(list.begin(), list.end(), id), list.end());
+			}
+			else if (levels[pos] == "+") {
+				if (node.any && remove(*node.any, levels, pos + 1, id)) node.any.reset();
+			}
+			else {
+				auto it = node.children.find(levels[pos]);
+				if (it != node.children.end() && remove(*it->second, levels, pos + 1, id)) node.children.erase(it);
+			}
+			return node.empty();
+		}
+	public:
+		broadcast_router()
+			: next_id(1), errors(0)
+		{}
+
+		// Throws std::invalid_argument if '#' is not the last level or a wildcard is mixed with other characters
+		id_type subscribe(const std::string& pattern, callback fn) {
+			auto levels = utils::split<std::string>(pattern, "/");
+			for (size_t i = 0; i < levels.size(); i++) {
+				auto& l = levels[i];
+				if ((l == "#" && i != levels.size() - 1)
+					|| (l.size() > 1 && l.find_first_of("+#") != std::string::npos))
+					throw std::invalid_argument("invalid broadcast pattern " + pattern);
+			}
+
+			std::lock_guard<std::mutex> lck(mtx);
+			auto id = next_id++;
+			trie_node* node = &root;
+			for (auto& l : levels) {
+				if (l == "#") break;
+				std::unique_ptr<trie_node>& next = l == "+" ? node->any : node->children[l];
+				if (!next) next.reset(new trie_node());
+				node = next.get();
+			}
+			if (!levels.empty() && levels.back() == "#") node->rest.push_back(id);
+			else node->exact.push_back(id);
+			entries[id] = { std::move(levels), std::make_shared<callback>(std::move(fn)) };
+			return id;
+		}
+
+		void unsubscribe(id_type id) {
+			std::lock_guard<std::mutex> lck(mtx);
+			auto it = entries.find(id);
+			if (it == entries.end()) return;
+			remove(root, it->second.levels, 0, id);
+			entries.erase(it);
+		}
+
+		size_t size() const {
+			std::lock_guard<std::mutex> lck(mtx);
+			return entries.size();
+		}
+
+		// Number of exceptions thrown by callbacks
+		uint64_t get_errors() const {
+			return errors;
+		}
+
+		// Calls every callback whose pattern matches level, in subscription order.
+		// Callbacks run without the lock held and may subscribe or unsubscribe. Returns the number of calls.
+		// An exception of one callback does not stop the others, it is counted by get_errors().
+		size_t dispatch(const std::string& level, const std::string& payload) const {
+			auto parts = utils::split<std::string>(level, "/");
+			std::vector<std::shared_ptr<callback>> targets;
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				if (entries.empty()) return 0;
+				std::vector<id_type> ids;
+				collect(root, parts, 0, ids);
+				std::sort(ids.begin(), ids.end());
+				targets.reserve(ids.size());
+				for (auto id : ids) targets.push_back(entries.at(id).fn);
+			}
+			for (auto& fn : targets) {
+				try {
+					(*fn)(level, payload);
+				}
+				catch (const std::exception&) {
+					errors++;
+				}
+			}
+			return targets.size();
+		}
+	};
+}
@@ -3,30 +3,138 @@
 #include "device.h"
 #include "utils.h"
 #include "client_event_handler.h"
+#include "format.h"
+#include "outbox.h"
+#include "protocol_version.h"
+#include "json.h"
+#include "broadcast.h"
+#include "executor.h"
+#include "mpsc_queue.h"
+#include "stats.h"
+#include "quarantine.h"
 #include <set>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
 
 namespace homie {
 	class client : private mqtt_event_handler {
 		mqtt_client& mqtt;
 		std::string base_topic;
 		device_ptr dev;
+		protocol_version version;
 		client_event_handler* handler;
+		// Guards the cached announcement, stat collectors and compiled formats, which are used by the transport
+		// thread (announcements, sets), the thread publishing notifications and user threads changing the structure.
+		// Held while publishing the announcement, so it never interleaves with a rebuild.
+		std::mutex structure_mtx;
+		// Compiled $format by node and property id, compiled again when the datatype or $format changes
+		struct cached_format {
+			bool valid = false;
+			bool known = false;
+			datatype type = datatype::string;
+			std::string source;
+			property_format compiled;
+		};
+		std::map<std::pair<std::string, std::string>, cached_format> formats;
+		std::atomic<size_t> rejected_sets;
+		// Exceptions thrown by property setters and broadcast handlers, they are not the message's fault
+		std::atomic<uint64_t> handler_errors;
+
+		// Cached announcement, rebuilt after notify_structure_changed.
+		// Property pointers stay valid as long as the structure does not change.
+		struct announcement_message {
+			std::string topic;
+			std::string payload;
+		};
+		struct announcement_value {
+			std::string topic;
+			const property* prop;
+			int64_t idx;
+			bool is_array;
+		};
+		std::vector<announcement_message> announcement;
+		std::vector<announcement_value> announced_values;
+		struct announced_stat {
+			std::string id;
+			std::string topic;
+			// Null for stats read through device::get_stat()
+			const stat_collector* collector;
+			// Last value published by notify_stats_changed()
+			std::string last;
+			bool published;
+		};
+		std::vector<announced_stat> announced_stats;
+		// Name in the cached Homie 5 $description
+		std::string described_name;
+		bool announcement_valid;
+
+		// Updates that could not be published while the connection was down
+		mutable outbound_queue outbox;
+		std::atomic<bool> online;
+		// Drains the outbox while updates are pending after a reconnect
+		scheduled_task drain_task;
+
+		broadcast_router broadcasts;
+
+		// Runs setters off the transport thread, null until enable_async_sets().
+		// Published once through the atomic pointer, the transport thread reads it without locking.
+		std::unique_ptr<keyed_executor> set_executor_storage;
+		std::atomic<keyed_executor*> set_executor;
+		// Guards creating the set executor and the notification consumer
+		std::mutex enable_mtx;
+
+		struct change_token {
+			enum kind_type : uint8_t { property, property_index, stats } kind;
+			std::string node;
+			std::string prop;
+			int64_t idx;
+
+			bool operator<(const change_token& o) const {
+				if (kind != o.kind) return kind < o.kind;
+				if (idx != o.idx) return idx < o.idx;
+				if (node != o.node) return node < o.node;
+				return prop < o.prop;
+			}
+		};
+		// Notifications from any thread, published by a single thread. Null until enable_concurrent_notify(),
+		// then published once through the atomic pointer that notifying threads read without locking.
+		std::unique_ptr<utils::batch_consumer<change_token>> notifications_storage;
+		std::atomic<utils::batch_consumer<change_token>*> notifications;
+
+		// Stats computed by the client instead of the device
+		std::map<std::string, stat_collector> collectors;
+		// Collector values of the last notify_stats_changed(), announced without sampling again as
+		// collectors like cpuload measure the time between two calls. Guarded by structure_mtx.
+		std::map<std::string, std::string> collected_stats;
+		// Periodic stats publishing on the shared scheduler, 0 if disabled
+		stats_scheduler::id_type stats_timer;
+
+		// Malformed incoming messages
+		message_quarantine quarantine;
 
 		// Inherited by mqtt_event_handler
 		virtual void on_connect(bool session_present, bool reconnected) override {
-			if (reconnected) {
+			// Without a session the broker may have lost the retained announcement as well (e.g. after a restart)
+			if (reconnected && session_present) {
 				mqtt.publish(base_topic + dev->get_id() + "/$state", enum_to_string(dev->get_state()), 1, true);
 			}
 			else {
 				publish_device_info();
 			}
 			mqtt.subscribe(base_topic + dev->get_id() + "/+/+/set", 1);
+			online = true;
+			drain_outbox();
 		}
 		virtual void on_closing() override {
 			mqtt.publish(base_topic + dev->get_id() + "/$state", enum_to_string(device_state::disconnected), 1, true);
 		}
 		virtual void on_closed() override {}
-		virtual void on_offline() override {}
+		virtual void on_offline() override {
+			online = false;
+		}
 		virtual void on_message(const std::string & topic, const std::string & payload) override {
 			// Check basetopic
 			if (topic.size() < base_topic.size())
@@ -34,13 +142,31 @@ namespace homie {
 			if (topic.compare(0, base_topic.size(), base_topic) != 0)
 				return;
 
+			// Nothing may escape into the mqtt library, setters and handlers are guarded where they are called
+			try {
+				handle_message(topic, payload);
+			}
+			catch (const std::exception& e) {
+				quarantine.add(topic, payload, e.what());
+			}
+		}
+
+		void handle_message(const std::string& topic, const std::string& payload) {
 			auto parts = utils::split<std::string>(topic, "/", base_topic.size());
-			if (parts.size() < 2)
+			if (parts.size() < 2) {
+				quarantine.add(topic, payload, "missing topic levels");
 				return;
-			for (auto& e : parts) if (e.empty()) return;
+			}
+			for (auto& e : parts) {
+				if (e.empty()) {
+					quarantine.add(topic, payload, "empty topic level");
+					return;
+				}
+			}
 			if (parts[0][0] == '$') {
 				if (parts[0] == "$broadcast") {
-					this->handle_broadcast(parts[1], payload);
+					// Levels may span several topic levels ("alert/fire")
+					this->handle_broadcast(topic.substr(base_topic.size() + parts[0].size() + 1), payload);
 				}
 			}
 			else if(parts[0] == dev->get_id()) {
@@ -48,11 +174,11 @@ namespace homie {
 					|| parts[3] != "set"
 					|| parts[2][0] == '$')
 					return;
-				this->handle_property_set(parts[1], parts[2], payload);
+				this->handle_property_set(topic, parts[1], parts[2], payload);
 			}
 		}
 
-		void handle_property_set(const std::string& snode, const std::string& sproperty, const std::string& payload) {
+		void handle_property_set(const std::string& topic, const std::string& snode, const std::string& sproperty, const std::string& payload) {
 			if (snode.empty() || sproperty.empty())
 				return;
 
@@ -61,103 +187,290 @@ namespace homie {
 			std::string rnode = snode;
 			auto pos = rnode.find('_');
 			if (pos != std::string::npos) {
-				id = std::stoll(rnode.substr(pos + 1));
+				if (!utils::parse_int64(rnode.data() + pos + 1, rnode.data() + rnode.size(), id)) {
+					quarantine.add(topic, payload, "invalid array index");
+					return;
+				}
 				is_array_node = true;
 				rnode.resize(pos);
 			}
 
 			auto node = dev->get_node(rnode);
 			if (node == nullptr || node->is_array() != is_array_node) return;
+			if (is_array_node) {
+				auto range = node->array_range();
+				if (id < range.first || id > range.second) {
+					quarantine.add(topic, payload, "array index out of range");
+					return;
+				}
+			}
 			auto prop = node->get_property(sproperty);
 			if (prop == nullptr) return;
 
-			if (is_array_node)
-				prop->set_value(id, payload);
-			else prop->set_value(payload);
+			typed_value typed;
+			bool valid;
+			{
+				std::lock_guard<std::mutex> lck(structure_mtx);
+				valid = get_format(rnode, *prop).validate(payload, typed);
+			}
+			if (!valid) {
+				rejected_sets++;
+				return;
+			}
+			if (auto executor = set_executor.load()) {
+				// Serialised per property and array index, the key uses the parsed index as "_2" and "_02" are the same
+				auto key = is_array_node ? rnode + "_" + std::to_string(id) + "/" + sproperty : rnode + "/" + sproperty;
+				executor->post(key, [prop, is_array_node, id, typed, payload]() {
+					if (is_array_node)
+						prop->set_typed_value(id, typed, payload);
+					else prop->set_typed_value(typed, payload);
+				});
+				return;
+			}
+			try {
+				if (is_array_node)
+					prop->set_typed_value(id, typed, payload);
+				else prop->set_typed_value(typed, payload);
+			}
+			catch (const std::exception&) {
+				handler_errors++;
+			}
+		}
+
+		// Caller holds structure_mtx
+		const property_format& get_format(const std::string& node_id, const property& prop) {
+			bool known = true;
+			datatype type = datatype::string;
+			try {
+				type = prop.get_datatype();
+			}
+			catch (const std::exception&) {
+				known = false;
+			}
+			auto source = prop.get_format();
+			auto& e = formats[{ node_id, prop.get_id() }];
+			if (e.valid && e.known == known && e.type == type && e.source == source) return e.compiled;
+			e.valid = true;
+			e.known = known;
+			e.type = type;
+			e.source = source;
+			e.compiled = property_format();
+			try {
+				if (known) e.compiled = property_format::compile(type, source);
+			}
+			catch (const std::exception&) {
+				// Invalid $format, accept everything
+			}
+			return e.compiled;
 		}
 
 		void handle_broadcast(const std::string& level, const std::string& payload) {
-			if(handler)
-				handler->on_broadcast(level, payload);
+			if (handler) {
+				try {
+					handler->on_broadcast(level, payload);
+				}
+				catch (const std::exception&) {
+					handler_errors++;
+				}
+			}
+			broadcasts.dispatch(level, payload);
 		}
 
 		void publish_device_info() {
+			std::lock_guard<std::mutex> lck(structure_mtx);
 			// Signal initialisation phase
 			this->publish_device_attribute("$state", enum_to_string(device_state::init));
 
+			// Homie 5 carries the name in $description
+			if (version == protocol_version::v5 && announcement_valid && dev->get_name() != described_name) announcement_valid = false;
+			if (!announcement_valid) build_announcement();
+			for (auto& e : announcement)
+				mqtt.publish(e.topic, e.payload, 1, true);
+
+			// Runtime attributes, values and stats change without a structure change (renaming, a new address
+			// after DHCP or a cellular reconnect) and are read on every announcement
+			if (version != protocol_version::v5) {
+				publish_device_attribute("$name", dev->get_name());
+				if (version == protocol_version::v3) {
+					publish_device_attribute("$localip", dev->get_localip());
+					publish_device_attribute("$mac", dev->get_mac());
+				}
+			}
+			for (auto& e : announced_values) {
+				auto val = e.is_array ? e.prop->get_value(e.idx) : e.prop->get_value();
+				if (!val.empty())
+					mqtt.publish(e.topic, val, 1, true);
+			}
+			for (auto& e : announced_stats)
+				mqtt.publish(e.topic, get_announced_stat(e), 1, true);
+
+			// Everything done, set device to real state
+			this->publish_device_attribute("$state", enum_to_string(dev->get_state()));
+		}
+
+		// Collects all announcement messages that only change with the device structure,
+		// $name, $localip and $mac are published separately. Caller holds structure_mtx.
+		void build_announcement() {
+			announcement.clear();
+			announced_values.clear();
+			announced_stats.clear();
+			const std::string prefix = base_topic + dev->get_id() + "/";
+			auto add = [&](const std::string& attribute, const std::string& value) {
+				announcement.push_back({ prefix + attribute, value });
+			};
+
+			if (version == protocol_version::v5) {
+				add("$description", build_description(prefix));
+				announcement_valid = true;
+				return;
+			}
+
 			// Public device properties
-			this->publish_device_attribute("$homie", "3.0.0");
-			this->publish_device_attribute("$name", dev->get_name());
-			this->publish_device_attribute("$localip", dev->get_localip());
-			this->publish_device_attribute("$mac", dev->get_mac());
-			this->publish_device_attribute("$fw/name", dev->get_firmware_name());
-			this->publish_device_attribute("$fw/version", dev->get_firmware_version());
-			this->publish_device_attribute("$implementation", dev->get_implementation());
-			this->publish_device_attribute("$stats/interval", std::to_string(dev->get_stats_interval().count()));
-
-			// Publish nodes
+			add("$homie", enum_to_string(version));
+			if (version == protocol_version::v3) {
+				auto fixed = dynamic_cast<const static_structure*>(dev.get());
+				if (fixed) {
+					build_static_announcement(prefix, *fixed);
+					return;
+				}
+			}
+			if (version == protocol_version::v3) {
+				add("$fw/name", dev->get_firmware_name());
+				add("$fw/version", dev->get_firmware_version());
+				add("$implementation", dev->get_implementation());
+				add("$stats/interval", std::to_string(dev->get_stats_interval().count()));
+			}
+			else {
+				add("$extensions", "");
+			}
+
+			// Nodes
 			std::string nodes = "";
 			for (auto& nodename : dev->get_nodes()) {
 				auto node = dev->get_node(nodename);
+				// Homie 4 has no array nodes
+				if (version != protocol_version::v3 && node->is_array()) continue;
+				const std::string node_prefix = node->get_id() + "/";
+				auto range = node->is_array() ? node->array_range() : std::pair<int64_t, int64_t>(0, -1);
 				if (node->is_array()) {
 					nodes += node->get_id() + "[],";
-					this->publish_node_attribute(node, "$array", std::to_string(node->array_range().first) + "-" + std::to_string(node->array_range().second));
-					for (int64_t i = node->array_range().first; i <= node->array_range().second; i++) {
+					add(node_prefix + "$array", std::to_string(range.first) + "-" + std::to_string(range.second));
+					for (int64_t i = range.first; i <= range.second; i++) {
 						auto n = node->get_name(i);
-						if(n != "")
-						this->publish_device_attribute(node->get_id() + "_" + std::to_string(i) + "/$name", n);
+						if (n != "")
+							add(node->get_id() + "_" + std::to_string(i) + "/$name", n);
 					}
 				}
 				else {
 					nodes += node->get_id() + ",";
 				}
-				this->publish_node_attribute(node, "$name", node->get_name());
-				this->publish_node_attribute(node, "$type", node->get_type());
+				add(node_prefix + "$name", node->get_name());
+				add(node_prefix + "$type", node->get_type());
 
-				// Publish node properties
+				// Node properties
 				std::string properties = "";
 				for (auto& propertyname : node->get_properties()) {
 					auto property = node->get_property(propertyname);
+					const std::string property_prefix = node_prefix + property->get_id() + "/";
 					properties += property->get_id() + ",";
-					this->publish_property_attribute(node, property, "$name", property->get_name());
-					this->publish_property_attribute(node, property, "$settable", property->is_settable() ? "true" : "false");
-					this->publish_property_attribute(node, property, "$retained", property->is_retained() ? "true" : "false");
-					this->publish_property_attribute(node, property, "$unit", property->get_unit());
-					this->publish_property_attribute(node, property, "$datatype", enum_to_string(property->get_datatype()));
-					this->publish_device_attribute(node->get_id() + "/" + property->get_id() + "/$format", property->get_format());
+					add(property_prefix + "$name", property->get_name());
+					add(property_prefix + "$settable", property->is_settable() ? "true" : "false");
+					add(property_prefix + "$retained", property->is_retained() ? "true" : "false");
+					add(property_prefix + "$unit", property->get_unit());
+					add(property_prefix + "$datatype", enum_to_string(property->get_datatype()));
+					add(property_prefix + "$format", property->get_format());
 					if (!node->is_array()) {
-						auto val = property->get_value();
-						if (!val.empty())
-							this->publish_node_attribute(node, property->get_id(), val);
+						announced_values.push_back({ prefix + node_prefix + property->get_id(), property.get(), 0, false });
 					}
 					else {
-						for (int64_t i = node->array_range().first; i <= node->array_range().second; i++) {
-							auto val = property->get_value(i);
-							if(!val.empty())
-								this->publish_device_attribute(node->get_id() + "_" + std::to_string(i) + "/" + property->get_id(), val);
-						}
+						for (int64_t i = range.first; i <= range.second; i++)
+							announced_values.push_back({ prefix + node->get_id() + "_" + std::to_string(i) + "/" + property->get_id(), property.get(), i, true });
 					}
 				}
 				if (!properties.empty())
 					properties.resize(properties.size() - 1);
-				this->publish_node_attribute(node, "$properties", properties);
+				add(node_prefix + "$properties", properties);
 			}
 			if (!nodes.empty())
 				nodes.resize(nodes.size() - 1);
-			this->publish_device_attribute("$nodes", nodes);
+			add("$nodes", nodes);
+
+			if (version == protocol_version::v3) add_stats(prefix);
+			announcement_valid = true;
+		}
 
-			// Publish stats
+		// Structure attributes come from the precomputed table, only values and runtime attributes are read from the device
+		void build_static_announcement(const std::string& prefix, const static_structure& fixed) {
+			for (auto& e : fixed.get_static_announcement()) {
+				if (e.first != "$name") announcement.push_back({ prefix + e.first, e.second });
+			}
+			const device& d = *dev;
+			d.for_each_node([&](const std::string& node_id, const node& n) {
+				n.for_each_property([&](const std::string& prop_id, const property& p) {
+					announced_values.push_back({ prefix + node_id + "/" + prop_id, &p, 0, false });
+				});
+			});
+			add_stats(prefix);
+			announcement_valid = true;
+		}
+
+		void add_stats(const std::string& prefix) {
 			std::string stats = "";
-			for (auto& stat : dev->get_stats()) {
+			auto ids = dev->get_stats();
+			for (auto& e : collectors) ids.insert(e.first);
+			for (auto& stat : ids) {
 				stats += stat + ",";
-				this->publish_device_attribute("$stats/" + stat, dev->get_stat(stat));
+				auto it = collectors.find(stat);
+				announced_stats.push_back({ stat, prefix + "$stats/" + stat, it != collectors.end() ? &it->second : nullptr, std::string(), false });
 			}
 			if (!stats.empty())
 				stats.resize(stats.size() - 1);
-			this->publish_device_attribute("$stats", stats);
+			announcement.push_back({ prefix + "$stats", stats });
+		}
 
-			// Everything done, set device to real state
-			this->publish_device_attribute("$state", enum_to_string(dev->get_state()));
+		// Homie 5 describes the whole structure in one JSON document, array nodes are not supported
+		std::string build_description(const std::string& prefix) {
+			std::string body;
+			json::writer w(body);
+			w.begin_object();
+			w.key("homie").value(enum_to_string(version));
+			described_name = dev->get_name();
+			w.key("name").value(described_name);
+			w.key("nodes").begin_object();
+			for (auto& nodename : dev->get_nodes()) {
+				auto node = dev->get_node(nodename);
+				if (node->is_array()) continue;
+				w.key(node->get_id()).begin_object();
+				w.key("name").value(node->get_name());
+				w.key("type").value(node->get_type());
+				w.key("properties").begin_object();
+				for (auto& propertyname : node->get_properties()) {
+					auto property = node->get_property(propertyname);
+					w.key(property->get_id()).begin_object();
+					w.key("name").value(property->get_name());
+					w.key("datatype").value(enum_to_string(property->get_datatype()));
+					auto format = property->get_format();
+					if (!format.empty()) w.key("format").value(format);
+					w.key("settable").value(property->is_settable());
+					w.key("retained").value(property->is_retained());
+					auto unit = property->get_unit();
+					if (!unit.empty()) w.key("unit").value(unit);
+					w.end_object();
+					announced_values.push_back({ prefix + node->get_id() + "/" + property->get_id(), property.get(), 0, false });
+				}
+				w.end_object();
+				w.end_object();
+			}
+			w.end_object();
+			w.end_object();
+
+			// The version has to change whenever the description does
+			uint32_t hash = 2166136261u;
+			for (auto c : body) {
+				hash ^= static_cast<uint8_t>(c);
+				hash *= 16777619u;
+			}
+			return "{\"version\":" + std::to_string(hash) + "," + body.substr(1);
 		}
 
 		void publish_device_attribute(const std::string& attribute, const std::string& value, const bool retained) {
@@ -176,6 +489,77 @@ namespace homie {
 			publish_node_attribute(node, prop->get_id() + "/" + attribute, value);
 		}
 
+		// Publishes a value update or queues it while the connection is down.
+		// Queued updates are published first to keep the latest value last.
+		void publish_update(const std::string& topic, const std::string& value, bool retained) {
+			if (online && outbox.empty()) {
+				try {
+					mqtt.publish(topic, value, 1, retained);
+					return;
+				}
+				catch (const std::exception&) {
+					online = false;
+				}
+			}
+			outbox.push(topic, value, 1, retained);
+			if (online) drain_outbox();
+		}
+
+		void drain_outbox() {
+			try {
+				outbox.drain(mqtt);
+			}
+			catch (const std::exception&) {
+				online = false;
+			}
+			// Whatever the drain rate held back is published by the task, which stops once the outbox
+			// is empty or the connection is lost again
+			if (online && !outbox.empty()) {
+				auto interval = outbox.drain_interval();
+				if (interval.count() == 0) interval = std::chrono::milliseconds(100);
+				drain_task.start(interval, [this]() { drain(); }, [this]() { return online && !outbox.empty(); });
+			}
+		}
+
+		// Samples collectors, caller holds structure_mtx
+		std::string get_stat(const announced_stat& stat) {
+			if (!stat.collector) return dev->get_stat(stat.id);
+			auto value = (*stat.collector)();
+			collected_stats[stat.id] = value;
+			return value;
+		}
+
+		// Last sampled value of collectors, caller holds structure_mtx
+		std::string get_announced_stat(const announced_stat& stat) {
+			auto it = stat.collector ? collected_stats.find(stat.id) : collected_stats.end();
+			return it != collected_stats.end() ? it->second : get_stat(stat);
+		}
+
+		// Only publishes stats that changed since the last call
+		void notify_stats_changed_impl() {
+			std::lock_guard<std::mutex> lck(structure_mtx);
+			if (!announcement_valid) build_announcement();
+			for (auto& e : announced_stats) {
+				auto value = get_stat(e);
+				if (e.published && value == e.last) continue;
+				publish_update(e.topic, value, true);
+				e.last = std::move(value);
+				e.published = true;
+			}
+		}
+
+		void publish_changes(std::vector<change_token>& batch) {
+			std::set<change_token> seen;
+			for (auto& e : batch) {
+				if (!seen.insert(e).second) continue;
+				switch (e.kind) {
+				case change_token::property: notify_property_changed_impl(e.node, e.prop, nullptr); break;
+				case change_token::property_index: notify_property_changed_impl(e.node, e.prop, &e.idx); break;
+				case change_token::stats: notify_stats_changed_impl(); break;
+				}
+			}
+		}
+
 		void notify_property_changed_impl(const std::string& snode, const std::string& sproperty, const int64_t* idx) {
 			if (snode.empty() || sproperty.empty())
 				return;
@@ -184,24 +568,26 @@ namespace homie {
 			if (!node) return;
 			auto prop = node->get_property(sproperty);
 			if (!prop) return;
+			const std::string prefix = base_topic + dev->get_id() + "/";
 			if (node->is_array()) {
+				if (version != protocol_version::v3) return;
 				if (idx != nullptr) {
-					this->publish_device_attribute(node->get_id() + "_" + std::to_string(*idx) + "/" + prop->get_id(), prop->get_value(*idx), prop->is_retained());
+					this->publish_update(prefix + node->get_id() + "_" + std::to_string(*idx) + "/" + prop->get_id(), prop->get_value(*idx), prop->is_retained());
 				}
 				else {
 					auto range = node->array_range();
 					for (auto i = range.first; i <= range.second; i++) {
-						this->publish_device_attribute(node->get_id() + "_" + std::to_string(i) + "/" + prop->get_id(), prop->get_value(i), prop->is_retained());
+						this->publish_update(prefix + node->get_id() + "_" + std::to_string(i) + "/" + prop->get_id(), prop->get_value(i), prop->is_retained());
 					}
 				}
 			}
 			else {
-				this->publish_device_attribute(node->get_id() + "/" + prop->get_id(), prop->get_value(), prop->is_retained());
+				this->publish_update(prefix + node->get_id() + "/" + prop->get_id(), prop->get_value(), prop->is_retained());
 			}
 		}
 	public:
-		client(mqtt_client& con, device_ptr pdev, std::string basetopic = "homie/")
-			: mqtt(con), base_topic(basetopic), dev(pdev), handler(nullptr)
+		client(mqtt_client& con, device_ptr pdev, std::string basetopic = "homie/", protocol_version protocol = protocol_version::v3)
+			: mqtt(con), base_topic(basetopic), dev(pdev), version(protocol), handler(nullptr), rejected_sets(0), handler_errors(0), announcement_valid(false), online(false), set_executor(nullptr), notifications(nullptr), stats_timer(0)
 		{
 			if (!pdev) throw std::invalid_argument("device is null");
 			mqtt.set_event_handler(this);
@@ -210,27 +596,179 @@ namespace homie {
 		}
 
 		~client() {
+			// Finish queued sets and notifications while they can still be published
+			disable_stats_scheduler();
+			drain_task.stop();
+			set_executor = nullptr;
+			set_executor_storage.reset();
+			notifications = nullptr;
+			notifications_storage.reset();
 			this->publish_device_attribute("$state", enum_to_string(device_state::disconnected));
 			this->mqtt.unsubscribe(base_topic + dev->get_id() + "/+/+/set");
 			mqtt.set_event_handler(nullptr);
 		}
 
 		void notify_property_changed(const std::string& snode, const std::string& sproperty) {
-			notify_property_changed_impl(snode, sproperty, nullptr);
+			if (auto queue = notifications.load()) queue->push({ change_token::property, snode, sproperty, 0 });
+			else notify_property_changed_impl(snode, sproperty, nullptr);
 		}
 
 		void notify_property_changed(const std::string& snode, const std::string& sproperty, int64_t idx) {
-			notify_property_changed_impl(snode, sproperty, &idx);
+			if (auto queue = notifications.load()) queue->push({ change_token::property_index, snode, sproperty, idx });
+			else notify_property_changed_impl(snode, sproperty, &idx);
 		}
 
 		void notify_stats_changed() {
-			for (auto& stat : dev->get_stats()) {
-				this->publish_device_attribute("$stats/" + stat, dev->get_stat(stat));
+			if (auto queue = notifications.load()) {
+				queue->push({ change_token::stats, std::string(), std::string(), 0 });
+				return;
 			}
+			notify_stats_changed_impl();
 		};
 
+		// Keeps the last messages malformed messages, with payloads cut to payload_limit bytes, for get_quarantined().
+		// They are counted in any case, sets rejected by $format are counted separately.
+		void enable_quarantine(size_t messages = 64, size_t payload_limit = 256) {
+			quarantine.set_capacity(messages, payload_limit);
+		}
+
+		uint64_t get_malformed_messages() const {
+			return quarantine.count();
+		}
+
+		// Exceptions thrown by property setters, including those run by enable_async_sets(), and broadcast handlers.
+		// They are not counted as malformed messages.
+		uint64_t get_handler_errors() {
+			auto executor = set_executor.load();
+			return handler_errors + broadcasts.get_errors() + (executor ? executor->get_failed() : 0);
+		}
+
+		// Oldest first
+		std::vector<quarantined_message> get_quarantined() const {
+			return quarantine.get_messages();
+		}
+
+		// Publishes the value returned by fn as stat id instead of device::get_stat(), id is added to $stats if needed.
+		// Call it before connecting, or call notify_structure_changed() afterwards.
+		void add_stat_collector(const std::string& id, stat_collector fn) {
+			std::lock_guard<std::mutex> lck(structure_mtx);
+			collectors[id] = std::move(fn);
+			collected_stats.erase(id);
+			announcement_valid = false;
+		}
+
+		// Adds the built in uptime, cpuload (percent) and rss (bytes) collectors.
+		// Other stats like signal keep coming from the device.
+		void add_builtin_stats() {
+			add_stat_collector("uptime", stat_collectors::uptime());
+			add_stat_collector("cpuload", stat_collectors::cpu_load());
+			add_stat_collector("rss", stat_collectors::resident_memory());
+		}
+
+		// Publishes the stats that changed every interval, by default the announced $stats/interval.
+		// Runs on the timer thread shared by all clients and enables concurrent notify, so stats are queued without
+		// blocking that thread and published
+		// by the same thread as property notifications. Homie 4 and 5 have no stats, so nothing is scheduled.
+		void enable_stats_scheduler(std::chrono::milliseconds interval = std::chrono::milliseconds(0)) {
+			if (stats_timer != 0 || version != protocol_version::v3) return;
+			if (interval.count() == 0) interval = dev->get_stats_interval();
+			if (interval.count() <= 0) return;
+			enable_concurrent_notify();
+			stats_timer = stats_scheduler::instance().add(interval, [this]() { notify_stats_changed(); });
+		}
+
+		void disable_stats_scheduler() {
+			if (stats_timer == 0) return;
+			stats_scheduler::instance().remove(stats_timer);
+			stats_timer = 0;
+		}
+
+		// Makes notify_property_changed() and notify_stats_changed() safe to call from any thread, including
+		// while this is called. Notifications are queued without waiting for the publishing thread (the queue
+		// allocates a node per notification) and published by one thread, which reads the value once per batch, so repeated
+		// notifications of the same property collapse into one publish.
+		void enable_concurrent_notify() {
+			std::lock_guard<std::mutex> lck(enable_mtx);
+			if (notifications_storage) return;
+			notifications_storage.reset(new utils::batch_consumer<change_token>([this](std::vector<change_token>& batch) { publish_changes(batch); }));
+			notifications = notifications_storage.get();
+		}
+
+		// Blocks until notifications queued so far are published
+		void flush_notifications() {
+			if (auto queue = notifications.load()) queue->flush();
+		}
+
 		void set_event_handler(client_event_handler* hdl) {
 			handler = hdl;
 		}
+
+		// Runs property setters on a pool of threads instead of the transport thread, so slow hardware
+		// does not hold up other sets. Sets of one property (and array index) keep their order,
+		// with latest_wins a set still waiting replaces the one queued before it.
+		// Setters then run concurrently and notify from worker threads, so this enables concurrent notify as well.
+		// Safe while sets arrive; later calls keep the running executor and its settings.
+		void enable_async_sets(size_t threads = 2, bool latest_wins = false) {
+			enable_concurrent_notify();
+			std::lock_guard<std::mutex> lck(enable_mtx);
+			if (set_executor_storage) return;
+			set_executor_storage.reset(new keyed_executor(threads, latest_wins));
+			set_executor = set_executor_storage.get();
+		}
+
+		// Blocks until all queued sets have run
+		void wait_for_sets() {
+			if (auto executor = set_executor.load()) executor->wait_idle();
+		}
+
+		// Queued sets replaced by a newer one
+		uint64_t get_dropped_sets() {
+			auto executor = set_executor.load();
+			return executor ? executor->get_dropped() : 0;
+		}
+
+		// Calls fn for broadcasts whose level matches pattern ("alert/#", "system/+/reboot")
+		broadcast_router::id_type subscribe_broadcast(const std::string& pattern, broadcast_router::callback fn) {
+			return broadcasts.subscribe(pattern, std::move(fn));
+		}
+
+		void unsubscribe_broadcast(broadcast_router::id_type id) {
+			broadcasts.unsubscribe(id);
+		}
+
+		// Has to be called if nodes, properties or their attributes change after construction
+		void notify_structure_changed() {
+			std::lock_guard<std::mutex> lck(structure_mtx);
+			formats.clear();
+			announcement_valid = false;
+		}
+
+		// Reconfigures the offline queue, queued messages are kept as far as the new limits allow.
+		// Safe while the transport or the drain task use the queue.
+		void set_outbox_options(const outbox_options& options) {
+			outbox.reset(options);
+		}
+
+		// Publishes queued updates as far as the drain rate allows. After a reconnect the client
+		// keeps draining on its own, so this is only needed to publish a spill file left by a previous run early.
+		size_t drain() {
+			if (!online) return 0;
+			try {
+				return outbox.drain(mqtt);
+			}
+			catch (const std::exception&) {
+				online = false;
+				return 0;
+			}
+		}
+
+		// Updates waiting for the connection and updates lost because the queue was full
+		size_t get_pending_updates() const { return outbox.size(); }
+		size_t get_dropped_updates() const { return outbox.get_dropped(); }
+
+		// Number of incoming sets dropped because they did not match the datatype or $format
+		size_t get_rejected_sets() const {
+			return rejected_sets;
+		}
 	};
 }
\ No newline at end of file
@@ -0,0 +1,126 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+
+namespace homie {
+	// Keeps only the latest value per key and hands the survivors to a sink on a fixed cadence.
+	// The first value after an idle period is flushed right away, later ones at most once per interval.
+	// Keys are flushed in the order they were first put since the last flush.
+	// Entries the sink leaves in the batch failed and are put back for the next flush, unless a newer
+	// value for the key arrived meanwhile. The final flush of the destructor drops them.
+	template<typename Key, typename Value, typename Hash = std::hash<Key>>
+	class coalescer {
+	public:
+		typedef std::vector<std::pair<Key, Value>> batch;
+		typedef std::function<void(batch&)> sink_type;
+	private:
+		std::mutex mtx;
+		std::condition_variable cv;
+		// Serialises flushes, so the sink sees batches in order
+		std::mutex flush_mtx;
+		std::unordered_map<Key, size_t, Hash> index;
+		batch pending;
+		sink_type sink;
+		std::chrono::milliseconds interval;
+		uint64_t coalesced;
+		bool stop;
+		std::thread worker;
+
+		batch take() {
+			batch res;
+			res.swap(pending);
+			index.clear();
+			return res;
+		}
+	public:
+		coalescer(std::chrono::milliseconds flush_interval, sink_type fn)
+			: sink(std::move(fn)), interval(flush_interval), coalesced(0), stop(false)
+		{
+			worker = std::thread([this]() {
+				std::unique_lock<std::mutex> lck(mtx);
+				while (!stop) {
+					if (pending.empty()) {
+						cv.wait(lck);
+						continue;
+					}
+					lck.unlock();
+					flush();
+					lck.lock();
+					// At most one flush per interval, values arriving meanwhile are coalesced
+					cv.wait_for(lck, interval, [this]() { return stop; });
+				}
+			});
+		}
+
+		// Publishes what is still pending
+		~coalescer() {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				stop = true;
+			}
+			cv.notify_all();
+			worker.join();
+			flush();
+		}
+
+		coalescer(const coalescer&) = delete;
+		coalescer& operator=(const coalescer&) = delete;
+
+		void put(const Key& key, Value value) {
+			bool first;
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				first = pending.empty();
+				auto it = index.find(key);
+				if (it != index.end()) {
+					pending[it->second].second = std::move(value);
+					coalesced++;
+					return;
+				}
+				index.insert({ key, pending.size() });
+				pending.emplace_back(key, std::move(value));
+			}
+			if (first) cv.notify_all();
+		}
+
+		// Hands everything pending to the sink now, returns the number of entries
+		size_t flush() {
+			std::lock_guard<std::mutex> flck(flush_mtx);
+			batch b;
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				b = take();
+			}
+			if (b.empty()) return 0;
+			auto count = b.size();
+			sink(b);
+			if (!b.empty()) {
+				std::lock_guard<std::mutex> lck(mtx);
+				for (auto& e : b) {
+					if (index.count(e.first) != 0) continue;
+					index.insert({ e.first, pending.size() });
+					pending.emplace_back(std::move(e));
+				}
+			}
+			return count;
+		}
+
+		size_t size() {
+			std::lock_guard<std::mutex> lck(mtx);
+			return pending.size();
+		}
+
+		// Values replaced by a newer one before they were flushed
+		uint64_t get_coalesced() {
+			std::lock_guard<std::mutex> lck(mtx);
+			return coalesced;
+		}
+	};
+}
@@ -4,6 +4,9 @@
 namespace homie {
 	template<typename T>
 	inline T enum_from_string(const std::string& s);
+	// Same as enum_from_string but returns false instead of throwing, out is only set on success
+	template<typename T>
+	inline bool try_enum_from_string(const std::string& s, T& out);
 
 	enum class datatype {
 		integer,
@@ -28,14 +31,21 @@ namespace homie {
 		}
 	}
 
+	template<>
+	inline bool try_enum_from_string<datatype>(const std::string& s, datatype& out) {
+		if (s == "integer") { out = datatype::integer; return true; }
+		if (s == "float") { out = datatype::number; return true; }
+		if (s == "boolean") { out = datatype::boolean; return true; }
+		if (s == "string") { out = datatype::string; return true; }
+		if (s == "enum") { out = datatype::enumeration; return true; }
+		if (s == "color") { out = datatype::color; return true; }
+		return false;
+	}
+
 	template<>
 	inline datatype enum_from_string<datatype>(const std::string& s) {
-		if (s == "integer") return datatype::integer;
-		if (s == "float") return datatype::number;
-		if (s == "boolean") return datatype::boolean;
-		if (s == "string") return datatype::string;
-		if (s == "enum") return datatype::enumeration;
-		if (s == "color") return datatype::color;
-		throw std::invalid_argument("not a enum member");
+		datatype res;
+		if (!try_enum_from_string(s, res)) throw std::invalid_argument("not a enum member");
+		return res;
 	}
 }
\ No newline at end of file
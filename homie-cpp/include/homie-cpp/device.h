@@ -8,6 +8,9 @@
 #include "utils.h"
 
 namespace homie {
+	typedef utils::function_ref<void(const std::string& id, node& n)> node_visitor;
+	typedef utils::function_ref<void(const std::string& id, const node& n)> const_node_visitor;
+
 	struct device {
 		virtual std::string get_id() const = 0;
 		virtual std::string get_name() const = 0;
@@ -27,12 +30,17 @@ namespace homie {
 		virtual std::set<std::string> get_attributes() const = 0;
 		virtual std::string get_attribute(const std::string& id) const = 0;
 		virtual void set_attribute(const std::string& id, const std::string& value) = 0;
+
+		// Visit every node/attribute without building an intermediate set or doing a second lookup
+		virtual void for_each_node(node_visitor fn) = 0;
+		virtual void for_each_node(const_node_visitor fn) const = 0;
+		virtual void for_each_attribute(attribute_visitor fn) const = 0;
 	};
 
 	struct basic_device : public device {
 		// Geerbt über device
 		virtual std::string get_name() const override { return get_attribute("name"); }
-		virtual device_state get_state() const override { try { return enum_from_string<device_state>(get_attribute("state")); } catch (const std::exception&) { return device_state::init; } }
+		virtual device_state get_state() const override { auto s = device_state::init; try_enum_from_string(get_attribute("state"), s); return s; }
 		virtual std::string get_localip() const override { return get_attribute("localip"); }
 		virtual std::string get_mac() const override { return get_attribute("mac"); }
 		virtual std::string get_firmware_name() const override { return get_attribute("fw/name"); }
@@ -43,8 +51,39 @@ namespace homie {
 			return std::set<std::string>(parts.begin(), parts.end());
 		}
 		virtual std::string get_stat(const std::string& id) const { return get_attribute("stats/" + id); }
-		virtual std::chrono::seconds get_stats_interval() const override { return std::chrono::seconds(std::stoull(get_attribute("stats/interval"))); }
+		// 0 if the attribute is missing or malformed
+		virtual std::chrono::seconds get_stats_interval() const override {
+			int64_t interval = 0;
+			if (!utils::parse_int64(get_attribute("stats/interval"), interval) || interval < 0) interval = 0;
+			return std::chrono::seconds(interval);
+		}
+		virtual void for_each_node(node_visitor fn) override {
+			for (auto& e : get_nodes()) {
+				auto n = get_node(e);
+				if (n) fn(e, *n);
+			}
+		}
+		virtual void for_each_node(const_node_visitor fn) const override {
+			for (auto& e : get_nodes()) {
+				auto n = get_node(e);
+				if (n) fn(e, *n);
+			}
+		}
+		virtual void for_each_attribute(attribute_visitor fn) const override {
+			for (auto& e : get_attributes()) fn(e, get_attribute(e));
+		}
+	};
+
+	// Implemented by devices whose structure is fixed at compile time, see schema::static_device.
+	// client publishes this table instead of walking nodes and properties.
+	struct static_structure {
+		virtual ~static_structure() {}
+		// Homie 3 structure attributes relative to the device topic, built once per device type
+		virtual const std::vector<std::pair<std::string, std::string>>& get_static_announcement() const = 0;
 	};
+
 	typedef std::shared_ptr<device> device_ptr;
 	typedef std::shared_ptr<const device> const_device_ptr;
+	typedef utils::function_ref<void(const std::string& id, device& dev)> device_visitor;
+	typedef utils::function_ref<void(const std::string& id, const device& dev)> const_device_visitor;
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 namespace homie {
 	template<typename T>
 	inline T enum_from_string(const std::string& s);
+	template<typename T>
+	inline bool try_enum_from_string(const std::string& s, T& out);
 
 	enum class device_state {
 		init,
@@ -28,14 +30,21 @@ namespace homie {
 		}
 	}
 
+	template<>
+	inline bool try_enum_from_string<device_state>(const std::string& s, device_state& out) {
+		if (s == "init") { out = device_state::init; return true; }
+		if (s == "ready") { out = device_state::ready; return true; }
+		if (s == "disconnected") { out = device_state::disconnected; return true; }
+		if (s == "sleeping") { out = device_state::sleeping; return true; }
+		if (s == "lost") { out = device_state::lost; return true; }
+		if (s == "alert") { out = device_state::alert; return true; }
+		return false;
+	}
+
 	template<>
 	inline device_state enum_from_string<device_state>(const std::string& s) {
-		if (s == "init") return device_state::init;
-		if (s == "ready") return device_state::ready;
-		if (s == "disconnected") return device_state::disconnected;
-		if (s == "sleeping") return device_state::sleeping;
-		if (s == "lost") return device_state::lost;
-		if (s == "alert") return device_state::alert;
-		throw std::invalid_argument("not a enum member");
+		device_state res;
+		if (!try_enum_from_string(s, res)) throw std::invalid_argument("not a enum member");
+		return res;
 	}
 }
\ No newline at end of file
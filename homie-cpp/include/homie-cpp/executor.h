@@ -0,0 +1,130 @@
+#pragma once
+#include <string>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <cstdint>
+
+namespace homie {
+	// Thread pool running tasks in parallel across keys and in order per key.
+	// With latest_wins set, a task still waiting for its key replaces the queued one instead of queueing behind it.
+	class keyed_executor {
+		struct strand {
+			std::deque<std::function<void()>> tasks;
+		};
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::condition_variable idle_cv;
+		// A key has a strand while it has queued or running tasks
+		std::unordered_map<std::string, strand> strands;
+		// Keys with queued tasks and no running one
+		std::deque<std::string> ready;
+		std::vector<std::thread> workers;
+		bool latest_wins;
+		bool stop;
+		uint64_t dropped;
+		uint64_t failed;
+
+		void work() {
+			std::unique_lock<std::mutex> lck(mtx);
+			while (true) {
+				cv.wait(lck, [this]() { return stop || !ready.empty(); });
+				if (ready.empty()) return;
+				auto key = std::move(ready.front());
+				ready.pop_front();
+				auto& s = strands[key];
+				auto task = std::move(s.tasks.front());
+				s.tasks.pop_front();
+				lck.unlock();
+				try {
+					task();
+				}
+				catch (const std::exception&) {
+					lck.lock();
+					failed++;
+					lck.unlock();
+				}
+				lck.lock();
+				auto it = strands.find(key);
+				if (it->second.tasks.empty()) strands.erase(it);
+				else {
+					// Back of the line, so busy keys do not starve the others
+					ready.push_back(std::move(key));
+					cv.notify_one();
+				}
+				if (strands.empty()) idle_cv.notify_all();
+			}
+		}
+	public:
+		keyed_executor(size_t threads, bool latest_only = false)
+			: latest_wins(latest_only), stop(false), dropped(0), failed(0)
+		{
+			threads = std::max<size_t>(1, threads);
+			for (size_t i = 0; i < threads; i++) workers.emplace_back([this]() { work(); });
+		}
+
+		// Runs the remaining tasks before returning
+		~keyed_executor() {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				stop = true;
+			}
+			cv.notify_all();
+			for (auto& t : workers) t.join();
+		}
+
+		keyed_executor(const keyed_executor&) = delete;
+		keyed_executor& operator=(const keyed_executor&) = delete;
+
+		void post(const std::string& key, std::function<void()> task) {
+			std::lock_guard<std::mutex> lck(mtx);
+			auto it = strands.find(key);
+			if (it == strands.end()) {
+				strands[key].tasks.push_back(std::move(task));
+				ready.push_back(key);
+				cv.notify_one();
+				return;
+			}
+			// Queued tasks have not started yet, a running one was already taken from the queue
+			if (latest_wins && !it->second.tasks.empty()) {
+				it->second.tasks.back() = std::move(task);
+				dropped++;
+				return;
+			}
+			// Either already in ready or put back there when the running task finishes
+			it->second.tasks.push_back(std::move(task));
+		}
+
+		// Blocks until every queued task has run
+		void wait_idle() {
+			std::unique_lock<std::mutex> lck(mtx);
+			idle_cv.wait(lck, [this]() { return strands.empty(); });
+		}
+
+		size_t size() {
+			std::lock_guard<std::mutex> lck(mtx);
+			size_t res = 0;
+			for (auto& e : strands) res += e.second.tasks.size();
+			return res;
+		}
+
+		// Tasks replaced by a newer one for the same key
+		uint64_t get_dropped() {
+			std::lock_guard<std::mutex> lck(mtx);
+			return dropped;
+		}
+
+		// Tasks that ended with an exception
+		uint64_t get_failed() {
+			std::lock_guard<std::mutex> lck(mtx);
+			return failed;
+		}
+	};
+}
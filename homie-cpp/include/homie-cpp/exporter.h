@@ -0,0 +1,370 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <ostream>
+#include <fstream>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstdint>
+#include <stdexcept>
+#include "master_event_handler.h"
+#include "node.h"
+#include "device.h"
+#include "intern.h"
+
+namespace homie {
+	enum class export_value_kind : uint8_t {
+		number,
+		boolean,
+		text
+	};
+
+	// Columnar batch of property value changes.
+	// Row i consists of timestamps[i], keys[i], kinds[i] and numbers[i] (number/boolean)
+	// or texts[text_index[i]] (text).
+	struct export_batch {
+		// Nanoseconds since epoch
+		std::vector<int64_t> timestamps;
+		// Interned "device/node/property", array nodes use "device/node_idx/property"
+		std::vector<uint32_t> keys;
+		std::vector<export_value_kind> kinds;
+		std::vector<double> numbers;
+		std::vector<uint32_t> text_index;
+		std::vector<std::string> texts;
+		const utils::interner* names = nullptr;
+
+		size_t size() const { return timestamps.size(); }
+		bool empty() const { return timestamps.empty(); }
+
+		void reserve(size_t n) {
+			timestamps.reserve(n);
+			keys.reserve(n);
+			kinds.reserve(n);
+			numbers.reserve(n);
+			text_index.reserve(n);
+		}
+
+		void clear() {
+			timestamps.clear();
+			keys.clear();
+			kinds.clear();
+			numbers.clear();
+			text_index.clear();
+			texts.clear();
+		}
+
+		const std::string& key_name(size_t row) const { return names->name(keys[row]); }
+	};
+
+	struct export_sink {
+		virtual void write(const export_batch& batch) = 0;
+		virtual void flush() = 0;
+	};
+
+	// Buffers property value changes into columnar batches and hands them to a sink
+	// once max_rows are buffered or the oldest buffered row is older than max_age.
+	// Register it on a master using subscribe(exporter, event_filter().only(event_kind::value)),
+	// events are expected from one thread at a time while flush() may be called from any thread.
+	class batch_exporter : public master_event_handler {
+		struct array_key {
+			const property* prop;
+			int64_t idx;
+			bool operator==(const array_key& o) const { return prop == o.prop && idx == o.idx; }
+		};
+		struct array_key_hash {
+			size_t operator()(const array_key& k) const { return std::hash<const void*>()(k.prop) ^ std::hash<int64_t>()(k.idx); }
+		};
+
+		// Interned keys by property address. The entry remembers which property it was built for,
+		// so a property allocated at the address of an erased one gets its own key.
+		template<typename Key, typename Hash = std::hash<Key>>
+		class key_cache {
+			struct entry {
+				std::weak_ptr<const property> prop;
+				uint32_t key;
+			};
+			std::unordered_map<Key, entry, Hash> entries;
+			// Entries of erased properties are dropped once the cache doubled since the last sweep
+			size_t sweep_at = 64;
+		public:
+			template<typename Fn>
+			uint32_t get(const Key& k, const const_property_ptr& prop, Fn&& make) {
+				auto it = entries.find(k);
+				if (it != entries.end() && !it->second.prop.owner_before(prop) && !prop.owner_before(it->second.prop))
+					return it->second.key;
+				auto key = make();
+				if (it != entries.end()) {
+					it->second = entry{ prop, key };
+					return key;
+				}
+				if (entries.size() >= sweep_at) {
+					for (auto e = entries.begin(); e != entries.end();) {
+						if (e->second.prop.expired()) e = entries.erase(e);
+						else e++;
+					}
+					sweep_at = std::max<size_t>(64, entries.size() * 2);
+				}
+				entries.insert({ k, entry{ prop, key } });
+				return key;
+			}
+		};
+
+		export_sink& sink;
+		size_t max_rows;
+		std::chrono::nanoseconds max_age;
+		utils::interner names;
+		// Only used by the thread delivering events
+		key_cache<const property*> keys;
+		key_cache<array_key, array_key_hash> array_keys;
+
+		std::mutex mtx;
+		export_batch current;
+		export_batch spare;
+		int64_t oldest;
+
+		std::mutex sink_mtx;
+		std::condition_variable cv;
+		bool exit;
+		std::thread timer;
+
+		static int64_t now() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		}
+
+		uint32_t make_key(const property& prop, const int64_t* idx) {
+			auto node = prop.get_node();
+			auto dev = node ? node->get_device() : nullptr;
+			std::string key = (dev ? dev->get_id() : std::string()) + "/" + (node ? node->get_id() : std::string());
+			if (idx) key += "_" + std::to_string(*idx);
+			key += "/" + prop.get_id();
+			return names.intern(key);
+		}
+
+		uint32_t key_for(const const_property_ptr& prop) {
+			return keys.get(prop.get(), prop, [&]() { return make_key(*prop, nullptr); });
+		}
+
+		uint32_t key_for(const const_property_ptr& prop, int64_t idx) {
+			return array_keys.get(array_key{ prop.get(), idx }, prop, [&]() { return make_key(*prop, &idx); });
+		}
+
+		void append(uint32_t key, const std::string& value) {
+			auto ts = now();
+			double num = 0;
+			export_value_kind kind = export_value_kind::text;
+			if (value == "true" || value == "false") {
+				kind = export_value_kind::boolean;
+				num = value == "true" ? 1 : 0;
+			}
+			// Never nan or inf, time series databases reject them
+			else if (utils::parse_double(value.data(), value.data() + value.size(), num)) kind = export_value_kind::number;
+			else num = 0;
+
+			std::unique_lock<std::mutex> lck(mtx);
+			if (current.empty()) oldest = ts;
+			current.timestamps.push_back(ts);
+			current.keys.push_back(key);
+			current.kinds.push_back(kind);
+			current.numbers.push_back(num);
+			if (kind == export_value_kind::text) {
+				current.text_index.push_back(static_cast<uint32_t>(current.texts.size()));
+				current.texts.push_back(value);
+			}
+			else current.text_index.push_back(0);
+
+			if (current.size() >= max_rows || ts - oldest >= max_age.count())
+				flush_locked(lck);
+		}
+
+		// Swaps out the current batch, producers only wait for the sink if another flush is still writing.
+		// sink_mtx is only ever taken while holding mtx and released before mtx is taken again.
+		void flush_locked(std::unique_lock<std::mutex>& lck) {
+			if (current.empty()) return;
+			std::unique_lock<std::mutex> slck(sink_mtx);
+			std::swap(current, spare);
+			current.clear();
+			current.reserve(max_rows);
+			lck.unlock();
+			sink.write(spare);
+			sink.flush();
+			slck.unlock();
+			lck.lock();
+		}
+	public:
+		// With use_timer set, a background thread also flushes batches that stop growing before max_age
+		batch_exporter(export_sink& s, size_t rows = 8192, std::chrono::milliseconds age = std::chrono::seconds(1), bool use_timer = false)
+			: sink(s), max_rows(rows == 0 ? 1 : rows), max_age(age), oldest(0), exit(false)
+		{
+			current.names = &names;
+			spare.names = &names;
+			current.reserve(max_rows);
+			if (use_timer) {
+				timer = std::thread([this]() {
+					std::unique_lock<std::mutex> lck(mtx);
+					while (!exit) {
+						cv.wait_for(lck, max_age);
+						if (!current.empty() && now() - oldest >= max_age.count())
+							flush_locked(lck);
+					}
+				});
+			}
+		}
+
+		~batch_exporter() {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				exit = true;
+			}
+			cv.notify_all();
+			if (timer.joinable()) timer.join();
+			flush();
+		}
+
+		void flush() {
+			std::unique_lock<std::mutex> lck(mtx);
+			flush_locked(lck);
+		}
+
+		const utils::interner& get_names() const { return names; }
+
+		// Inherited by master_event_handler
+		virtual void on_broadcast(const std::string& level, const std::string& payload) override {}
+		virtual void on_device_discovered(device_ptr dev) override {}
+		virtual void on_device_changed(device_ptr dev, const std::string& attribute) override {}
+		virtual void on_node_changed(node_ptr node, const std::string& attribute) override {}
+		virtual void on_node_changed(node_ptr node, int64_t idx, const std::string& attribute) override {}
+		virtual void on_property_changed(property_ptr prop, const std::string& attribute) override {}
+		virtual void on_property_changed(property_ptr prop, int64_t idx, const std::string& attribute) override {}
+		virtual void on_property_value_changed(property_ptr prop, const std::string& value) override {
+			append(key_for(prop), value);
+		}
+		virtual void on_property_value_changed(property_ptr prop, int64_t idx, const std::string& value) override {
+			append(key_for(prop, idx), value);
+		}
+	};
+
+	enum class export_format {
+		csv,
+		line_protocol
+	};
+
+	// Writes batches as CSV (timestamp,key,value) or InfluxDB line protocol to a stream.
+	// Numbers are written as float fields, also integral ones, so a property keeps one field type.
+	class stream_sink : public export_sink {
+		std::ostream& out;
+		export_format format;
+		std::string measurement;
+		// Line protocol series prefix per key id
+		std::vector<std::string> series;
+		std::string line;
+
+		static void escape_tag(std::string& out, const std::string& s) {
+			for (auto c : s) {
+				if (c == ',' || c == '=' || c == ' ' || c == '\\') out += '\\';
+				out += c;
+			}
+		}
+
+		static void append_number(std::string& out, double v) {
+			char buf[32];
+			auto len = std::snprintf(buf, sizeof(buf), "%.15g", v);
+			out.append(buf, len);
+		}
+
+		const std::string& series_for(const export_batch& b, size_t row) {
+			auto key = b.keys[row];
+			if (series.size() <= key) series.resize(key + 1);
+			auto& s = series[key];
+			if (s.empty()) {
+				const std::string& name = b.key_name(row);
+				auto p1 = name.find('/');
+				auto p2 = name.find('/', p1 + 1);
+				s = measurement + ",device=";
+				escape_tag(s, name.substr(0, p1));
+				s += ",node=";
+				escape_tag(s, name.substr(p1 + 1, p2 - p1 - 1));
+				s += ",property=";
+				escape_tag(s, name.substr(p2 + 1));
+				s += " value=";
+			}
+			return s;
+		}
+	public:
+		stream_sink(std::ostream& o, export_format fmt, std::string measurement_name = "homie")
+			: out(o), format(fmt), measurement(measurement_name)
+		{}
+
+		virtual void write(const export_batch& b) override {
+			for (size_t i = 0; i < b.size(); i++) {
+				line.clear();
+				if (format == export_format::csv) {
+					line += std::to_string(b.timestamps[i]);
+					line += ',';
+					line += b.key_name(i);
+					line += ',';
+					if (b.kinds[i] == export_value_kind::text) {
+						auto& t = b.texts[b.text_index[i]];
+						line += '"';
+						for (auto c : t) {
+							if (c == '"') line += '"';
+							line += c;
+						}
+						line += '"';
+					}
+					else if (b.kinds[i] == export_value_kind::boolean) line += b.numbers[i] != 0 ? "true" : "false";
+					else append_number(line, b.numbers[i]);
+				}
+				else {
+					if (b.kinds[i] == export_value_kind::number && !std::isfinite(b.numbers[i])) continue;
+					line += series_for(b, i);
+					if (b.kinds[i] == export_value_kind::text) {
+						line += '"';
+						for (auto c : b.texts[b.text_index[i]]) {
+							// A raw newline would end the line
+							if (c == '\n') {
+								line += "\\n";
+								continue;
+							}
+							if (c == '"' || c == '\\') line += '\\';
+							line += c;
+						}
+						line += '"';
+					}
+					else if (b.kinds[i] == export_value_kind::boolean) line += b.numbers[i] != 0 ? 't' : 'f';
+					else append_number(line, b.numbers[i]);
+					line += ' ';
+					line += std::to_string(b.timestamps[i]);
+				}
+				line += '\n';
+				out.write(line.data(), line.size());
+			}
+		}
+
+		virtual void flush() override {
+			out.flush();
+		}
+	};
+
+	// stream_sink appending to a local file
+	class file_sink : public export_sink {
+		std::ofstream file;
+		stream_sink stream;
+	public:
+		file_sink(const std::string& path, export_format fmt, std::string measurement_name = "homie")
+			: file(path, std::ios::out | std::ios::app | std::ios::binary), stream(file, fmt, measurement_name)
+		{
+			if (!file) throw std::runtime_error("failed to open " + path);
+		}
+
+		virtual void write(const export_batch& b) override { stream.write(b); }
+		virtual void flush() override { stream.flush(); }
+	};
+}
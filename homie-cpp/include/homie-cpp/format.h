@@ -0,0 +1,179 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include <algorithm>
+#include "datatype.h"
+#include "utils.h"
+
+namespace homie {
+	enum class color_model {
+		none,
+		rgb,
+		hsv
+	};
+
+	// Payload of a property converted according to its datatype
+	struct typed_value {
+		datatype type = datatype::string;
+		int64_t integer = 0;
+		double number = 0;
+		bool boolean = false;
+		// Index into the $format list for enum properties
+		size_t enum_index = 0;
+		color_model model = color_model::none;
+		int64_t color[3] = { 0, 0, 0 };
+	};
+
+	// $format of a property compiled once into a range, an enum lookup table or a color model.
+	class property_format {
+		datatype type;
+		bool has_min;
+		bool has_max;
+		double min;
+		double max;
+		int64_t imin;
+		int64_t imax;
+		color_model model;
+		// Enum values and a collision free hash table (seeded FNV-1a) over them
+		std::vector<std::string> values;
+		std::vector<int32_t> table;
+		uint32_t seed;
+		uint32_t mask;
+
+		static uint32_t hash(const char* s, size_t len, uint32_t seed) {
+			uint32_t h = 2166136261u ^ seed;
+			for (size_t i = 0; i < len; i++) {
+				h ^= static_cast<uint8_t>(s[i]);
+				h *= 16777619u;
+			}
+			return h ^ (h >> 15);
+		}
+
+		void build_enum(const std::string& format) {
+			values = utils::split<std::string>(format, ",");
+			size_t size = 1;
+			while (size < values.size() * 2) size <<= 1;
+			mask = static_cast<uint32_t>(size - 1);
+			// Search for a seed without collisions, this is a one time cost per property
+			for (seed = 0; seed < 4096; seed++) {
+				table.assign(size, -1);
+				bool ok = true;
+				for (size_t i = 0; i < values.size() && ok; i++) {
+					auto& slot = table[hash(values[i].data(), values[i].size(), seed) & mask];
+					if (slot == -1) slot = static_cast<int32_t>(i);
+					else ok = values[slot] == values[i];
+				}
+				if (ok) return;
+			}
+			// Pathological value sets fall back to a linear scan
+			table.clear();
+		}
+
+		bool find_enum(const std::string& payload, size_t& idx) const {
+			if (table.empty()) {
+				for (size_t i = 0; i < values.size(); i++) {
+					if (values[i] == payload) {
+						idx = i;
+						return true;
+					}
+				}
+				return false;
+			}
+			auto slot = table[hash(payload.data(), payload.size(), seed) & mask];
+			if (slot < 0 || values[slot] != payload) return false;
+			idx = static_cast<size_t>(slot);
+			return true;
+		}
+
+		bool parse_range(const std::string& format) {
+			auto pos = format.find(':');
+			if (pos == std::string::npos) return false;
+			auto b = format.c_str();
+			has_min = pos != 0;
+			has_max = pos != format.size() - 1;
+			if (type == datatype::integer) {
+				if (has_min && !utils::parse_int64(b, b + pos, imin)) return false;
+				if (has_max && !utils::parse_int64(b + pos + 1, b + format.size(), imax)) return false;
+			}
+			else {
+				if (has_min && !utils::parse_double(b, b + pos, min)) return false;
+				if (has_max && !utils::parse_double(b + pos + 1, b + format.size(), max)) return false;
+			}
+			return true;
+		}
+
+		bool parse_color(const std::string& payload, typed_value& out) const {
+			auto b = payload.c_str();
+			auto e = b + payload.size();
+			for (int i = 0; i < 3; i++) {
+				auto p = b;
+				while (p != e && *p != ',') p++;
+				if ((i < 2) == (p == e)) return false;
+				if (!utils::parse_int64(b, p, out.color[i]) || out.color[i] < 0) return false;
+				b = p == e ? e : p + 1;
+			}
+			if (model == color_model::rgb)
+				return out.color[0] <= 255 && out.color[1] <= 255 && out.color[2] <= 255;
+			return out.color[0] <= 360 && out.color[1] <= 100 && out.color[2] <= 100;
+		}
+	public:
+		property_format()
+			: type(datatype::string), has_min(false), has_max(false), min(0), max(0), imin(0), imax(0), model(color_model::none), seed(0), mask(0)
+		{}
+
+		// Unknown or malformed formats are ignored, the value is then only checked against the datatype
+		static property_format compile(datatype t, const std::string& format) {
+			property_format res;
+			res.type = t;
+			switch (t) {
+			case datatype::integer:
+			case datatype::number:
+				if (!res.parse_range(format)) res.has_min = res.has_max = false;
+				break;
+			case datatype::enumeration:
+				res.build_enum(format);
+				break;
+			case datatype::color:
+				if (format == "rgb") res.model = color_model::rgb;
+				else if (format == "hsv") res.model = color_model::hsv;
+				break;
+			default: break;
+			}
+			return res;
+		}
+
+		datatype get_datatype() const { return type; }
+
+		bool validate(const std::string& payload, typed_value& out) const {
+			out.type = type;
+			switch (type) {
+			case datatype::integer:
+				if (!utils::parse_int64(payload.data(), payload.data() + payload.size(), out.integer)) return false;
+				return (!has_min || out.integer >= imin) && (!has_max || out.integer <= imax);
+			case datatype::number:
+				if (!utils::parse_double(payload.data(), payload.data() + payload.size(), out.number)) return false;
+				return (!has_min || out.number >= min) && (!has_max || out.number <= max);
+			case datatype::boolean:
+				if (payload == "true") out.boolean = true;
+				else if (payload == "false") out.boolean = false;
+				else return false;
+				return true;
+			case datatype::enumeration:
+				return find_enum(payload, out.enum_index);
+			case datatype::color:
+				out.model = model;
+				return model == color_model::none || parse_color(payload, out);
+			default:
+				return true;
+			}
+		}
+
+		bool validate(const std::string& payload) const {
+			typed_value v;
+			return validate(payload, v);
+		}
+	};
+}
@@ -0,0 +1,203 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <limits>
+#include <algorithm>
+#include <memory>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cstdint>
+#include "utils.h"
+
+namespace homie {
+	struct history_aggregate {
+		size_t count = 0;
+		double min = std::numeric_limits<double>::quiet_NaN();
+		double max = std::numeric_limits<double>::quiet_NaN();
+		double avg = std::numeric_limits<double>::quiet_NaN();
+	};
+
+	// Fixed size ring buffer of time stamped property values.
+	// Numeric properties store doubles, everything else stores the raw payload.
+	// Columns are kept separately (timestamps, values) so aggregates run over plain arrays.
+	class value_history {
+	public:
+		typedef std::chrono::system_clock clock;
+	private:
+		mutable std::mutex mtx;
+		size_t cap;
+		size_t head;
+		size_t count;
+		bool numeric;
+		std::vector<int64_t> timestamps;
+		std::vector<double> numbers;
+		std::vector<std::string> strings;
+
+		static int64_t to_ticks(clock::time_point tp) {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count();
+		}
+		static clock::time_point from_ticks(int64_t t) {
+			return clock::time_point(std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds(t)));
+		}
+
+		// Physical index of the i-th oldest sample
+		size_t slot(size_t i) const {
+			return (head + cap - count + i) % cap;
+		}
+
+		// Logical index of the first sample with timestamp >= t, samples are sorted by time
+		size_t lower_bound(int64_t t) const {
+			size_t lo = 0, hi = count;
+			while (lo < hi) {
+				auto mid = lo + (hi - lo) / 2;
+				if (timestamps[slot(mid)] < t) lo = mid + 1;
+				else hi = mid;
+			}
+			return lo;
+		}
+
+		// Four independent accumulators, which lets the compiler keep them in one vector register
+		static void aggregate_span(const double* v, size_t n, double& mn, double& mx, double& sum) {
+			double lmin[4] = { mn, mn, mn, mn };
+			double lmax[4] = { mx, mx, mx, mx };
+			double lsum[4] = { 0, 0, 0, 0 };
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				for (size_t l = 0; l < 4; l++) {
+					lmin[l] = v[i + l] < lmin[l] ? v[i + l] : lmin[l];
+					lmax[l] = v[i + l] > lmax[l] ? v[i + l] : lmax[l];
+					lsum[l] += v[i + l];
+				}
+			}
+			for (; i < n; i++) {
+				lmin[0] = v[i] < lmin[0] ? v[i] : lmin[0];
+				lmax[0] = v[i] > lmax[0] ? v[i] : lmax[0];
+				lsum[0] += v[i];
+			}
+			mn = std::min(std::min(lmin[0], lmin[1]), std::min(lmin[2], lmin[3]));
+			mx = std::max(std::max(lmax[0], lmax[1]), std::max(lmax[2], lmax[3]));
+			sum += (lsum[0] + lsum[1]) + (lsum[2] + lsum[3]);
+		}
+
+		// Non finite values would poison sum and avg for the whole retention window
+		static bool parse(const std::string& value, double& num) {
+			return utils::parse_double(value.data(), value.data() + value.size(), num) && std::isfinite(num);
+		}
+
+		// Shortest text that parses back to the same number, "21.5" instead of "21.500000"
+		static std::string format(double num) {
+			char buf[32];
+			std::snprintf(buf, sizeof(buf), "%.15g", num);
+			if (std::strtod(buf, nullptr) != num) std::snprintf(buf, sizeof(buf), "%.17g", num);
+			return buf;
+		}
+	public:
+		value_history(size_t capacity, bool is_numeric)
+			: cap(capacity == 0 ? 1 : capacity), head(0), count(0), numeric(is_numeric), timestamps(cap)
+		{
+			if (numeric) numbers.resize(cap);
+			else strings.resize(cap);
+		}
+
+		// Approximate memory used by a buffer, not counting heap storage of string values
+		static size_t footprint(size_t capacity, bool is_numeric) {
+			return sizeof(value_history) + capacity * (sizeof(int64_t) + (is_numeric ? sizeof(double) : sizeof(std::string)));
+		}
+
+		bool is_numeric() const { return numeric; }
+		size_t capacity() const { return cap; }
+		size_t size() const {
+			std::lock_guard<std::mutex> lck(mtx);
+			return count;
+		}
+
+		// Numeric buffers silently skip values that do not parse as a number
+		void push(clock::time_point tp, const std::string& value) {
+			double num = 0;
+			if (numeric && !parse(value, num)) return;
+			std::lock_guard<std::mutex> lck(mtx);
+			auto t = to_ticks(tp);
+			// Keep timestamps sorted even if the wall clock jumps backwards
+			if (count != 0 && t < timestamps[slot(count - 1)]) t = timestamps[slot(count - 1)];
+			timestamps[head] = t;
+			if (numeric) numbers[head] = num;
+			else strings[head] = value;
+			head = (head + 1) % cap;
+			if (count < cap) count++;
+		}
+
+		// Buffer of the same capacity holding the samples as numbers or strings, samples that are no number are skipped
+		std::shared_ptr<value_history> convert(bool is_numeric) const {
+			auto res = std::make_shared<value_history>(cap, is_numeric);
+			std::lock_guard<std::mutex> lck(mtx);
+			for (size_t i = 0; i < count; i++) {
+				auto s = slot(i);
+				double num = 0;
+				if (is_numeric) {
+					if (numeric) num = numbers[s];
+					else if (!parse(strings[s], num)) continue;
+				}
+				auto h = res->head;
+				res->timestamps[h] = timestamps[s];
+				if (is_numeric) res->numbers[h] = num;
+				else res->strings[h] = numeric ? format(numbers[s]) : strings[s];
+				res->head = (h + 1) % res->cap;
+				res->count++;
+			}
+			return res;
+		}
+
+		// Visit samples in [from, to) oldest first
+		void for_each_value(clock::time_point from, clock::time_point to, utils::function_ref<void(clock::time_point, const std::string&)> fn) const {
+			std::lock_guard<std::mutex> lck(mtx);
+			auto end = lower_bound(to_ticks(to));
+			for (auto i = lower_bound(to_ticks(from)); i < end; i++) {
+				auto s = slot(i);
+				if (numeric) {
+					auto str = format(numbers[s]);
+					fn(from_ticks(timestamps[s]), str);
+				}
+				else fn(from_ticks(timestamps[s]), strings[s]);
+			}
+		}
+
+		// Same as for_each_value but without formatting, does nothing for non numeric buffers
+		void for_each_number(clock::time_point from, clock::time_point to, utils::function_ref<void(clock::time_point, double)> fn) const {
+			std::lock_guard<std::mutex> lck(mtx);
+			if (!numeric) return;
+			auto end = lower_bound(to_ticks(to));
+			for (auto i = lower_bound(to_ticks(from)); i < end; i++) {
+				auto s = slot(i);
+				fn(from_ticks(timestamps[s]), numbers[s]);
+			}
+		}
+
+		// min/max/avg over samples in [from, to), count is 0 for non numeric buffers
+		history_aggregate aggregate(clock::time_point from, clock::time_point to) const {
+			std::lock_guard<std::mutex> lck(mtx);
+			history_aggregate res;
+			if (!numeric) return res;
+			auto first = lower_bound(to_ticks(from));
+			auto last = lower_bound(to_ticks(to));
+			if (first >= last) return res;
+
+			double mn = std::numeric_limits<double>::infinity();
+			double mx = -std::numeric_limits<double>::infinity();
+			double sum = 0;
+			// The logical range maps to at most two contiguous spans of the ring
+			auto begin = slot(first);
+			auto n = last - first;
+			auto n1 = std::min(n, cap - begin);
+			aggregate_span(numbers.data() + begin, n1, mn, mx, sum);
+			if (n > n1) aggregate_span(numbers.data(), n - n1, mn, mx, sum);
+			res.count = n;
+			res.min = mn;
+			res.max = mx;
+			res.avg = sum / n;
+			return res;
+		}
+	};
+}
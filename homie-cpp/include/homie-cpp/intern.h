@@ -0,0 +1,122 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+#include <algorithm>
+
+namespace homie {
+	namespace utils {
+		// Maps strings to small, stable integer ids.
+		// Ids are never released, so they can be cached by the caller and compared instead of strings.
+		class interner {
+			mutable std::mutex mtx;
+			std::deque<std::string> names;
+			std::unordered_map<std::string, uint32_t> ids;
+		public:
+			enum : uint32_t { invalid = UINT32_MAX };
+
+			uint32_t intern(const std::string& s) {
+				std::lock_guard<std::mutex> lck(mtx);
+				auto it = ids.find(s);
+				if (it != ids.end()) return it->second;
+				auto id = static_cast<uint32_t>(names.size());
+				names.push_back(s);
+				ids.insert({ s, id });
+				return id;
+			}
+
+			// Returns invalid if the string was never interned
+			uint32_t find(const std::string& s) const {
+				std::lock_guard<std::mutex> lck(mtx);
+				auto it = ids.find(s);
+				return it != ids.end() ? it->second : invalid;
+			}
+
+			// References stay valid for the lifetime of the interner
+			const std::string& name(uint32_t id) const {
+				std::lock_guard<std::mutex> lck(mtx);
+				return names.at(id);
+			}
+
+			size_t size() const {
+				std::lock_guard<std::mutex> lck(mtx);
+				return names.size();
+			}
+		};
+
+		typedef std::map<std::string, std::string> attribute_map;
+		typedef std::shared_ptr<const attribute_map> attribute_set;
+
+		// Hash consing of attribute maps: equal maps are stored once and shared by every owner.
+		// Sets are immutable, changing an attribute yields another shared set. Sets nobody
+		// references any more are swept once the table doubled since the last sweep.
+		class attribute_pool {
+			mutable std::mutex mtx;
+			std::unordered_multimap<size_t, std::weak_ptr<const attribute_map>> sets;
+			attribute_set empty_set;
+			size_t sweep_at;
+
+			static size_t hash(const attribute_map& m) {
+				std::hash<std::string> h;
+				size_t res = m.size();
+				for (auto& e : m) {
+					res = res * 31 + h(e.first);
+					res = res * 31 + h(e.second);
+				}
+				return res;
+			}
+
+			void sweep() {
+				for (auto it = sets.begin(); it != sets.end();) {
+					if (it->second.expired()) it = sets.erase(it);
+					else it++;
+				}
+				sweep_at = std::max<size_t>(64, sets.size() * 2);
+			}
+		public:
+			attribute_pool()
+				: empty_set(std::make_shared<const attribute_map>()), sweep_at(64)
+			{}
+
+			attribute_set empty() const { return empty_set; }
+
+			attribute_set intern(attribute_map&& m) {
+				if (m.empty()) return empty_set;
+				auto h = hash(m);
+				std::lock_guard<std::mutex> lck(mtx);
+				auto range = sets.equal_range(h);
+				for (auto it = range.first; it != range.second; it++) {
+					auto existing = it->second.lock();
+					if (existing && *existing == m) return existing;
+				}
+				if (sets.size() >= sweep_at) sweep();
+				auto res = std::make_shared<const attribute_map>(std::move(m));
+				sets.insert({ h, res });
+				return res;
+			}
+
+			// The set with key changed to value
+			attribute_set with(const attribute_set& base, const std::string& key, const std::string& value) {
+				auto it = base->find(key);
+				if (it != base->end() && it->second == value) return base;
+				attribute_map m(*base);
+				m[key] = value;
+				return intern(std::move(m));
+			}
+
+			// Distinct sets still referenced
+			size_t size() const {
+				std::lock_guard<std::mutex> lck(mtx);
+				size_t res = 0;
+				for (auto& e : sets) if (!e.second.expired()) res++;
+				return res;
+			}
+		};
+	}
+}
@@ -0,0 +1,300 @@
+#pragma once
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include "utils.h"
+
+namespace homie {
+	namespace json {
+		// Single pass reader over a JSON document without building a DOM.
+		// Objects are visited member by member, the callback has to consume the member value.
+		// All functions return false on malformed input, the reader then stays in the failed state.
+		class reader {
+			const char* p;
+			const char* end;
+			bool failed;
+			int depth;
+
+			enum : int { max_depth = 64 };
+
+			static bool is_ws(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+			void skip_ws() {
+				while (p != end && is_ws(*p)) p++;
+			}
+
+			bool fail() {
+				failed = true;
+				return false;
+			}
+
+			bool expect(char c) {
+				skip_ws();
+				if (p == end || *p != c) return fail();
+				p++;
+				return true;
+			}
+
+			// Finds the next '"', '\\' or control character, eight bytes at a time
+			static const char* find_special(const char* s, const char* e) {
+				const uint64_t ones = 0x0101010101010101ull;
+				const uint64_t highs = 0x8080808080808080ull;
+				while (e - s >= 8) {
+					uint64_t w;
+					std::memcpy(&w, s, 8);
+					uint64_t q = w ^ (ones * '"');
+					uint64_t b = w ^ (ones * '\\');
+					// Bytes that are zero after the xor, or smaller than 0x20
+					uint64_t m = ((q - ones) & ~q) | ((b - ones) & ~b) | ((w - ones * 0x20) & ~w);
+					if (m & highs) break;
+					s += 8;
+				}
+				while (s != e && *s != '"' && *s != '\\' && static_cast<unsigned char>(*s) >= 0x20) s++;
+				return s;
+			}
+
+			static void append_utf8(std::string& out, uint32_t cp) {
+				if (cp < 0x80) out += static_cast<char>(cp);
+				else if (cp < 0x800) {
+					out += static_cast<char>(0xC0 | (cp >> 6));
+					out += static_cast<char>(0x80 | (cp & 0x3F));
+				}
+				else if (cp < 0x10000) {
+					out += static_cast<char>(0xE0 | (cp >> 12));
+					out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+					out += static_cast<char>(0x80 | (cp & 0x3F));
+				}
+				else {
+					out += static_cast<char>(0xF0 | (cp >> 18));
+					out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+					out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+					out += static_cast<char>(0x80 | (cp & 0x3F));
+				}
+			}
+
+			bool hex4(uint32_t& out) {
+				if (end - p < 4) return fail();
+				out = 0;
+				for (int i = 0; i < 4; i++) {
+					char c = *p++;
+					out <<= 4;
+					if (c >= '0' && c <= '9') out |= c - '0';
+					else if (c >= 'a' && c <= 'f') out |= c - 'a' + 10;
+					else if (c >= 'A' && c <= 'F') out |= c - 'A' + 10;
+					else return fail();
+				}
+				return true;
+			}
+
+			bool literal(const char* lit) {
+				auto len = std::strlen(lit);
+				if (static_cast<size_t>(end - p) < len || std::memcmp(p, lit, len) != 0) return fail();
+				p += len;
+				return true;
+			}
+
+			bool number(std::string* out) {
+				auto start = p;
+				if (p != end && *p == '-') p++;
+				if (p == end || *p < '0' || *p > '9') return fail();
+				while (p != end && ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E' || *p == '+' || *p == '-')) p++;
+				if (out) out->assign(start, p);
+				return true;
+			}
+
+			bool value(std::string* out) {
+				skip_ws();
+				if (p == end) return fail();
+				switch (*p) {
+				case '"': {
+					std::string tmp;
+					return string(out ? *out : tmp);
+				}
+				case '{': return object([this](const std::string&) { return skip(); });
+				case '[': return array([this]() { return skip(); });
+				case 't': if (!literal("true")) return false; if (out) *out = "true"; return true;
+				case 'f': if (!literal("false")) return false; if (out) *out = "false"; return true;
+				case 'n': if (!literal("null")) return false; if (out) out->clear(); return true;
+				default: return number(out);
+				}
+			}
+		public:
+			reader(const char* begin, const char* e)
+				: p(begin), end(e), failed(false), depth(0)
+			{}
+			explicit reader(const std::string& doc)
+				: reader(doc.data(), doc.data() + doc.size())
+			{}
+
+			bool ok() const { return !failed; }
+
+			// True if only whitespace is left
+			bool at_end() {
+				skip_ws();
+				return p == end;
+			}
+
+			bool string(std::string& out) {
+				if (failed || !expect('"')) return false;
+				out.clear();
+				while (true) {
+					auto s = find_special(p, end);
+					out.append(p, s);
+					p = s;
+					if (p == end || static_cast<unsigned char>(*p) < 0x20) return fail();
+					if (*p == '"') {
+						p++;
+						return true;
+					}
+					// Escape sequence
+					if (++p == end) return fail();
+					char c = *p++;
+					switch (c) {
+					case '"': out += '"'; break;
+					case '\\': out += '\\'; break;
+					case '/': out += '/'; break;
+					case 'b': out += '\b'; break;
+					case 'f': out += '\f'; break;
+					case 'n': out += '\n'; break;
+					case 'r': out += '\r'; break;
+					case 't': out += '\t'; break;
+					case 'u': {
+						uint32_t cp;
+						if (!hex4(cp)) return false;
+						if (cp >= 0xD800 && cp < 0xDC00) {
+							uint32_t low;
+							if (end - p < 2 || p[0] != '\\' || p[1] != 'u') return fail();
+							p += 2;
+							if (!hex4(low) || low < 0xDC00 || low >= 0xE000) return fail();
+							cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+						}
+						append_utf8(out, cp);
+						break;
+					}
+					default: return fail();
+					}
+				}
+			}
+
+			// True if the next value is an object or an array
+			bool at_container() {
+				skip_ws();
+				return p != end && (*p == '{' || *p == '[');
+			}
+
+			// Reads a string, number or literal as text (booleans become "true"/"false", null becomes "")
+			bool scalar(std::string& out) {
+				if (failed) return false;
+				skip_ws();
+				if (p != end && (*p == '{' || *p == '[')) return fail();
+				return value(&out);
+			}
+
+			bool skip() {
+				if (failed) return false;
+				return value(nullptr);
+			}
+
+			bool object(utils::function_ref<bool(const std::string& key)> member) {
+				if (failed || !expect('{')) return false;
+				if (++depth > max_depth) return fail();
+				skip_ws();
+				if (p != end && *p == '}') {
+					p++;
+					depth--;
+					return true;
+				}
+				std::string key;
+				while (true) {
+					if (!string(key) || !expect(':')) return false;
+					if (!member(key) || failed) return fail();
+					skip_ws();
+					if (p == end) return fail();
+					if (*p == ',') {
+						p++;
+						continue;
+					}
+					if (*p != '}') return fail();
+					p++;
+					depth--;
+					return true;
+				}
+			}
+
+			bool array(utils::function_ref<bool()> element) {
+				if (failed || !expect('[')) return false;
+				if (++depth > max_depth) return fail();
+				skip_ws();
+				if (p != end && *p == ']') {
+					p++;
+					depth--;
+					return true;
+				}
+				while (true) {
+					if (!element() || failed) return fail();
+					skip_ws();
+					if (p == end) return fail();
+					if (*p == ',') {
+						p++;
+						continue;
+					}
+					if (*p != ']') return fail();
+					p++;
+					depth--;
+					return true;
+				}
+			}
+		};
+
+		// Appends JSON to a string
+		class writer {
+			std::string& out;
+			bool first;
+		public:
+			explicit writer(std::string& o)
+				: out(o), first(true)
+			{}
+
+			static void escape(std::string& out, const std::string& s) {
+				out += '"';
+				for (auto c : s) {
+					switch (c) {
+					case '"': out += "\\\""; break;
+					case '\\': out += "\\\\"; break;
+					case '\n': out += "\\n"; break;
+					case '\r': out += "\\r"; break;
+					case '\t': out += "\\t"; break;
+					default:
+						if (static_cast<unsigned char>(c) < 0x20) {
+							char buf[8];
+							std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned char>(c));
+							out += buf;
+						}
+						else out += c;
+					}
+				}
+				out += '"';
+			}
+
+			writer& begin_object() { separator(); out += '{'; first = true; return *this; }
+			writer& end_object() { out += '}'; first = false; return *this; }
+			writer& key(const std::string& k) {
+				separator();
+				escape(out, k);
+				out += ':';
+				first = true;
+				return *this;
+			}
+			writer& value(const std::string& v) { separator(); escape(out, v); return *this; }
+			writer& value(const char* v) { return value(std::string(v)); }
+			writer& value(bool v) { separator(); out += v ? "true" : "false"; return *this; }
+			writer& value(int64_t v) { separator(); out += std::to_string(v); return *this; }
+		private:
+			void separator() {
+				if (!first) out += ',';
+				first = false;
+			}
+		};
+	}
+}
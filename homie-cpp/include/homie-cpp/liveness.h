@@ -0,0 +1,130 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+namespace homie {
+	// Deadlines per key in a hierarchical timing wheel (four levels of 256 slots).
+	// Moving a deadline only updates the entry, its slot is fixed when the old deadline comes up,
+	// so touching a key on every message is O(1) and does not grow the wheel.
+	template<typename Key, typename Hash = std::hash<Key>>
+	class timing_wheel {
+	public:
+		typedef std::chrono::steady_clock clock;
+	private:
+		enum : uint64_t { bits = 8, slots = 1 << bits, levels = 4 };
+
+		struct entry {
+			uint64_t deadline;
+			// Tick of the slot element currently representing the entry
+			uint64_t placed;
+		};
+		struct slot_entry {
+			Key key;
+			uint64_t placed;
+		};
+
+		std::unordered_map<Key, entry, Hash> entries;
+		std::array<std::array<std::vector<slot_entry>, slots>, levels> wheel;
+		clock::duration resolution;
+		clock::time_point origin;
+		// Next tick to process
+		uint64_t current;
+
+		uint64_t tick_of(clock::time_point t) const {
+			return t <= origin ? 0 : static_cast<uint64_t>((t - origin) / resolution);
+		}
+
+		void push(const Key& k, uint64_t placed) {
+			auto delta = placed - current;
+			size_t level = 0;
+			while (level + 1 < levels && delta >= (uint64_t(1) << (bits * (level + 1)))) level++;
+			wheel[level][(placed >> (bits * level)) & (slots - 1)].push_back({ k, placed });
+		}
+
+		void place(const Key& k, entry& e) {
+			e.placed = std::max(e.deadline, current);
+			// Beyond the last level the entry is parked in the furthest slot and placed again when it comes up
+			e.placed = std::min(e.placed, current + (uint64_t(1) << (bits * levels)) - 1);
+			push(k, e.placed);
+		}
+
+		bool valid(const slot_entry& s, typename std::unordered_map<Key, entry, Hash>::iterator it) const {
+			return it != entries.end() && it->second.placed == s.placed;
+		}
+
+		// Moves the entries of a higher level slot down, they are due within its range
+		void cascade(size_t level, size_t idx) {
+			std::vector<slot_entry> list;
+			list.swap(wheel[level][idx]);
+			for (auto& s : list) {
+				if (valid(s, entries.find(s.key))) push(s.key, s.placed);
+			}
+		}
+	public:
+		explicit timing_wheel(clock::duration tick = std::chrono::seconds(1), clock::time_point start = clock::now())
+			: resolution(std::max<clock::duration>(tick, std::chrono::milliseconds(1))), origin(start), current(tick_of(start))
+		{}
+
+		// Sets (or moves) the deadline of k to now + timeout
+		void touch(const Key& k, clock::duration timeout, clock::time_point now = clock::now()) {
+			// Round up, a key never expires early
+			auto deadline = tick_of(now + timeout) + 1;
+			auto it = entries.find(k);
+			if (it == entries.end()) it = entries.insert({ k, entry{ deadline, 0 } }).first;
+			else {
+				it->second.deadline = deadline;
+				// A later deadline is picked up when the current slot comes up
+				if (deadline >= it->second.placed) return;
+			}
+			place(k, it->second);
+		}
+
+		void remove(const Key& k) {
+			// Slots skip keys without an entry
+			entries.erase(k);
+		}
+
+		bool contains(const Key& k) const { return entries.count(k) != 0; }
+
+		size_t size() const { return entries.size(); }
+
+		// Processes every tick up to now and calls fn for keys whose deadline passed, they are removed before the call
+		template<typename Fn>
+		void advance(clock::time_point now, Fn&& fn) {
+			auto target = tick_of(now);
+			if (entries.empty()) {
+				for (auto& level : wheel) for (auto& slot : level) slot.clear();
+				current = std::max(current, target + 1);
+				return;
+			}
+			std::vector<Key> expired;
+			for (; current <= target && !entries.empty(); current++) {
+				auto t = current;
+				// A level cascades when all levels below it wrapped around
+				for (size_t level = 1; level < levels; level++) {
+					auto shift = bits * level;
+					if ((t & ((uint64_t(1) << shift) - 1)) != 0) break;
+					cascade(level, (t >> shift) & (slots - 1));
+				}
+				std::vector<slot_entry> list;
+				list.swap(wheel[0][t & (slots - 1)]);
+				for (auto& s : list) {
+					auto it = entries.find(s.key);
+					if (!valid(s, it)) continue;
+					if (it->second.deadline <= t) {
+						entries.erase(it);
+						expired.push_back(s.key);
+					}
+					else place(s.key, it->second);
+				}
+			}
+			current = std::max(current, target + 1);
+			for (auto& k : expired) fn(k);
+		}
+	};
+}
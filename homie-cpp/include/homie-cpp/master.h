@@ -3,23 +3,78 @@
 #include "device.h"
 #include "utils.h"
 #include "master_event_handler.h"
+#include "subscription.h"
+#include "intern.h"
+#include "history.h"
+#include "protocol_version.h"
+#include "json.h"
+#include "snapshot.h"
+#include "broadcast.h"
+#include "outbox.h"
+#include "stats.h"
+#include "set_tracker.h"
+#include "coalescer.h"
+#include "rules.h"
+#include "aggregate.h"
+#include "liveness.h"
+#include "quarantine.h"
 #include <set>
+#include <algorithm>
 #include <map>
+#include <mutex>
+#include <atomic>
 
 namespace homie {
+	enum class set_status {
+		published,
+		// The transport failed to publish the message
+		failed,
+		// The property was not discovered by this master
+		unknown_property
+	};
+
+	// One entry of master::set_values, index is only used for array nodes
+	struct set_request {
+		const_property_ptr property;
+		bool has_index;
+		int64_t index;
+		std::string value;
+
+		set_request(const_property_ptr prop, std::string val)
+			: property(std::move(prop)), has_index(false), index(0), value(std::move(val))
+		{}
+		set_request(const_property_ptr prop, int64_t idx, std::string val)
+			: property(std::move(prop)), has_index(true), index(idx), value(std::move(val))
+		{}
+	};
+
 	class master : private mqtt_event_handler {
 		struct remote_property : public homie::basic_property, public std::enable_shared_from_this<remote_property> {
 			master* parent;
 			std::string value;
 			std::map<int64_t, std::string> value_array;
 			std::string id;
-			std::map<std::string, std::string> attributes;
+			// Shared with every property that has the same attributes
+			utils::attribute_set attributes;
 			std::weak_ptr<homie::node> node;
+			uint32_t key;
+			uint32_t datatypes;
+			// "<base>/<device>/<node>", set topics are built from it without locking node and device
+			std::string node_topic;
+			std::string set_topic;
+			// Guarded by master::history_mtx
+			std::shared_ptr<value_history> history;
+			std::map<int64_t, std::shared_ptr<value_history>> history_array;
 
-			remote_property(master* p, std::weak_ptr<homie::node> ptr, const std::string& mid)
-				: parent(p), node(ptr), id(mid)
+			remote_property(master* p, std::weak_ptr<homie::node> ptr, const std::string& mid, const std::string& prefix)
+				: parent(p), id(mid), attributes(p->attribute_sets.empty()), node(ptr), key(p->ids.intern(mid)), datatypes(datatype_bit(datatype::string)),
+				node_topic(prefix), set_topic(prefix + "/" + mid + "/set")
 			{ }
 
+			std::string get_set_topic(int64_t idx) const {
+				return node_topic + "_" + std::to_string(idx) + "/" + id + "/set";
+			}
+
 			virtual node_ptr get_node() { return node.lock(); }
 			virtual const_node_ptr get_node() const { return node.lock(); }
 
@@ -32,35 +87,54 @@ namespace homie {
 			virtual std::string get_value() const { return value; }
 			virtual void set_value(const std::string& value) { parent->publish_set_property(this, value); }
 
+			void update_datatypes() {
+				auto value = get_attribute("datatype");
+				datatype type;
+				datatypes = try_enum_from_string(value.empty() ? "string" : value, type) ? datatype_bit(type) : 0;
+			}
+
+			// Replaces all attributes at once
+			void assign_attributes(utils::attribute_map&& attrs) {
+				attributes = parent->attribute_sets.intern(std::move(attrs));
+				update_datatypes();
+			}
+
 			virtual std::set<std::string> get_attributes() const override {
 				std::set<std::string> res;
-				for (auto& e : attributes) res.insert(e.first);
+				for (auto& e : *attributes) res.insert(e.first);
 				return res;
 			}
 			virtual std::string get_attribute(const std::string& id) const override {
-				auto it = attributes.find(id);
-				if (it != attributes.cend()) return it->second;
+				auto it = attributes->find(id);
+				if (it != attributes->cend()) return it->second;
 				return "";
 			}
 			virtual void set_attribute(const std::string& id, const std::string& value) override {
-				attributes[id] = value;
+				attributes = parent->attribute_sets.with(attributes, id, value);
+				if (id == "datatype") update_datatypes();
+			}
+			virtual void for_each_attribute(attribute_visitor fn) const override {
+				for (auto& e : *attributes) fn(e.first, e.second);
 			}
 		};
 		struct remote_node : public homie::basic_node, public std::enable_shared_from_this<remote_node> {
 			master* parent;
 			std::string id;
 			std::map<std::string, std::shared_ptr<remote_property>> properties;
-			std::map<std::string, std::string> attributes;
+			// Shared with every node that has the same attributes
+			utils::attribute_set attributes;
 			std::map<std::pair<int64_t, std::string>, std::string> attributes_array;
 			std::weak_ptr<homie::device> device;
+			uint32_t key;
+			std::string topic;
 
-			remote_node(master* p, std::weak_ptr<homie::device> dev, const std::string& mid)
-				: parent(p), id(mid), device(dev)
+			remote_node(master* p, std::weak_ptr<homie::device> dev, const std::string& mid, const std::string& device_topic)
+				: parent(p), id(mid), attributes(p->attribute_sets.empty()), device(dev), key(p->ids.intern(mid)), topic(device_topic + mid)
 			{}
 
 			std::shared_ptr<remote_property> get_add_property(const std::string& id) {
 				if (properties.count(id)) return properties.at(id);
-				auto prop = std::make_shared<remote_property>(parent, this->shared_from_this(), id);
+				auto prop = std::make_shared<remote_property>(parent, this->shared_from_this(), id, topic);
 				properties.insert({ id, prop });
 				return prop;
 			}
@@ -93,7 +167,7 @@ namespace homie {
 
 			virtual std::set<std::string> get_attributes() const override {
 				std::set<std::string> res;
-				for (auto& e : attributes) res.insert(e.first);
+				for (auto& e : *attributes) res.insert(e.first);
 				return res;
 			}
 			virtual std::set<std::string> get_attributes(int64_t idx) const override {
@@ -104,12 +178,12 @@ namespace homie {
 				return res;
 			}
 			virtual std::string get_attribute(const std::string& id) const override {
-				auto it = attributes.find(id);
-				if (it != attributes.cend()) return it->second;
+				auto it = attributes->find(id);
+				if (it != attributes->cend()) return it->second;
 				return "";
 			}
 			virtual void set_attribute(const std::string& id, const std::string& value) override {
-				attributes[id] = value;
+				attributes = parent->attribute_sets.with(attributes, id, value);
 			}
 			virtual std::string get_attribute(const std::string& id, int64_t idx) const override {
 				auto it = attributes_array.find({ idx, id });
@@ -119,20 +193,45 @@ namespace homie {
 			virtual void set_attribute(const std::string& id, const std::string& value, int64_t idx) override {
 				attributes_array[{idx, id}] = value;
 			}
+			virtual void for_each_property(property_visitor fn) override {
+				for (auto& e : properties) fn(e.first, *e.second);
+			}
+			virtual void for_each_property(const_property_visitor fn) const override {
+				for (auto& e : properties) fn(e.first, *e.second);
+			}
+			virtual void for_each_attribute(attribute_visitor fn) const override {
+				for (auto& e : *attributes) fn(e.first, e.second);
+			}
+			virtual void for_each_attribute(int64_t idx, attribute_visitor fn) const override {
+				// Keys are ordered by index first, so all attributes of one index are adjacent
+				for (auto it = attributes_array.lower_bound({ idx, std::string() }); it != attributes_array.cend() && it->first.first == idx; it++)
+					fn(it->first.second, it->second);
+			}
 		};
+		struct remote_device;
+		// Handles topics below a device that are not device attributes, selected per device from $homie
+		typedef void (master::*topic_parser)(const std::shared_ptr<remote_device>& dev, const std::vector<std::string>& parts, const std::string& payload);
+
 		struct remote_device : public homie::basic_device, public std::enable_shared_from_this<remote_device> {
 			master* parent;
 			std::string id;
 			std::map<std::string, std::shared_ptr<remote_node>> nodes;
 			std::map<std::string, std::string> attributes;
+			uint32_t key;
+			protocol_version version;
+			topic_parser parser;
+			// Time the device went lost, unset while it is in any other state
+			std::chrono::system_clock::time_point lost_since;
+			// State before liveness tracking declared the device lost, empty while it is alive
+			std::string presumed_state;
 
 			remote_device(master* p, const std::string& mid)
-				: parent(p), id(mid)
+				: parent(p), id(mid), key(p->ids.intern(mid)), version(protocol_version::v3), parser(&master::parse_v3)
 			{}
 
 			std::shared_ptr<remote_node> get_add_node(const std::string& id) {
 				if (nodes.count(id)) return nodes.at(id);
-				auto node = std::make_shared<remote_node>(parent, this->shared_from_this(), id);
+				auto node = std::make_shared<remote_node>(parent, this->shared_from_this(), id, parent->base_topic + this->id + "/");
 				nodes.insert({ id, node });
 				return node;
 			}
@@ -166,13 +265,104 @@ namespace homie {
 			}
 			virtual void set_attribute(const std::string& id, const std::string& value) {
 				attributes[id] = value;
+				if (id == "state") {
+					if (value != "lost") lost_since = std::chrono::system_clock::time_point();
+					else if (lost_since == std::chrono::system_clock::time_point()) lost_since = std::chrono::system_clock::now();
+				}
+			}
+			virtual void for_each_node(node_visitor fn) override {
+				for (auto& e : nodes) fn(e.first, *e.second);
+			}
+			virtual void for_each_node(const_node_visitor fn) const override {
+				for (auto& e : nodes) fn(e.first, *e.second);
+			}
+			virtual void for_each_attribute(attribute_visitor fn) const override {
+				for (auto& e : attributes) fn(e.first, e.second);
 			}
 		};
 
 		mqtt_client& mqtt;
 		master_event_handler* handler;
 		std::string base_topic;
+		utils::interner ids;
+		utils::attribute_pool attribute_sets;
+		subscription_registry subscriptions;
+		broadcast_router broadcasts;
+		// Outgoing broadcasts, published as fast as the configured rate allows
+		outbound_queue broadcast_queue;
+		// Publishes broadcasts the rate held back or a failing publish left in the queue
+		scheduled_task broadcast_task;
+		// Pending sets waiting for the device to echo the value, null until enable_set_tracking().
+		// Created once and kept until the master is destroyed, the atomic pointer publishes it
+		// to the transport thread and threads calling set_value().
+		std::unique_ptr<set_tracker> set_tracker_storage;
+		std::atomic<set_tracker*> set_tracking;
+		std::mutex set_tracking_mtx;
+		struct pending_set {
+			std::shared_ptr<const remote_property> prop;
+			bool is_array;
+			int64_t idx;
+			std::string value;
+		};
+		typedef coalescer<std::string, pending_set> set_coalescer;
+		// Latest set per topic, null until enable_set_coalescing().
+		// coalescing_mtx guards the pointer, users take a reference, so switching coalescing off
+		// while set_value() runs on another thread destroys the coalescer once the last of them is done.
+		mutable std::mutex coalescing_mtx;
+		std::shared_ptr<set_coalescer> set_coalescing;
+
+		std::shared_ptr<set_coalescer> get_coalescer() const {
+			std::lock_guard<std::mutex> lck(coalescing_mtx);
+			return set_coalescing;
+		}
+		rule_engine rules;
+		// Rule actions whose target or value is unknown or whose set could not be published
+		std::atomic<uint64_t> rule_failures;
+		struct derived_binding {
+			std::string node_id;
+			std::string property_id;
+			std::shared_ptr<derived_property> prop;
+		};
+		std::shared_ptr<derived_device> derived;
+		// Guards the bindings, aggregators lock themselves
+		std::mutex derived_mtx;
+		std::atomic<size_t> derived_count;
+		// Aggregates with a window, their members expire over time
+		std::atomic<size_t> derived_windowed;
+		// Property value aggregates by property id, "+" for those matching any property
+		std::unordered_map<std::string, std::vector<std::shared_ptr<derived_binding>>> derived_by_property;
+		std::vector<std::shared_ptr<derived_binding>> derived_by_state;
+		// Heartbeat deadlines by device id, null until enable_liveness()
+		std::unique_ptr<timing_wheel<std::string>> liveness;
+		unsigned liveness_misses;
+		std::chrono::milliseconds liveness_fallback;
+		// Malformed incoming messages
+		message_quarantine quarantine;
+		// Exceptions thrown by event handlers and set callbacks, they are not the message's fault
+		std::atomic<uint64_t> handler_errors;
+
+		// Wraps an event for the handler and the subscribers, an exception of one of them is counted
+		// and neither quarantines the message nor stops delivery to the others
+		template<typename Fn>
+		auto guarded_event(Fn fn) {
+			return [this, fn](master_event_handler& h) {
+				try {
+					fn(h);
+				}
+				catch (const std::exception&) {
+					handler_errors++;
+				}
+			};
+		}
 		std::map<std::string, std::shared_ptr<remote_device>> devices;
+		mutable std::mutex history_mtx;
+		std::atomic<size_t> history_samples;
+		std::atomic<size_t> history_budget;
+		std::atomic<size_t> history_used;
+		// Copy on write mirror of the tree, null until enable_snapshots().
+		// Only replaced by the thread handling messages, snapshot_mtx guards the pointer for readers.
+		mutable std::mutex snapshot_mtx;
+		std::shared_ptr<const master_snapshot::root> snapshot_root;
 
 		// Inherited by mqtt_event_handler
 		virtual void on_connect(bool session_present, bool reconnected) override {
@@ -192,13 +382,31 @@ namespace homie {
 			if (topic.compare(0, base_topic.size(), base_topic) != 0)
 				return;
 
+			// Nothing may escape into the mqtt library, whatever the publisher sent
+			try {
+				handle_message(topic, payload);
+			}
+			catch (const std::exception& e) {
+				quarantine.add(topic, payload, e.what());
+			}
+		}
+
+		void handle_message(const std::string& topic, const std::string& payload) {
 			auto parts = utils::split<std::string>(topic, "/", base_topic.size());
-			if (parts.size() < 2)
+			if (parts.size() < 2) {
+				quarantine.add(topic, payload, "missing topic levels");
 				return;
-			for (auto& e : parts) if (e.empty()) return;
+			}
+			for (auto& e : parts) {
+				if (e.empty()) {
+					quarantine.add(topic, payload, "empty topic level");
+					return;
+				}
+			}
 			if (parts[0][0] == '$') {
 				if (parts[0] == "$broadcast") {
-					this->handle_broadcast(parts[1], payload);
+					// Levels may span several topic levels ("alert/fire")
+					this->handle_broadcast(topic.substr(base_topic.size() + parts[0].size() + 1), payload);
 				}
 			}
 			else {
@@ -207,82 +415,407 @@ namespace homie {
 		}
 
 		void handle_broadcast(const std::string& level, const std::string& payload) {
-			if (handler)
-				handler->on_broadcast(level, payload);
+			auto evt = guarded_event([&](master_event_handler& h) { h.on_broadcast(level, payload); });
+			if (handler) evt(*handler);
+			subscriptions.dispatch_broadcast(evt);
+			broadcasts.dispatch(level, payload);
 		}
 
 		void handle_device_message(const std::vector<std::string>& parts, const std::string& payload) {
+			// Empty payloads clear retained topics and must not create phantom devices, nodes or properties
+			if (payload.empty() && devices.count(parts[0]) == 0) return;
 			auto dev = get_add_device(parts[0]);
+			// Any message of the device proves it is alive, unlike retained sets and clears published by controllers
+			bool heartbeat = !payload.empty() && !(parts.size() >= 4 && parts.back() == "set");
+			bool is_state = parts.size() == 2 && parts[1] == "$state";
+			if (heartbeat && !dev->presumed_state.empty()) {
+				auto state = std::move(dev->presumed_state);
+				dev->presumed_state.clear();
+				// A new $state replaces the presumed one below
+				if (!is_state) apply_state(dev, state);
+			}
 			if (parts[1][0] == '$') {
 				std::string id = parts[1].substr(1);
 				for (size_t i = 2; i < parts.size(); i++) {
 					id += "/" + parts[i];
 				}
+				if (id == "homie") {
+					// Unknown versions are parsed as Homie 3
+					if (!try_enum_from_string(payload, dev->version)) dev->version = protocol_version::v3;
+					dev->parser = dev->version == protocol_version::v3 ? &master::parse_v3 : &master::parse_v4;
+				}
+				std::vector<structure_change> changes;
+				if (id == "description") {
+					if (!apply_description(*dev, payload, changes)) reject(parts, payload, "invalid $description");
+				}
 				if (id == "state" && payload != "init" && (dev->get_attribute("state") == "" || dev->get_state() == device_state::init)) {
 					dev->set_attribute(id, payload);
-					if (handler)
-						handler->on_device_discovered(dev);
+					update_snapshot(*dev, nullptr, nullptr);
+					auto evt = guarded_event([&](master_event_handler& h) { h.on_device_discovered(dev); });
+					if (handler) evt(*handler);
+					subscriptions.dispatch_device(dev->key, evt);
 				}
 				else {
 					dev->set_attribute(id, payload);
-					if (handler && dev->get_state() != device_state::init) {
-						handler->on_device_changed(dev, id);
+					// A description may have replaced the whole structure
+					if (id == "description") rebuild_snapshot(*dev);
+					else update_snapshot(*dev, nullptr, nullptr);
+					if (dev->get_state() != device_state::init) {
+						auto evt = guarded_event([&](master_event_handler& h) { h.on_device_changed(dev, id); });
+						if (handler) evt(*handler);
+						subscriptions.dispatch_device(dev->key, evt);
+						notify_structure_changes(dev, changes);
 					}
 				}
+				if (id == "state" && derived_count != 0) update_derived_state(*dev, payload);
 			}
 			else if (parts.size() >= 3) {
-				bool is_array = false;
-				int64_t idx = 0;
-				std::shared_ptr<remote_node> node;
-				{
-					auto pos = parts[1].find('_');
-					if (pos != std::string::npos) {
-						node = dev->get_add_node(parts[1].substr(0, pos));
-						is_array = true;
-						idx = std::stoll(parts[1].substr(pos + 1));
+				(this->*(dev->parser))(dev, parts, payload);
+			}
+			if (liveness) {
+				// A changed $state may start or end tracking
+				if (heartbeat || is_state) track_liveness(*dev);
+				check_liveness();
+			}
+			if (derived_windowed != 0) expire_derived();
+		}
+
+		void apply_state(const std::shared_ptr<remote_device>& dev, const std::string& state) {
+			dev->set_attribute("state", state);
+			update_snapshot(*dev, nullptr, nullptr);
+			if (derived_count != 0) update_derived_state(*dev, state);
+			auto evt = guarded_event([&](master_event_handler& h) { h.on_device_changed(dev, "state"); });
+			if (handler) evt(*handler);
+			subscriptions.dispatch_device(dev->key, evt);
+		}
+
+		// Devices that went offline on purpose or have no known interval are not tracked
+		std::chrono::milliseconds heartbeat_timeout(const remote_device& dev) const {
+			auto state = dev.get_attribute("state");
+			if (state != "ready" && state != "alert") return std::chrono::milliseconds(0);
+			int64_t interval;
+			auto base = utils::parse_int64(dev.get_attribute("stats/interval"), interval) && interval > 0
+				? std::chrono::milliseconds(std::chrono::seconds(interval)) : liveness_fallback;
+			return base * liveness_misses;
+		}
+
+		void track_liveness(const remote_device& dev) {
+			auto timeout = heartbeat_timeout(dev);
+			if (timeout.count() > 0) liveness->touch(dev.id, timeout);
+			else liveness->remove(dev.id);
+		}
+
+		// Homie 3, node ids may carry an array index ("node_1")
+		void parse_v3(const std::shared_ptr<remote_device>& dev, const std::vector<std::string>& parts, const std::string& payload) {
+			auto pos = parts[1].find('_');
+			if (payload.empty() && dev->nodes.count(parts[1].substr(0, pos)) == 0) return;
+			if (pos != std::string::npos) {
+				int64_t idx;
+				if (!utils::parse_int64(parts[1].data() + pos + 1, parts[1].data() + parts[1].size(), idx)) {
+					reject(parts, payload, "invalid array index");
+					return;
+				}
+				handle_node_message(dev, dev->get_add_node(parts[1].substr(0, pos)), true, idx, parts, payload);
+			}
+			else
+				handle_node_message(dev, dev->get_add_node(parts[1]), false, 0, parts, payload);
+		}
+
+		void reject(const std::vector<std::string>& parts, const std::string& payload, const char* reason) {
+			std::string topic = base_topic + parts[0];
+			for (size_t i = 1; i < parts.size(); i++) topic += "/" + parts[i];
+			quarantine.add(topic, payload, reason);
+		}
+
+		// Homie 4, there are no array nodes
+		void parse_v4(const std::shared_ptr<remote_device>& dev, const std::vector<std::string>& parts, const std::string& payload) {
+			if (payload.empty() && dev->nodes.count(parts[1]) == 0) return;
+			handle_node_message(dev, dev->get_add_node(parts[1]), false, 0, parts, payload);
+		}
+
+		// Attribute changed by a Homie 5 description, node and prop are null for device and node attributes
+		struct structure_change {
+			std::shared_ptr<remote_node> node;
+			std::shared_ptr<remote_property> prop;
+			std::string attribute;
+		};
+
+		// Calls fn for every key whose value differs, including keys missing on either side
+		template<typename Fn>
+		static void diff_attributes(const utils::attribute_map& before, const utils::attribute_map& after, Fn fn) {
+			auto a = before.begin();
+			auto b = after.begin();
+			while (a != before.end() || b != after.end()) {
+				if (b == after.end() || (a != before.end() && a->first < b->first)) fn((a++)->first);
+				else if (a == before.end() || b->first < a->first) fn((b++)->first);
+				else {
+					if (a->second != b->second) fn(a->first);
+					a++;
+					b++;
+				}
+			}
+		}
+
+		// Same events as if the changed attributes had arrived as single topics
+		void notify_structure_changes(const std::shared_ptr<remote_device>& dev, const std::vector<structure_change>& changes) {
+			for (auto& c : changes) {
+				if (!c.node) {
+					auto evt = guarded_event([&](master_event_handler& h) { h.on_device_changed(dev, c.attribute); });
+					if (handler) evt(*handler);
+					subscriptions.dispatch_device(dev->key, evt);
+				}
+				else if (!c.prop) {
+					auto evt = guarded_event([&](master_event_handler& h) { h.on_node_changed(c.node, c.attribute); });
+					if (handler) evt(*handler);
+					subscriptions.dispatch_node(dev->key, c.node->key, evt);
+				}
+				else {
+					auto evt = guarded_event([&](master_event_handler& h) { h.on_property_changed(c.prop, c.attribute); });
+					if (handler) evt(*handler);
+					subscriptions.dispatch_property(event_kind::property, dev->key, c.node->key, c.prop->key, c.prop->datatypes, evt);
+				}
+			}
+		}
+
+		// Homie 5, the whole structure arrives as one JSON document.
+		// Nodes and properties missing from a new description are removed, malformed documents are ignored.
+		// Every changed attribute, including the node and property lists, is added to changes.
+		bool apply_description(remote_device& dev, const std::string& payload, std::vector<structure_change>& changes) {
+			typedef std::vector<std::pair<std::string, std::string>> attribute_list;
+			struct staged_node {
+				std::string id;
+				attribute_list attributes;
+				std::vector<std::pair<std::string, attribute_list>> properties;
+			};
+
+			json::reader r(payload);
+			attribute_list device_attributes;
+			std::vector<staged_node> staged;
+			auto scalar = [&](const std::string& key, attribute_list& out) {
+				if (r.at_container()) return r.skip();
+				std::string v;
+				if (!r.scalar(v)) return false;
+				out.push_back({ key, v });
+				return true;
+			};
+			bool ok = r.object([&](const std::string& key) {
+				if (key != "nodes") return scalar(key, device_attributes);
+				return r.object([&](const std::string& node_id) {
+					staged.emplace_back();
+					staged.back().id = node_id;
+					return r.object([&](const std::string& node_key) {
+						auto& node = staged.back();
+						if (node_key != "properties") return scalar(node_key, node.attributes);
+						return r.object([&](const std::string& prop_id) {
+							node.properties.push_back({ prop_id, attribute_list() });
+							return r.object([&](const std::string& prop_key) { return scalar(prop_key, node.properties.back().second); });
+						});
+					});
+				});
+			}) && r.at_end();
+			if (!ok) return false;
+
+			dev.version = protocol_version::v5;
+			dev.parser = &master::parse_v4;
+			// "homie", "name" and "version" become device attributes
+			for (auto& e : device_attributes) {
+				if (e.first == "state" || e.first == "description") continue;
+				if (dev.get_attribute(e.first) != e.second) changes.push_back({ nullptr, nullptr, e.first });
+				dev.set_attribute(e.first, e.second);
+			}
+
+			std::string node_list;
+			std::set<std::string> node_ids;
+			for (auto& n : staged) {
+				node_ids.insert(n.id);
+				node_list += (node_list.empty() ? "" : ",") + n.id;
+				auto node = dev.get_add_node(n.id);
+
+				std::string prop_list;
+				std::set<std::string> prop_ids;
+				for (auto& p : n.properties) {
+					prop_ids.insert(p.first);
+					prop_list += (prop_list.empty() ? "" : ",") + p.first;
+					auto prop = node->get_add_property(p.first);
+					utils::attribute_map attrs{ { "settable", "false" }, { "retained", "true" } };
+					for (auto& e : p.second) attrs[e.first] = e.second;
+					auto before = prop->attributes;
+					// A dropped $datatype resets the property to string
+					prop->assign_attributes(std::move(attrs));
+					diff_attributes(*before, *prop->attributes, [&](const std::string& key) { changes.push_back({ node, prop, key }); });
+					if (history_used != 0) retype_history(*prop);
+				}
+				for (auto it = node->properties.begin(); it != node->properties.end();) {
+					if (prop_ids.count(it->first) == 0) {
+						forget_property(dev, *node, *it->second);
+						it = node->properties.erase(it);
 					}
-					else
-						node = dev->get_add_node(parts[1]);
+					else it++;
+				}
+				utils::attribute_map attrs(n.attributes.begin(), n.attributes.end());
+				attrs["properties"] = prop_list;
+				auto before = node->attributes;
+				node->attributes = attribute_sets.intern(std::move(attrs));
+				diff_attributes(*before, *node->attributes, [&](const std::string& key) { changes.push_back({ node, nullptr, key }); });
+			}
+			for (auto it = dev.nodes.begin(); it != dev.nodes.end();) {
+				if (node_ids.count(it->first) == 0) {
+					forget_node(dev, *it->second);
+					it = dev.nodes.erase(it);
 				}
+				else it++;
+			}
+			if (dev.get_attribute("nodes") != node_list) changes.push_back({ nullptr, nullptr, "nodes" });
+			dev.set_attribute("nodes", node_list);
+			return true;
+		}
 
-				if (parts[2][0] == '$') {
-					std::string id = parts[2].substr(1);
-					for (size_t i = 3; i < parts.size(); i++) {
-						id += "/" + parts[i];
+		void handle_node_message(const std::shared_ptr<remote_device>& dev, const std::shared_ptr<remote_node>& node, bool is_array, int64_t idx, const std::vector<std::string>& parts, const std::string& payload) {
+			if (parts[2][0] == '$') {
+				std::string id = parts[2].substr(1);
+				for (size_t i = 3; i < parts.size(); i++) {
+					id += "/" + parts[i];
+				}
+				if (is_array) node->set_attribute(id, payload, idx);
+				else node->set_attribute(id, payload);
+				update_snapshot(*dev, node.get(), nullptr);
+				if (id == "type" && derived_count != 0) refresh_derived(*dev, *node);
+				if (dev->get_state() != device_state::init) {
+					auto evt = guarded_event([&](master_event_handler& h) {
+						if (is_array) h.on_node_changed(node, idx, id);
+						else h.on_node_changed(node, id);
+					});
+					if (handler) evt(*handler);
+					subscriptions.dispatch_node(dev->key, node->key, evt);
+				}
+			}
+			else {
+				if (payload.empty() && node->properties.count(parts[2]) == 0) return;
+				auto prop = node->get_add_property(parts[2]);
+				if (parts.size() == 3) {
+					if (is_array) prop->value_array[idx] = payload;
+					else prop->value = payload;
+					if (history_samples != 0) record_history(*prop, is_array, idx, payload);
+					if (auto tracker = set_tracking.load()) {
+						try {
+							tracker->complete({ prop.get(), idx, is_array }, payload);
+						}
+						catch (const std::exception&) {
+							handler_errors++;
+						}
 					}
-					if (is_array) node->set_attribute(id, payload, idx);
-					else node->set_attribute(id, payload);
-					if (handler && dev->get_state() != device_state::init) {
-						if (is_array) handler->on_node_changed(node, idx, id);
-						else handler->on_node_changed(node, id);
+					update_snapshot(*dev, node.get(), prop.get());
+					if (!rules.empty()) apply_rules(*dev, *node, *prop, is_array, idx, payload);
+					if (derived_count != 0) update_derived(*dev, *node, *prop, is_array, idx, payload);
+
+					if (dev->get_state() != device_state::init) {
+						auto evt = guarded_event([&](master_event_handler& h) {
+							if (is_array) h.on_property_value_changed(prop, idx, payload);
+							else h.on_property_value_changed(prop, payload);
+						});
+						if (handler) evt(*handler);
+						subscriptions.dispatch_property(event_kind::value, dev->key, node->key, prop->key, prop->datatypes, evt);
 					}
 				}
 				else {
-					auto prop = node->get_add_property(parts[2]);
-					if (parts.size() == 3) {
-						if (is_array) prop->value_array[idx] = payload;
-						else prop->value = payload;
-
-						if (handler && dev->get_state() != device_state::init) {
-							if (is_array) handler->on_property_value_changed(prop, idx, payload);
-							else handler->on_property_value_changed(prop, payload);
-						}
+					std::string id = parts[3].substr(1);
+					for (size_t i = 4; i < parts.size(); i++) {
+						id += "/" + parts[i];
 					}
-					else {
-						std::string id = parts[3].substr(1);
-						for (size_t i = 4; i < parts.size(); i++) {
-							id += "/" + parts[i];
-						}
-						prop->set_attribute(id, payload);
-						if (handler && dev->get_state() != device_state::init) {
-							if (is_array) handler->on_property_changed(prop, idx, id);
-							else handler->on_property_changed(prop, id);
-						}
+					prop->set_attribute(id, payload);
+					if (id == "datatype" && history_used != 0) retype_history(*prop);
+					update_snapshot(*dev, node.get(), prop.get());
+					if (dev->get_state() != device_state::init) {
+						auto evt = guarded_event([&](master_event_handler& h) {
+							if (is_array) h.on_property_changed(prop, idx, id);
+							else h.on_property_changed(prop, id);
+						});
+						if (handler) evt(*handler);
+						subscriptions.dispatch_property(event_kind::property, dev->key, node->key, prop->key, prop->datatypes, evt);
 					}
 				}
 			}
 		}
 
+		void record_history(remote_property& prop, bool is_array, int64_t idx, const std::string& payload) {
+			std::lock_guard<std::mutex> lck(history_mtx);
+			auto& hist = is_array ? prop.history_array[idx] : prop.history;
+			if (!hist) {
+				bool numeric = has_numeric_history(prop);
+				auto samples = history_samples.load();
+				auto size = value_history::footprint(samples, numeric);
+				if (history_used + size > history_budget) {
+					if (is_array) prop.history_array.erase(idx);
+					return;
+				}
+				history_used += size;
+				hist = std::make_shared<value_history>(samples, numeric);
+			}
+			hist->push(value_history::clock::now(), payload);
+		}
+
+		static bool has_numeric_history(const remote_property& prop) {
+			auto dt = prop.get_attribute("datatype");
+			return dt == "integer" || dt == "float";
+		}
+
+		// Caller holds history_mtx. Converts hist to the given type, or drops it if the converted buffer exceeds the budget.
+		void retype_history(std::shared_ptr<value_history>& hist, bool numeric) {
+			if (!hist || hist->is_numeric() == numeric) return;
+			history_used -= value_history::footprint(hist->capacity(), hist->is_numeric());
+			auto size = value_history::footprint(hist->capacity(), numeric);
+			if (history_used + size > history_budget) {
+				hist.reset();
+				return;
+			}
+			history_used += size;
+			hist = hist->convert(numeric);
+		}
+
+		// Retained values often arrive before $datatype, so buffers are converted once the datatype is known
+		void retype_history(remote_property& prop) {
+			std::lock_guard<std::mutex> lck(history_mtx);
+			bool numeric = has_numeric_history(prop);
+			retype_history(prop.history, numeric);
+			for (auto it = prop.history_array.begin(); it != prop.history_array.end();) {
+				retype_history(it->second, numeric);
+				if (it->second) it++;
+				else it = prop.history_array.erase(it);
+			}
+		}
+
+		void release_history(remote_property& prop) {
+			std::lock_guard<std::mutex> lck(history_mtx);
+			if (prop.history) history_used -= value_history::footprint(prop.history->capacity(), prop.history->is_numeric());
+			for (auto& e : prop.history_array) history_used -= value_history::footprint(e.second->capacity(), e.second->is_numeric());
+			prop.history.reset();
+			prop.history_array.clear();
+		}
+
+		// Releases what master keeps about a property outside of the tree, called before it is erased
+		void forget_property(const remote_device& dev, const remote_node& node, remote_property& prop) {
+			if (history_used != 0) release_history(prop);
+			if (derived_count != 0) forget_derived(dev, node, prop);
+		}
+
+		void forget_node(const remote_device& dev, remote_node& node) {
+			for (auto& e : node.properties) forget_property(dev, node, *e.second);
+		}
+
+		void forget_device(remote_device& dev) {
+			for (auto& e : dev.nodes) forget_node(dev, *e.second);
+			if (derived_count != 0) update_derived_state(dev, std::string());
+		}
+
+		std::shared_ptr<const value_history> find_history(const property* prop, const int64_t* idx) const {
+			auto p = dynamic_cast<const remote_property*>(prop);
+			if (p == nullptr || p->parent != this) return nullptr;
+			std::lock_guard<std::mutex> lck(history_mtx);
+			if (idx == nullptr) return p->history;
+			auto it = p->history_array.find(*idx);
+			return it != p->history_array.end() ? it->second : nullptr;
+		}
+
 		std::shared_ptr<remote_device> get_add_device(const std::string& id) {
 			if (devices.count(id)) return devices.at(id);
 			auto dev = std::make_shared<remote_device>(this, id);
@@ -290,26 +823,310 @@ namespace homie {
 			return dev;
 		}
 
-		void publish_set_property(const homie::property* prop, const std::string& value) {
-			auto node = prop->get_node();
-			auto dev = node->get_device();
-			mqtt.publish(base_topic + dev->get_id() + "/" + node->get_id() + "/" + prop->get_id() + "/set", value, 1, true);
+		static std::set<std::string> split_list(const std::string& list) {
+			std::set<std::string> res;
+			for (auto& e : utils::split<std::string>(list, ",")) {
+				if (e.empty()) continue;
+				// Homie 3 marks array nodes with "[]"
+				res.insert(e.size() > 2 && e.compare(e.size() - 2, 2, "[]") == 0 ? e.substr(0, e.size() - 2) : e);
+			}
+			return res;
+		}
+
+		void property_topics(const std::string& node_prefix, const remote_node& node, const remote_property& prop, std::vector<std::string>& out) const {
+			if (!prop.value.empty()) out.push_back(node_prefix + node.id + "/" + prop.id);
+			for (auto& e : prop.value_array)
+				out.push_back(node_prefix + node.id + "_" + std::to_string(e.first) + "/" + prop.id);
+			for (auto& e : *prop.attributes)
+				out.push_back(node_prefix + node.id + "/" + prop.id + "/$" + e.first);
+		}
+
+		void node_topics(const std::string& node_prefix, const remote_node& node, std::vector<std::string>& out) const {
+			for (auto& e : *node.attributes)
+				out.push_back(node_prefix + node.id + "/$" + e.first);
+			for (auto& e : node.attributes_array)
+				out.push_back(node_prefix + node.id + "_" + std::to_string(e.first.first) + "/$" + e.first.second);
+			for (auto& e : node.properties)
+				property_topics(node_prefix, node, *e.second, out);
+		}
+
+		static std::shared_ptr<const snapshot_property> copy_property(const remote_property& prop) {
+			auto res = std::make_shared<snapshot_property>();
+			res->id = prop.id;
+			res->value = prop.value;
+			res->value_array = prop.value_array;
+			res->attributes = prop.attributes;
+			return res;
+		}
+
+		void publish_snapshot_device(const std::string& device_id, std::shared_ptr<const snapshot_device> dev) {
+			auto r = master_snapshot::with_device(snapshot_root, device_id, std::move(dev));
+			std::lock_guard<std::mutex> lck(snapshot_mtx);
+			snapshot_root = r;
+		}
+
+		// Copies the path from the root down to the changed device, node or property.
+		// Device attributes are only copied if node is null, node attributes only if prop is null.
+		void update_snapshot(const remote_device& dev, const remote_node* node, const remote_property* prop) {
+			if (!snapshot_root) return;
+			auto old_dev = master_snapshot::find_device(*snapshot_root, dev.id);
+			auto d = std::make_shared<snapshot_device>();
+			d->id = dev.id;
+			if (old_dev) {
+				d->attributes = node == nullptr ? dev.attributes : old_dev->attributes;
+				d->nodes = old_dev->nodes;
+			}
+			else d->attributes = dev.attributes;
+			if (node) {
+				auto n = std::make_shared<snapshot_node>();
+				n->id = node->id;
+				auto old_node = d->nodes.find(node->id);
+				if (old_node != d->nodes.end()) {
+					n->attributes = prop == nullptr ? node->attributes : old_node->second->attributes;
+					n->attributes_array = prop == nullptr ? node->attributes_array : old_node->second->attributes_array;
+					n->properties = old_node->second->properties;
+				}
+				else {
+					n->attributes = node->attributes;
+					n->attributes_array = node->attributes_array;
+				}
+				if (prop) n->properties[prop->id] = copy_property(*prop);
+				d->nodes[node->id] = n;
+			}
+			publish_snapshot_device(dev.id, d);
+		}
+
+		// Copies a device completely, used after structural changes
+		void rebuild_snapshot(const remote_device& dev) {
+			if (!snapshot_root) return;
+			auto d = std::make_shared<snapshot_device>();
+			d->id = dev.id;
+			d->attributes = dev.attributes;
+			for (auto& e : dev.nodes) {
+				auto n = std::make_shared<snapshot_node>();
+				n->id = e.second->id;
+				n->attributes = e.second->attributes;
+				n->attributes_array = e.second->attributes_array;
+				for (auto& p : e.second->properties) n->properties[p.first] = copy_property(*p.second);
+				d->nodes[e.first] = n;
+			}
+			publish_snapshot_device(dev.id, d);
+		}
+
+		void publish_set_property(const remote_property* prop, const std::string& value) {
+			if (auto c = get_coalescer()) c->put(prop->set_topic, { prop->shared_from_this(), false, 0, value });
+			else publish_set(prop, false, 0, value, nullptr);
+		}
+
+		void publish_set_property(const remote_property* prop, const std::string& value, int64_t idx) {
+			if (auto c = get_coalescer()) c->put(prop->get_set_topic(idx), { prop->shared_from_this(), true, idx, value });
+			else publish_set(prop, true, idx, value, nullptr);
+		}
+
+		// Sets that failed stay in the batch, the coalescer retries them with the next flush
+		void publish_coalesced(set_coalescer::batch& sets) {
+			set_coalescer::batch failed;
+			for (auto& e : sets) {
+				try {
+					publish_set(e.second.prop.get(), e.second.is_array, e.second.idx, e.second.value, nullptr);
+				}
+				catch (const std::exception&) {
+					// Nobody waits on the flusher thread, set tracking reports the failure if enabled
+					failed.push_back(std::move(e));
+				}
+			}
+			sets.swap(failed);
+		}
+
+		std::string device_of(const remote_property& prop) const {
+			return prop.node_topic.substr(base_topic.size(), prop.node_topic.find('/', base_topic.size()) - base_topic.size());
+		}
+
+		void publish_set(const remote_property* prop, bool is_array, int64_t idx, const std::string& value, set_callback done) {
+			// Track before publishing, the echo may arrive before publish returns
+			if (auto tracker = set_tracking.load()) tracker->track({ prop, is_array ? idx : 0, is_array }, device_of(*prop), value, std::move(done));
+			try {
+				mqtt.publish(is_array ? prop->get_set_topic(idx) : prop->set_topic, value, 1, true);
+			}
+			catch (const std::exception&) {
+				if (auto tracker = set_tracking.load()) tracker->fail({ prop, is_array ? idx : 0, is_array });
+				throw;
+			}
+		}
+
+		remote_property* find_property(const property_ref& ref) const {
+			auto dit = devices.find(ref.device);
+			if (dit == devices.end()) return nullptr;
+			auto nit = dit->second->nodes.find(ref.node);
+			if (nit == dit->second->nodes.end()) return nullptr;
+			auto pit = nit->second->properties.find(ref.property);
+			return pit != nit->second->properties.end() ? pit->second.get() : nullptr;
+		}
+
+		void apply_rules(const remote_device& dev, const remote_node& node, const remote_property& prop, bool is_array, int64_t idx, const std::string& payload) {
+			std::string key = dev.id + "/" + node.id;
+			if (is_array) key += "_" + std::to_string(idx);
+			key += "/" + prop.id;
+			std::vector<rule_engine::fired_action> fired;
+			if (!rules.update(key, payload, fired)) return;
+			for (auto& a : fired) {
+				// Values computed from unknown properties are not sent as sets
+				auto target = a.known ? find_property(a.target) : nullptr;
+				if (target == nullptr) {
+					rule_failures++;
+					continue;
+				}
+				try {
+					if (a.target.is_array) publish_set_property(target, a.value, a.target.index);
+					else publish_set_property(target, a.value);
+				}
+				catch (const std::exception&) {
+					rule_failures++;
+				}
+			}
+		}
+
+		static std::string member_key(const remote_device& dev, const remote_node& node, const remote_property& prop, bool is_array, int64_t idx) {
+			std::string key = dev.id + "/" + node.id;
+			if (is_array) key += "_" + std::to_string(idx);
+			return key + "/" + prop.id;
+		}
+
+		static bool derived_matches(const aggregate_spec& spec, const remote_device& dev, const remote_node& node, const remote_property& prop) {
+			return spec.matches(spec.device, dev.id) && spec.matches(spec.node, node.id) && spec.matches(spec.property, prop.id)
+				&& (spec.node_type.empty() || node.get_attribute("type") == spec.node_type);
+		}
+
+		// Caller holds derived_mtx, returns true if the aggregate changed
+		static bool apply_derived(derived_binding& b, const std::string& key, const std::string& value) {
+			return value.empty() ? b.prop->values.remove(key) : b.prop->values.update(key, value);
+		}
+
+		void notify_derived(const std::vector<std::shared_ptr<derived_binding>>& changed) {
+			for (auto& b : changed) derived->notify_changed(b->node_id, b->property_id);
+		}
+
+		void update_derived(const remote_device& dev, const remote_node& node, const remote_property& prop, bool is_array, int64_t idx, const std::string& payload) {
+			std::vector<std::shared_ptr<derived_binding>> changed;
+			{
+				std::lock_guard<std::mutex> lck(derived_mtx);
+				static const std::string any = "+";
+				std::string key;
+				for (auto id : { &prop.id, &any }) {
+					auto it = derived_by_property.find(*id);
+					if (it == derived_by_property.end()) continue;
+					for (auto& b : it->second) {
+						if (!derived_matches(b->prop->values.get_spec(), dev, node, prop)) continue;
+						if (key.empty()) key = member_key(dev, node, prop, is_array, idx);
+						if (apply_derived(*b, key, payload)) changed.push_back(b);
+					}
+				}
+			}
+			notify_derived(changed);
+		}
+
+		// Drops the values of an erased property from every aggregate
+		void forget_derived(const remote_device& dev, const remote_node& node, const remote_property& prop) {
+			std::vector<std::shared_ptr<derived_binding>> changed;
+			{
+				std::lock_guard<std::mutex> lck(derived_mtx);
+				static const std::string any = "+";
+				for (auto id : { &prop.id, &any }) {
+					auto it = derived_by_property.find(*id);
+					if (it == derived_by_property.end()) continue;
+					for (auto& b : it->second) {
+						bool c = b->prop->values.remove(member_key(dev, node, prop, false, 0));
+						for (auto& v : prop.value_array) c |= b->prop->values.remove(member_key(dev, node, prop, true, v.first));
+						if (c) changed.push_back(b);
+					}
+				}
+			}
+			notify_derived(changed);
+		}
+
+		void update_derived_state(const remote_device& dev, const std::string& state) {
+			std::vector<std::shared_ptr<derived_binding>> changed;
+			{
+				std::lock_guard<std::mutex> lck(derived_mtx);
+				for (auto& b : derived_by_state) {
+					auto& spec = b->prop->values.get_spec();
+					if (spec.matches(spec.device, dev.id) && apply_derived(*b, dev.id, state)) changed.push_back(b);
+				}
+			}
+			notify_derived(changed);
+		}
+
+		// Feeds every value of a property into the binding, or removes them if the property no longer matches
+		static bool backfill_derived(derived_binding& b, const remote_device& dev, const remote_node& node, const remote_property& prop) {
+			bool match = derived_matches(b.prop->values.get_spec(), dev, node, prop);
+			bool changed = false;
+			if (!prop.value.empty()) changed |= apply_derived(b, member_key(dev, node, prop, false, 0), match ? prop.value : std::string());
+			for (auto& v : prop.value_array) changed |= apply_derived(b, member_key(dev, node, prop, true, v.first), match ? v.second : std::string());
+			return changed;
+		}
+
+		// The node $type changed, so its properties may have joined or left aggregates selecting by type
+		void refresh_derived(const remote_device& dev, const remote_node& node) {
+			std::vector<std::shared_ptr<derived_binding>> changed;
+			{
+				std::lock_guard<std::mutex> lck(derived_mtx);
+				for (auto& e : derived_by_property) {
+					for (auto& b : e.second) {
+						if (b->prop->values.get_spec().node_type.empty()) continue;
+						bool c = false;
+						for (auto& p : node.properties) c |= backfill_derived(*b, dev, node, *p.second);
+						if (c) changed.push_back(b);
+					}
+				}
+			}
+			notify_derived(changed);
+		}
+
+		static outbox_options unlimited_broadcasts() {
+			outbox_options opts;
+			opts.drain_rate = 0;
+			return opts;
+		}
+
+		void drain_broadcasts() {
+			try {
+				broadcast_queue.drain(mqtt);
+			}
+			catch (const std::exception&) {
+				// Kept in the queue and retried by the task
+			}
+			if (broadcast_queue.empty()) return;
+			auto interval = broadcast_queue.drain_interval();
+			if (interval.count() == 0) interval = std::chrono::seconds(1);
+			broadcast_task.start(interval, [this]() {
+				try {
+					broadcast_queue.drain(mqtt);
+				}
+				catch (const std::exception&) {}
+			}, [this]() { return !broadcast_queue.empty(); });
 		}
 
-		void publish_set_property(const homie::property* prop, const std::string& value, int64_t idx) {
-			auto node = prop->get_node();
-			auto dev = node->get_device();
-			mqtt.publish(base_topic + dev->get_id() + "/" + node->get_id() + "_" + std::to_string(idx) + "/" + prop->get_id() + "/set", value, 1, true);
+		const remote_property* find_own_property(const set_request& req) const {
+			auto prop = dynamic_cast<const remote_property*>(req.property.get());
+			if (prop == nullptr || prop->parent != this) throw std::invalid_argument("property not discovered by this master");
+			return prop;
 		}
 	public:
 		master(mqtt_client& con, std::string basetopic = "homie/")
-			: mqtt(con), handler(nullptr), base_topic(basetopic)
+			: mqtt(con), handler(nullptr), base_topic(basetopic), subscriptions(ids), broadcast_queue(unlimited_broadcasts()), set_tracking(nullptr), rule_failures(0), derived(std::make_shared<derived_device>("derived")), derived_count(0), derived_windowed(0), liveness_misses(3), liveness_fallback(0), handler_errors(0), history_samples(0), history_budget(0), history_used(0)
 		{
 			mqtt.set_event_handler(this);
 			mqtt.open();
 		}
 
 		~master() {
+			// Publish the final values of coalesced sets and broadcasts the rate held back
+			disable_set_coalescing();
+			broadcast_task.stop();
+			try {
+				broadcast_queue.drain(mqtt, true);
+			}
+			catch (const std::exception&) {}
 			this->mqtt.unsubscribe(base_topic + "#");
 			mqtt.set_event_handler(nullptr);
 		}
@@ -326,6 +1143,14 @@ namespace homie {
 			return res;
 		}
 
+		void for_each_discovered_device(device_visitor fn) {
+			for (auto& e : devices) fn(e.first, *e.second);
+		}
+
+		void for_each_discovered_device(const_device_visitor fn) const {
+			for (auto& e : devices) fn(e.first, *e.second);
+		}
+
 		device_ptr get_discovered_device(const std::string& id) {
 			return devices.count(id) ? devices.at(id) : nullptr;
 		}
@@ -334,12 +1159,436 @@ namespace homie {
 			return devices.count(id) ? devices.at(id) : nullptr;
 		}
 
+		// Publishes many set requests through mqtt_client::publish_batch instead of one blocking publish each.
+		// Returns the outcome of every request in request order.
+		std::vector<set_status> set_values(const std::vector<set_request>& requests) {
+			std::vector<set_status> res(requests.size(), set_status::unknown_property);
+			std::vector<mqtt_message> batch;
+			std::vector<size_t> slots;
+			batch.reserve(requests.size());
+			slots.reserve(requests.size());
+			for (size_t i = 0; i < requests.size(); i++) {
+				auto& req = requests[i];
+				auto prop = dynamic_cast<const remote_property*>(req.property.get());
+				if (prop == nullptr || prop->parent != this) continue;
+				if (auto tracker = set_tracking.load()) tracker->track({ prop, req.has_index ? req.index : 0, req.has_index }, device_of(*prop), req.value, nullptr);
+				batch.push_back({ req.has_index ? prop->get_set_topic(req.index) : prop->set_topic, req.value, 1, true });
+				slots.push_back(i);
+			}
+			if (batch.empty()) return res;
+			std::vector<bool> ok;
+			mqtt.publish_batch(batch, ok);
+			auto tracker = set_tracking.load();
+			for (size_t i = 0; i < slots.size(); i++) {
+				res[slots[i]] = i < ok.size() && ok[i] ? set_status::published : set_status::failed;
+				if (tracker && res[slots[i]] == set_status::failed) {
+					auto& req = requests[slots[i]];
+					tracker->fail({ dynamic_cast<const remote_property*>(req.property.get()), req.has_index ? req.index : 0, req.has_index });
+				}
+			}
+			return res;
+		}
+
+		// Track every set until the device publishes the requested value or timeout passes.
+		// Call this before sending sets, resolution is the granularity of timeouts.
+		void enable_set_tracking(std::chrono::milliseconds timeout = std::chrono::seconds(5), std::chrono::milliseconds resolution = std::chrono::milliseconds(50)) {
+			std::lock_guard<std::mutex> lck(set_tracking_mtx);
+			if (set_tracking) return;
+			set_tracker_storage.reset(new set_tracker(timeout, resolution));
+			set_tracking = set_tracker_storage.get();
+		}
+
+		// property::set_value() only keeps the latest value per property (and array index), flushed at most
+		// once per interval by a background thread. Meant for UI controls that send many intermediate values.
+		// set_values() and set_value_tracked() are not coalesced.
+		// Sets whose publish fails are retried with the next flush unless a newer value replaced them.
+		// Safe to call while other threads set values.
+		void enable_set_coalescing(std::chrono::milliseconds interval = std::chrono::milliseconds(100)) {
+			std::lock_guard<std::mutex> lck(coalescing_mtx);
+			if (set_coalescing) return;
+			set_coalescing = std::make_shared<set_coalescer>(interval, [this](set_coalescer::batch& sets) { publish_coalesced(sets); });
+		}
+
+		// Publishes pending sets and returns to publishing every set immediately. Sets still failing are dropped.
+		void disable_set_coalescing() {
+			std::shared_ptr<set_coalescer> old;
+			{
+				std::lock_guard<std::mutex> lck(coalescing_mtx);
+				old.swap(set_coalescing);
+			}
+			// The final flush runs outside the lock, sets arriving meanwhile go out directly
+			old.reset();
+		}
+
+		// Publishes pending sets now, returns their number
+		size_t flush_sets() {
+			auto c = get_coalescer();
+			return c ? c->flush() : 0;
+		}
+
+		// Intermediate values dropped in favour of a newer one
+		uint64_t get_coalesced_sets() {
+			auto c = get_coalescer();
+			return c ? c->get_coalesced() : 0;
+		}
+
+		// Sets a value and reports when the device acknowledged it.
+		// Throws std::logic_error without enable_set_tracking(), publish failures resolve as set_outcome::failed.
+		void set_value_tracked(const set_request& req, set_callback done) {
+			if (!set_tracking) throw std::logic_error("set tracking is not enabled");
+			auto prop = find_own_property(req);
+			try {
+				publish_set(prop, req.has_index, req.index, req.value, std::move(done));
+			}
+			catch (const std::exception&) {
+				// Already reported through done
+			}
+		}
+
+		std::future<set_result> set_value_tracked(const set_request& req) {
+			set_callback done;
+			auto res = set_tracker::make_future(done);
+			set_value_tracked(req, std::move(done));
+			return res;
+		}
+
+		// Acknowledge latencies and outcomes of sets sent to a device
+		set_statistics get_set_statistics(const std::string& device_id) {
+			auto tracker = set_tracking.load();
+			return tracker ? tracker->get_statistics(device_id) : set_statistics();
+		}
+
+		size_t get_pending_sets() {
+			auto tracker = set_tracking.load();
+			return tracker ? tracker->size() : 0;
+		}
+
+		// Sets target properties when condition turns true, see rule_engine for the expression syntax.
+		// actions are (property reference, value expression) pairs, e.g. { "home/heater/power", "\"on\"" }.
+		// Sets go through property::set_value(), so they are coalesced if enabled.
+		// Reads the current values of the referenced properties, so call it before connecting or from the
+		// thread handling mqtt messages. Throws std::invalid_argument on syntax errors.
+		rule_engine::rule_id add_rule(const std::string& condition, const std::vector<std::pair<std::string, std::string>>& actions) {
+			return rules.add(condition, actions, [this](const property_ref& ref, std::string& value) {
+				auto prop = find_property(ref);
+				if (prop == nullptr) return false;
+				if (!ref.is_array) {
+					value = prop->value;
+					return true;
+				}
+				auto it = prop->value_array.find(ref.index);
+				if (it == prop->value_array.end()) return false;
+				value = it->second;
+				return true;
+			});
+		}
+
+		void remove_rule(rule_engine::rule_id id) {
+			rules.remove(id);
+		}
+
+		size_t get_rule_count() const {
+			return rules.size();
+		}
+
+		// Number of times a rule condition turned true
+		uint64_t get_fired_rules() const {
+			return rules.get_fired();
+		}
+
+		// Actions skipped because the target property or a property read by the value has no value yet,
+		// and actions whose set could not be published
+		uint64_t get_failed_rule_actions() const {
+			return rule_failures;
+		}
+
+		// Adds property_id to node node_id of get_derived_device(), aggregating the values selected by spec.
+		// The aggregate is updated with every matching value instead of scanning the tree.
+		// Reads the current values, so call it before connecting or from the thread handling mqtt messages.
+		// Throws std::invalid_argument if the property already exists.
+		property_ptr add_derived_property(const std::string& node_id, const std::string& property_id, const aggregate_spec& spec) {
+			std::shared_ptr<derived_binding> b(new derived_binding{ node_id, property_id, nullptr });
+			std::lock_guard<std::mutex> lck(derived_mtx);
+			b->prop = derived->add_property(node_id, property_id, spec);
+			for (auto& d : devices) {
+				auto& dev = *d.second;
+				if (!spec.matches(spec.device, dev.id)) continue;
+				if (spec.source == aggregate_source::device_state) {
+					auto state = dev.get_attribute("state");
+					if (!state.empty()) b->prop->values.update(dev.id, state);
+					continue;
+				}
+				for (auto& n : dev.nodes) {
+					for (auto& p : n.second->properties) backfill_derived(*b, dev, *n.second, *p.second);
+				}
+			}
+			if (spec.source == aggregate_source::device_state) derived_by_state.push_back(b);
+			else derived_by_property[spec.property].push_back(b);
+			derived_count++;
+			if (spec.window.count() != 0) derived_windowed++;
+			return b->prop;
+		}
+
+		// Returns false if there is no such derived property
+		bool remove_derived_property(const std::string& node_id, const std::string& property_id) {
+			std::lock_guard<std::mutex> lck(derived_mtx);
+			bool windowed = false;
+			auto matches = [&](const std::shared_ptr<derived_binding>& b) {
+				if (b->node_id != node_id || b->property_id != property_id) return false;
+				windowed = b->prop->values.get_spec().window.count() != 0;
+				return true;
+			};
+			derived_by_state.erase(std::remove_if(derived_by_state.begin(), derived_by_state.end(), matches), derived_by_state.end());
+			for (auto& e : derived_by_property) e.second.erase(std::remove_if(e.second.begin(), e.second.end(), matches), e.second.end());
+			if (!derived->remove_property(node_id, property_id)) return false;
+			derived_count--;
+			if (windowed) derived_windowed--;
+			return true;
+		}
+
+		// Drops aggregate members that fell out of their window and reports the changed aggregates through the
+		// derived device. Runs with every message, call it periodically from the thread handling mqtt messages
+		// so windows also expire on quiet networks.
+		void expire_derived() {
+			std::vector<std::shared_ptr<derived_binding>> changed;
+			{
+				std::lock_guard<std::mutex> lck(derived_mtx);
+				auto expire = [&](const std::shared_ptr<derived_binding>& b) {
+					if (b->prop->values.get_spec().window.count() != 0 && b->prop->values.expire()) changed.push_back(b);
+				};
+				for (auto& b : derived_by_state) expire(b);
+				for (auto& e : derived_by_property) {
+					for (auto& b : e.second) expire(b);
+				}
+			}
+			notify_derived(changed);
+		}
+
+		// Virtual device with id "derived" holding the derived properties.
+		// Publish it through homie::client to share the aggregates with other controllers.
+		std::shared_ptr<derived_device> get_derived_device() const {
+			return derived;
+		}
+
+		// Declares ready or alert devices lost once they stayed silent for missed_intervals times their $stats/interval,
+		// any message of the device counts as heartbeat. Devices without an interval use fallback_interval, 0 skips them.
+		// The lost state is reported through on_device_changed and replaced by the previous state once the device is
+		// heard again. Deadlines are checked with every message and by check_liveness(), call that periodically from the
+		// thread handling mqtt messages so quiet networks are noticed as well.
+		void enable_liveness(unsigned missed_intervals = 3, std::chrono::milliseconds fallback_interval = std::chrono::milliseconds(0),
+			std::chrono::milliseconds resolution = std::chrono::seconds(1)) {
+			liveness_misses = std::max(1u, missed_intervals);
+			liveness_fallback = fallback_interval;
+			liveness.reset(new timing_wheel<std::string>(resolution));
+			for (auto& e : devices) track_liveness(*e.second);
+		}
+
+		// Devices currently presumed lost keep that state until they are heard again
+		void disable_liveness() {
+			liveness.reset();
+		}
+
+		void check_liveness() {
+			if (!liveness) return;
+			liveness->advance(timing_wheel<std::string>::clock::now(), [this](const std::string& id) {
+				auto it = devices.find(id);
+				if (it == devices.end()) return;
+				auto dev = it->second;
+				dev->presumed_state = dev->get_attribute("state");
+				apply_state(dev, enum_to_string(device_state::lost));
+			});
+		}
+
+		size_t get_tracked_devices() const {
+			return liveness ? liveness->size() : 0;
+		}
+
+		// Keeps the last messages malformed messages, with payloads cut to payload_limit bytes, for get_quarantined().
+		// They are counted in any case.
+		void enable_quarantine(size_t messages = 64, size_t payload_limit = 256) {
+			quarantine.set_capacity(messages, payload_limit);
+		}
+
+		uint64_t get_malformed_messages() const {
+			return quarantine.count();
+		}
+
+		// Exceptions thrown by event handlers, broadcast callbacks and set completion callbacks.
+		// They are not counted as malformed messages.
+		uint64_t get_handler_errors() const {
+			return handler_errors + broadcasts.get_errors();
+		}
+
+		// Oldest first
+		std::vector<quarantined_message> get_quarantined() const {
+			return quarantine.get_messages();
+		}
+
+		// Queues the broadcast and publishes as many queued broadcasts as the rate allows, unlimited by default.
+		// The rest, and broadcasts whose publish failed, are published in the background at the configured rate.
 		void publish_broadcast(const std::string& level, const std::string& payload) {
-			mqtt.publish(base_topic + "$broadcast/" + level, payload, 1, false);
+			broadcast_queue.push(base_topic + "$broadcast/" + level, payload, 1, false);
+			drain_broadcasts();
+		}
+
+		// Limits outgoing broadcasts, e.g. to protect a fleet from command storms.
+		// Pending broadcasts are kept. Once more than max_entries are pending the oldest are dropped
+		// (counted by get_dropped_broadcasts()), destroying the master publishes all pending broadcasts at once.
+		void set_broadcast_options(const outbox_options& options) {
+			broadcast_queue.reset(options);
+			drain_broadcasts();
+		}
+
+		// Publishes pending broadcasts as far as the rate allows without waiting for the background task
+		size_t flush_broadcasts() {
+			return broadcast_queue.drain(mqtt);
+		}
+
+		size_t get_pending_broadcasts() {
+			return broadcast_queue.size();
+		}
+
+		size_t get_dropped_broadcasts() {
+			return broadcast_queue.get_dropped();
+		}
+
+		// Calls fn for received broadcasts whose level matches pattern ("alert/#", "system/+/reboot")
+		broadcast_router::id_type subscribe_broadcast(const std::string& pattern, broadcast_router::callback fn) {
+			return broadcasts.subscribe(pattern, std::move(fn));
+		}
+
+		void unsubscribe_broadcast(broadcast_router::id_type id) {
+			broadcasts.unsubscribe(id);
 		}
 
 		void set_event_handler(master_event_handler* hdl) {
 			handler = hdl;
 		}
+
+		// Register an additional event handler that only receives events matching filter.
+		// With own_thread set the events are delivered from a dedicated thread through a bounded queue.
+		// The device, node and property objects passed to such a handler keep being changed by the thread
+		// handling mqtt messages, so the handler must not read them. Use the ids and values passed with the
+		// event, or read a consistent copy of the tree through snapshot().
+		subscription_registry::id_type subscribe(master_event_handler& hdl, const event_filter& filter = event_filter(), bool own_thread = false, size_t queue_limit = 1024) {
+			return subscriptions.subscribe(hdl, filter, own_thread, queue_limit);
+		}
+
+		void unsubscribe(subscription_registry::id_type id) {
+			subscriptions.unsubscribe(id);
+		}
+
+		// Record the last samples values of every property.
+		// No new buffers are created once memory_budget bytes are in use across all properties.
+		void enable_history(size_t samples, size_t memory_budget) {
+			history_budget = memory_budget;
+			history_samples = samples;
+		}
+
+		// Stops recording, buffers created so far are kept
+		void disable_history() {
+			history_samples = 0;
+		}
+
+		size_t get_history_memory() const {
+			return history_used;
+		}
+
+		// Distinct node and property attribute sets, devices running the same firmware share theirs
+		size_t get_attribute_set_count() const {
+			return attribute_sets.size();
+		}
+
+		// Returns nullptr if no history is recorded for this property
+		std::shared_ptr<const value_history> get_history(const_property_ptr prop) const {
+			return find_history(prop.get(), nullptr);
+		}
+
+		std::shared_ptr<const value_history> get_history(const_property_ptr prop, int64_t idx) const {
+			return find_history(prop.get(), &idx);
+		}
+
+		// Start mirroring the tree for snapshot(). Copies the current tree once, so call it
+		// before connecting or from the thread handling mqtt messages.
+		void enable_snapshots() {
+			if (snapshot_root) return;
+			{
+				std::lock_guard<std::mutex> lck(snapshot_mtx);
+				snapshot_root = master_snapshot::make_root();
+			}
+			for (auto& e : devices) rebuild_snapshot(*e.second);
+		}
+
+		// O(1) point in time copy of the tree, safe to call from any thread.
+		// Empty unless enable_snapshots() was called.
+		master_snapshot snapshot() const {
+			std::shared_ptr<const master_snapshot::root> r;
+			{
+				std::lock_guard<std::mutex> lck(snapshot_mtx);
+				r = snapshot_root;
+			}
+			return master_snapshot(r, std::chrono::system_clock::now());
+		}
+
+		// Retained topics of objects that are no longer part of the announced structure:
+		// properties missing from $properties, nodes missing from $nodes and devices lost for at least lost_for.
+		// Nodes and properties are only checked once their parent announced its list.
+		// With forget set the stale objects are removed from the discovered tree.
+		// Clear the returned topics on the broker, e.g. with retained_purger.
+		std::vector<std::string> collect_stale_topics(std::chrono::seconds lost_for, bool forget = true) {
+			std::vector<std::string> res;
+			auto now = std::chrono::system_clock::now();
+			for (auto dit = devices.begin(); dit != devices.end();) {
+				auto& dev = *dit->second;
+				const std::string prefix = base_topic + dev.id + "/";
+				// Devices only presumed lost by liveness tracking keep their topics
+				if (dev.lost_since != std::chrono::system_clock::time_point() && now - dev.lost_since >= lost_for && dev.presumed_state.empty()) {
+					for (auto& e : dev.attributes) res.push_back(prefix + "$" + e.first);
+					for (auto& e : dev.nodes) node_topics(prefix, *e.second, res);
+					if (forget) {
+						if (snapshot_root) publish_snapshot_device(dev.id, nullptr);
+						if (liveness) liveness->remove(dev.id);
+						forget_device(dev);
+						dit = devices.erase(dit);
+					}
+					else dit++;
+					continue;
+				}
+				auto removed = res.size();
+				auto nodes_attr = dev.attributes.find("nodes");
+				auto node_ids = nodes_attr != dev.attributes.end() ? split_list(nodes_attr->second) : std::set<std::string>();
+				for (auto nit = dev.nodes.begin(); nit != dev.nodes.end();) {
+					auto& node = *nit->second;
+					if (nodes_attr != dev.attributes.end() && node_ids.count(node.id) == 0) {
+						node_topics(prefix, node, res);
+						if (forget) {
+							forget_node(dev, node);
+							nit = dev.nodes.erase(nit);
+						}
+						else nit++;
+						continue;
+					}
+					auto props_attr = node.attributes->find("properties");
+					if (props_attr != node.attributes->end()) {
+						auto prop_ids = split_list(props_attr->second);
+						for (auto pit = node.properties.begin(); pit != node.properties.end();) {
+							if (prop_ids.count(pit->first) == 0) {
+								property_topics(prefix, node, *pit->second, res);
+								if (forget) {
+									forget_property(dev, node, *pit->second);
+									pit = node.properties.erase(pit);
+								}
+								else pit++;
+							}
+							else pit++;
+						}
+					}
+					nit++;
+				}
+				if (forget && res.size() != removed) rebuild_snapshot(dev);
+				dit++;
+			}
+			return res;
+		}
 	};
 }
\ No newline at end of file
@@ -0,0 +1,151 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <exception>
+#include <cstdint>
+
+namespace homie {
+	namespace utils {
+		// Unbounded multi producer, single consumer queue (Vyukov).
+		// push links its node with a single atomic exchange, producers never wait for each other or the consumer.
+		// The node is allocated by push though, so it is only as lock free as the allocator.
+		// pop must only be called from one thread at a time.
+		template<typename T>
+		class mpsc_queue {
+			struct node {
+				std::atomic<node*> next;
+				T value;
+
+				node() : next(nullptr) {}
+				explicit node(T&& v) : next(nullptr), value(std::move(v)) {}
+			};
+
+			std::atomic<node*> head;
+			node* tail;
+		public:
+			mpsc_queue() {
+				auto stub = new node();
+				head.store(stub);
+				tail = stub;
+			}
+
+			~mpsc_queue() {
+				T v;
+				while (pop(v)) {}
+				delete tail;
+			}
+
+			mpsc_queue(const mpsc_queue&) = delete;
+			mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+			void push(T value) {
+				auto n = new node(std::move(value));
+				auto prev = head.exchange(n, std::memory_order_acq_rel);
+				// Until this store the consumer sees the queue end before n
+				prev->next.store(n, std::memory_order_release);
+			}
+
+			// Consumer only
+			bool pop(T& out) {
+				auto next = tail->next.load(std::memory_order_acquire);
+				if (next == nullptr) return false;
+				out = std::move(next->value);
+				delete tail;
+				tail = next;
+				return true;
+			}
+
+			// Consumer only
+			bool empty() const {
+				return tail->next.load(std::memory_order_acquire) == nullptr;
+			}
+		};
+
+		// Thread draining an mpsc_queue and handing everything available to fn as one batch.
+		// Producers only take a lock when they have to wake the sleeping consumer.
+		template<typename T>
+		class batch_consumer {
+			mpsc_queue<T> queue;
+			std::function<void(std::vector<T>&)> fn;
+			std::atomic<bool> sleeping;
+			std::atomic<uint64_t> pushed;
+			bool stop;
+			uint64_t handled;
+			std::mutex mtx;
+			std::condition_variable cv;
+			std::condition_variable done_cv;
+			std::thread worker;
+
+			void run() {
+				std::vector<T> batch;
+				while (true) {
+					batch.clear();
+					T v;
+					while (queue.pop(v)) batch.push_back(std::move(v));
+					if (!batch.empty()) {
+						try {
+							fn(batch);
+						}
+						catch (const std::exception&) {
+							// Keep the consumer alive, the batch is lost
+						}
+						std::lock_guard<std::mutex> lck(mtx);
+						handled += batch.size();
+						done_cv.notify_all();
+						continue;
+					}
+					std::unique_lock<std::mutex> lck(mtx);
+					if (stop) return;
+					sleeping = true;
+					// A producer may have pushed before seeing sleeping set
+					if (!queue.empty()) {
+						sleeping = false;
+						continue;
+					}
+					cv.wait(lck, [this]() { return !sleeping || stop; });
+					sleeping = false;
+				}
+			}
+		public:
+			explicit batch_consumer(std::function<void(std::vector<T>&)> handler)
+				: fn(std::move(handler)), sleeping(false), pushed(0), stop(false), handled(0)
+			{
+				worker = std::thread([this]() { run(); });
+			}
+
+			// Handles what is still queued before returning
+			~batch_consumer() {
+				{
+					std::lock_guard<std::mutex> lck(mtx);
+					stop = true;
+					cv.notify_all();
+				}
+				worker.join();
+			}
+
+			batch_consumer(const batch_consumer&) = delete;
+			batch_consumer& operator=(const batch_consumer&) = delete;
+
+			void push(T value) {
+				pushed.fetch_add(1);
+				queue.push(std::move(value));
+				if (sleeping.exchange(false)) {
+					std::lock_guard<std::mutex> lck(mtx);
+					cv.notify_one();
+				}
+			}
+
+			// Blocks until everything pushed before the call was handled
+			void flush() {
+				auto target = pushed.load();
+				std::unique_lock<std::mutex> lck(mtx);
+				done_cv.wait(lck, [&]() { return handled >= target; });
+			}
+		};
+	}
+}
@@ -1,7 +1,17 @@
 #pragma once
 #include "mqtt_event_handler.h"
+#include <string>
+#include <vector>
+#include <exception>
 
 namespace homie {
+	struct mqtt_message {
+		std::string topic;
+		std::string payload;
+		int qos;
+		bool retain;
+	};
+
 	struct mqtt_client {
 		virtual void set_event_handler(mqtt_event_handler* evt) = 0;
 		virtual void open(const std::string& will_topic, const std::string& will_payload, int will_qos, bool will_retain) = 0;
@@ -10,5 +20,18 @@ namespace homie {
 		virtual void subscribe(const std::string& topic, int qos) = 0;
 		virtual void unsubscribe(const std::string& topic) = 0;
 		virtual bool is_connected() const = 0;
+
+		// Publishes messages back to back, ok[i] tells whether messages[i] was handed to the broker.
+		// Transports able to pipeline or batch publishes should override this, the default publishes one by one.
+		virtual void publish_batch(const std::vector<mqtt_message>& messages, std::vector<bool>& ok) {
+			ok.assign(messages.size(), false);
+			for (size_t i = 0; i < messages.size(); i++) {
+				try {
+					publish(messages[i].topic, messages[i].payload, messages[i].qos, messages[i].retain);
+					ok[i] = true;
+				}
+				catch (const std::exception&) {}
+			}
+		}
 	};
 }
\ No newline at end of file
@@ -9,6 +9,9 @@ namespace homie {
 	typedef std::shared_ptr<device> device_ptr;
 	typedef std::shared_ptr<const device> const_device_ptr;
 
+	typedef utils::function_ref<void(const std::string& id, property& prop)> property_visitor;
+	typedef utils::function_ref<void(const std::string& id, const property& prop)> const_property_visitor;
+
 	struct node {
 		virtual device_ptr get_device() = 0;
 		virtual const_device_ptr get_device() const = 0;
@@ -29,17 +32,45 @@ namespace homie {
 		virtual void set_attribute(const std::string& id, const std::string& value) = 0;
 		virtual std::string get_attribute(const std::string& id, int64_t idx) const = 0;
 		virtual void set_attribute(const std::string& id, const std::string& value, int64_t idx) = 0;
+
+		// Visit every property/attribute without building an intermediate set or doing a second lookup
+		virtual void for_each_property(property_visitor fn) = 0;
+		virtual void for_each_property(const_property_visitor fn) const = 0;
+		virtual void for_each_attribute(attribute_visitor fn) const = 0;
+		virtual void for_each_attribute(int64_t idx, attribute_visitor fn) const = 0;
 	};
 	struct basic_node : public node {
 		virtual std::string get_name() const override { return get_attribute("name"); }
 		virtual std::string get_name(int64_t node_idx) const { return get_attribute("name", node_idx); }
 		virtual std::string get_type() const { return get_attribute("type"); }
 		virtual bool is_array() const { return get_attribute("array") != ""; }
+		// Empty range (0, -1) if the attribute is malformed
 		virtual std::pair<int64_t, int64_t> array_range() const {
 			auto att = get_attribute("array");
 			auto pos = att.find('-');
-			if (pos == std::string::npos || pos == 0 || pos == att.size() - 1) throw std::logic_error("invalid attribute");
-			return{ std::stoll(att.substr(0, pos)), std::stoll(att.substr(pos + 1)) };
+			int64_t first, last;
+			if (pos == std::string::npos || !utils::parse_int64(att.data(), att.data() + pos, first)
+				|| !utils::parse_int64(att.data() + pos + 1, att.data() + att.size(), last))
+				return{ 0, -1 };
+			return{ first, last };
+		}
+		virtual void for_each_property(property_visitor fn) override {
+			for (auto& e : get_properties()) {
+				auto p = get_property(e);
+				if (p) fn(e, *p);
+			}
+		}
+		virtual void for_each_property(const_property_visitor fn) const override {
+			for (auto& e : get_properties()) {
+				auto p = get_property(e);
+				if (p) fn(e, *p);
+			}
+		}
+		virtual void for_each_attribute(attribute_visitor fn) const override {
+			for (auto& e : get_attributes()) fn(e, get_attribute(e));
+		}
+		virtual void for_each_attribute(int64_t idx, attribute_visitor fn) const override {
+			for (auto& e : get_attributes(idx)) fn(e, get_attribute(e, idx));
 		}
 	};
 	typedef std::shared_ptr<node> node_ptr;
@@ -0,0 +1,348 @@
+#pragma once
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include "mqtt_client.h"
+#include "supervisor.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace homie {
+	struct outbox_options {
+		// Messages kept in memory, older messages are spilled (if enabled) or dropped
+		size_t max_entries = 1024;
+		// Messages per second published when draining, 0 drains everything at once
+		double drain_rate = 100;
+		double drain_burst = 100;
+		// Optional memory mapped file receiving messages that do not fit into memory.
+		// Messages left in the file are published after a restart as well.
+		std::string spill_path;
+		size_t spill_size = 1 << 20;
+	};
+
+	struct outbox_message {
+		std::string topic;
+		std::string payload;
+		int qos;
+		bool retain;
+	};
+
+#ifndef _WIN32
+	// Append only log of messages in a memory mapped file, consumed from the front.
+	class spill_file {
+		struct header {
+			uint32_t magic;
+			uint32_t count;
+			uint64_t read;
+			uint64_t write;
+		};
+		struct record {
+			uint32_t topic_len;
+			uint32_t payload_len;
+			uint8_t qos;
+			uint8_t retain;
+			uint8_t pad[2];
+		};
+		enum : uint32_t { file_magic = 0x484f4d51 };
+
+		int fd;
+		char* base;
+		size_t size;
+
+		header& head() const { return *reinterpret_cast<header*>(base); }
+		static size_t align(size_t v) { return (v + 7) & ~size_t(7); }
+
+		void truncate() {
+			auto& h = head();
+			h.count = 0;
+			h.read = h.write = sizeof(header);
+		}
+
+		bool front_record(record& r) {
+			auto& h = head();
+			if (h.write > size || h.read > h.write || h.write - h.read < sizeof(record)) {
+				truncate();
+				return false;
+			}
+			std::memcpy(&r, base + h.read, sizeof(r));
+			if (uint64_t(r.topic_len) + r.payload_len > h.write - h.read - sizeof(record)) {
+				truncate();
+				return false;
+			}
+			return true;
+		}
+	public:
+		spill_file(const std::string& path, size_t capacity)
+			: fd(-1), base(nullptr), size(std::max(capacity, sizeof(header) + sizeof(record) + 64))
+		{
+			fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+			if (fd < 0) throw std::runtime_error("failed to open " + path);
+			struct stat st;
+			if (::fstat(fd, &st) != 0 || (static_cast<size_t>(st.st_size) < size && ::ftruncate(fd, size) != 0)) {
+				::close(fd);
+				throw std::runtime_error("failed to resize " + path);
+			}
+			if (static_cast<size_t>(st.st_size) > size) size = static_cast<size_t>(st.st_size);
+			auto p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED) {
+				::close(fd);
+				throw std::runtime_error("failed to map " + path);
+			}
+			base = static_cast<char*>(p);
+			auto& h = head();
+			if (h.magic != file_magic || h.read > h.write || h.write > size) {
+				h.magic = file_magic;
+				h.count = 0;
+				h.read = h.write = sizeof(header);
+			}
+		}
+
+		~spill_file() {
+			::msync(base, size, MS_ASYNC);
+			::munmap(base, size);
+			::close(fd);
+		}
+
+		spill_file(const spill_file&) = delete;
+		spill_file& operator=(const spill_file&) = delete;
+
+		bool empty() const { return head().count == 0; }
+		size_t count() const { return head().count; }
+
+		bool push(const outbox_message& msg) {
+			auto& h = head();
+			auto len = align(sizeof(record) + msg.topic.size() + msg.payload.size());
+			if (h.count == 0) h.read = h.write = sizeof(header);
+			if (h.write + len > size) return false;
+			record r{ static_cast<uint32_t>(msg.topic.size()), static_cast<uint32_t>(msg.payload.size()), static_cast<uint8_t>(msg.qos), static_cast<uint8_t>(msg.retain ? 1 : 0), { 0, 0 } };
+			auto p = base + h.write;
+			std::memcpy(p, &r, sizeof(r));
+			std::memcpy(p + sizeof(r), msg.topic.data(), msg.topic.size());
+			std::memcpy(p + sizeof(r) + msg.topic.size(), msg.payload.data(), msg.payload.size());
+			h.write += len;
+			h.count++;
+			return true;
+		}
+
+		// Reads the record at the front, a record running past the written part of the file
+		// (e.g. after a crash while writing) drops it and everything behind it
+		bool front(outbox_message& msg) {
+			auto& h = head();
+			if (h.count == 0) return false;
+			record r;
+			if (!front_record(r)) return false;
+			auto p = base + h.read;
+			msg.topic.assign(p + sizeof(r), r.topic_len);
+			msg.payload.assign(p + sizeof(r) + r.topic_len, r.payload_len);
+			msg.qos = r.qos;
+			msg.retain = r.retain != 0;
+			return true;
+		}
+
+		void pop() {
+			auto& h = head();
+			if (h.count == 0) return;
+			record r;
+			if (!front_record(r)) return;
+			h.read += align(sizeof(record) + r.topic_len + r.payload_len);
+			if (--h.count == 0) h.read = h.write = sizeof(header);
+		}
+	};
+#endif
+
+	// Messages waiting for the connection to come back.
+	// Retained messages are coalesced per topic (the latest payload wins), the in memory part is bounded
+	// and older messages either move to a spill file or are dropped.
+	class outbound_queue {
+		typedef std::list<outbox_message> list_type;
+
+		std::mutex mtx;
+		// Serialises drains so messages leave in order, publishes run without holding mtx
+		std::mutex drain_mtx;
+		outbox_options opts;
+		list_type queue;
+		std::unordered_map<std::string, list_type::iterator> retained;
+		rate_limiter limiter;
+		size_t dropped;
+#ifndef _WIN32
+		std::unique_ptr<spill_file> spill;
+#endif
+
+		static std::unique_ptr<spill_file> open_spill(const outbox_options& options) {
+			if (options.spill_path.empty()) return nullptr;
+#ifndef _WIN32
+			return std::unique_ptr<spill_file>(new spill_file(options.spill_path, options.spill_size));
+#else
+			throw std::logic_error("spill files are not supported on this platform");
+#endif
+		}
+
+		void evict_front() {
+			auto& msg = queue.front();
+#ifndef _WIN32
+			if (!spill || !spill->push(msg)) dropped++;
+#else
+			dropped++;
+#endif
+			if (msg.retain) retained.erase(msg.topic);
+			queue.pop_front();
+		}
+	public:
+		outbound_queue(const outbox_options& options = outbox_options())
+			: opts(options), limiter(options.drain_rate, options.drain_burst), dropped(0)
+		{
+			if (opts.max_entries == 0) opts.max_entries = 1;
+#ifndef _WIN32
+			spill = open_spill(opts);
+#else
+			open_spill(opts);
+#endif
+		}
+
+		// Applies new options while other threads may push or drain. Queued messages are kept: a spill file
+		// at the same path stays in use, messages of a replaced spill file move to the new one or into memory.
+		// Beyond the new max_entries the oldest messages in memory move to the spill file or are dropped.
+		void reset(const outbox_options& options) {
+			std::lock_guard<std::mutex> drain_lck(drain_mtx);
+#ifndef _WIN32
+			std::unique_ptr<spill_file> next;
+			bool same_spill;
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				same_spill = options.spill_path == opts.spill_path;
+			}
+			if (!same_spill) next = open_spill(options);
+#else
+			open_spill(options);
+#endif
+			std::lock_guard<std::mutex> lck(mtx);
+			opts = options;
+			if (opts.max_entries == 0) opts.max_entries = 1;
+			limiter.set_rate(opts.drain_rate, opts.drain_burst);
+#ifndef _WIN32
+			if (!same_spill) {
+				spill.swap(next);
+				// Spilled messages are older than those in memory
+				list_type moved;
+				outbox_message msg;
+				while (next && next->front(msg)) {
+					next->pop();
+					if (spill) {
+						if (!spill->push(msg)) dropped++;
+						continue;
+					}
+					if (msg.retain && retained.count(msg.topic) != 0) continue;
+					moved.push_back(std::move(msg));
+					if (moved.back().retain) retained[moved.back().topic] = std::prev(moved.end());
+				}
+				queue.splice(queue.begin(), moved);
+			}
+#endif
+			while (queue.size() > opts.max_entries) evict_front();
+		}
+
+		// Time between two messages at the drain rate, 0 if the rate is not limited
+		std::chrono::milliseconds drain_interval() {
+			std::lock_guard<std::mutex> lck(mtx);
+			if (opts.drain_rate <= 0) return std::chrono::milliseconds(0);
+			return std::chrono::milliseconds(std::max<int64_t>(1, static_cast<int64_t>(1000 / opts.drain_rate)));
+		}
+
+		void push(const std::string& topic, const std::string& payload, int qos, bool retain) {
+			std::lock_guard<std::mutex> lck(mtx);
+			if (retain) {
+				auto it = retained.find(topic);
+				if (it != retained.end()) {
+					it->second->payload = payload;
+					it->second->qos = qos;
+					return;
+				}
+			}
+			if (queue.size() >= opts.max_entries) evict_front();
+			queue.push_back({ topic, payload, qos, retain });
+			if (retain) retained[topic] = std::prev(queue.end());
+		}
+
+		bool empty() {
+			std::lock_guard<std::mutex> lck(mtx);
+#ifndef _WIN32
+			if (spill && !spill->empty()) return false;
+#endif
+			return queue.empty();
+		}
+
+		// Messages in memory and in the spill file
+		size_t size() {
+			std::lock_guard<std::mutex> lck(mtx);
+#ifndef _WIN32
+			if (spill) return queue.size() + spill->count();
+#endif
+			return queue.size();
+		}
+
+		// Messages lost because the queue and the spill file were full
+		size_t get_dropped() {
+			std::lock_guard<std::mutex> lck(mtx);
+			return dropped;
+		}
+
+		// Publishes queued messages, oldest first, as long as the drain rate allows or everything with unlimited set.
+		// Stops at the first failing publish (rethrowing its exception) and keeps that message.
+		// Returns the number of published messages. Publishes do not block push().
+		size_t drain(mqtt_client& mqtt, bool unlimited = false) {
+			std::lock_guard<std::mutex> drain_lck(drain_mtx);
+			std::unique_lock<std::mutex> lck(mtx);
+			size_t published = 0;
+#ifndef _WIN32
+			// Only drains pop from the spill file, so its front stays put while unlocked
+			outbox_message msg;
+			while (spill && spill->front(msg)) {
+				// A newer payload for the same retained topic is still in memory
+				if (msg.retain && retained.count(msg.topic) != 0) {
+					spill->pop();
+					continue;
+				}
+				if (!unlimited && !limiter.try_acquire()) return published;
+				lck.unlock();
+				mqtt.publish(msg.topic, msg.payload, msg.qos, msg.retain);
+				lck.lock();
+				spill->pop();
+				published++;
+			}
+#endif
+			while (!queue.empty()) {
+				if (!unlimited && !limiter.try_acquire()) return published;
+				auto front = std::move(queue.front());
+				if (front.retain) retained.erase(front.topic);
+				queue.pop_front();
+				lck.unlock();
+				try {
+					mqtt.publish(front.topic, front.payload, front.qos, front.retain);
+				}
+				catch (...) {
+					lck.lock();
+					// Unless a newer payload for the retained topic arrived meanwhile
+					if (!front.retain || retained.count(front.topic) == 0) {
+						queue.push_front(std::move(front));
+						if (queue.front().retain) retained[queue.front().topic] = queue.begin();
+					}
+					throw;
+				}
+				lck.lock();
+				published++;
+			}
+			return published;
+		}
+	};
+}
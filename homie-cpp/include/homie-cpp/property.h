@@ -1,13 +1,18 @@
 #pragma once
 #include <string>
 #include <memory>
+#include <set>
 #include "datatype.h"
+#include "format.h"
+#include "utils.h"
 
 namespace homie {
 	struct node;
 	typedef std::shared_ptr<node> node_ptr;
 	typedef std::shared_ptr<const node> const_node_ptr;
 
+	typedef utils::function_ref<void(const std::string& id, const std::string& value)> attribute_visitor;
+
 	struct property {
 		virtual node_ptr get_node() = 0;
 		virtual const_node_ptr get_node() const = 0;
@@ -24,10 +29,15 @@ namespace homie {
 		virtual void set_value(int64_t node_idx, const std::string& value) = 0;
 		virtual std::string get_value() const = 0;
 		virtual void set_value(const std::string& value) = 0;
+		// Called by client for incoming sets that passed $format validation
+		virtual void set_typed_value(int64_t node_idx, const typed_value& typed, const std::string& value) = 0;
+		virtual void set_typed_value(const typed_value& typed, const std::string& value) = 0;
 
 		virtual std::set<std::string> get_attributes() const = 0;
 		virtual std::string get_attribute(const std::string& id) const = 0;
 		virtual void set_attribute(const std::string& id, const std::string& value) = 0;
+		// Visit every attribute without building an intermediate set
+		virtual void for_each_attribute(attribute_visitor fn) const = 0;
 	};
 	struct basic_property : public property {
 		virtual std::string get_name() const override { return get_attribute("name"); }
@@ -39,6 +49,11 @@ namespace homie {
 		}
 		virtual std::string get_format() const { return get_attribute("format"); }
 		virtual bool is_retained() const { return get_attribute("retained") == "true"; }
+		virtual void set_typed_value(int64_t node_idx, const typed_value& typed, const std::string& value) override { set_value(node_idx, value); }
+		virtual void set_typed_value(const typed_value& typed, const std::string& value) override { set_value(value); }
+		virtual void for_each_attribute(attribute_visitor fn) const override {
+			for (auto& e : get_attributes()) fn(e, get_attribute(e));
+		}
 	};
 	typedef std::shared_ptr<property> property_ptr;
 	typedef std::shared_ptr<const property> const_property_ptr;
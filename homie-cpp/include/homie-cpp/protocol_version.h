@@ -0,0 +1,45 @@
+#pragma once
+#include <string>
+
+namespace homie {
+	template<typename T>
+	inline T enum_from_string(const std::string& s);
+	template<typename T>
+	inline bool try_enum_from_string(const std::string& s, T& out);
+
+	enum class protocol_version {
+		v3,
+		v4,
+		// Structure is published as one JSON $description, there is no $homie topic
+		v5
+	};
+
+	// Value of the $homie attribute
+	inline std::string enum_to_string(protocol_version v) {
+		switch (v)
+		{
+		case protocol_version::v3: return "3.0.0";
+		case protocol_version::v4: return "4.0.0";
+		case protocol_version::v5: return "5.0";
+		default:
+			throw std::invalid_argument("invalid enum value");
+		}
+	}
+
+	// Only the major version is relevant, minor versions are compatible
+	template<>
+	inline bool try_enum_from_string<protocol_version>(const std::string& s, protocol_version& out) {
+		auto major = s.substr(0, s.find('.'));
+		if (major == "3") { out = protocol_version::v3; return true; }
+		if (major == "4") { out = protocol_version::v4; return true; }
+		if (major == "5") { out = protocol_version::v5; return true; }
+		return false;
+	}
+
+	template<>
+	inline protocol_version enum_from_string<protocol_version>(const std::string& s) {
+		protocol_version res;
+		if (!try_enum_from_string(s, res)) throw std::invalid_argument("not a enum member");
+		return res;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,75 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace homie {
+	struct quarantined_message {
+		std::string topic;
+		// Truncated to the configured limit
+		std::string payload;
+		std::string reason;
+		std::chrono::system_clock::time_point time;
+	};
+
+	// Counts malformed incoming messages and keeps the latest ones in a bounded ring for inspection.
+	// Without a capacity rejecting a message is a single atomic increment.
+	class message_quarantine {
+		mutable std::mutex mtx;
+		std::vector<quarantined_message> ring;
+		size_t next;
+		std::atomic<size_t> capacity;
+		size_t max_payload;
+		std::atomic<uint64_t> rejected;
+	public:
+		message_quarantine()
+			: next(0), capacity(0), max_payload(0), rejected(0)
+		{}
+
+		message_quarantine(const message_quarantine&) = delete;
+		message_quarantine& operator=(const message_quarantine&) = delete;
+
+		// Keeps the last messages messages with at most payload_limit bytes of payload, 0 only counts
+		void set_capacity(size_t messages, size_t payload_limit) {
+			std::lock_guard<std::mutex> lck(mtx);
+			ring.clear();
+			next = 0;
+			max_payload = payload_limit;
+			capacity = messages;
+		}
+
+		void add(const std::string& topic, const std::string& payload, const std::string& reason) {
+			rejected++;
+			if (capacity == 0) return;
+			std::lock_guard<std::mutex> lck(mtx);
+			if (capacity == 0) return;
+			quarantined_message msg{ topic, payload.substr(0, max_payload), reason, std::chrono::system_clock::now() };
+			if (ring.size() < capacity) ring.push_back(std::move(msg));
+			else ring[next] = std::move(msg);
+			next = (next + 1) % capacity;
+		}
+
+		// Malformed messages seen, including those no longer kept
+		uint64_t count() const {
+			return rejected;
+		}
+
+		// Oldest first
+		std::vector<quarantined_message> get_messages() const {
+			std::lock_guard<std::mutex> lck(mtx);
+			if (ring.size() < capacity) return ring;
+			std::vector<quarantined_message> res(ring.begin() + next, ring.end());
+			res.insert(res.end(), ring.begin(), ring.begin() + next);
+			return res;
+		}
+
+		void clear() {
+			std::lock_guard<std::mutex> lck(mtx);
+			ring.clear();
+			next = 0;
+		}
+	};
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <exception>
+#include "mqtt_client.h"
+#include "supervisor.h"
+
+namespace homie {
+	// Clears retained topics by publishing empty retained messages.
+	// Messages go out in batches of up to batch_size at no more than rate messages per second.
+	class retained_purger {
+		mqtt_client& mqtt;
+		rate_limiter limiter;
+	public:
+		retained_purger(mqtt_client& con, double rate = 100, size_t batch_size = 100)
+			: mqtt(con), limiter(rate, static_cast<double>(batch_size))
+		{}
+
+		// Returns the number of cleared topics, stops at the first failing publish
+		size_t purge(const std::vector<std::string>& topics) {
+			size_t done = 0;
+			for (auto& topic : topics) {
+				limiter.acquire();
+				try {
+					mqtt.publish(topic, "", 1, true);
+				}
+				catch (const std::exception&) {
+					break;
+				}
+				done++;
+			}
+			return done;
+		}
+	};
+}
\ No newline at end of file
@@ -0,0 +1,497 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+#include "utils.h"
+
+namespace homie {
+	// Property referenced by a rule, "device/node/property" or "device/node_1/property" for array nodes
+	struct property_ref {
+		std::string device;
+		std::string node;
+		std::string property;
+		bool is_array = false;
+		int64_t index = 0;
+
+		std::string key() const {
+			return device + "/" + node + (is_array ? "_" + std::to_string(index) : std::string()) + "/" + property;
+		}
+
+		static property_ref parse(const std::string& text) {
+			auto parts = utils::split<std::string>(text, "/");
+			if (parts.size() != 3) throw std::invalid_argument("invalid property reference " + text);
+			for (auto& e : parts) if (e.empty()) throw std::invalid_argument("invalid property reference " + text);
+			property_ref res;
+			res.device = parts[0];
+			res.node = parts[1];
+			res.property = parts[2];
+			auto pos = res.node.find('_');
+			if (pos != std::string::npos) {
+				if (!utils::parse_int64(res.node.data() + pos + 1, res.node.data() + res.node.size(), res.index))
+					throw std::invalid_argument("invalid property reference " + text);
+				res.is_array = true;
+				res.node.resize(pos);
+			}
+			return res;
+		}
+	};
+
+	// Condition/action rules over property values.
+	// Conditions are expressions over property references in braces, e.g.
+	//   {home/living/temperature} > 22.5 && {home/window/open} == true
+	// with || && ! == != < <= > >= + - * / and parentheses. Values that parse as numbers (or true/false)
+	// compare numerically, == and != compare everything else as text. Ordering and arithmetic on text or
+	// unknown properties is not comparable and makes the comparison false. A rule fires its actions when
+	// its condition turns true, which requires every property in the condition to have a value.
+	// Every referenced property has a slot that lists the rules reading it, so a value change only
+	// re-evaluates those rules.
+	class rule_engine {
+	public:
+		typedef uint32_t rule_id;
+
+		struct fired_action {
+			property_ref target;
+			std::string value;
+			// False if the value expression read a property without a value, the action must not be published
+			bool known;
+		};
+	private:
+		enum class op : uint8_t {
+			push_const, push_slot,
+			neg, lnot,
+			add, sub, mul, div,
+			eq, ne, lt, le, gt, ge,
+			land, lor
+		};
+		struct instr {
+			op code;
+			uint32_t arg;
+		};
+		typedef std::vector<instr> program;
+
+		struct operand {
+			double num;
+			bool numeric;
+			// Null for computed numbers
+			const std::string* text;
+			// False for unknown properties and arithmetic on them or on text
+			bool known;
+		};
+
+		struct slot {
+			// Property key, empty for constants and released slots
+			std::string key;
+			std::string value;
+			double num;
+			bool numeric;
+			// Set once a non empty value was received
+			bool known;
+			std::vector<rule_id> rules;
+		};
+
+		struct action {
+			property_ref target;
+			program value;
+		};
+
+		struct rule {
+			program condition;
+			std::vector<action> actions;
+			std::vector<uint32_t> slots;
+			// Slots read by the condition, a subset of slots
+			std::vector<uint32_t> inputs;
+			std::vector<uint32_t> constants;
+			bool state;
+		};
+
+		mutable std::mutex mtx;
+		std::vector<slot> slots;
+		std::unordered_map<std::string, uint32_t> slot_index;
+		std::vector<slot> constants;
+		std::vector<std::unique_ptr<rule>> rules;
+		// Entries released by remove(), reused before the vectors grow
+		std::vector<uint32_t> free_slots;
+		std::vector<uint32_t> free_constants;
+		std::vector<rule_id> free_rules;
+		// Slots and constants created by the rule add() is compiling
+		std::vector<uint32_t> new_slots;
+		std::vector<uint32_t> new_constants;
+		std::vector<operand> stack;
+		std::atomic<size_t> active_rules;
+		uint64_t fired;
+
+		static const std::string& true_text() { static const std::string s = "true"; return s; }
+		static const std::string& false_text() { static const std::string s = "false"; return s; }
+
+		static void classify(slot& s) {
+			if (s.value == "true") { s.num = 1; s.numeric = true; return; }
+			if (s.value == "false") { s.num = 0; s.numeric = true; return; }
+			char* end = nullptr;
+			s.num = std::strtod(s.value.c_str(), &end);
+			s.numeric = !s.value.empty() && *end == '\0';
+		}
+
+		// Recursive descent parser emitting postfix code
+		class compiler {
+			rule_engine& engine;
+			const std::string& src;
+			size_t pos;
+			program& out;
+			std::vector<uint32_t>* refs;
+
+			[[noreturn]] void error(const std::string& msg) {
+				throw std::invalid_argument(msg + " at " + std::to_string(pos) + " in " + src);
+			}
+			void skip_ws() {
+				while (pos < src.size() && (src[pos] == ' ' || src[pos] == '\t' || src[pos] == '\n' || src[pos] == '\r')) pos++;
+			}
+			bool accept(const char* tok) {
+				skip_ws();
+				auto len = std::char_traits<char>::length(tok);
+				if (src.compare(pos, len, tok) != 0) return false;
+				pos += len;
+				return true;
+			}
+			void emit(op code, uint32_t arg = 0) { out.push_back({ code, arg }); }
+
+			void parse_or() {
+				parse_and();
+				while (accept("||")) { parse_and(); emit(op::lor); }
+			}
+			void parse_and() {
+				parse_cmp();
+				while (accept("&&")) { parse_cmp(); emit(op::land); }
+			}
+			void parse_cmp() {
+				parse_add();
+				static const std::pair<const char*, op> ops[] = {
+					{ "==", op::eq }, { "!=", op::ne }, { "<=", op::le }, { ">=", op::ge }, { "<", op::lt }, { ">", op::gt }
+				};
+				for (auto& e : ops) {
+					if (accept(e.first)) {
+						parse_add();
+						emit(e.second);
+						return;
+					}
+				}
+			}
+			void parse_add() {
+				parse_mul();
+				while (true) {
+					if (accept("+")) { parse_mul(); emit(op::add); }
+					else if (accept("-")) { parse_mul(); emit(op::sub); }
+					else return;
+				}
+			}
+			void parse_mul() {
+				parse_unary();
+				while (true) {
+					if (accept("*")) { parse_unary(); emit(op::mul); }
+					else if (accept("/")) { parse_unary(); emit(op::div); }
+					else return;
+				}
+			}
+			void parse_unary() {
+				if (accept("!")) { parse_unary(); emit(op::lnot); }
+				else if (accept("-")) { parse_unary(); emit(op::neg); }
+				else parse_primary();
+			}
+			void parse_primary() {
+				skip_ws();
+				if (pos >= src.size()) error("unexpected end");
+				char c = src[pos];
+				if (c == '(') {
+					pos++;
+					parse_or();
+					if (!accept(")")) error("expected )");
+				}
+				else if (c == '{') {
+					auto end = src.find('}', pos);
+					if (end == std::string::npos) error("expected }");
+					auto ref = property_ref::parse(src.substr(pos + 1, end - pos - 1));
+					pos = end + 1;
+					auto id = engine.get_slot(ref.key());
+					if (refs) refs->push_back(id);
+					emit(op::push_slot, id);
+				}
+				else if (c == '"') {
+					std::string text;
+					pos++;
+					while (pos < src.size() && src[pos] != '"') {
+						if (src[pos] == '\\' && pos + 1 < src.size()) pos++;
+						text += src[pos++];
+					}
+					if (pos >= src.size()) error("unterminated string");
+					pos++;
+					emit(op::push_const, engine.add_constant(text));
+				}
+				else if ((c >= '0' && c <= '9') || c == '.') {
+					auto start = pos;
+					while (pos < src.size() && ((src[pos] >= '0' && src[pos] <= '9') || src[pos] == '.' || src[pos] == 'e' || src[pos] == 'E'
+						|| ((src[pos] == '+' || src[pos] == '-') && (src[pos - 1] == 'e' || src[pos - 1] == 'E'))))
+						pos++;
+					emit(op::push_const, engine.add_constant(src.substr(start, pos - start)));
+				}
+				else if (accept("true")) emit(op::push_const, engine.add_constant("true"));
+				else if (accept("false")) emit(op::push_const, engine.add_constant("false"));
+				else error("unexpected character");
+			}
+		public:
+			compiler(rule_engine& e, const std::string& s, program& p, std::vector<uint32_t>* r)
+				: engine(e), src(s), pos(0), out(p), refs(r)
+			{}
+
+			void compile() {
+				parse_or();
+				skip_ws();
+				if (pos != src.size()) error("unexpected input");
+			}
+		};
+
+		uint32_t get_slot(const std::string& key) {
+			auto it = slot_index.find(key);
+			if (it != slot_index.end()) return it->second;
+			auto id = allocate(slots, free_slots);
+			auto& s = slots[id];
+			s.key = key;
+			classify(s);
+			s.known = false;
+			slot_index.insert({ key, id });
+			new_slots.push_back(id);
+			return id;
+		}
+
+		uint32_t add_constant(const std::string& text) {
+			auto id = allocate(constants, free_constants);
+			auto& c = constants[id];
+			c.value = text;
+			classify(c);
+			c.known = true;
+			new_constants.push_back(id);
+			return id;
+		}
+
+		template<typename T>
+		static uint32_t allocate(std::vector<T>& entries, std::vector<uint32_t>& free_list) {
+			if (free_list.empty()) {
+				entries.emplace_back();
+				return static_cast<uint32_t>(entries.size() - 1);
+			}
+			auto id = free_list.back();
+			free_list.pop_back();
+			return id;
+		}
+
+		void release_slot(uint32_t id) {
+			slot_index.erase(slots[id].key);
+			slots[id] = slot();
+			free_slots.push_back(id);
+		}
+
+		void release_constant(uint32_t id) {
+			constants[id] = slot();
+			free_constants.push_back(id);
+		}
+
+		static operand make(const slot& s) { return { s.num, s.numeric, &s.value, s.known }; }
+		static operand make(bool b) { return { b ? 1.0 : 0.0, true, b ? &true_text() : &false_text(), true }; }
+		static operand make(double d) { return { d, true, nullptr, true }; }
+		static operand unknown() { return { 0, false, nullptr, false }; }
+
+		static bool number(const operand& o) { return o.known && o.numeric; }
+
+		static bool truthy(const operand& o) {
+			if (!o.known) return false;
+			if (o.numeric) return o.num != 0;
+			return o.text != nullptr && !o.text->empty();
+		}
+
+		// -1, 0, 1 or 2 if the operands are not comparable
+		static int compare(const operand& a, const operand& b) {
+			if (!a.known || !b.known) return 2;
+			if (a.numeric && b.numeric) return a.num < b.num ? -1 : (a.num > b.num ? 1 : 0);
+			if (a.text == nullptr || b.text == nullptr) return 2;
+			auto c = a.text->compare(*b.text);
+			return c < 0 ? -1 : (c > 0 ? 1 : 0);
+		}
+
+		// Caller holds mtx
+		operand run(const program& p) {
+			stack.clear();
+			for (auto& i : p) {
+				switch (i.code) {
+				case op::push_const: stack.push_back(make(constants[i.arg])); continue;
+				case op::push_slot: stack.push_back(make(slots[i.arg])); continue;
+				case op::neg: stack.back() = number(stack.back()) ? make(-stack.back().num) : unknown(); continue;
+				case op::lnot: stack.back() = make(!truthy(stack.back())); continue;
+				default: break;
+				}
+				auto b = stack.back();
+				stack.pop_back();
+				auto& a = stack.back();
+				// Arithmetic and ordering are only defined on numbers
+				if (i.code >= op::add && i.code <= op::div && !(number(a) && number(b))) {
+					a = unknown();
+					continue;
+				}
+				if (i.code >= op::lt && i.code <= op::ge && !(number(a) && number(b))) {
+					a = make(false);
+					continue;
+				}
+				switch (i.code) {
+				case op::add: a = make(a.num + b.num); break;
+				case op::sub: a = make(a.num - b.num); break;
+				case op::mul: a = make(a.num * b.num); break;
+				case op::div: a = make(a.num / b.num); break;
+				case op::eq: a = make(compare(a, b) == 0); break;
+				case op::ne: { auto c = compare(a, b); a = make(c == -1 || c == 1); break; }
+				case op::lt: a = make(compare(a, b) == -1); break;
+				case op::le: { auto c = compare(a, b); a = make(c == -1 || c == 0); break; }
+				case op::gt: a = make(compare(a, b) == 1); break;
+				case op::ge: { auto c = compare(a, b); a = make(c == 1 || c == 0); break; }
+				case op::land: a = make(truthy(a) && truthy(b)); break;
+				case op::lor: a = make(truthy(a) || truthy(b)); break;
+				default: break;
+				}
+			}
+			return stack.back();
+		}
+
+		static std::string to_text(const operand& o) {
+			if (o.text) return *o.text;
+			if (std::isfinite(o.num) && o.num == std::floor(o.num) && std::fabs(o.num) < 1e15)
+				return std::to_string(static_cast<int64_t>(o.num));
+			char buf[32];
+			std::snprintf(buf, sizeof(buf), "%.10g", o.num);
+			return buf;
+		}
+
+		// Caller holds mtx
+		bool ready(const rule& r) const {
+			for (auto s : r.inputs) {
+				if (!slots[s].known) return false;
+			}
+			return true;
+		}
+
+		// Caller holds mtx
+		void evaluate(rule& r, std::vector<fired_action>& out) {
+			bool now = ready(r) && truthy(run(r.condition));
+			if (now && !r.state) {
+				fired++;
+				for (auto& a : r.actions) {
+					auto v = run(a.value);
+					out.push_back({ a.target, v.known ? to_text(v) : std::string(), v.known });
+				}
+			}
+			r.state = now;
+		}
+	public:
+		rule_engine()
+			: active_rules(0), fired(0)
+		{}
+
+		// Cheap check before building slot keys
+		bool empty() const { return active_rules == 0; }
+
+		// Compiles a rule, actions are (target property reference, value expression) pairs.
+		// current provides the known value of newly referenced properties. The condition is evaluated once
+		// without firing, so a rule that is already true fires only after turning false and true again.
+		// A rule reading properties without a value starts false and fires once they arrive.
+		// Throws std::invalid_argument on syntax errors.
+		rule_id add(const std::string& condition, const std::vector<std::pair<std::string, std::string>>& actions,
+			utils::function_ref<bool(const property_ref&, std::string&)> current) {
+			std::lock_guard<std::mutex> lck(mtx);
+			new_slots.clear();
+			new_constants.clear();
+			std::unique_ptr<rule> r(new rule());
+			r->state = false;
+			try {
+				compiler(*this, condition, r->condition, &r->inputs).compile();
+				r->slots = r->inputs;
+				for (auto& e : actions) {
+					auto target = e.first;
+					if (target.size() > 2 && target.front() == '{' && target.back() == '}') target = target.substr(1, target.size() - 2);
+					r->actions.push_back({ property_ref::parse(target), program() });
+					compiler(*this, e.second, r->actions.back().value, &r->slots).compile();
+				}
+			}
+			catch (...) {
+				// Drop slots and constants created for the broken rule
+				for (auto s : new_slots) release_slot(s);
+				for (auto c : new_constants) release_constant(c);
+				throw;
+			}
+			for (auto i : new_slots) {
+				auto& s = slots[i];
+				if (current(property_ref::parse(s.key), s.value)) {
+					classify(s);
+					s.known = !s.value.empty();
+				}
+			}
+			r->constants = new_constants;
+			auto id = allocate(rules, free_rules);
+			std::sort(r->slots.begin(), r->slots.end());
+			r->slots.erase(std::unique(r->slots.begin(), r->slots.end()), r->slots.end());
+			std::sort(r->inputs.begin(), r->inputs.end());
+			r->inputs.erase(std::unique(r->inputs.begin(), r->inputs.end()), r->inputs.end());
+			for (auto s : r->slots) slots[s].rules.push_back(id);
+			r->state = ready(*r) && truthy(run(r->condition));
+			rules[id] = std::move(r);
+			active_rules++;
+			return id;
+		}
+
+		// Releases the rule and the slots no other rule reads, the id may be reused by a later add()
+		void remove(rule_id id) {
+			std::lock_guard<std::mutex> lck(mtx);
+			if (id >= rules.size() || !rules[id]) return;
+			for (auto s : rules[id]->slots) {
+				auto& list = slots[s].rules;
+				list.erase(std::remove(list.begin(), list.end(), id), list.end());
+				if (list.empty()) release_slot(s);
+			}
+			for (auto c : rules[id]->constants) release_constant(c);
+			rules[id].reset();
+			free_rules.push_back(id);
+			active_rules--;
+		}
+
+		// Stores a new property value and evaluates the rules reading it.
+		// Actions of rules that turned true are appended to out. Returns false if no rule reads key.
+		bool update(const std::string& key, const std::string& value, std::vector<fired_action>& out) {
+			std::lock_guard<std::mutex> lck(mtx);
+			auto it = slot_index.find(key);
+			if (it == slot_index.end()) return false;
+			auto& s = slots[it->second];
+			if (s.value == value) return true;
+			s.value = value;
+			classify(s);
+			s.known = !value.empty();
+			for (auto id : s.rules) evaluate(*rules[id], out);
+			return true;
+		}
+
+		size_t size() const { return active_rules; }
+
+		// Properties read by at least one rule
+		size_t get_slot_count() const {
+			std::lock_guard<std::mutex> lck(mtx);
+			return slot_index.size();
+		}
+
+		uint64_t get_fired() const {
+			std::lock_guard<std::mutex> lck(mtx);
+			return fired;
+		}
+	};
+}
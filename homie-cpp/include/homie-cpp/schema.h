@@ -0,0 +1,467 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <tuple>
+#include <vector>
+#include <map>
+#include <set>
+#include <functional>
+#include <utility>
+#include <chrono>
+#include "device.h"
+#include "format.h"
+
+// Compile time description of a device.
+//
+// Properties, nodes and devices are described by plain structs with constexpr static member functions:
+//
+//	struct intensity : homie::schema::property_defaults {
+//		static constexpr const char* id() { return "intensity"; }
+//		static constexpr const char* name() { return "Intensity"; }
+//		static constexpr homie::datatype type() { return homie::datatype::integer; }
+//		static constexpr const char* unit() { return "%"; }
+//		static constexpr const char* format() { return "0:100"; }
+//		static constexpr bool settable() { return true; }
+//	};
+//	struct light : homie::schema::node_defaults {
+//		static constexpr const char* id() { return "light"; }
+//		static constexpr const char* name() { return "Light"; }
+//		static constexpr const char* type() { return "dimmer"; }
+//		typedef homie::schema::list<intensity> properties;
+//	};
+//	struct lamp : homie::schema::device_defaults {
+//		static constexpr const char* name() { return "Lamp"; }
+//		typedef homie::schema::list<light> nodes;
+//	};
+//
+//	auto dev = homie::schema::make_device<lamp>("lamp-1");
+//	dev->get<light>().get<intensity>().on_set = ...;
+//
+// The generated classes are final and resolve ids and attributes from the descriptors,
+// attribute tables and announcement payloads are built once per type.
+namespace homie {
+	namespace schema {
+		template<typename... T>
+		struct list {};
+
+		struct property_defaults {
+			static constexpr const char* unit() { return ""; }
+			static constexpr const char* format() { return ""; }
+			static constexpr bool settable() { return false; }
+			static constexpr bool retained() { return true; }
+		};
+
+		struct node_defaults {
+			typedef list<> properties;
+		};
+
+		struct device_defaults {
+			static constexpr const char* firmware_name() { return ""; }
+			static constexpr const char* firmware_version() { return ""; }
+			static constexpr const char* implementation() { return "homie-cpp"; }
+			static constexpr int64_t stats_interval() { return 60; }
+			typedef list<> nodes;
+		};
+
+		namespace detail {
+			constexpr bool str_equal(const char* a, const char* b) {
+				return *a == *b && (*a == '\0' || str_equal(a + 1, b + 1));
+			}
+
+			// Homie ids consist of lowercase letters, digits and hyphens and do not start with a hyphen
+			constexpr bool valid_id_chars(const char* s) {
+				return *s == '\0' || (((*s >= 'a' && *s <= 'z') || (*s >= '0' && *s <= '9') || *s == '-') && valid_id_chars(s + 1));
+			}
+			constexpr bool valid_id(const char* s) {
+				return *s != '\0' && *s != '-' && valid_id_chars(s);
+			}
+
+			template<typename... T>
+			struct ids_unique;
+			template<>
+			struct ids_unique<> { static constexpr bool value = true; };
+			template<typename T, typename... Rest>
+			struct ids_unique<T, Rest...> {
+				static constexpr bool differs() {
+					bool res = true;
+					const char* ids[] = { "", Rest::id()... };
+					for (size_t i = 1; i < sizeof(ids) / sizeof(ids[0]); i++)
+						res = res && !str_equal(T::id(), ids[i]);
+					return res;
+				}
+				static constexpr bool value = differs() && ids_unique<Rest...>::value;
+			};
+
+			template<typename... T>
+			struct ids_valid;
+			template<>
+			struct ids_valid<> { static constexpr bool value = true; };
+			template<typename T, typename... Rest>
+			struct ids_valid<T, Rest...> {
+				static constexpr bool value = valid_id(T::id()) && ids_valid<Rest...>::value;
+			};
+
+			template<typename T, typename... List>
+			struct index_of;
+			template<typename T, typename... Rest>
+			struct index_of<T, T, Rest...> { static constexpr size_t value = 0; };
+			template<typename T, typename U, typename... Rest>
+			struct index_of<T, U, Rest...> { static constexpr size_t value = 1 + index_of<T, Rest...>::value; };
+
+			template<typename Tuple, typename Fn, size_t... I>
+			void for_each(Tuple& t, Fn&& fn, std::index_sequence<I...>) {
+				int dummy[] = { 0, (fn(std::get<I>(t)), 0)... };
+				(void)dummy;
+			}
+			template<typename... T, typename Fn>
+			void for_each(std::tuple<T...>& t, Fn&& fn) {
+				for_each(t, std::forward<Fn>(fn), std::index_sequence_for<T...>());
+			}
+			template<typename... T, typename Fn>
+			void for_each(const std::tuple<T...>& t, Fn&& fn) {
+				for_each(t, std::forward<Fn>(fn), std::index_sequence_for<T...>());
+			}
+
+			typedef std::vector<std::pair<std::string, std::string>> attribute_table;
+
+			template<typename Desc>
+			const attribute_table& property_attributes() {
+				static const attribute_table table = {
+					{ "datatype", enum_to_string(Desc::type()) },
+					{ "format", Desc::format() },
+					{ "name", Desc::name() },
+					{ "retained", Desc::retained() ? "true" : "false" },
+					{ "settable", Desc::settable() ? "true" : "false" },
+					{ "unit", Desc::unit() }
+				};
+				return table;
+			}
+
+			template<typename Desc>
+			const attribute_table& node_attributes() {
+				static const attribute_table table = {
+					{ "name", Desc::name() },
+					{ "type", Desc::type() }
+				};
+				return table;
+			}
+
+			inline const std::string* find_attribute(const attribute_table& table, const std::string& id) {
+				for (auto& e : table)
+					if (e.first == id) return &e.second;
+				return nullptr;
+			}
+		}
+
+		template<typename Desc>
+		class static_property final : public property {
+			static_assert(detail::valid_id(Desc::id()), "invalid property id");
+			std::weak_ptr<homie::node> parent;
+			std::map<std::string, std::string> extra_attributes;
+		public:
+			typedef Desc descriptor;
+			static constexpr const char* descriptor_id() { return Desc::id(); }
+
+			std::string value;
+			// Called for sets received through homie::client, the value is already validated against $format
+			std::function<void(static_property&, const typed_value&, const std::string&)> on_set;
+
+			explicit static_property(std::weak_ptr<homie::node> node)
+				: parent(node)
+			{}
+
+			static const property_format& compiled_format() {
+				static const property_format fmt = property_format::compile(Desc::type(), Desc::format());
+				return fmt;
+			}
+
+			// Inherited by property
+			virtual node_ptr get_node() override { return parent.lock(); }
+			virtual const_node_ptr get_node() const override { return parent.lock(); }
+			virtual std::string get_id() const override { return Desc::id(); }
+			virtual std::string get_name() const override { return Desc::name(); }
+			virtual bool is_settable() const override { return Desc::settable(); }
+			virtual std::string get_unit() const override { return Desc::unit(); }
+			virtual datatype get_datatype() const override { return Desc::type(); }
+			virtual std::string get_format() const override { return Desc::format(); }
+			virtual bool is_retained() const override { return Desc::retained(); }
+
+			// Array nodes are not supported by the schema
+			virtual std::string get_value(int64_t node_idx) const override { return ""; }
+			virtual void set_value(int64_t node_idx, const std::string& value) override {}
+			virtual std::string get_value() const override { return value; }
+			virtual void set_value(const std::string& v) override {
+				typed_value typed;
+				if (compiled_format().validate(v, typed)) set_typed_value(typed, v);
+			}
+			virtual void set_typed_value(int64_t node_idx, const typed_value& typed, const std::string& v) override {}
+			virtual void set_typed_value(const typed_value& typed, const std::string& v) override {
+				value = v;
+				if (on_set) on_set(*this, typed, v);
+			}
+
+			virtual std::set<std::string> get_attributes() const override {
+				std::set<std::string> res;
+				for (auto& e : detail::property_attributes<Desc>()) res.insert(e.first);
+				for (auto& e : extra_attributes) res.insert(e.first);
+				return res;
+			}
+			virtual std::string get_attribute(const std::string& id) const override {
+				auto v = detail::find_attribute(detail::property_attributes<Desc>(), id);
+				if (v) return *v;
+				auto it = extra_attributes.find(id);
+				return it != extra_attributes.end() ? it->second : "";
+			}
+			// Attributes defined by the schema are fixed, everything else is stored
+			virtual void set_attribute(const std::string& id, const std::string& value) override {
+				if (!detail::find_attribute(detail::property_attributes<Desc>(), id))
+					extra_attributes[id] = value;
+			}
+			virtual void for_each_attribute(attribute_visitor fn) const override {
+				for (auto& e : detail::property_attributes<Desc>()) fn(e.first, e.second);
+				for (auto& e : extra_attributes) fn(e.first, e.second);
+			}
+		};
+
+		template<typename Desc, typename Properties = typename Desc::properties>
+		class static_node;
+
+		template<typename Desc, typename... Props>
+		class static_node<Desc, list<Props...>> final : public node, public std::enable_shared_from_this<static_node<Desc, list<Props...>>> {
+			static_assert(detail::valid_id(Desc::id()), "invalid node id");
+			static_assert(detail::ids_unique<Props...>::value, "duplicate property id");
+			std::weak_ptr<homie::device> parent;
+			std::tuple<std::shared_ptr<static_property<Props>>...> properties;
+
+		public:
+			typedef Desc descriptor;
+			static constexpr const char* descriptor_id() { return Desc::id(); }
+
+			explicit static_node(std::weak_ptr<homie::device> dev)
+				: parent(dev)
+			{}
+
+			// Has to be called once after the node is owned by a shared_ptr
+			void init() {
+				properties = std::make_tuple(std::make_shared<static_property<Props>>(this->shared_from_this())...);
+			}
+
+			template<typename P>
+			static_property<P>& get() {
+				return *std::get<detail::index_of<P, Props...>::value>(properties);
+			}
+
+			// Inherited by node
+			virtual device_ptr get_device() override { return parent.lock(); }
+			virtual const_device_ptr get_device() const override { return parent.lock(); }
+			virtual std::string get_id() const override { return Desc::id(); }
+			virtual std::string get_name() const override { return Desc::name(); }
+			virtual std::string get_name(int64_t node_idx) const override { return ""; }
+			virtual std::string get_type() const override { return Desc::type(); }
+			virtual bool is_array() const override { return false; }
+			virtual std::pair<int64_t, int64_t> array_range() const override { return { 0, -1 }; }
+			virtual std::set<std::string> get_properties() const override {
+				return { Props::id()... };
+			}
+			virtual const_property_ptr get_property(const std::string& id) const override {
+				const_property_ptr res;
+				detail::for_each(properties, [&](const auto& p) {
+					if (!res && id == p->descriptor_id()) res = p;
+				});
+				return res;
+			}
+			virtual property_ptr get_property(const std::string& id) override {
+				property_ptr res;
+				detail::for_each(properties, [&](const auto& p) {
+					if (!res && id == p->descriptor_id()) res = p;
+				});
+				return res;
+			}
+
+			virtual std::set<std::string> get_attributes() const override {
+				std::set<std::string> res;
+				for (auto& e : detail::node_attributes<Desc>()) res.insert(e.first);
+				return res;
+			}
+			virtual std::set<std::string> get_attributes(int64_t idx) const override { return {}; }
+			virtual std::string get_attribute(const std::string& id) const override {
+				auto v = detail::find_attribute(detail::node_attributes<Desc>(), id);
+				return v ? *v : "";
+			}
+			virtual void set_attribute(const std::string& id, const std::string& value) override {}
+			virtual std::string get_attribute(const std::string& id, int64_t idx) const override { return ""; }
+			virtual void set_attribute(const std::string& id, const std::string& value, int64_t idx) override {}
+
+			virtual void for_each_property(property_visitor fn) override {
+				detail::for_each(properties, [&](const auto& p) { fn(p->get_id(), *p); });
+			}
+			virtual void for_each_property(const_property_visitor fn) const override {
+				detail::for_each(properties, [&](const auto& p) { fn(p->get_id(), *p); });
+			}
+			virtual void for_each_attribute(attribute_visitor fn) const override {
+				for (auto& e : detail::node_attributes<Desc>()) fn(e.first, e.second);
+			}
+			virtual void for_each_attribute(int64_t idx, attribute_visitor fn) const override {}
+		};
+
+		template<typename Desc, typename Nodes = typename Desc::nodes>
+		class static_device;
+
+		template<typename Desc, typename... Nodes>
+		class static_device<Desc, list<Nodes...>> final : public device, public static_structure, public std::enable_shared_from_this<static_device<Desc, list<Nodes...>>> {
+			static_assert(detail::ids_valid<Nodes...>::value, "invalid node id");
+			static_assert(detail::ids_unique<Nodes...>::value, "duplicate node id");
+			std::string id;
+			std::tuple<std::shared_ptr<static_node<Nodes>>...> nodes;
+			// Runtime attributes like state, localip, mac and stats
+			std::map<std::string, std::string> attributes;
+
+			static const detail::attribute_table& fixed_attributes() {
+				static const detail::attribute_table table = {
+					{ "fw/name", Desc::firmware_name() },
+					{ "fw/version", Desc::firmware_version() },
+					{ "implementation", Desc::implementation() },
+					{ "name", Desc::name() },
+					{ "stats/interval", std::to_string(Desc::stats_interval()) }
+				};
+				return table;
+			}
+		public:
+			typedef Desc descriptor;
+
+			explicit static_device(const std::string& device_id)
+				: id(device_id)
+			{
+				attributes["state"] = "ready";
+			}
+
+			// Has to be called once after the device is owned by a shared_ptr, make_device does this
+			void init() {
+				nodes = std::make_tuple(std::make_shared<static_node<Nodes>>(this->shared_from_this())...);
+				int dummy[] = { 0, (std::get<detail::index_of<Nodes, Nodes...>::value>(nodes)->init(), 0)... };
+				(void)dummy;
+			}
+
+			template<typename N>
+			static_node<N>& get() {
+				return *std::get<detail::index_of<N, Nodes...>::value>(nodes);
+			}
+
+			// Announcement attributes defined by the schema, relative to the device topic.
+			// Built once per device type.
+			static const std::vector<std::pair<std::string, std::string>>& static_announcement() {
+				static const std::vector<std::pair<std::string, std::string>> res = []() {
+					std::vector<std::pair<std::string, std::string>> r;
+					for (auto& e : fixed_attributes()) r.push_back({ "$" + e.first, e.second });
+					std::string node_list;
+					int dummy[] = { 0, (add_node_announcement<Nodes>(r, node_list), 0)... };
+					(void)dummy;
+					r.push_back({ "$nodes", node_list });
+					return r;
+				}();
+				return res;
+			}
+
+			// Inherited by static_structure
+			virtual const std::vector<std::pair<std::string, std::string>>& get_static_announcement() const override {
+				return static_announcement();
+			}
+
+			// Inherited by device
+			virtual std::string get_id() const override { return id; }
+			virtual std::string get_name() const override { return Desc::name(); }
+			virtual device_state get_state() const override {
+				auto s = device_state::init;
+				try_enum_from_string(get_attribute("state"), s);
+				return s;
+			}
+			virtual std::string get_localip() const override { return get_attribute("localip"); }
+			virtual std::string get_mac() const override { return get_attribute("mac"); }
+			virtual std::string get_firmware_name() const override { return Desc::firmware_name(); }
+			virtual std::string get_firmware_version() const override { return Desc::firmware_version(); }
+			virtual std::set<std::string> get_nodes() const override { return { Nodes::id()... }; }
+			virtual node_ptr get_node(const std::string& nid) override {
+				node_ptr res;
+				detail::for_each(nodes, [&](const auto& n) {
+					if (!res && nid == n->descriptor_id()) res = n;
+				});
+				return res;
+			}
+			virtual const_node_ptr get_node(const std::string& nid) const override {
+				const_node_ptr res;
+				detail::for_each(nodes, [&](const auto& n) {
+					if (!res && nid == n->descriptor_id()) res = n;
+				});
+				return res;
+			}
+			virtual std::string get_implementation() const override { return Desc::implementation(); }
+			virtual std::set<std::string> get_stats() const override {
+				auto parts = utils::split<std::string>(get_attribute("stats"), ",");
+				std::set<std::string> res;
+				for (auto& e : parts) if (!e.empty()) res.insert(e);
+				return res;
+			}
+			virtual std::string get_stat(const std::string& sid) const override { return get_attribute("stats/" + sid); }
+			virtual std::chrono::seconds get_stats_interval() const override { return std::chrono::seconds(Desc::stats_interval()); }
+
+			virtual std::set<std::string> get_attributes() const override {
+				std::set<std::string> res;
+				for (auto& e : fixed_attributes()) res.insert(e.first);
+				for (auto& e : attributes) res.insert(e.first);
+				return res;
+			}
+			virtual std::string get_attribute(const std::string& aid) const override {
+				auto v = detail::find_attribute(fixed_attributes(), aid);
+				if (v) return *v;
+				auto it = attributes.find(aid);
+				return it != attributes.end() ? it->second : "";
+			}
+			virtual void set_attribute(const std::string& aid, const std::string& value) override {
+				if (!detail::find_attribute(fixed_attributes(), aid))
+					attributes[aid] = value;
+			}
+
+			virtual void for_each_node(node_visitor fn) override {
+				detail::for_each(nodes, [&](const auto& n) { fn(n->get_id(), *n); });
+			}
+			virtual void for_each_node(const_node_visitor fn) const override {
+				detail::for_each(nodes, [&](const auto& n) { fn(n->get_id(), *n); });
+			}
+			virtual void for_each_attribute(attribute_visitor fn) const override {
+				for (auto& e : fixed_attributes()) fn(e.first, e.second);
+				for (auto& e : attributes) fn(e.first, e.second);
+			}
+		private:
+			template<typename N>
+			static void add_node_announcement(std::vector<std::pair<std::string, std::string>>& r, std::string& node_list) {
+				if (!node_list.empty()) node_list += ",";
+				node_list += N::id();
+				std::string prefix = std::string(N::id()) + "/";
+				for (auto& e : detail::node_attributes<N>()) r.push_back({ prefix + "$" + e.first, e.second });
+				add_property_announcements<N>(r, prefix, typename N::properties());
+			}
+			template<typename N, typename... Props>
+			static void add_property_announcements(std::vector<std::pair<std::string, std::string>>& r, const std::string& prefix, list<Props...>) {
+				std::string prop_list;
+				const char* ids[] = { "", Props::id()... };
+				for (size_t i = 1; i < sizeof(ids) / sizeof(ids[0]); i++) {
+					if (!prop_list.empty()) prop_list += ",";
+					prop_list += ids[i];
+				}
+				r.push_back({ prefix + "$properties", prop_list });
+				int dummy[] = { 0, (add_attributes(r, prefix + Props::id() + "/", detail::property_attributes<Props>()), 0)... };
+				(void)dummy;
+			}
+			static void add_attributes(std::vector<std::pair<std::string, std::string>>& r, const std::string& prefix, const detail::attribute_table& table) {
+				for (auto& e : table) r.push_back({ prefix + "$" + e.first, e.second });
+			}
+		};
+
+		template<typename Desc>
+		std::shared_ptr<static_device<Desc>> make_device(const std::string& id) {
+			auto res = std::make_shared<static_device<Desc>>(id);
+			res->init();
+			return res;
+		}
+	}
+}
@@ -0,0 +1,289 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <future>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+
+namespace homie {
+	enum class set_outcome {
+		// The device published the requested value
+		acknowledged,
+		// No matching value arrived in time
+		timed_out,
+		// Another set for the same property replaced this one
+		superseded,
+		// Publishing the set failed
+		failed,
+		// Tracking stopped before the set completed
+		cancelled
+	};
+
+	struct set_result {
+		set_outcome outcome;
+		// Time from publishing the set until it completed
+		std::chrono::steady_clock::duration latency;
+	};
+
+	typedef std::function<void(const set_result&)> set_callback;
+
+	// Latencies in power of two buckets from 128us up to about a minute
+	class latency_histogram {
+	public:
+		enum : size_t { bucket_count = 20 };
+	private:
+		std::array<uint64_t, bucket_count + 1> buckets;
+		uint64_t total;
+		std::chrono::microseconds sum;
+
+		static std::chrono::microseconds bound(size_t i) { return std::chrono::microseconds(int64_t(128) << i); }
+	public:
+		latency_histogram()
+			: total(0), sum(0)
+		{
+			buckets.fill(0);
+		}
+
+		void record(std::chrono::steady_clock::duration d) {
+			auto us = std::chrono::duration_cast<std::chrono::microseconds>(d);
+			size_t i = 0;
+			while (i < bucket_count && us >= bound(i)) i++;
+			buckets[i]++;
+			total++;
+			sum += us;
+		}
+
+		uint64_t count() const { return total; }
+
+		std::chrono::microseconds mean() const {
+			return total ? sum / static_cast<int64_t>(total) : std::chrono::microseconds(0);
+		}
+
+		// Upper bound of the bucket holding the q quantile (0..1), the last bound for the overflow bucket
+		std::chrono::microseconds percentile(double q) const {
+			if (total == 0) return std::chrono::microseconds(0);
+			auto rank = static_cast<uint64_t>(q * (total - 1)) + 1;
+			uint64_t seen = 0;
+			for (size_t i = 0; i < bucket_count; i++) {
+				seen += buckets[i];
+				if (seen >= rank) return bound(i);
+			}
+			return bound(bucket_count - 1);
+		}
+
+		// Samples per bucket, bucket i holds latencies below 128us << i, the last one everything above
+		const std::array<uint64_t, bucket_count + 1>& get_buckets() const { return buckets; }
+	};
+
+	struct set_statistics {
+		latency_histogram latency;
+		uint64_t acknowledged = 0;
+		uint64_t timed_out = 0;
+		uint64_t superseded = 0;
+		uint64_t failed = 0;
+	};
+
+	// Pending sets keyed by property and array index, expired through a hashed timing wheel.
+	// A set completes once the device echoes the requested value, a background thread turns the wheel.
+	class set_tracker {
+	public:
+		struct key {
+			const void* object;
+			int64_t index;
+			bool is_array;
+
+			bool operator==(const key& o) const { return object == o.object && index == o.index && is_array == o.is_array; }
+		};
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		struct key_hash {
+			size_t operator()(const key& k) const {
+				auto h = std::hash<const void*>()(k.object);
+				return h ^ (std::hash<int64_t>()(k.index) + 0x9e3779b9 + (h << 6) + (h >> 2) + (k.is_array ? 1 : 0));
+			}
+		};
+		struct entry {
+			std::string device;
+			std::string value;
+			clock::time_point started;
+			uint64_t deadline;
+			uint64_t generation;
+			set_callback done;
+		};
+		struct slot_entry {
+			key k;
+			uint64_t generation;
+		};
+		struct completion {
+			set_callback done;
+			set_result result;
+		};
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::unordered_map<key, entry, key_hash> pending;
+		std::vector<std::vector<slot_entry>> wheel;
+		std::unordered_map<std::string, set_statistics> stats;
+		clock::duration resolution;
+		clock::duration timeout;
+		clock::time_point origin;
+		uint64_t current_tick;
+		uint64_t next_generation;
+		bool stop;
+		std::thread worker;
+
+		uint64_t tick_of(clock::time_point t) const {
+			return static_cast<uint64_t>((t - origin) / resolution);
+		}
+
+		// Caller holds mtx
+		void finish(std::unordered_map<key, entry, key_hash>::iterator it, set_outcome outcome, clock::time_point now, std::vector<completion>& out) {
+			auto& e = it->second;
+			set_result res{ outcome, now - e.started };
+			auto& s = stats[e.device];
+			switch (outcome) {
+			case set_outcome::acknowledged: s.acknowledged++; s.latency.record(res.latency); break;
+			case set_outcome::timed_out: s.timed_out++; break;
+			case set_outcome::superseded: s.superseded++; break;
+			case set_outcome::failed: s.failed++; break;
+			default: break;
+			}
+			if (e.done) out.push_back({ std::move(e.done), res });
+			pending.erase(it);
+		}
+
+		static void run(std::vector<completion>& done) {
+			for (auto& c : done) c.done(c.result);
+		}
+
+		void advance(clock::time_point now, std::vector<completion>& out) {
+			auto target = tick_of(now);
+			if (target < current_tick) return;
+			// After a long idle period every slot is visited once
+			auto steps = std::min<uint64_t>(target - current_tick + 1, wheel.size());
+			for (uint64_t step = 0; step < steps; step++) {
+				auto& slot = wheel[(current_tick + step) % wheel.size()];
+				for (size_t i = 0; i < slot.size();) {
+					auto it = pending.find(slot[i].k);
+					if (it == pending.end() || it->second.generation != slot[i].generation) {
+						slot[i] = slot.back();
+						slot.pop_back();
+					}
+					else if (it->second.deadline <= target) {
+						finish(it, set_outcome::timed_out, now, out);
+						slot[i] = slot.back();
+						slot.pop_back();
+					}
+					else i++;
+				}
+			}
+			current_tick = target + 1;
+		}
+	public:
+		set_tracker(std::chrono::milliseconds set_timeout, std::chrono::milliseconds tick)
+			: resolution(std::max(tick, std::chrono::milliseconds(1))), timeout(set_timeout), origin(clock::now()),
+			current_tick(0), next_generation(0), stop(false)
+		{
+			wheel.resize(static_cast<size_t>(timeout / resolution) + 3);
+			worker = std::thread([this]() {
+				std::unique_lock<std::mutex> lck(mtx);
+				while (!stop) {
+					if (pending.empty()) cv.wait(lck);
+					else cv.wait_for(lck, resolution);
+					if (stop) break;
+					std::vector<completion> done;
+					advance(clock::now(), done);
+					lck.unlock();
+					run(done);
+					lck.lock();
+				}
+			});
+		}
+
+		~set_tracker() {
+			std::vector<completion> done;
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				stop = true;
+				auto now = clock::now();
+				while (!pending.empty()) finish(pending.begin(), set_outcome::cancelled, now, done);
+			}
+			cv.notify_all();
+			worker.join();
+			run(done);
+		}
+
+		set_tracker(const set_tracker&) = delete;
+		set_tracker& operator=(const set_tracker&) = delete;
+
+		// Registers a set before it is published, an older pending set for the same key is superseded
+		void track(const key& k, const std::string& device, const std::string& value, set_callback done) {
+			std::vector<completion> out;
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				auto now = clock::now();
+				// Catch up after an idle period, so the new entry lands in a slot ahead of the wheel
+				advance(now, out);
+				auto it = pending.find(k);
+				if (it != pending.end()) finish(it, set_outcome::superseded, now, out);
+				// Round up, a set never expires early
+				auto deadline = tick_of(now + timeout) + 1;
+				auto gen = next_generation++;
+				pending.insert({ k, entry{ device, value, now, deadline, gen, std::move(done) } });
+				wheel[deadline % wheel.size()].push_back({ k, gen });
+			}
+			cv.notify_all();
+			run(out);
+		}
+
+		// The set could not be published
+		void fail(const key& k) {
+			std::vector<completion> out;
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				auto it = pending.find(k);
+				if (it != pending.end()) finish(it, set_outcome::failed, clock::now(), out);
+			}
+			run(out);
+		}
+
+		// A value arrived, completes the pending set if it asked for exactly this value
+		void complete(const key& k, const std::string& value) {
+			std::vector<completion> out;
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				if (pending.empty()) return;
+				auto it = pending.find(k);
+				if (it == pending.end() || it->second.value != value) return;
+				finish(it, set_outcome::acknowledged, clock::now(), out);
+			}
+			run(out);
+		}
+
+		size_t size() {
+			std::lock_guard<std::mutex> lck(mtx);
+			return pending.size();
+		}
+
+		set_statistics get_statistics(const std::string& device) {
+			std::lock_guard<std::mutex> lck(mtx);
+			auto it = stats.find(device);
+			return it != stats.end() ? it->second : set_statistics();
+		}
+
+		static std::future<set_result> make_future(set_callback& cb) {
+			auto p = std::make_shared<std::promise<set_result>>();
+			cb = [p](const set_result& r) { p->set_value(r); };
+			return p->get_future();
+		}
+	};
+}
@@ -0,0 +1,354 @@
+#pragma once
+#include <string>
+#include <map>
+#include <array>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <cstdint>
+#include <stdexcept>
+#include "utils.h"
+#include "intern.h"
+#include "json.h"
+
+namespace homie {
+	// Immutable copies of the discovered tree, shared between snapshots until a part changes
+	struct snapshot_property {
+		std::string id;
+		std::string value;
+		std::map<int64_t, std::string> value_array;
+		// Never null, shared with the master and every property that has the same attributes
+		utils::attribute_set attributes;
+	};
+
+	struct snapshot_node {
+		std::string id;
+		// Never null, shared like property attributes
+		utils::attribute_set attributes;
+		std::map<std::pair<int64_t, std::string>, std::string> attributes_array;
+		std::map<std::string, std::shared_ptr<const snapshot_property>> properties;
+	};
+
+	struct snapshot_device {
+		std::string id;
+		std::map<std::string, std::string> attributes;
+		std::map<std::string, std::shared_ptr<const snapshot_node>> nodes;
+	};
+
+	// Point in time view of every device known to a master.
+	// Devices live in a persistent hash trie, so a change only copies the path from the root
+	// over a few small trie nodes down to the changed object, however large the fleet grows.
+	class master_snapshot {
+	public:
+		typedef std::map<std::string, std::shared_ptr<const snapshot_device>> bucket;
+		enum : size_t { trie_bits = 5, trie_fanout = size_t(1) << trie_bits, max_leaf = 8 };
+		// Leaves hold up to max_leaf devices and split once they grow beyond,
+		// inner nodes branch on the next trie_bits of the id hash
+		struct device_trie {
+			bucket devices;
+			std::array<std::shared_ptr<const device_trie>, trie_fanout> children;
+			bool leaf = true;
+			// Devices below this node
+			size_t count = 0;
+		};
+		typedef device_trie root;
+	private:
+		std::shared_ptr<const root> tree;
+		std::chrono::system_clock::time_point taken;
+
+		enum : uint32_t { binary_magic = 0x31534d48 };
+
+		static std::shared_ptr<const root> empty_root() {
+			return std::make_shared<const root>();
+		}
+
+		static size_t hash_of(const std::string& device_id) {
+			return std::hash<std::string>()(device_id);
+		}
+		static size_t child_of(size_t hash, unsigned level) {
+			return (hash >> (level * trie_bits)) & (trie_fanout - 1);
+		}
+
+		// Turns a leaf into an inner node, every hash bit is used once so collisions stay in one leaf
+		static void split(device_trie& t, unsigned level) {
+			if ((level + 1) * trie_bits > sizeof(size_t) * 8) return;
+			std::array<std::shared_ptr<device_trie>, trie_fanout> parts;
+			for (auto& p : parts) p = std::make_shared<device_trie>();
+			for (auto& e : t.devices) {
+				auto& p = *parts[child_of(hash_of(e.first), level)];
+				p.devices.insert(e);
+				p.count++;
+			}
+			for (size_t i = 0; i < trie_fanout; i++) t.children[i] = parts[i];
+			t.devices.clear();
+			t.leaf = false;
+		}
+
+		static std::shared_ptr<const device_trie> assign(const device_trie& t, size_t hash, unsigned level, const std::string& id, const std::shared_ptr<const snapshot_device>& dev) {
+			auto res = std::make_shared<device_trie>(t);
+			if (t.leaf) {
+				if (dev) res->devices[id] = dev;
+				else res->devices.erase(id);
+				res->count = res->devices.size();
+				if (res->count > max_leaf) split(*res, level);
+				return res;
+			}
+			auto& child = res->children[child_of(hash, level)];
+			auto next = assign(*child, hash, level + 1, id, dev);
+			res->count = res->count - child->count + next->count;
+			child = next;
+			return res;
+		}
+
+		static void visit(const device_trie& t, utils::function_ref<void(const snapshot_device&)> fn) {
+			if (t.leaf) {
+				for (auto& e : t.devices) fn(*e.second);
+			}
+			else {
+				for (auto& c : t.children) visit(*c, fn);
+			}
+		}
+
+		static void write_varint(std::ostream& out, uint64_t v) {
+			char buf[10];
+			size_t n = 0;
+			do {
+				buf[n] = static_cast<char>(v & 0x7F);
+				v >>= 7;
+				if (v) buf[n] |= 0x80;
+				n++;
+			} while (v);
+			out.write(buf, n);
+		}
+		static void write_int(std::ostream& out, int64_t v) {
+			// Zigzag, small negative array indices stay short
+			write_varint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+		}
+		static void write_string(std::ostream& out, const std::string& s) {
+			write_varint(out, s.size());
+			out.write(s.data(), s.size());
+		}
+		static void write_attributes(std::ostream& out, const utils::attribute_map& attributes) {
+			write_varint(out, attributes.size());
+			for (auto& e : attributes) {
+				write_string(out, e.first);
+				write_string(out, e.second);
+			}
+		}
+
+		static uint64_t read_varint(std::istream& in) {
+			uint64_t v = 0;
+			for (int shift = 0; shift < 64; shift += 7) {
+				auto c = in.get();
+				if (c == std::char_traits<char>::eof()) throw std::runtime_error("truncated snapshot");
+				v |= static_cast<uint64_t>(c & 0x7F) << shift;
+				if ((c & 0x80) == 0) return v;
+			}
+			throw std::runtime_error("malformed snapshot");
+		}
+		static int64_t read_int(std::istream& in) {
+			auto v = read_varint(in);
+			return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+		}
+		static std::string read_string(std::istream& in) {
+			auto len = read_varint(in);
+			std::string res;
+			// Grow with the data actually read instead of trusting the length
+			char buf[4096];
+			while (len > 0) {
+				auto n = static_cast<size_t>(std::min<uint64_t>(len, sizeof(buf)));
+				if (!in.read(buf, n)) throw std::runtime_error("truncated snapshot");
+				res.append(buf, n);
+				len -= n;
+			}
+			return res;
+		}
+		static void read_attributes(std::istream& in, utils::attribute_map& attributes) {
+			for (auto n = read_varint(in); n > 0; n--) {
+				auto key = read_string(in);
+				attributes[key] = read_string(in);
+			}
+		}
+		static utils::attribute_set read_attributes(std::istream& in) {
+			utils::attribute_map res;
+			read_attributes(in, res);
+			return std::make_shared<const utils::attribute_map>(std::move(res));
+		}
+
+		static void write_json_attributes(json::writer& w, const utils::attribute_map& attributes) {
+			w.key("attributes").begin_object();
+			for (auto& e : attributes) w.key(e.first).value(e.second);
+			w.end_object();
+		}
+	public:
+		master_snapshot()
+			: tree(empty_root())
+		{}
+		master_snapshot(std::shared_ptr<const root> r, std::chrono::system_clock::time_point t)
+			: tree(r ? r : empty_root()), taken(t)
+		{}
+
+		static std::shared_ptr<const root> make_root() { return empty_root(); }
+
+		// New root with the device replaced, or removed if dev is null. r stays unchanged.
+		static std::shared_ptr<const root> with_device(const std::shared_ptr<const root>& r, const std::string& id, std::shared_ptr<const snapshot_device> dev) {
+			return assign(*r, hash_of(id), 0, id, dev);
+		}
+
+		static std::shared_ptr<const snapshot_device> find_device(const root& r, const std::string& id) {
+			auto hash = hash_of(id);
+			auto t = &r;
+			for (unsigned level = 0; !t->leaf; level++) t = t->children[child_of(hash, level)].get();
+			auto it = t->devices.find(id);
+			return it != t->devices.end() ? it->second : nullptr;
+		}
+
+		std::chrono::system_clock::time_point get_time() const { return taken; }
+
+		size_t size() const {
+			return tree->count;
+		}
+
+		std::shared_ptr<const snapshot_device> get_device(const std::string& id) const {
+			return find_device(*tree, id);
+		}
+
+		// Visits all devices ordered by id
+		void for_each_device(utils::function_ref<void(const snapshot_device&)> fn) const {
+			std::vector<const snapshot_device*> devs;
+			devs.reserve(size());
+			visit(*tree, [&](const snapshot_device& d) { devs.push_back(&d); });
+			std::sort(devs.begin(), devs.end(), [](const snapshot_device* a, const snapshot_device* b) { return a->id < b->id; });
+			for (auto d : devs) fn(*d);
+		}
+
+		// Compact binary form: varint lengths and counts, strings are stored raw
+		void write_binary(std::ostream& out) const {
+			uint32_t magic = binary_magic;
+			out.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+			write_int(out, std::chrono::duration_cast<std::chrono::milliseconds>(taken.time_since_epoch()).count());
+			write_varint(out, size());
+			for_each_device([&](const snapshot_device& dev) {
+				write_string(out, dev.id);
+				write_attributes(out, dev.attributes);
+				write_varint(out, dev.nodes.size());
+				for (auto& n : dev.nodes) {
+					auto& node = *n.second;
+					write_string(out, node.id);
+					write_attributes(out, *node.attributes);
+					write_varint(out, node.attributes_array.size());
+					for (auto& e : node.attributes_array) {
+						write_int(out, e.first.first);
+						write_string(out, e.first.second);
+						write_string(out, e.second);
+					}
+					write_varint(out, node.properties.size());
+					for (auto& p : node.properties) {
+						auto& prop = *p.second;
+						write_string(out, prop.id);
+						write_string(out, prop.value);
+						write_varint(out, prop.value_array.size());
+						for (auto& e : prop.value_array) {
+							write_int(out, e.first);
+							write_string(out, e.second);
+						}
+						write_attributes(out, *prop.attributes);
+					}
+				}
+			});
+		}
+
+		// Reads a snapshot written by write_binary, throws std::runtime_error on malformed input
+		static master_snapshot read_binary(std::istream& in) {
+			uint32_t magic = 0;
+			if (!in.read(reinterpret_cast<char*>(&magic), sizeof(magic)) || magic != binary_magic)
+				throw std::runtime_error("not a snapshot");
+			std::chrono::system_clock::time_point taken(std::chrono::milliseconds(read_int(in)));
+			auto r = empty_root();
+			for (auto ndev = read_varint(in); ndev > 0; ndev--) {
+				auto dev = std::make_shared<snapshot_device>();
+				dev->id = read_string(in);
+				read_attributes(in, dev->attributes);
+				for (auto nnode = read_varint(in); nnode > 0; nnode--) {
+					auto node = std::make_shared<snapshot_node>();
+					node->id = read_string(in);
+					node->attributes = read_attributes(in);
+					for (auto n = read_varint(in); n > 0; n--) {
+						auto idx = read_int(in);
+						auto key = read_string(in);
+						node->attributes_array[{ idx, key }] = read_string(in);
+					}
+					for (auto nprop = read_varint(in); nprop > 0; nprop--) {
+						auto prop = std::make_shared<snapshot_property>();
+						prop->id = read_string(in);
+						prop->value = read_string(in);
+						for (auto n = read_varint(in); n > 0; n--) {
+							auto idx = read_int(in);
+							prop->value_array[idx] = read_string(in);
+						}
+						prop->attributes = read_attributes(in);
+						node->properties[prop->id] = prop;
+					}
+					dev->nodes[node->id] = node;
+				}
+				r = with_device(r, dev->id, dev);
+			}
+			return master_snapshot(r, taken);
+		}
+
+		// Streams the snapshot as JSON, only one device is held as text at a time
+		void write_json(std::ostream& out) const {
+			out << "{\"time\":" << std::chrono::duration_cast<std::chrono::milliseconds>(taken.time_since_epoch()).count() << ",\"devices\":{";
+			bool first = true;
+			std::string buf;
+			for_each_device([&](const snapshot_device& dev) {
+				buf.clear();
+				if (!first) buf += ',';
+				first = false;
+				json::writer w(buf);
+				w.key(dev.id).begin_object();
+				write_json_attributes(w, dev.attributes);
+				w.key("nodes").begin_object();
+				for (auto& n : dev.nodes) {
+					auto& node = *n.second;
+					w.key(node.id).begin_object();
+					write_json_attributes(w, *node.attributes);
+					if (!node.attributes_array.empty()) {
+						w.key("array_attributes").begin_object();
+						for (auto it = node.attributes_array.begin(); it != node.attributes_array.end();) {
+							auto idx = it->first.first;
+							w.key(std::to_string(idx)).begin_object();
+							for (; it != node.attributes_array.end() && it->first.first == idx; it++)
+								w.key(it->first.second).value(it->second);
+							w.end_object();
+						}
+						w.end_object();
+					}
+					w.key("properties").begin_object();
+					for (auto& p : node.properties) {
+						auto& prop = *p.second;
+						w.key(prop.id).begin_object();
+						w.key("value").value(prop.value);
+						if (!prop.value_array.empty()) {
+							w.key("values").begin_object();
+							for (auto& e : prop.value_array) w.key(std::to_string(e.first)).value(e.second);
+							w.end_object();
+						}
+						write_json_attributes(w, *prop.attributes);
+						w.end_object();
+					}
+					w.end_object();
+					w.end_object();
+				}
+				w.end_object();
+				w.end_object();
+				out.write(buf.data(), buf.size());
+			});
+			out << "}}";
+		}
+	};
+}
@@ -0,0 +1,252 @@
+#pragma once
+#include <string>
+#include <map>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <fstream>
+#include <exception>
+#include <cstdio>
+#include <cstdint>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace homie {
+	typedef std::function<std::string()> stat_collector;
+
+	// Single timer thread running the periodic stats tasks of every client in the process.
+	// Tasks must not block (e.g. on a publish), that would delay the stats of every other client.
+	class stats_scheduler {
+	public:
+		typedef uint64_t id_type;
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		struct entry {
+			clock::duration interval;
+			std::function<void()> fn;
+		};
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::map<id_type, entry> entries;
+		// Due time of every entry, removed entries are skipped when they come up
+		std::multimap<clock::time_point, id_type> queue;
+		id_type next_id;
+		id_type running;
+		bool stop;
+		std::thread worker;
+
+		void run() {
+			std::unique_lock<std::mutex> lck(mtx);
+			while (!stop) {
+				if (queue.empty()) {
+					cv.wait(lck);
+					continue;
+				}
+				auto due = queue.begin()->first;
+				if (clock::now() < due) {
+					cv.wait_until(lck, due);
+					continue;
+				}
+				auto id = queue.begin()->second;
+				queue.erase(queue.begin());
+				auto it = entries.find(id);
+				if (it == entries.end()) continue;
+				auto fn = it->second.fn;
+				running = id;
+				lck.unlock();
+				try {
+					fn();
+				}
+				catch (const std::exception&) {
+					// A failing task keeps its schedule
+				}
+				lck.lock();
+				running = 0;
+				cv.notify_all();
+				it = entries.find(id);
+				if (it == entries.end()) continue;
+				// Skip missed runs instead of catching up
+				auto next = due + it->second.interval;
+				auto now = clock::now();
+				queue.insert({ next > now ? next : now + it->second.interval, id });
+			}
+		}
+	public:
+		stats_scheduler()
+			: next_id(1), running(0), stop(false)
+		{
+			worker = std::thread([this]() { run(); });
+		}
+
+		~stats_scheduler() {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				stop = true;
+			}
+			cv.notify_all();
+			worker.join();
+		}
+
+		stats_scheduler(const stats_scheduler&) = delete;
+		stats_scheduler& operator=(const stats_scheduler&) = delete;
+
+		// Never destroyed, so clients, masters and their tasks may outlive main without
+		// touching a scheduler that static destruction already tore down
+		static stats_scheduler& instance() {
+			static stats_scheduler* s = new stats_scheduler();
+			return *s;
+		}
+
+		// Runs fn every interval, the first time one interval from now
+		id_type add(std::chrono::milliseconds interval, std::function<void()> fn) {
+			std::lock_guard<std::mutex> lck(mtx);
+			auto id = next_id++;
+			entries.insert({ id, entry{ interval, std::move(fn) } });
+			queue.insert({ clock::now() + interval, id });
+			cv.notify_all();
+			return id;
+		}
+
+		// Waits for a running fn to return, unless called from fn itself
+		void remove(id_type id) {
+			std::unique_lock<std::mutex> lck(mtx);
+			entries.erase(id);
+			if (std::this_thread::get_id() == worker.get_id()) return;
+			cv.wait(lck, [&]() { return running != id; });
+		}
+
+		size_t size() {
+			std::lock_guard<std::mutex> lck(mtx);
+			return entries.size();
+		}
+	};
+
+	// Restartable task on its own thread that runs while work is pending, e.g. draining a rate limited queue.
+	// Steps may block on a publish without holding up the stats scheduler or the tasks of other clients,
+	// the thread only exists while work is pending.
+	// The owner has to stop() it before the state used by step and pending goes away.
+	class scheduled_task {
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::thread worker;
+		bool running;
+		bool stopping;
+
+		void run(std::chrono::milliseconds interval, const std::function<void()>& step, const std::function<bool()>& pending) {
+			std::unique_lock<std::mutex> lck(mtx);
+			while (!cv.wait_for(lck, interval, [this]() { return stopping; })) {
+				lck.unlock();
+				step();
+				bool more = pending();
+				lck.lock();
+				// Work queued meanwhile found the task still running and relies on it
+				if (!more && !pending()) break;
+			}
+			running = false;
+		}
+	public:
+		scheduled_task()
+			: running(false), stopping(false)
+		{}
+
+		~scheduled_task() { stop(); }
+
+		scheduled_task(const scheduled_task&) = delete;
+		scheduled_task& operator=(const scheduled_task&) = delete;
+
+		// Runs step every interval until pending returns false, does nothing if the task is already running
+		void start(std::chrono::milliseconds interval, std::function<void()> step, std::function<bool()> pending) {
+			std::lock_guard<std::mutex> lck(mtx);
+			if (running) return;
+			// A finished run released the lock for good
+			if (worker.joinable()) worker.join();
+			running = true;
+			stopping = false;
+			worker = std::thread([this, interval, step, pending]() { run(interval, step, pending); });
+		}
+
+		// Waits for a running step to return
+		void stop() {
+			std::thread t;
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				stopping = true;
+				t = std::move(worker);
+			}
+			cv.notify_all();
+			if (!t.joinable()) return;
+			if (t.get_id() == std::this_thread::get_id()) t.detach();
+			else t.join();
+		}
+	};
+
+	// Built in collectors, each call returns the current value of the stat
+	namespace stat_collectors {
+		// Seconds since the collector was created
+		inline stat_collector uptime() {
+			auto start = std::chrono::steady_clock::now();
+			return [start]() {
+				return std::to_string(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count());
+			};
+		}
+
+		// CPU time used by the process since the previous call in percent of one core, empty where /proc is not available.
+		// Every call starts a new measurement, client only calls it from notify_stats_changed().
+		inline stat_collector cpu_load() {
+			struct sample {
+				std::chrono::steady_clock::time_point time;
+				double cpu;
+			};
+			auto read_cpu = []() {
+#ifndef _WIN32
+				std::ifstream in("/proc/self/stat");
+				std::string line;
+				if (!std::getline(in, line)) return -1.0;
+				// The command name may contain spaces, fields are counted from its closing parenthesis
+				auto pos = line.rfind(')');
+				if (pos == std::string::npos) return -1.0;
+				unsigned long utime = 0, stime = 0;
+				if (std::sscanf(line.c_str() + pos + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) return -1.0;
+				return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+#else
+				return -1.0;
+#endif
+			};
+			struct state {
+				std::mutex mtx;
+				sample last;
+			};
+			auto st = std::make_shared<state>();
+			st->last = sample{ std::chrono::steady_clock::now(), read_cpu() };
+			return [st, read_cpu]() {
+				sample now{ std::chrono::steady_clock::now(), read_cpu() };
+				std::lock_guard<std::mutex> lck(st->mtx);
+				if (now.cpu < 0 || st->last.cpu < 0) return std::string();
+				auto wall = std::chrono::duration<double>(now.time - st->last.time).count();
+				auto load = wall > 0 ? (now.cpu - st->last.cpu) / wall * 100 : 0.0;
+				st->last = now;
+				return std::to_string(static_cast<int64_t>(load + 0.5));
+			};
+		}
+
+		// Resident set size of the process in bytes, empty where /proc is not available
+		inline stat_collector resident_memory() {
+			return []() {
+#ifndef _WIN32
+				std::ifstream in("/proc/self/statm");
+				unsigned long size = 0, resident = 0;
+				if (!(in >> size >> resident)) return std::string();
+				return std::to_string(static_cast<uint64_t>(resident) * static_cast<uint64_t>(sysconf(_SC_PAGESIZE)));
+#else
+				return std::string();
+#endif
+			};
+		}
+	}
+}
@@ -0,0 +1,380 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include "master_event_handler.h"
+#include "datatype.h"
+#include "intern.h"
+#include "utils.h"
+
+namespace homie {
+	enum class event_kind : uint32_t {
+		broadcast = 1,
+		device = 2,
+		node = 4,
+		property = 8,
+		value = 16,
+		all = 31
+	};
+
+	inline uint32_t datatype_bit(datatype t) {
+		return 1u << static_cast<uint32_t>(t);
+	}
+
+	// Selects which master events a subscriber receives.
+	// Id patterns are either an exact id or "+" (or empty) to match any id.
+	// A level that is not part of an event (e.g. the property for node events) is not checked.
+	struct event_filter {
+		std::string device = "+";
+		std::string node = "+";
+		std::string property = "+";
+		// Bitmask of event_kind values
+		uint32_t kinds = static_cast<uint32_t>(event_kind::all);
+		// Bitmask of datatype_bit values, only checked for property and value events
+		uint32_t datatypes = UINT32_MAX;
+
+		event_filter& on_device(const std::string& id) { device = id; return *this; }
+		event_filter& on_node(const std::string& id) { node = id; return *this; }
+		event_filter& on_property(const std::string& id) { property = id; return *this; }
+		event_filter& only(event_kind k) { kinds = static_cast<uint32_t>(k); return *this; }
+		event_filter& also(event_kind k) { kinds |= static_cast<uint32_t>(k); return *this; }
+		event_filter& with_datatype(datatype t) {
+			if (datatypes == UINT32_MAX) datatypes = 0;
+			datatypes |= datatype_bit(t);
+			return *this;
+		}
+	};
+
+	// Forwards events to another handler from a dedicated thread.
+	// Events are dropped (and counted) if the queue is full.
+	// The objects passed with an event are shared with the thread changing the tree, see master::subscribe.
+	class queued_event_handler final : public master_event_handler {
+		master_event_handler& target;
+		size_t limit;
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::deque<std::function<void()>> queue;
+		bool exit;
+		// Set when released from its own delivery thread, the thread deletes the handler once the current event returns
+		bool orphaned;
+		std::atomic<size_t> dropped;
+		std::thread worker;
+
+		void push(std::function<void()> fn) {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				if (queue.size() >= limit) {
+					dropped++;
+					return;
+				}
+				queue.push_back(std::move(fn));
+			}
+			cv.notify_one();
+		}
+
+		void run() {
+			std::unique_lock<std::mutex> lck(mtx);
+			while (true) {
+				cv.wait(lck, [this]() { return exit || !queue.empty(); });
+				if (queue.empty()) break;
+				auto fn = std::move(queue.front());
+				queue.pop_front();
+				lck.unlock();
+				fn();
+				lck.lock();
+				if (orphaned) break;
+			}
+			if (orphaned) {
+				lck.unlock();
+				worker.detach();
+				delete this;
+			}
+		}
+	public:
+		queued_event_handler(master_event_handler& hdl, size_t queue_limit = 1024)
+			: target(hdl), limit(queue_limit), exit(false), orphaned(false), dropped(0)
+		{
+			worker = std::thread([this]() { run(); });
+		}
+
+		// Delivers all queued events before returning, from the delivery thread itself use release instead
+		~queued_event_handler() {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				exit = true;
+			}
+			cv.notify_one();
+			if (worker.joinable()) worker.join();
+		}
+
+		size_t get_dropped() const { return dropped; }
+
+		bool on_delivery_thread() const { return std::this_thread::get_id() == worker.get_id(); }
+
+		// Destroys the handler, from its own delivery thread the remaining events are discarded
+		// and destruction is deferred until the event being delivered returns.
+		static void release(std::unique_ptr<queued_event_handler> hdl) {
+			if (!hdl || !hdl->on_delivery_thread()) return;
+			auto* ptr = hdl.release();
+			std::lock_guard<std::mutex> lck(ptr->mtx);
+			ptr->orphaned = true;
+			ptr->queue.clear();
+		}
+
+		// Inherited by master_event_handler
+		virtual void on_broadcast(const std::string& level, const std::string& payload) override {
+			push([this, level, payload]() { target.on_broadcast(level, payload); });
+		}
+		virtual void on_device_discovered(device_ptr dev) override {
+			push([this, dev]() { target.on_device_discovered(dev); });
+		}
+		virtual void on_device_changed(device_ptr dev, const std::string& attribute) override {
+			push([this, dev, attribute]() { target.on_device_changed(dev, attribute); });
+		}
+		virtual void on_node_changed(node_ptr node, const std::string& attribute) override {
+			push([this, node, attribute]() { target.on_node_changed(node, attribute); });
+		}
+		virtual void on_node_changed(node_ptr node, int64_t idx, const std::string& attribute) override {
+			push([this, node, idx, attribute]() { target.on_node_changed(node, idx, attribute); });
+		}
+		virtual void on_property_changed(property_ptr prop, const std::string& attribute) override {
+			push([this, prop, attribute]() { target.on_property_changed(prop, attribute); });
+		}
+		virtual void on_property_changed(property_ptr prop, int64_t idx, const std::string& attribute) override {
+			push([this, prop, idx, attribute]() { target.on_property_changed(prop, idx, attribute); });
+		}
+		virtual void on_property_value_changed(property_ptr prop, const std::string& value) override {
+			push([this, prop, value]() { target.on_property_value_changed(prop, value); });
+		}
+		virtual void on_property_value_changed(property_ptr prop, int64_t idx, const std::string& value) override {
+			push([this, prop, idx, value]() { target.on_property_value_changed(prop, idx, value); });
+		}
+	};
+
+	// Dispatches master events to many subscribers.
+	// Subscriptions are stored in a trie (device -> node -> property) keyed by interned ids,
+	// so an event only visits the subscribers whose patterns match it.
+	class subscription_registry {
+	public:
+		typedef uint64_t id_type;
+	private:
+		struct entry {
+			id_type id;
+			uint32_t kinds;
+			uint32_t datatypes;
+			uint32_t path[3];
+			master_event_handler* handler;
+			std::unique_ptr<queued_event_handler> queue;
+
+			~entry() { queued_event_handler::release(std::move(queue)); }
+
+			master_event_handler& target() { return queue ? *queue : *handler; }
+		};
+		struct level {
+			std::unordered_map<uint32_t, std::unique_ptr<level>> children;
+			std::unique_ptr<level> any;
+			// All entries below this level
+			std::vector<entry*> subtree;
+
+			level* child(uint32_t key) const {
+				if (key == utils::interner::invalid) return nullptr;
+				auto it = children.find(key);
+				return it != children.end() ? it->second.get() : nullptr;
+			}
+		};
+
+		utils::interner& ids;
+		std::recursive_mutex mtx;
+		std::map<id_type, std::unique_ptr<entry>> entries;
+		std::vector<entry*> broadcast_entries;
+		level root;
+		id_type next_id;
+		std::atomic<size_t> count;
+		// Changes requested by handlers while an event is dispatched are applied afterwards
+		int dispatching;
+		std::vector<std::unique_ptr<entry>> pending_add;
+		std::vector<id_type> pending_remove;
+
+		uint32_t key_for(const std::string& pattern) {
+			if (pattern.empty() || pattern == "+") return utils::interner::invalid;
+			return ids.intern(pattern);
+		}
+
+		void insert(std::unique_ptr<entry> e) {
+			auto* ptr = e.get();
+			level* l = &root;
+			l->subtree.push_back(ptr);
+			for (auto key : ptr->path) {
+				std::unique_ptr<level>& next = key == utils::interner::invalid ? l->any : l->children[key];
+				if (!next) next.reset(new level());
+				l = next.get();
+				l->subtree.push_back(ptr);
+			}
+			if (ptr->kinds & static_cast<uint32_t>(event_kind::broadcast))
+				broadcast_entries.push_back(ptr);
+			entries.insert({ ptr->id, std::move(e) });
+		}
+
+		static void erase_ptr(std::vector<entry*>& v, entry* e) {
+			for (auto it = v.begin(); it != v.end(); it++) {
+				if (*it == e) {
+					v.erase(it);
+					return;
+				}
+			}
+		}
+
+		// Returns the removed entry, it is destroyed by the caller after releasing mtx as that joins its delivery thread
+		std::unique_ptr<entry> remove(id_type id) {
+			auto it = entries.find(id);
+			if (it == entries.end()) return nullptr;
+			auto* ptr = it->second.get();
+			level* l = &root;
+			erase_ptr(l->subtree, ptr);
+			for (auto key : ptr->path) {
+				l = key == utils::interner::invalid ? l->any.get() : l->child(key);
+				erase_ptr(l->subtree, ptr);
+			}
+			erase_ptr(broadcast_entries, ptr);
+			auto res = std::move(it->second);
+			entries.erase(it);
+			return res;
+		}
+
+		void apply_pending(std::vector<std::unique_ptr<entry>>& removed) {
+			auto add = std::move(pending_add);
+			auto rem = std::move(pending_remove);
+			pending_add.clear();
+			pending_remove.clear();
+			for (auto& e : add) insert(std::move(e));
+			for (auto id : rem) removed.push_back(remove(id));
+		}
+
+		static bool accepts(const entry* e, uint32_t kind, uint32_t datatypes) {
+			return (e->kinds & kind) != 0 && (e->datatypes == UINT32_MAX || (e->datatypes & datatypes) != 0);
+		}
+
+		// Keys not part of the event have to be utils::interner::invalid.
+		void dispatch(event_kind kind, uint32_t dev, uint32_t node, uint32_t prop, uint32_t datatypes, utils::function_ref<void(master_event_handler&)> fn) {
+			if (count == 0) return;
+			std::vector<std::unique_ptr<entry>> removed;
+			std::lock_guard<std::recursive_mutex> lck(mtx);
+			struct guard {
+				subscription_registry* that;
+				std::vector<std::unique_ptr<entry>>& removed;
+				guard(subscription_registry* t, std::vector<std::unique_ptr<entry>>& r) : that(t), removed(r) { that->dispatching++; }
+				~guard() {
+					if (--that->dispatching == 0 && (!that->pending_add.empty() || !that->pending_remove.empty()))
+						that->apply_pending(removed);
+				}
+			} g(this, removed);
+			auto k = static_cast<uint32_t>(kind);
+			if (kind == event_kind::broadcast) {
+				for (auto* e : broadcast_entries)
+					if (e->kinds & k) fn(e->target());
+				return;
+			}
+			const level* devs[] = { root.child(dev), root.any.get() };
+			for (auto* d : devs) {
+				if (d == nullptr) continue;
+				if (node == utils::interner::invalid) {
+					visit(d, k, datatypes, fn);
+					continue;
+				}
+				const level* nodes[] = { d->child(node), d->any.get() };
+				for (auto* n : nodes) {
+					if (n == nullptr) continue;
+					if (prop == utils::interner::invalid) {
+						visit(n, k, datatypes, fn);
+						continue;
+					}
+					visit(n->child(prop), k, datatypes, fn);
+					visit(n->any.get(), k, datatypes, fn);
+				}
+			}
+		}
+
+		void visit(const level* l, uint32_t kind, uint32_t datatypes, utils::function_ref<void(master_event_handler&)> fn) {
+			if (l == nullptr) return;
+			for (auto* e : l->subtree) {
+				if (accepts(e, kind, datatypes))
+					fn(e->target());
+			}
+		}
+	public:
+		subscription_registry(utils::interner& interner)
+			: ids(interner), next_id(1), count(0), dispatching(0)
+		{}
+
+		id_type subscribe(master_event_handler& hdl, const event_filter& filter, bool own_thread = false, size_t queue_limit = 1024) {
+			std::unique_ptr<entry> e(new entry());
+			e->kinds = filter.kinds;
+			e->datatypes = filter.datatypes;
+			e->path[0] = key_for(filter.device);
+			e->path[1] = key_for(filter.node);
+			e->path[2] = key_for(filter.property);
+			e->handler = &hdl;
+			if (own_thread) e->queue.reset(new queued_event_handler(hdl, queue_limit));
+
+			std::lock_guard<std::recursive_mutex> lck(mtx);
+			e->id = next_id++;
+			auto id = e->id;
+			if (dispatching) pending_add.push_back(std::move(e));
+			else insert(std::move(e));
+			count++;
+			return id;
+		}
+
+		// May be called from the handler itself, also when it has its own thread.
+		// In that case no further events are delivered once the current one returns.
+		void unsubscribe(id_type id) {
+			std::unique_ptr<entry> removed;
+			std::lock_guard<std::recursive_mutex> lck(mtx);
+			if (dispatching) {
+				for (auto it = pending_add.begin(); it != pending_add.end(); it++) {
+					if ((*it)->id == id) {
+						pending_add.erase(it);
+						count--;
+						return;
+					}
+				}
+				if (entries.count(id) == 0) return;
+				// Stop delivery right away, cleanup happens after dispatch
+				entries.at(id)->kinds = 0;
+				pending_remove.push_back(id);
+			}
+			else {
+				if (entries.count(id) == 0) return;
+				removed = remove(id);
+			}
+			count--;
+		}
+
+		bool empty() const { return count == 0; }
+
+		void dispatch_broadcast(utils::function_ref<void(master_event_handler&)> fn) {
+			dispatch(event_kind::broadcast, utils::interner::invalid, utils::interner::invalid, utils::interner::invalid, UINT32_MAX, fn);
+		}
+
+		void dispatch_device(uint32_t dev, utils::function_ref<void(master_event_handler&)> fn) {
+			dispatch(event_kind::device, dev, utils::interner::invalid, utils::interner::invalid, UINT32_MAX, fn);
+		}
+
+		void dispatch_node(uint32_t dev, uint32_t node, utils::function_ref<void(master_event_handler&)> fn) {
+			dispatch(event_kind::node, dev, node, utils::interner::invalid, UINT32_MAX, fn);
+		}
+
+		// kind is either event_kind::property or event_kind::value
+		void dispatch_property(event_kind kind, uint32_t dev, uint32_t node, uint32_t prop, uint32_t datatypes, utils::function_ref<void(master_event_handler&)> fn) {
+			dispatch(kind, dev, node, prop, datatypes, fn);
+		}
+	};
+}
@@ -0,0 +1,283 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include "mqtt_client.h"
+
+namespace homie {
+	// Token bucket allowing `rate` operations per second with bursts of up to `burst` operations.
+	// A rate of 0 disables limiting.
+	class rate_limiter {
+		typedef std::chrono::steady_clock clock;
+		mutable std::mutex mtx;
+		double rate;
+		double burst;
+		double tokens;
+		clock::time_point last;
+
+		void refill(clock::time_point now) {
+			std::chrono::duration<double> dt = now - last;
+			last = now;
+			tokens = std::min(burst, tokens + dt.count() * rate);
+		}
+	public:
+		rate_limiter(double per_second = 0, double max_burst = 1)
+			: rate(per_second), burst(std::max(1.0, max_burst)), tokens(std::max(1.0, max_burst)), last(clock::now())
+		{}
+
+		void set_rate(double per_second, double max_burst) {
+			std::lock_guard<std::mutex> lck(mtx);
+			rate = per_second;
+			burst = std::max(1.0, max_burst);
+			tokens = std::min(tokens, burst);
+		}
+
+		bool is_limited() const {
+			std::lock_guard<std::mutex> lck(mtx);
+			return rate > 0;
+		}
+
+		bool try_acquire() {
+			std::lock_guard<std::mutex> lck(mtx);
+			if (rate <= 0) return true;
+			refill(clock::now());
+			if (tokens < 1) return false;
+			tokens -= 1;
+			return true;
+		}
+
+		// Blocks until a token is available
+		void acquire() {
+			std::unique_lock<std::mutex> lck(mtx);
+			if (rate <= 0) return;
+			refill(clock::now());
+			tokens -= 1;
+			if (tokens >= 0) return;
+			// The token is taken in advance, sleep until the debt is paid off
+			auto wait = std::chrono::duration<double>(-tokens / rate);
+			lck.unlock();
+			std::this_thread::sleep_for(wait);
+		}
+	};
+
+	struct backoff_policy {
+		std::chrono::milliseconds initial = std::chrono::seconds(1);
+		std::chrono::milliseconds max = std::chrono::seconds(60);
+		double multiplier = 2;
+		// Fraction of each delay that is randomized, 1 spreads reconnects over the whole interval
+		double jitter = 0.5;
+	};
+
+	// mqtt_client decorator that reconnects a transport after an unexpected connection loss.
+	// Reconnect attempts run on a background thread with exponential backoff and jitter, so a fleet
+	// of processes does not reconnect in lockstep after a broker restart.
+	// Subscriptions are tracked and restored if the broker did not keep the session,
+	// publishes can be rate limited to spread out re-announcements.
+	// The transport is expected to report failed connects by throwing from open().
+	class connection_supervisor : public mqtt_client, private mqtt_event_handler {
+		mqtt_client& inner;
+		// Set by the application while the transport and the worker deliver events
+		std::atomic<mqtt_event_handler*> handler;
+		backoff_policy policy;
+		rate_limiter limiter;
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::map<std::string, int> subscriptions;
+		// Topics subscribed by the handler during the current on_connect
+		std::set<std::string> resubscribed;
+		bool has_will;
+		std::string will_topic;
+		std::string will_payload;
+		int will_qos;
+		bool will_retain;
+		bool opened;
+		bool offline;
+		bool reconnecting;
+		bool exit;
+		// Failed attempts since the connection was lost, picks the next backoff delay
+		size_t attempt;
+		std::atomic<size_t> attempts;
+		std::atomic<size_t> reconnects;
+		std::mt19937 rng;
+		std::thread worker;
+
+		std::chrono::milliseconds next_delay(size_t attempt) {
+			double base = static_cast<double>(policy.initial.count());
+			for (size_t i = 0; i < attempt && base < policy.max.count(); i++)
+				base *= policy.multiplier;
+			base = std::min(base, static_cast<double>(policy.max.count()));
+			auto jitter = std::min(1.0, std::max(0.0, policy.jitter));
+			std::uniform_real_distribution<double> dist(0, base * jitter);
+			return std::chrono::milliseconds(static_cast<int64_t>(base * (1 - jitter) + dist(rng)));
+		}
+
+		void run() {
+			std::unique_lock<std::mutex> lck(mtx);
+			while (true) {
+				cv.wait(lck, [this]() { return exit || (offline && opened); });
+				if (exit) break;
+				// The transport may reconnect by itself meanwhile
+				if (cv.wait_for(lck, next_delay(attempt), [this]() { return exit || !offline; })) {
+					if (exit) break;
+					continue;
+				}
+				reconnecting = true;
+				lck.unlock();
+				attempts++;
+				bool ok = true;
+				try {
+					if (has_will) inner.open(will_topic, will_payload, will_qos, will_retain);
+					else inner.open();
+				}
+				catch (const std::exception&) {
+					ok = false;
+				}
+				lck.lock();
+				reconnecting = false;
+				if (ok) {
+					offline = false;
+					attempt = 0;
+				}
+				else attempt++;
+			}
+		}
+
+		// Inherited by mqtt_event_handler
+		virtual void on_connect(bool session_present, bool reconnected) override {
+			bool is_reconnect;
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				is_reconnect = reconnecting || reconnected;
+				resubscribed.clear();
+				offline = false;
+				attempt = 0;
+			}
+			cv.notify_all();
+			if (is_reconnect) reconnects++;
+			auto h = handler.load();
+			if (h) h->on_connect(session_present, is_reconnect);
+			if (!is_reconnect || session_present) return;
+
+			// Restore subscriptions the handler did not renew itself
+			std::vector<std::pair<std::string, int>> missing;
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				for (auto& e : subscriptions)
+					if (resubscribed.count(e.first) == 0) missing.push_back(e);
+				resubscribed.clear();
+			}
+			for (auto& e : missing) inner.subscribe(e.first, e.second);
+		}
+		virtual void on_closing() override {
+			auto h = handler.load();
+			if (h) h->on_closing();
+		}
+		virtual void on_closed() override {
+			auto h = handler.load();
+			if (h) h->on_closed();
+		}
+		virtual void on_offline() override {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				offline = true;
+			}
+			cv.notify_all();
+			auto h = handler.load();
+			if (h) h->on_offline();
+		}
+		virtual void on_message(const std::string& topic, const std::string& payload) override {
+			auto h = handler.load();
+			if (h) h->on_message(topic, payload);
+		}
+	public:
+		// publish_rate limits publishes per second (0 = unlimited) with bursts up to publish_burst
+		connection_supervisor(mqtt_client& transport, backoff_policy backoff = backoff_policy(), double publish_rate = 0, double publish_burst = 100)
+			: inner(transport), handler(nullptr), policy(backoff), limiter(publish_rate, publish_burst),
+			has_will(false), will_qos(0), will_retain(false), opened(false), offline(false), reconnecting(false), exit(false), attempt(0),
+			attempts(0), reconnects(0), rng(std::random_device()())
+		{
+			inner.set_event_handler(this);
+			worker = std::thread([this]() { run(); });
+		}
+
+		~connection_supervisor() {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				exit = true;
+			}
+			cv.notify_all();
+			if (worker.joinable()) worker.join();
+			inner.set_event_handler(nullptr);
+		}
+
+		void set_publish_rate(double per_second, double burst) {
+			limiter.set_rate(per_second, burst);
+		}
+
+		// Number of reconnect attempts and successful reconnects since construction
+		size_t get_reconnect_attempts() const { return attempts; }
+		size_t get_reconnects() const { return reconnects; }
+
+		// Inherited by mqtt_client
+		virtual void set_event_handler(mqtt_event_handler* evt) override {
+			handler = evt;
+		}
+		virtual void open(const std::string& topic, const std::string& payload, int qos, bool retain) override {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				has_will = true;
+				will_topic = topic;
+				will_payload = payload;
+				will_qos = qos;
+				will_retain = retain;
+				opened = true;
+			}
+			inner.open(topic, payload, qos, retain);
+		}
+		virtual void open() override {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				has_will = false;
+				opened = true;
+			}
+			inner.open();
+		}
+		virtual void publish(const std::string& topic, const std::string& payload, int qos, bool retain) override {
+			limiter.acquire();
+			inner.publish(topic, payload, qos, retain);
+		}
+		virtual void publish_batch(const std::vector<mqtt_message>& messages, std::vector<bool>& ok) override {
+			// Keep the transport's batching unless every publish has to wait for the limiter
+			if (limiter.is_limited()) mqtt_client::publish_batch(messages, ok);
+			else inner.publish_batch(messages, ok);
+		}
+		virtual void subscribe(const std::string& topic, int qos) override {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				subscriptions[topic] = qos;
+				resubscribed.insert(topic);
+			}
+			inner.subscribe(topic, qos);
+		}
+		virtual void unsubscribe(const std::string& topic) override {
+			{
+				std::lock_guard<std::mutex> lck(mtx);
+				subscriptions.erase(topic);
+			}
+			inner.unsubscribe(topic);
+		}
+		virtual bool is_connected() const override {
+			return inner.is_connected();
+		}
+	};
+}
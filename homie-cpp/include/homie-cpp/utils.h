@@ -1,5 +1,14 @@
 #pragma once
 #include <vector>
+#include <string>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
 
 namespace homie {
 	namespace utils {
@@ -19,5 +28,84 @@ namespace homie {
 			} while (true);
 			return res;
 		}
+
+		// Parses the whole range as decimal integer without throwing, accepting what std::from_chars accepts.
+		// Returns false for empty input, trailing characters and values out of range.
+		inline bool parse_int64(const char* first, const char* last, int64_t& out) {
+			bool negative = first != last && *first == '-';
+			if (negative) first++;
+			if (first == last) return false;
+			uint64_t limit = negative ? uint64_t(std::numeric_limits<int64_t>::max()) + 1 : uint64_t(std::numeric_limits<int64_t>::max());
+			uint64_t value = 0;
+			for (; first != last; first++) {
+				if (*first < '0' || *first > '9') return false;
+				auto digit = static_cast<uint64_t>(*first - '0');
+				if (value > (limit - digit) / 10) return false;
+				value = value * 10 + digit;
+			}
+			out = negative ? static_cast<int64_t>(0 - value) : static_cast<int64_t>(value);
+			return true;
+		}
+
+		inline bool parse_int64(const std::string& s, int64_t& out) {
+			return parse_int64(s.data(), s.data() + s.size(), out);
+		}
+
+		// Parses a decimal number ("-1.5", "2e3") covering the whole range. Returns false for anything strtod
+		// would accept beyond that (whitespace, hex, nan, inf), trailing characters and overflow.
+		inline bool parse_double(const char* begin, const char* end, double& out) {
+			if (begin == end || end - begin > 63) return false;
+			auto p = begin;
+			if (*p == '-' || *p == '+') p++;
+			bool digits = false;
+			for (; p != end && *p >= '0' && *p <= '9'; p++) digits = true;
+			if (p != end && *p == '.') {
+				for (p++; p != end && *p >= '0' && *p <= '9'; p++) digits = true;
+			}
+			if (!digits) return false;
+			if (p != end && (*p == 'e' || *p == 'E')) {
+				p++;
+				if (p != end && (*p == '-' || *p == '+')) p++;
+				if (p == end) return false;
+				for (; p != end; p++) {
+					if (*p < '0' || *p > '9') return false;
+				}
+			}
+			if (p != end) return false;
+			char buf[64];
+			std::copy(begin, end, buf);
+			buf[end - begin] = '\0';
+			char* pend = nullptr;
+			errno = 0;
+			auto v = std::strtod(buf, &pend);
+			if (errno != 0 || pend != buf + (end - begin) || !std::isfinite(v)) return false;
+			out = v;
+			return true;
+		}
+
+		// Non owning reference to a callable, used for visitor style enumeration.
+		// Unlike std::function it never allocates, the referenced callable has to outlive the call.
+		template<typename Signature>
+		class function_ref;
+
+		template<typename Ret, typename... Args>
+		class function_ref<Ret(Args...)> {
+			void* obj;
+			Ret(*cb)(void*, Args...);
+
+			template<typename Fn>
+			static Ret invoke(void* o, Args... args) {
+				return (*reinterpret_cast<Fn*>(o))(std::forward<Args>(args)...);
+			}
+		public:
+			template<typename Fn, typename = typename std::enable_if<!std::is_same<typename std::decay<Fn>::type, function_ref>::value>::type>
+			function_ref(Fn&& fn)
+				: obj(const_cast<void*>(static_cast<const void*>(std::addressof(fn)))), cb(&invoke<typename std::remove_reference<Fn>::type>)
+			{}
+
+			Ret operator()(Args... args) const {
+				return cb(obj, std::forward<Args>(args)...);
+			}
+		};
 	}
-}
\ No newline at end of file
+}
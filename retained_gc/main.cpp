@@ -0,0 +1,90 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include "..\sample_master\mqtt_client.h"
+#include "..\homie-cpp\include\homie-cpp\master.h"
+#include "..\homie-cpp\include\homie-cpp\retained_gc.h"
+
+// Collects the retained state of all devices below the base topic and clears topics
+// that are no longer part of the announced structure.
+int main(int argc, char** argv) try {
+	std::string brokerip = "127.0.0.1";
+	std::string username;
+	std::string password;
+	std::string basetopic = "homie/";
+	std::string clientid = "retained_gc";
+	// Devices have to stay lost this long while the tool is watching, 0 purges all lost devices
+	int64_t lost_seconds = 0;
+	int64_t wait_seconds = 5;
+	double rate = 100;
+	bool dry_run = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-h") == 0) {
+			if (i == argc - 1) throw std::runtime_error("Missing argument to -h");
+			brokerip = argv[++i];
+		}
+		else if (strcmp(argv[i], "-u") == 0) {
+			if (i == argc - 1) throw std::runtime_error("Missing argument to -u");
+			username = argv[++i];
+		}
+		else if (strcmp(argv[i], "-p") == 0) {
+			if (i == argc - 1) throw std::runtime_error("Missing argument to -p");
+			password = argv[++i];
+		}
+		else if (strcmp(argv[i], "-t") == 0) {
+			if (i == argc - 1) throw std::runtime_error("Missing argument to -t");
+			basetopic = argv[++i];
+		}
+		else if (strcmp(argv[i], "-c") == 0) {
+			if (i == argc - 1) throw std::runtime_error("Missing argument to -c");
+			clientid = argv[++i];
+		}
+		else if (strcmp(argv[i], "-l") == 0) {
+			if (i == argc - 1) throw std::runtime_error("Missing argument to -l");
+			lost_seconds = std::stoll(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-w") == 0) {
+			if (i == argc - 1) throw std::runtime_error("Missing argument to -w");
+			wait_seconds = std::stoll(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-r") == 0) {
+			if (i == argc - 1) throw std::runtime_error("Missing argument to -r");
+			rate = std::stod(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-n") == 0) {
+			dry_run = true;
+		}
+	}
+
+	mqtt_client c(brokerip, username, password, clientid);
+	homie::master m(c, basetopic);
+
+	// Retained messages arrive right after subscribing, lost devices are timed from when they were seen.
+	// Messages are delivered on the transport's own thread, so this thread only has to wait.
+	std::this_thread::sleep_for(std::chrono::seconds(wait_seconds));
+	if (lost_seconds > 0) std::this_thread::sleep_for(std::chrono::seconds(lost_seconds));
+
+	// The master is not safe to read while messages arrive. The broker acknowledges the unsubscribe
+	// after every message sent before it, and the transport delivers them in order, so once this returns
+	// nothing touches the tree anymore. This also keeps the cleared topics from coming back.
+	c.unsubscribe(basetopic + "#");
+
+	auto topics = m.collect_stale_topics(std::chrono::seconds(lost_seconds));
+	for (auto& topic : topics) {
+		std::cout << topic << std::endl;
+	}
+	if (dry_run) {
+		std::cout << topics.size() << " stale topics" << std::endl;
+		return 0;
+	}
+
+	homie::retained_purger purger(c, rate);
+	auto cleared = purger.purge(topics);
+	std::cout << cleared << " of " << topics.size() << " stale topics cleared" << std::endl;
+}
+catch (const std::exception& e) {
+	std::cerr << "Error:" << e.what() << std::endl;
+}
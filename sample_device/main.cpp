@@ -2,6 +2,7 @@
 #include <string>
 #include "mqtt_client.h"
 #include "..\homie-cpp\include\homie-cpp\client.h"
+#include "..\homie-cpp\include\homie-cpp\supervisor.h"
 #include "test_device.h"
 
 int main(int argc, char** argv) try {
@@ -41,7 +42,8 @@ int main(int argc, char** argv) try {
 	dev->add_node(node);
 
 	mqtt_client c(brokerip, username, password, clientid);
-	homie::client hc(c, dev, basetopic);
+	homie::connection_supervisor sc(c);
+	homie::client hc(sc, dev, basetopic);
 	prop->client = &hc;
 	
 	while (true) {
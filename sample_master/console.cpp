@@ -6,10 +6,9 @@ int console::handle_cmd(const std::string & cmd)
 	if (cmd == "q" || cmd == "quit" || cmd == "exit" || cmd == ".quit" || cmd == ".q")
 		return -1;
 	if (cmd == "devices") {
-		auto devs = master.get_discovered_devices();
-		for (auto& e : devs) {
-			std::cout << e->get_id() << " (" << e->get_name() << ")" << std::endl;
-		}
+		master.for_each_discovered_device([](const std::string& id, const homie::device& dev) {
+			std::cout << id << " (" << dev.get_name() << ")" << std::endl;
+		});
 		return 1;
 	}
 	else if (cmd == "dump") {
@@ -24,28 +23,29 @@ int console::handle_cmd(const std::string & cmd)
 			else
 				std::cout << "Value: " << property->get_value() << std::endl;
 			std::cout << "Attributes:" << std::endl;
-			for (auto& att : property->get_attributes())
-				std::cout << "\t" << att << " = " << property->get_attribute(att) << std::endl;
+			property->for_each_attribute([](const std::string& att, const std::string& value) {
+				std::cout << "\t" << att << " = " << value << std::endl;
+			});
 		}
 		else if (node) {
 			std::cout << "Properties:" << std::endl;
-			for (auto& e : node->get_properties()) {
-				auto p = node->get_property(e);
-				std::cout << "\t" << p->get_id() << " (" << p->get_name() << ")" << std::endl;
-			}
+			node->for_each_property([](const std::string& id, const homie::property& p) {
+				std::cout << "\t" << id << " (" << p.get_name() << ")" << std::endl;
+			});
 			std::cout << "Attributes:" << std::endl;
-			for (auto& att : node->get_attributes())
-				std::cout << "\t" << att << " = " << node->get_attribute(att) << std::endl;
+			node->for_each_attribute([](const std::string& att, const std::string& value) {
+				std::cout << "\t" << att << " = " << value << std::endl;
+			});
 		}
 		else if (device) {
 			std::cout << "Nodes:" << std::endl;
-			for (auto& e : device->get_nodes()) {
-				auto n = device->get_node(e);
-				std::cout << "\t" << n->get_id() << " (" << n->get_name() << ")" << std::endl;
-			}
+			device->for_each_node([](const std::string& id, const homie::node& n) {
+				std::cout << "\t" << id << " (" << n.get_name() << ")" << std::endl;
+			});
 			std::cout << "Attributes:" << std::endl;
-			for (auto& att : device->get_attributes())
-				std::cout << "\t" << att << " = " << device->get_attribute(att) << std::endl;
+			device->for_each_attribute([](const std::string& att, const std::string& value) {
+				std::cout << "\t" << att << " = " << value << std::endl;
+			});
 		}
 		else {
 			std::cout << "No device selected" << std::endl;
@@ -93,17 +93,15 @@ int console::handle_cmd(const std::string & cmd)
 	}
 	else if (device) {
 		if (cmd == "nodes") {
-			for (auto& e : device->get_nodes()) {
-				auto n = device->get_node(e);
-				std::cout << n->get_id() << " (" << n->get_name() << ")" << std::endl;
-			}
+			device->for_each_node([](const std::string& id, const homie::node& n) {
+				std::cout << id << " (" << n.get_name() << ")" << std::endl;
+			});
 			return 1;
 		}
 		else if (node && cmd == "properties") {
-			for (auto& e : node->get_properties()) {
-				auto p = node->get_property(e);
-				std::cout << p->get_id() << " (" << p->get_name() << ")" << std::endl;
-			}
+			node->for_each_property([](const std::string& id, const homie::property& p) {
+				std::cout << id << " (" << p.get_name() << ")" << std::endl;
+			});
 			return 1;
 		}
 	}
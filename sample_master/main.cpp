@@ -4,6 +4,7 @@
 #include <atomic>
 #include <thread>
 #include "..\homie-cpp\include\homie-cpp\master.h"
+#include "..\homie-cpp\include\homie-cpp\supervisor.h"
 #include "console.h"
 
 int main(int argc, char** argv) try {
@@ -37,7 +38,8 @@ int main(int argc, char** argv) try {
 	}
 
 	mqtt_client c(brokerip, username, password, clientid);
-	homie::master hc(c, basetopic);
+	homie::connection_supervisor sc(c);
+	homie::master hc(sc, basetopic);
 
 	std::atomic<bool> exit = false;
 	std::thread th([&]() {